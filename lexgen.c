@@ -0,0 +1,183 @@
+
+/*
+ * RPAL lexer DFA generator.
+ *
+ * Builds the dense transition table used by the table driven scanner in
+ * parser.c (rpal -L) from the RPAL lexical grammar and writes it out as a C
+ * header:
+ *
+ *   % lexgen > lexdfa.h
+ *
+ * License: (Beerware) This code is public domain and can be used without
+ * restriction.  Just buy me a beer if we should ever meet.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+
+/*
+ * The RPAL lexicon (see the Lexical Grammar on the RPAL site).
+ *
+ * Identifier -> Letter (Letter | Digit | '_')*
+ * Integer    -> Digit+
+ * Operator   -> Operator_symbol+
+ * String     -> '''' ('\' 't' | '\' 'n' | '\' '\' | '\' '''' | '(' | ')' |
+ *                     ';' | ',' | '' | Letter | Digit | Operator_symbol)* ''''
+ * Spaces     -> (' ' | ht | Eol)+
+ * Comment    -> '//' (any char but Eol)* Eol
+ * Punction   -> '(' | ')' | ';' | ','
+ */
+#define LETTERS      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+#define DIGITS       "0123456789"
+#define OPERATORS    "+-*<>&.@/:=~|$!#%^_[]{}\"`?"
+#define PUNCTIONS    "();,"
+#define SPACES       " \t\n\r"
+#define STRING_CHARS LETTERS DIGITS OPERATORS PUNCTIONS " "
+#define ESCAPES      "tn\\'"
+
+/*
+ * States.  A token is emitted on the first byte that can't extend it (the
+ * EMIT flag) and that same byte is then run through the START transition,
+ * which is folded into the table here, so the scanner looks at every byte
+ * exactly once.  Strings and punctions end on their last byte so they get
+ * their own "complete" states that emit on the following byte.
+ */
+enum
+{
+    S_START,   /* between tokens */
+    S_IDENT,   /* in an identifier/keyword */
+    S_INT,     /* in an integer */
+    S_OPER,    /* in an operator */
+    S_SLASH,   /* a leading '/', either an operator or a comment */
+    S_COMMENT, /* in a comment, up to the end of the line */
+    S_STRING,  /* in a string */
+    S_STR_ESC, /* after a '\' in a string */
+    S_STR_END, /* string complete */
+    S_PUNCT,   /* punction complete */
+    NUM_STATES
+};
+
+const char * stateNames[NUM_STATES] =
+{
+    "START", "IDENT", "INT", "OPER", "SLASH",
+    "COMMENT", "STRING", "STR_ESC", "STR_END", "PUNCT"
+};
+
+/* token type emitted when leaving a state */
+const char * stateTypes[NUM_STATES] =
+{
+    "-1", "T_IDENTIFIER", "T_INTEGER", "T_OPERATOR", "T_OPERATOR",
+    "-1", "T_STRING", "T_STRING", "T_STRING", "T_PUNCTION"
+};
+
+#define EMIT 0x80 /* the token ends before this byte */
+#define ERR  0x40 /* this byte is a lexical error */
+
+unsigned char dfa[NUM_STATES][256];
+
+
+int In(const char * pSet, int c)
+{
+    return (c != 0) && (strchr(pSet, c) != NULL);
+}
+
+
+/* START transition for byte c, without any flags from the previous state. */
+unsigned char Start(int c)
+{
+    if (In(SPACES, c))    return S_START;
+    if (c == '/')         return S_SLASH;
+    if (c == '\'')        return S_STRING;
+    if (In(OPERATORS, c)) return S_OPER;
+    if (In(DIGITS, c))    return S_INT;
+    if (In(LETTERS, c))   return S_IDENT;
+    if (In(PUNCTIONS, c)) return S_PUNCT;
+    return (S_START | ERR);
+}
+
+
+void Build(void)
+{
+    int c;
+
+    for (c = 0; c < 256; c++)
+    {
+        dfa[S_START][c] = Start(c);
+
+        dfa[S_IDENT][c] = (In(LETTERS DIGITS "_", c)) ? S_IDENT :
+                                                        (EMIT | Start(c));
+
+        dfa[S_INT][c] = (In(DIGITS, c)) ? S_INT : (EMIT | Start(c));
+
+        dfa[S_OPER][c] = (In(OPERATORS, c)) ? S_OPER : (EMIT | Start(c));
+
+        dfa[S_SLASH][c] = (c == '/')          ? S_COMMENT :
+                          (In(OPERATORS, c))  ? S_OPER    :
+                                                (EMIT | Start(c));
+
+        dfa[S_COMMENT][c] = (c == '\n') ? S_START : S_COMMENT;
+
+        dfa[S_STRING][c] = (c == '\'')           ? S_STR_END :
+                           (c == '\\')           ? S_STR_ESC :
+                           (In(STRING_CHARS, c)) ? S_STRING  :
+                                                   (S_STRING | ERR);
+
+        /* a bad escape is reported and the char is taken as a string char */
+        dfa[S_STR_ESC][c] = (In(ESCAPES, c)) ? S_STRING :
+                                               (ERR | (dfa[S_STRING][c] & ~ERR));
+
+        dfa[S_STR_END][c] = (EMIT | Start(c));
+
+        dfa[S_PUNCT][c] = (EMIT | Start(c));
+    }
+}
+
+
+int main(void)
+{
+    int s, c;
+
+    Build();
+
+    printf("/* Generated by lexgen from the RPAL lexical grammar, do not edit. */\n\n");
+
+    for (s = 0; s < NUM_STATES; s++)
+    {
+        printf("#define LEX_S_%-8s %d\n", stateNames[s], s);
+    }
+
+    printf("#define LEX_NUM_STATES %d\n\n", NUM_STATES);
+    printf("#define LEX_EMIT       0x%02x /* the token ends before this byte */\n", EMIT);
+    printf("#define LEX_ERR        0x%02x /* this byte is a lexical error */\n", ERR);
+    printf("#define LEX_STATE(x)   ((x) & 0x%02x)\n\n", (unsigned char)~(EMIT | ERR));
+
+    printf("/* token type emitted when leaving a state */\n");
+    printf("static const int lexDfaType[LEX_NUM_STATES] =\n{\n");
+
+    for (s = 0; s < NUM_STATES; s++)
+    {
+        printf("    %s%s\n", stateTypes[s], (s < (NUM_STATES - 1)) ? "," : "");
+    }
+
+    printf("};\n\n");
+
+    printf("static const unsigned char lexDfa[LEX_NUM_STATES][256] =\n{\n");
+
+    for (s = 0; s < NUM_STATES; s++)
+    {
+        printf("    { /* %s */", stateNames[s]);
+
+        for (c = 0; c < 256; c++)
+        {
+            if ((c % 16) == 0) printf("\n       ");
+            printf(" 0x%02x%s", dfa[s][c], (c < 255) ? "," : "");
+        }
+
+        printf("\n    }%s\n", (s < (NUM_STATES - 1)) ? "," : "");
+    }
+
+    printf("};\n");
+
+    return 0;
+}
@@ -10,11 +10,25 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <getopt.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "rpal_rt.h"
 
 
 #define IS_OPERATOR_SYMBOL(c)                                        \
@@ -89,16 +103,36 @@ typedef struct _token
 {
     TAILQ_ENTRY(_token)         siblings;
     TokenType                   type;
+    unsigned int                offset; /* source offset of the token */
     int                         length; /* pStr length w/ delim */
     char *                      pStr;
     TAILQ_HEAD(subtree, _token) children;
+    int                         id;     /* node id, 0 = not finished yet */
+    struct _token *             pShare; /* canonical node if a reference */
+    int                         depth;  /* name use: envs out, see Resolve() */
+    int                         slot;   /* name use: slot in that env */
+    int                         memo;   /* body of a memoized function */
+    struct _proffunc *          pProf;  /* body of a function, --profile */
 } Token;
 
+#define RES_NONE (-2) /* depth of a node that isn't a (resolved) name use */
+#define RES_FREE (-1) /* depth of a name that isn't bound anywhere */
+
 TAILQ_HEAD(tailhead, _token) thead;
 
 #define T_MATCH(t, tt, s) \
     ((t) && (s) && ((t)->type == tt) && strcmp((t)->pStr, (s)) == 0)
 
+#define T_IS(t, tt) ((t) && ((t)->type == tt))
+
+/* panic mode error recovery synchronization tokens */
+#define T_SYNC(t)                                                      \
+    (                                                                  \
+     T_MATCH((t), T_KEYWORD, "in")  || T_MATCH((t), T_KEYWORD, "where") || \
+     T_MATCH((t), T_KEYWORD, "and") || T_MATCH((t), T_PUNCTION, ")")    || \
+     T_MATCH((t), T_PUNCTION, ";")                                     \
+    )
+
 #define T_NEXT(t)                 ((Token *)(t)->siblings.tqe_next)
 #define T_PREV(t)                 ((Token *)(t)->siblings.tqe_prev)
 
@@ -116,16 +150,26 @@ TAILQ_HEAD(tailhead, _token) thead;
 #define T_INSERT_TAIL_CHILD(t, c) TAILQ_INSERT_TAIL(&(t)->children, (c), siblings)
 #define T_REMOVE_CHILD(t, c)      TAILQ_REMOVE(&(t)->children, (c), siblings)
 
-#define T_PUSH(t)                 T_INSERT_HEAD(t)
+#define T_FINISHED(t)             ((t)->id || (t)->pShare)
+#define T_ID(t)                   ((t)->pShare ? (t)->pShare->id : (t)->id)
+#define T_NODE(t)                 ((t)->pShare ? (t)->pShare : (t))
+
+Token * AstFinish(Token * pToken); /* forward declaration */
+
+static inline void T_PUSH(Token * pToken)
+{
+    pToken = AstFinish(pToken);
+    T_INSERT_HEAD(pToken);
+}
 
-inline Token * T_POP(void)
+static inline Token * T_POP(void)
 {
     Token * pToken = T_FIRST();
     T_REMOVE(pToken);
     return pToken;
 }
 
-inline Token * T_POP_OP(void) /* T_POP plus type change to T_OPERATOR */
+static inline Token * T_POP_OP(void) /* T_POP plus type change to T_OPERATOR */
 {
     Token * pToken = T_POP();
     pToken->type = T_OPERATOR;
@@ -134,14 +178,32 @@ inline Token * T_POP_OP(void) /* T_POP plus type change to T_OPERATOR */
 
 #define T_POP_DUMP() TokenFree(T_POP())
 
-inline void T_VERIFY(TokenType type, const char * pStr)
+/* forward declarations */
+void TokenFree(Token * pToken);
+char * LocToStr(unsigned int offset);
+void Parser_Error(Token * pToken, const char * pExpected);
+void Parser_Sync(TokenType type, const char * pStr);
+
+/*
+ * Dump the expected token.  If it isn't there the error is reported and the
+ * tokens are skipped up to a synchronization token.  If that turns out to be
+ * the expected token it is dumped, otherwise parsing carries on as if it was
+ * there.
+ */
+static inline void T_EXPECT(TokenType type, const char * pStr)
 {
+    char buf[64];
+
     if (!T_MATCH(T_FIRST(), type, pStr))
     {
-        printf("ERROR: syntax error at token ('%s'), expected ('%s')\n",
-               T_FIRST()->pStr, pStr);
-        exit(1);
+        snprintf(buf, sizeof(buf), "('%s')", pStr);
+        Parser_Error(T_FIRST(), buf);
+        Parser_Sync(type, pStr);
+
+        if (!T_MATCH(T_FIRST(), type, pStr)) return;
     }
+
+    T_POP_DUMP();
 }
 
 /* forward declarations */
@@ -154,11 +216,13 @@ void DumpAST(Token * pRoot, int indent);
 #define LOG_RULE_TDN 0x1
 #define LOG_RULE_BUP 0x2
 int log_rules = LOG_RULE_OFF;
+int showLocations = 0;
 #define LOG_TDN(s, ...) if (log_rules & LOG_RULE_TDN) printf("TDN: " s "\n", ## __VA_ARGS__);
 #define LOG_BUP(s, ...) if (log_rules & LOG_RULE_BUP) printf("BUP: " s "\n", ## __VA_ARGS__);
 
 
 char tokenstr[256]; /* be careful, global string storage for printf */
+char locstr[256];   /* be careful, global string storage for printf */
 
 char * TokenToStr(Token * pToken)
 {
@@ -222,6 +286,7 @@ Token * TokenAlloc(TokenType type, char c, const char * pStr)
     }
 
     memset(pToken, 0, sizeof(Token));
+    pToken->depth = RES_NONE;
 
     len = (((c == 0) && (pStr == NULL)) ? 1                  :
            ((c != 0) && (pStr == NULL)) ? 2                  :
@@ -261,10 +326,10 @@ Token * TokenAlloc(TokenType type, char c, const char * pStr)
 }
 
 
-/* Free a Token. */
+/* Free a Token (a hash-cons reference doesn't own its string). */
 void TokenFree(Token * pToken)
 {
-    free(pToken->pStr);
+    if (!pToken->pShare) free(pToken->pStr);
     free(pToken);
 }
 
@@ -292,6 +357,98 @@ void TokenAddChar(Token * pToken, char c)
 }
 
 
+/*
+ * Diagnostics.  Scanner and parser errors don't stop the program, they are
+ * collected here (sorted by source offset) and printed once the whole file
+ * has been processed.  Past MAX_ERRORS they are only counted.
+ */
+#define MAX_ERRORS 100
+
+typedef struct _diag
+{
+    TAILQ_ENTRY(_diag) entries;
+    unsigned int       offset;
+    char *             pMsg;
+} Diag;
+
+TAILQ_HEAD(diaghead, _diag) dhead;
+int numDiags = 0;
+
+
+void DiagAdd(unsigned int offset, const char * pFmt, ...)
+{
+    Diag * pDiag;
+    Diag * pPos;
+    char buf[512];
+    va_list ap;
+
+    if (numDiags++ > MAX_ERRORS) return;
+
+    va_start(ap, pFmt);
+    vsnprintf(buf, sizeof(buf), pFmt, ap);
+    va_end(ap);
+
+    if (((pDiag = (Diag *)malloc(sizeof(Diag))) == NULL) ||
+        ((pDiag->pMsg = strdup(buf)) == NULL))
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    pDiag->offset = offset;
+
+    /* they mostly come in order, the scanner's and then the parser's */
+    pPos = TAILQ_LAST(&dhead, diaghead);
+
+    if ((pPos == NULL) || (pPos->offset <= offset))
+    {
+        TAILQ_INSERT_TAIL(&dhead, pDiag, entries);
+        return;
+    }
+
+    for (pPos = dhead.tqh_first; pPos != NULL; pPos = pPos->entries.tqe_next)
+    {
+        if (pPos->offset > offset) break;
+    }
+
+    TAILQ_INSERT_BEFORE(pPos, pDiag, entries);
+}
+
+
+/* Print and release all the diagnostics for pFile. */
+void DiagFlush(const char * pFile)
+{
+    Diag * pDiag;
+
+    while ((pDiag = dhead.tqh_first) != NULL)
+    {
+        TAILQ_REMOVE(&dhead, pDiag, entries);
+        printf("ERROR: %s:%s: %s\n", pFile, LocToStr(pDiag->offset), pDiag->pMsg);
+        free(pDiag->pMsg);
+        free(pDiag);
+    }
+
+    if (numDiags > MAX_ERRORS)
+    {
+        printf("ERROR: %s: too many errors, giving up\n", pFile);
+    }
+
+    numDiags = 0;
+}
+
+
+/*
+ * Offset of the next character in the file.  This is all the scanner keeps
+ * track of, line and column numbers are only computed when needed (see
+ * LineTableBuild).  The character functions return 0 at the end of the
+ * file, and for a NUL byte in it, scanEof tells the two apart.
+ */
+unsigned int scanOffset = 0;
+int scanEof = 0;
+
+#define SCAN_MORE(c) (((c) != 0) || !scanEof)
+
+
 /* Get the next character in the file. */
 char CharGet(int fd)
 {
@@ -304,6 +461,9 @@ char CharGet(int fd)
         exit(1);
     }
 
+    scanOffset += rc;
+    scanEof     = (rc == 0);
+
     return (rc == 0) ? 0 : c;
 }
 
@@ -320,26 +480,43 @@ char CharPeekNext(int fd)
         exit(1);
     }
 
-    if (lseek(fd, -1, SEEK_CUR) == -1)
+    if ((rc == 1) && (lseek(fd, -1, SEEK_CUR) == -1)) /* not at EOF */
     {
         perror("Failed to lseek file (CharPeekNext)");
         exit(1);
     }
 
+    scanEof = (rc == 0);
+
     return (rc == 0) ? 0 : c;
 }
 
 
+/* A character for an error message, a control char as a \xNN escape. */
+char * CharToStr(unsigned char c)
+{
+    static char buf[8];
+
+    if ((c < ' ') || (c > '~')) snprintf(buf, sizeof(buf), "\\x%02x", c);
+    else                        snprintf(buf, sizeof(buf), "%c", c);
+
+    return buf;
+}
+
+
 /* Skip over the next character in the file. */
 void CharSkipNext(int fd)
 {
     char c;
+    int rc;
 
-    if (read(fd, &c, 1) == -1)
+    if ((rc = read(fd, &c, 1)) == -1)
     {
         perror("Failed to read file (CharSkipNext)");
         exit(1);
     }
+
+    scanOffset += rc;
 }
 
 
@@ -353,7 +530,7 @@ void Scanner_Comment(int fd)
      * but instead we shortcut that here and just wipe out everything up to
      * the end of the line.
      */
-    while ((c = CharGet(fd)) != 0)
+    while (SCAN_MORE(c = CharGet(fd)))
     {
         if (c == '\n') break;
     }
@@ -366,7 +543,9 @@ void Scanner_String(int fd)
     Token * pToken = TokenAlloc(T_STRING, 0, NULL);
     char c;
 
-    while ((c = CharGet(fd)) != 0)
+    pToken->offset = (scanOffset - 1); /* the opening quote */
+
+    while (SCAN_MORE(c = CharGet(fd)))
     {
         if (c == '\'') /* end of the string */
         {
@@ -384,8 +563,9 @@ void Scanner_String(int fd)
             }
             else
             {
-                printf("ERROR: invalid string escape sequence (\\%c)\n", c);
-                exit(1);
+                DiagAdd((scanOffset - 1),
+                        "invalid string escape sequence (\\%s)",
+                        CharToStr(c));
             }
         }
         else if (IS_STRING_CHAR(c)) /* valid string char */
@@ -395,11 +575,16 @@ void Scanner_String(int fd)
         }
         else
         {
-            printf("ERROR: invalid string character (%c)", c);
-            exit(1);
+            DiagAdd((scanOffset - 1), "invalid string character (%s)",
+                    CharToStr(c));
         }
     }
 
+    if (scanEof)
+    {
+        DiagAdd(pToken->offset, "unterminated string");
+    }
+
     T_INSERT_TAIL(pToken);
 }
 
@@ -409,6 +594,8 @@ void Scanner_Operator(int fd, char c)
 {
     Token * pToken = TokenAlloc(T_OPERATOR, c, NULL);
 
+    pToken->offset = (scanOffset - 1);
+
     while ((c = CharPeekNext(fd)) != 0)
     {
         if (IS_OPERATOR_SYMBOL(c))
@@ -430,6 +617,8 @@ void Scanner_Integer(int fd, char c)
 {
     Token * pToken = TokenAlloc(T_INTEGER, c, NULL);
 
+    pToken->offset = (scanOffset - 1);
+
     while ((c = CharPeekNext(fd)) != 0)
     {
         if (IS_DIGIT(c))
@@ -451,6 +640,8 @@ void Scanner_Identifier(int fd, char c)
 {
     Token * pToken = TokenAlloc(T_IDENTIFIER, c, NULL);
 
+    pToken->offset = (scanOffset - 1);
+
     while ((c = CharPeekNext(fd)) != 0)
     {
         if (IS_IDENTIFIER_CHAR(c))
@@ -476,6 +667,8 @@ void Scanner_Identifier(int fd, char c)
 void Scanner_Punction(int fd, char c)
 {
     Token * pToken = TokenAlloc(T_PUNCTION, c, NULL);
+
+    pToken->offset = (scanOffset - 1);
     T_INSERT_TAIL(pToken);
 }
 
@@ -485,7 +678,7 @@ void Scanner(int fd)
 {
     char c;
 
-    while ((c = CharGet(fd)) != 0)
+    while (SCAN_MORE(c = CharGet(fd)))
     {
         if (IS_SPACE(c)) /* skip open whitespace */
         {
@@ -517,1160 +710,8012 @@ void Scanner(int fd)
         }
         else /* Doh! */
         {
-            printf("ERROR: unable to process char (%c)\n", c);
-            exit(1);
+            DiagAdd((scanOffset - 1), "unable to process char (%s)",
+                    CharToStr(c));
         }
     }
 }
 
 
 /*
- * Vl -> '<IDENTIFIER>' list ','   => ','?
+ * Table driven scanner (-L).  The whole file is read into memory and run
+ * through the DFA generated by lexgen (lexdfa.h) looking at every byte
+ * exactly once, a token is cut out of the buffer when the table says it
+ * has ended.  This produces the same tokens and errors as Scanner() above.
  */
-void Parser_Vl(void)
+#include "lexdfa.h"
+
+int dfaScanner = 0;
+
+
+/*
+ * The string chars Scanner_String() would have kept, only needed when a
+ * string had an error in it.
+ */
+int ScannerDfa_StrFilter(char * pStr, int len)
 {
-    Token * pID;
-    Token * pOp;
+    int i, j;
 
-    /*
-     * The equivalent rule is:
-     *
-     *   Vl -> '<IDENTIFIER>' ( ',' '<IDENTIFIER>' )+   => ','
-     *      -> '<IDENTIFIER>'
-     *
-     * If there aren't any trailing ID tokens the resulting tree is just the
-     * first ID.  If there are multiple IDs then the tree is rooted with a ','
-     * token.
-     */
+    for (i = 0, j = 0; i < len; i++)
+    {
+        if (pStr[i] == '\\')
+        {
+            if ((i + 1) < len)
+            {
+                if ((pStr[i + 1] == 't') || (pStr[i + 1] == 'n') ||
+                    (pStr[i + 1] == '\\') || (pStr[i + 1] == '\''))
+                {
+                    pStr[j++] = pStr[i++];
+                    pStr[j++] = pStr[i];
+                }
+            }
+        }
+        else if (IS_STRING_CHAR(pStr[i]))
+        {
+            pStr[j++] = pStr[i];
+        }
+    }
+
+    return j;
+}
 
-    if (T_FIRST()->type != T_IDENTIFIER)
+
+/* Cut the token scanned in state out of pBuf[start, end). */
+void ScannerDfa_Token(int state, unsigned char * pBuf,
+                      unsigned int start, unsigned int end, int strErr)
+{
+    Token * pToken;
+    unsigned int len;
+
+    if (lexDfaType[state] == T_STRING)
+    {
+        len = (end - start - ((state == LEX_S_STR_END) ? 2 : 1));
+    }
+    else
+    {
+        len = (end - start);
+    }
+
+    if ((pToken = (Token *)malloc(sizeof(Token))) == NULL)
     {
-        printf("ERROR: syntax error at token ('%s'), expected ID\n",
-               T_FIRST()->pStr);
+        perror("Failed to malloc memory");
         exit(1);
     }
 
-    LOG_TDN("Vl -> '<IDENTIFIER>' list ','");
+    memset(pToken, 0, sizeof(Token));
+    pToken->depth = RES_NONE;
 
-    if (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+    if ((pToken->pStr = (char *)malloc(sizeof(char) * (len + 1))) == NULL)
     {
-        pOp = TokenAlloc(T_OPERATOR, 0, ","); /* create a ',' token */
+        perror("Failed to malloc memory");
+        exit(1);
+    }
 
-        while (T_MATCH(T_SECOND(), T_PUNCTION, ","))
-        {
-            pID = T_POP(); /* pop ID */
-            T_INSERT_TAIL_CHILD(pOp, pID); /* child ID */ 
+    pToken->type   = lexDfaType[state];
+    pToken->offset = start;
+    TAILQ_INIT(&pToken->children);
 
-            T_POP_DUMP(); /* dump the ',' */
-        }
+    if (pToken->type == T_STRING)
+    {
+        memcpy(pToken->pStr, (pBuf + start + 1), len);
+        if (strErr) len = ScannerDfa_StrFilter(pToken->pStr, len);
+    }
+    else
+    {
+        memcpy(pToken->pStr, (pBuf + start), len);
+    }
 
-        pID = T_POP(); /* pop ID */
-        T_INSERT_TAIL_CHILD(pOp, pID); /* child ID */ 
+    pToken->pStr[len] = 0;
+    pToken->length    = (len + 1);
 
-        T_PUSH(pOp); /* push tree Op */
+    if ((pToken->type == T_IDENTIFIER) && IS_KEYWORD(pToken->pStr))
+    {
+        pToken->type = T_KEYWORD;
     }
 
-    LOG_BUP("Vl -> '<IDENTIFIER>' list ','");
+    T_INSERT_TAIL(pToken);
 }
 
 
-
-/*
- * Vb -> '<IDENTIFIER>'
- *    -> '(' Vl ')'
- *    -> '(' ')'          => '()'
- */
-void Parser_Vb(void)
+/* Scan an RPAL program with the DFA. */
+void ScannerDfa(int fd)
 {
-    Token * pVl;
-    Token * pOp;
+    struct stat st;
+    unsigned char * pBuf;
+    unsigned int len, start, i;
+    int state, next, strErr, rc;
+    unsigned char c;
 
-    if (T_FIRST()->type == T_IDENTIFIER)
+    if (fstat(fd, &st) == -1)
     {
-        /* nothing to do, leave the ID token on the stack */
-        LOG_TDN("Vb -> '<IDENTIFIER>'");
-        LOG_BUP("Vb -> '<IDENTIFIER>'");
+        perror("Failed to stat file (ScannerDfa)");
+        exit(1);
     }
-    else if (T_MATCH(T_FIRST(), T_PUNCTION, "(") &&
-             T_MATCH(T_SECOND(), T_PUNCTION, ")"))
-    {
-        LOG_TDN("Vb -> '(' ')'");
 
-        T_POP_DUMP(); /* dump the '(' */
-        T_POP_DUMP(); /* dump the ')' */
+    len = (unsigned int)st.st_size;
 
-        pOp = TokenAlloc(T_OPERATOR, 0, "()"); /* create a '()' token */
+    if ((pBuf = (unsigned char *)malloc(len + 1)) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
 
-        T_PUSH(pOp); /* push tree Op */
+    for (i = 0; i < len; i += rc)
+    {
+        if ((rc = read(fd, (pBuf + i), (len - i))) == -1)
+        {
+            perror("Failed to read file (ScannerDfa)");
+            exit(1);
+        }
 
-        LOG_BUP("Vb -> '(' ')'");
+        if (rc == 0) break;
     }
-    else if (T_MATCH(T_FIRST(), T_PUNCTION, "("))
+
+    len    = i;
+    state  = LEX_S_START;
+    start  = 0;
+    strErr = 0;
+
+    for (i = 0; i < len; i++)
     {
-        LOG_TDN("Vb -> '(' Vl ')'");
+        c    = pBuf[i];
+        next = lexDfa[state][c];
 
-        T_POP_DUMP(); /* dump the '(' */
+        if (next & (LEX_EMIT | LEX_ERR)) /* off the fast path */
+        {
+            if (next & LEX_EMIT)
+            {
+                ScannerDfa_Token(state, pBuf, start, i, strErr);
+                strErr = 0;
+                state  = LEX_S_START;
+            }
 
-        Parser_Vl();
+            if (next & LEX_ERR)
+            {
+                if (state == LEX_S_START)
+                {
+                    DiagAdd(i, "unable to process char (%s)", CharToStr(c));
+                }
+                else if (state == LEX_S_STR_ESC)
+                {
+                    DiagAdd((i - 1), "invalid string escape sequence (\\%s)",
+                            CharToStr(c));
+
+                    if (lexDfa[LEX_S_STRING][c] & LEX_ERR)
+                    {
+                        DiagAdd(i, "invalid string character (%s)",
+                                CharToStr(c));
+                    }
+
+                    strErr = 1;
+                }
+                else
+                {
+                    DiagAdd(i, "invalid string character (%s)",
+                            CharToStr(c));
+                    strErr = 1;
+                }
+            }
+        }
 
-        pVl = T_POP(); /* pop Vl */
+        if (state == LEX_S_START) start = i;
 
-        T_VERIFY(T_PUNCTION, ")");
-        T_POP_DUMP(); /* dump the ')' */
+        state = LEX_STATE(next);
+    }
 
-        T_PUSH(pVl); /* push Vl back on the stack */
+    if (state == LEX_S_STR_ESC) /* a '\' right at the end of the file */
+    {
+        DiagAdd((len - 1), "invalid string escape sequence (\\%s)",
+                CharToStr(0));
+        strErr = 1;
+    }
 
-        LOG_BUP("Vb -> '(' Vl ')'");
+    if ((state == LEX_S_STRING) || (state == LEX_S_STR_ESC))
+    {
+        DiagAdd(start, "unterminated string");
     }
-    else
+
+    if (lexDfaType[state] != -1)
     {
-        printf("ERROR: syntax error at token ('%s'), expected ('(')\n",
-               T_FIRST()->pStr);
-        exit(1);
+        ScannerDfa_Token(state, pBuf, start, len, strErr);
     }
+
+    scanOffset = len;
+    free(pBuf);
 }
 
 
 /*
- * Db -> Vl '=' E                   => '='
- *    -> '<IDENTIFIER>' Vb+ '=' E   => 'fcn_form'
- *    -> '(' D ')'
+ * Source locations.  Tokens only carry a 32-bit source offset.  The first
+ * time a line/column is needed the whole file is read back and the offsets
+ * of all the line starts are collected into a table (16 bytes at a time
+ * with SSE2), then an offset is turned into a line and column with a
+ * binary search of that table.
  */
-void Parser_Db(void)
-{
-    Token * pD;
-    Token * pID;
-    Token * pVl;
-    Token * pVb;
-    Token * pOp;
-    Token * pE;
-
-    if (T_MATCH(T_FIRST(), T_PUNCTION, "("))
-    {
-        LOG_TDN("Db -> '(' D ')'");
-
-        T_POP_DUMP(); /* dump the '(' */
+int srcFd = -1;
+unsigned int * lineStarts = NULL;
+int numLines = 0;
+int maxLines = 0;
 
-        Parser_D();
 
-        pD = T_POP(); /* pop D */
+void LineTableAdd(unsigned int offset)
+{
+    if (numLines == maxLines)
+    {
+        lineStarts = (unsigned int *)ArrayGrow(lineStarts, &maxLines,
+                                               sizeof(unsigned int));
+    }
 
-        T_VERIFY(T_PUNCTION, ")");
-        T_POP_DUMP(); /* dump the ')' */
+    lineStarts[numLines++] = offset;
+}
 
-        T_PUSH(pD); /* push D back on the stack */
 
-        LOG_BUP("Db -> '(' D ')'");
+void LineTableBuild(void)
+{
+    struct stat st;
+    char * pBuf;
+    unsigned int i = 0;
+    unsigned int len;
+#if defined(__SSE2__)
+    __m128i nl = _mm_set1_epi8('\n');
+    unsigned int mask;
+#endif
+
+    LineTableAdd(0);
+
+    if ((srcFd == -1) || (fstat(srcFd, &st) == -1) || (st.st_size == 0))
+    {
         return;
     }
 
-    /*
-     * The last two rules are a bit tricky since both start with an ID.  After
-     * expanding the rules further it's easy to see how they differ:
-     *
-     * Db -> Vl '=' E
-     *
-     *    => '<IDENTIFIER>' ( ',' '<IDENTIFIER>' )+ '=' E
-     *    => '<IDENTIFIER>'                         '=' E
-     *
-     * Db -> '<IDENTIFIER>' Vb+ '=' E
-     *
-     *    => '<IDENTIFIER>' '<IDENTIFIER>' '=' E
-     *    => '<IDENTIFIER>' '(' Vl ')'     '=' E
-     *    => '<IDENTIFIER>' '(' ')'        '=' E
-     */
+    len = st.st_size;
 
-    if (T_FIRST()->type != T_IDENTIFIER)
+    if ((pBuf = (char *)malloc(len)) == NULL)
     {
-        printf("ERROR: syntax error at token ('%s'), expected ID\n",
-               T_FIRST()->pStr);
+        perror("Failed to malloc memory");
         exit(1);
     }
 
-    if (T_MATCH(T_SECOND(), T_PUNCTION, ",") ||
-        T_MATCH(T_SECOND(), T_OPERATOR, "="))
+    if (pread(srcFd, pBuf, len, 0) != (ssize_t)len)
     {
-        LOG_TDN("Db -> Vl '=' E");
-
-        Parser_Vl();
+        perror("Failed to read file (LineTableBuild)");
+        exit(1);
+    }
 
-        pVl = T_POP(); /* pop Vl */
+#if defined(__SSE2__)
+    for (; (i + 16) <= len; i += 16)
+    {
+        mask = _mm_movemask_epi8(
+                   _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(pBuf + i)), nl));
 
-        T_VERIFY(T_OPERATOR, "=");
-        pOp = T_POP_OP(); /* pop '=' */
+        while (mask)
+        {
+            LineTableAdd(i + __builtin_ctz(mask) + 1);
+            mask &= (mask - 1);
+        }
+    }
+#endif
 
-        Parser_E();
+    for (; i < len; i++)
+    {
+        if (pBuf[i] == '\n') LineTableAdd(i + 1);
+    }
 
-        pE = T_POP(); /* pop E */
+    free(pBuf);
+}
 
-        T_INSERT_TAIL_CHILD(pOp, pVl); /* left child Vl */
-        T_INSERT_TAIL_CHILD(pOp, pE);  /* right child E */
-        T_PUSH(pOp);                   /* push tree Op */
 
-        LOG_BUP("Db -> Vl '=' E");
+/*
+ * Nodes grafted from a prelude image (--prelude/--image) have PRE_LOC set in
+ * their offset, the rest of it is an offset in the prelude, whose line
+ * starts come with the image.
+ */
+#define PRE_LOC 0x80000000u
+
+const unsigned int * preLineStarts = NULL;
+int numPreLines = 0;
+const char * pPreName = NULL;
+
+
+/* Convert a source offset to a (1 based) line and column. */
+void SrcLocation(unsigned int offset, int * pLine, int * pCol)
+{
+    const unsigned int * starts;
+    int lo = 0;
+    int hi, mid;
+
+    if (offset & PRE_LOC)
+    {
+        starts  = preLineStarts;
+        hi      = (numPreLines - 1);
+        offset &= ~PRE_LOC;
     }
-    else if ((T_SECOND()->type == T_IDENTIFIER) ||
-             T_MATCH(T_SECOND(), T_PUNCTION, "("))
+    else
     {
-        LOG_TDN("Db -> '<IDENTIFIER>' Vb+ '=' E");
-
-        /* XXX using "function_form" to match RPAL interpreter AST output */
-        pOp = TokenAlloc(T_OPERATOR, 0, "function_form"); /* create a 'fcn_form' token */
+        if (numLines == 0) LineTableBuild();
 
-        pID = T_POP(); /* pop ID */
+        starts = lineStarts;
+        hi     = (numLines - 1);
+    }
 
-        T_INSERT_TAIL_CHILD(pOp, pID); /* left child ID */
+    while (lo < hi) /* last line start <= offset */
+    {
+        mid = ((lo + hi + 1) / 2);
 
-        do
-        {
-            Parser_Vb();
-            pVb = T_POP(); /* pop Vb */
-            T_INSERT_TAIL_CHILD(pOp, pVb); /* child Vb */
-        } while ((T_FIRST()->type == T_IDENTIFIER) ||
-                 (T_MATCH(T_FIRST(), T_PUNCTION, "(")));
+        if (starts[mid] <= offset) lo = mid;
+        else                       hi = (mid - 1);
+    }
 
-        T_VERIFY(T_OPERATOR, "=");
-        T_POP_DUMP(); /* dump the '=' */
+    *pLine = (lo + 1);
+    *pCol  = (offset - starts[lo] + 1);
+}
 
-        Parser_E();
 
-        pE = T_POP(); /* pop E */
+/*
+ * Source offset as a "line:col" string (in global storage), or as
+ * "prelude:line:col" for a node of the prelude.
+ */
+char * LocToStr(unsigned int offset)
+{
+    int line, col;
 
-        T_INSERT_TAIL_CHILD(pOp, pE); /* right child E */
-        T_PUSH(pOp); /* push tree Op */
+    SrcLocation(offset, &line, &col);
 
-        LOG_BUP("Db -> '<IDENTIFIER>' Vb+ '=' E");
+    if (offset & PRE_LOC)
+    {
+        snprintf(locstr, sizeof(locstr), "%s:%d:%d", pPreName, line, col);
     }
     else
     {
-        printf("ERROR: syntax error at token ('%s')\n", T_SECOND()->pStr);
-        exit(1);
+        snprintf(locstr, sizeof(locstr), "%d:%d", line, col);
     }
+
+    return locstr;
 }
 
 
-/*
- * Dr -> 'rec' Db   => 'rec'
- *    -> Db
- */
-void Parser_Dr(void)
+void LineTableFree(void)
 {
-    Token * pOp;
-    Token * pDb;
+    free(lineStarts);
+    lineStarts = NULL;
+    numLines   = 0;
+    maxLines   = 0;
+}
 
-    if (T_MATCH(T_FIRST(), T_KEYWORD, "rec"))
-    {
-        LOG_TDN("Dr -> 'rec' Db");
 
-        pOp = T_POP_OP(); /* pop 'rec' */
+/*
+ * Offset of the last syntax error, or of the token the parser resynchronized
+ * on after it.  Any further error at that same spot is just a cascade.
+ */
+unsigned int errorOffset = (unsigned int)-1;
 
-        Parser_Db();
 
-        pDb = T_POP(); /* pop Db */
+/*
+ * Report a syntax error at pToken (NULL is the end of the file).  After too
+ * many errors the rest of the tokens are dropped and the parse unwinds.
+ */
+void Parser_Error(Token * pToken, const char * pExpected)
+{
+    unsigned int offset = (pToken) ? pToken->offset : scanOffset;
 
-        T_INSERT_TAIL_CHILD(pOp, pDb); /* single child Db */
-        T_PUSH(pOp);                   /* push tree Op */
+    if ((numDiags > MAX_ERRORS) || ((numDiags > 0) && (offset == errorOffset)))
+    {
+        return;
+    }
 
-        LOG_BUP("Dr -> 'rec' Db");
+    errorOffset = offset;
+
+    if (pToken == NULL)
+    {
+        DiagAdd(offset, "syntax error at end of file, expected %s", pExpected);
+    }
+    else if (pExpected == NULL)
+    {
+        DiagAdd(offset, "syntax error at token ('%s')", pToken->pStr);
     }
     else
     {
-        LOG_TDN("Dr -> Db");
-        Parser_Db();
-        LOG_BUP("Dr -> Db");
+        DiagAdd(offset, "syntax error at token ('%s'), expected %s",
+                pToken->pStr, pExpected);
+    }
+
+    if (numDiags > MAX_ERRORS)
+    {
+        while (T_FIRST()) T_POP_DUMP();
     }
 }
 
 
 /*
- * Da -> Dr ( 'and' Dr )+   => 'and'
- *    -> Dr
+ * Panic mode, skip tokens up to a synchronization token (or the token given
+ * by type/pStr).  Only scanner tokens are ever on the stack when a syntax
+ * error is found, the trees built so far are held by the Parser_* functions.
  */
-void Parser_Da(void)
+void Parser_Sync(TokenType type, const char * pStr)
 {
-    Token * pDr;
-    Token * pOp;
+    while (T_FIRST() && !T_SYNC(T_FIRST()) && !T_MATCH(T_FIRST(), type, pStr))
+    {
+        T_POP_DUMP();
+    }
 
-    LOG_TDN("Da -> Dr");
-    Parser_Dr();
-    LOG_BUP("Da -> Dr");
+    errorOffset = (T_FIRST()) ? T_FIRST()->offset : scanOffset;
+}
 
-    if (T_MATCH(T_SECOND(), T_KEYWORD, "and"))
-    {
-        LOG_TDN("Da -> Dr ( 'and' Dr )+");
 
-        pOp = TokenAlloc(T_OPERATOR, 0, "and"); /* create a 'and' token */
+/* Report an error, resynchronize and push an '<error>' placeholder tree. */
+void Parser_Recover(Token * pToken, const char * pExpected)
+{
+    Token * pErr = TokenAlloc(T_OPERATOR, 0, "<error>");
 
-        while (T_MATCH(T_SECOND(), T_KEYWORD, "and"))
-        {
-            pDr = T_POP(); /* pop Dr */
-            T_INSERT_TAIL_CHILD(pOp, pDr); /* child Dr */ 
+    pErr->offset = (pToken) ? pToken->offset : scanOffset;
 
-            T_POP_DUMP(); /* dump the 'and' */
+    Parser_Error(pToken, pExpected);
+    Parser_Sync(T_OPERATOR, NULL);
 
-            Parser_Dr();
-        }
+    T_PUSH(pErr);
+}
 
-        pDr = T_POP(); /* pop Dr */
-        T_INSERT_TAIL_CHILD(pOp, pDr); /* child Dr */ 
 
-        T_PUSH(pOp); /* push tree Op */
+/*
+ * Each '(' E ')' goes down the whole chain of Parser_* functions again, so
+ * the nesting of parentheses is what bounds the C stack the parse takes.
+ * Past PARSE_MAX_NEST it is an error and the rest of the file is dropped,
+ * the levels already open then unwind quietly at the end of the file.
+ */
+#define PARSE_MAX_NEST 3000
 
-        LOG_BUP("Da -> Dr ( 'and' Dr )+");
-    }
+int parseNest = 0;
+
+
+void Parser_TooDeep(void)
+{
+    Token * pErr = TokenAlloc(T_OPERATOR, 0, "<error>");
+
+    pErr->offset = T_FIRST()->offset;
+
+    DiagAdd(pErr->offset, "parentheses nested more than %d deep",
+            PARSE_MAX_NEST);
+
+    while (T_FIRST()) T_POP_DUMP();
+
+    errorOffset = scanOffset;
+
+    T_PUSH(pErr);
 }
 
 
 /*
- * D -> Da 'within' D   => 'within'
- *   -> Da
+ * Vl -> '<IDENTIFIER>' list ','   => ','?
  */
-void Parser_D(void)
+void Parser_Vl(void)
 {
-    Token * pDa;
+    Token * pID;
     Token * pOp;
-    Token * pD;
 
-    LOG_TDN("D -> Da");
-    Parser_Da();
-    LOG_BUP("D -> Da");
+    /*
+     * The equivalent rule is:
+     *
+     *   Vl -> '<IDENTIFIER>' ( ',' '<IDENTIFIER>' )+   => ','
+     *      -> '<IDENTIFIER>'
+     *
+     * If there aren't any trailing ID tokens the resulting tree is just the
+     * first ID.  If there are multiple IDs then the tree is rooted with a ','
+     * token.
+     */
 
-    while (T_MATCH(T_SECOND(), T_KEYWORD, "within"))
+    if (!T_IS(T_FIRST(), T_IDENTIFIER))
     {
-        LOG_TDN("D -> Da 'within' D");
+        Parser_Recover(T_FIRST(), "ID");
+        return;
+    }
 
-        pDa = T_POP(); /* pop Da */
+    LOG_TDN("Vl -> '<IDENTIFIER>' list ','");
 
-        pOp = T_POP_OP(); /* pop 'within' */
+    if (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+    {
+        pOp = TokenAlloc(T_OPERATOR, 0, ","); /* create a ',' token */
+        pOp->offset = T_FIRST()->offset;
 
-        Parser_D();
+        while (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+        {
+            pID = T_POP(); /* pop ID */
+            T_INSERT_TAIL_CHILD(pOp, pID); /* child ID */ 
 
-        pD = T_POP(); /* pop D */
+            T_POP_DUMP(); /* dump the ',' */
 
-        T_INSERT_TAIL_CHILD(pOp, pDa); /* left child Da */
-        T_INSERT_TAIL_CHILD(pOp, pD);  /* right child D */
-        T_PUSH(pOp);                   /* push tree Op */
+            if (!T_IS(T_FIRST(), T_IDENTIFIER))
+            {
+                Parser_Error(T_FIRST(), "ID");
+                Parser_Sync(T_IDENTIFIER, NULL);
+                break;
+            }
+        }
 
-        LOG_BUP("D -> Da 'within' D");
+        if (T_IS(T_FIRST(), T_IDENTIFIER))
+        {
+            pID = T_POP(); /* pop ID */
+            T_INSERT_TAIL_CHILD(pOp, pID); /* child ID */ 
+        }
+
+        T_PUSH(pOp); /* push tree Op */
     }
+
+    LOG_BUP("Vl -> '<IDENTIFIER>' list ','");
 }
 
 
+
 /*
- * Rn -> '<IDENTIFIER>'
- *    -> '<INTEGER>'
- *    -> '<STRING>'
- *    -> 'true'           => 'true'
- *    -> 'false'          => 'false'
- *    -> 'nil'            => 'nil'
- *    -> '(' E ')'
- *    -> 'dummy'          => 'dummy'
+ * Vb -> '<IDENTIFIER>'
+ *    -> '(' Vl ')'
+ *    -> '(' ')'          => '()'
  */
-void Parser_Rn(void)
+void Parser_Vb(void)
 {
-    Token * pE;
+    Token * pVl;
+    Token * pOp;
 
-    if (T_FIRST()->type == T_IDENTIFIER)
-    {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> '<IDENTIFIER>'");
-        LOG_BUP("Rn -> '<IDENTIFIER>'");
-    }
-    else if (T_FIRST()->type == T_INTEGER)
-    {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> '<INTEGER>'");
-        LOG_BUP("Rn -> '<INTEGER>'");
-    }
-    else if (T_FIRST()->type == T_STRING)
+    if (T_IS(T_FIRST(), T_IDENTIFIER))
     {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> '<STRING>'");
-        LOG_BUP("Rn -> '<STRING>'");
+        /* nothing to do, leave the ID token on the stack */
+        LOG_TDN("Vb -> '<IDENTIFIER>'");
+        LOG_BUP("Vb -> '<IDENTIFIER>'");
     }
-    else if T_MATCH(T_FIRST(), T_KEYWORD, "true")
+    else if (T_MATCH(T_FIRST(), T_PUNCTION, "(") &&
+             T_MATCH(T_SECOND(), T_PUNCTION, ")"))
     {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> 'true'");
-        LOG_BUP("Rn -> 'true'");
+        LOG_TDN("Vb -> '(' ')'");
 
-        /* XXX "<true>" hack to match RPAL interpreter AST output */
-        free(T_FIRST()->pStr);
-        T_FIRST()->pStr = strdup("<true>");
-    }
-    else if T_MATCH(T_FIRST(), T_KEYWORD, "false")
-    {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> 'false'");
-        LOG_BUP("Rn -> 'false'");
+        pOp = TokenAlloc(T_OPERATOR, 0, "()"); /* create a '()' token */
+        pOp->offset = T_FIRST()->offset;
 
-        /* XXX "<false>" hack to match RPAL interpreter AST output */
-        free(T_FIRST()->pStr);
-        T_FIRST()->pStr = strdup("<false>");
-    }
-    else if T_MATCH(T_FIRST(), T_KEYWORD, "nil")
-    {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> 'nil'");
-        LOG_BUP("Rn -> 'nil'");
+        T_POP_DUMP(); /* dump the '(' */
+        T_POP_DUMP(); /* dump the ')' */
 
-        /* XXX "<nil>" hack to match RPAL interpreter AST output */
-        free(T_FIRST()->pStr);
-        T_FIRST()->pStr = strdup("<nil>");
-    }
-    else if T_MATCH(T_FIRST(), T_KEYWORD, "dummy")
-    {
-        /* nothing to do, leave token on the stack */
-        LOG_TDN("Rn -> 'dummy'");
-        LOG_BUP("Rn -> 'dummy'");
+        T_PUSH(pOp); /* push tree Op */
 
-        /* XXX "<dummy>" hack to match RPAL interpreter AST output */
-        free(T_FIRST()->pStr);
-        T_FIRST()->pStr = strdup("<dummy>");
+        LOG_BUP("Vb -> '(' ')'");
     }
     else if (T_MATCH(T_FIRST(), T_PUNCTION, "("))
     {
-        LOG_TDN("Rn -> '(' E ')'");
+        LOG_TDN("Vb -> '(' Vl ')'");
 
         T_POP_DUMP(); /* dump the '(' */
 
-        Parser_E();
+        Parser_Vl();
 
-        pE = T_POP(); /* pop E */
+        pVl = T_POP(); /* pop Vl */
+
+        T_EXPECT(T_PUNCTION, ")"); /* dump the ')' */
+
+        T_PUSH(pVl); /* push Vl back on the stack */
+
+        LOG_BUP("Vb -> '(' Vl ')'");
+    }
+    else
+    {
+        Parser_Recover(T_FIRST(), "('(')");
+    }
+}
+
+
+/*
+ * Db -> Vl '=' E                   => '='
+ *    -> '<IDENTIFIER>' Vb+ '=' E   => 'fcn_form'
+ *    -> '(' D ')'
+ */
+void Parser_Db(void)
+{
+    Token * pD;
+    Token * pID;
+    Token * pVl;
+    Token * pVb;
+    Token * pOp;
+    Token * pE;
+
+    if (T_MATCH(T_FIRST(), T_PUNCTION, "("))
+    {
+        LOG_TDN("Db -> '(' D ')'");
+
+        T_POP_DUMP(); /* dump the '(' */
+
+        Parser_D();
+
+        pD = T_POP(); /* pop D */
+
+        T_EXPECT(T_PUNCTION, ")"); /* dump the ')' */
+
+        T_PUSH(pD); /* push D back on the stack */
+
+        LOG_BUP("Db -> '(' D ')'");
+        return;
+    }
+
+    /*
+     * The last two rules are a bit tricky since both start with an ID.  After
+     * expanding the rules further it's easy to see how they differ:
+     *
+     * Db -> Vl '=' E
+     *
+     *    => '<IDENTIFIER>' ( ',' '<IDENTIFIER>' )+ '=' E
+     *    => '<IDENTIFIER>'                         '=' E
+     *
+     * Db -> '<IDENTIFIER>' Vb+ '=' E
+     *
+     *    => '<IDENTIFIER>' '<IDENTIFIER>' '=' E
+     *    => '<IDENTIFIER>' '(' Vl ')'     '=' E
+     *    => '<IDENTIFIER>' '(' ')'        '=' E
+     */
+
+    if (!T_IS(T_FIRST(), T_IDENTIFIER))
+    {
+        Parser_Recover(T_FIRST(), "ID");
+        return;
+    }
+
+    if (T_MATCH(T_SECOND(), T_PUNCTION, ",") ||
+        T_MATCH(T_SECOND(), T_OPERATOR, "="))
+    {
+        LOG_TDN("Db -> Vl '=' E");
+
+        Parser_Vl();
+
+        pVl = T_POP(); /* pop Vl */
+
+        if (T_MATCH(T_FIRST(), T_OPERATOR, "="))
+        {
+            pOp = T_POP_OP(); /* pop '=' */
+        }
+        else /* report it, resync and make up the missing '=' */
+        {
+            pOp = TokenAlloc(T_OPERATOR, 0, "=");
+            pOp->offset = pVl->offset;
+
+            T_EXPECT(T_OPERATOR, "=");
+        }
+
+        Parser_E();
+
+        pE = T_POP(); /* pop E */
+
+        T_INSERT_TAIL_CHILD(pOp, pVl); /* left child Vl */
+        T_INSERT_TAIL_CHILD(pOp, pE);  /* right child E */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Db -> Vl '=' E");
+    }
+    else if (T_IS(T_SECOND(), T_IDENTIFIER) ||
+             T_MATCH(T_SECOND(), T_PUNCTION, "("))
+    {
+        LOG_TDN("Db -> '<IDENTIFIER>' Vb+ '=' E");
+
+        /* XXX using "function_form" to match RPAL interpreter AST output */
+        pOp = TokenAlloc(T_OPERATOR, 0, "function_form"); /* create a 'fcn_form' token */
+        pOp->offset = T_FIRST()->offset;
+
+        pID = T_POP(); /* pop ID */
+
+        T_INSERT_TAIL_CHILD(pOp, pID); /* left child ID */
+
+        do
+        {
+            Parser_Vb();
+            pVb = T_POP(); /* pop Vb */
+            T_INSERT_TAIL_CHILD(pOp, pVb); /* child Vb */
+        } while (T_IS(T_FIRST(), T_IDENTIFIER) ||
+                 (T_MATCH(T_FIRST(), T_PUNCTION, "(")));
+
+        T_EXPECT(T_OPERATOR, "="); /* dump the '=' */
+
+        Parser_E();
+
+        pE = T_POP(); /* pop E */
+
+        T_INSERT_TAIL_CHILD(pOp, pE); /* right child E */
+        T_PUSH(pOp); /* push tree Op */
+
+        LOG_BUP("Db -> '<IDENTIFIER>' Vb+ '=' E");
+    }
+    else
+    {
+        T_POP_DUMP(); /* dump the ID */
+        Parser_Recover(T_FIRST(), "('=')");
+    }
+}
+
+
+/*
+ * Dr -> 'rec' Db   => 'rec'
+ *    -> Db
+ */
+void Parser_Dr(void)
+{
+    Token * pOp;
+    Token * pDb;
+
+    if (T_MATCH(T_FIRST(), T_KEYWORD, "rec"))
+    {
+        LOG_TDN("Dr -> 'rec' Db");
+
+        pOp = T_POP_OP(); /* pop 'rec' */
+
+        Parser_Db();
+
+        pDb = T_POP(); /* pop Db */
+
+        T_INSERT_TAIL_CHILD(pOp, pDb); /* single child Db */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Dr -> 'rec' Db");
+    }
+    else
+    {
+        LOG_TDN("Dr -> Db");
+        Parser_Db();
+        LOG_BUP("Dr -> Db");
+    }
+}
+
+
+/*
+ * Da -> Dr ( 'and' Dr )+   => 'and'
+ *    -> Dr
+ */
+void Parser_Da(void)
+{
+    Token * pDr;
+    Token * pOp;
+
+    LOG_TDN("Da -> Dr");
+    Parser_Dr();
+    LOG_BUP("Da -> Dr");
+
+    if (T_MATCH(T_SECOND(), T_KEYWORD, "and"))
+    {
+        LOG_TDN("Da -> Dr ( 'and' Dr )+");
+
+        pOp = TokenAlloc(T_OPERATOR, 0, "and"); /* create a 'and' token */
+        pOp->offset = T_FIRST()->offset;
+
+        while (T_MATCH(T_SECOND(), T_KEYWORD, "and"))
+        {
+            pDr = T_POP(); /* pop Dr */
+            T_INSERT_TAIL_CHILD(pOp, pDr); /* child Dr */ 
+
+            T_POP_DUMP(); /* dump the 'and' */
+
+            Parser_Dr();
+        }
+
+        pDr = T_POP(); /* pop Dr */
+        T_INSERT_TAIL_CHILD(pOp, pDr); /* child Dr */ 
+
+        T_PUSH(pOp); /* push tree Op */
+
+        LOG_BUP("Da -> Dr ( 'and' Dr )+");
+    }
+}
+
+
+/*
+ * D -> Da 'within' D   => 'within'
+ *   -> Da
+ */
+void Parser_D(void)
+{
+    Token * pDa;
+    Token * pOp;
+    Token * pD;
+
+    LOG_TDN("D -> Da");
+    Parser_Da();
+    LOG_BUP("D -> Da");
+
+    while (T_MATCH(T_SECOND(), T_KEYWORD, "within"))
+    {
+        LOG_TDN("D -> Da 'within' D");
+
+        pDa = T_POP(); /* pop Da */
+
+        pOp = T_POP_OP(); /* pop 'within' */
+
+        Parser_D();
+
+        pD = T_POP(); /* pop D */
+
+        T_INSERT_TAIL_CHILD(pOp, pDa); /* left child Da */
+        T_INSERT_TAIL_CHILD(pOp, pD);  /* right child D */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("D -> Da 'within' D");
+    }
+}
+
+
+/*
+ * Rn -> '<IDENTIFIER>'
+ *    -> '<INTEGER>'
+ *    -> '<STRING>'
+ *    -> 'true'           => 'true'
+ *    -> 'false'          => 'false'
+ *    -> 'nil'            => 'nil'
+ *    -> '(' E ')'
+ *    -> 'dummy'          => 'dummy'
+ */
+void Parser_Rn(void)
+{
+    Token * pE;
+
+    if (T_IS(T_FIRST(), T_IDENTIFIER))
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> '<IDENTIFIER>'");
+        LOG_BUP("Rn -> '<IDENTIFIER>'");
+    }
+    else if (T_IS(T_FIRST(), T_INTEGER))
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> '<INTEGER>'");
+        LOG_BUP("Rn -> '<INTEGER>'");
+    }
+    else if (T_IS(T_FIRST(), T_STRING))
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> '<STRING>'");
+        LOG_BUP("Rn -> '<STRING>'");
+    }
+    else if T_MATCH(T_FIRST(), T_KEYWORD, "true")
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> 'true'");
+        LOG_BUP("Rn -> 'true'");
+
+        /* XXX "<true>" hack to match RPAL interpreter AST output */
+        free(T_FIRST()->pStr);
+        T_FIRST()->pStr = strdup("<true>");
+    }
+    else if T_MATCH(T_FIRST(), T_KEYWORD, "false")
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> 'false'");
+        LOG_BUP("Rn -> 'false'");
+
+        /* XXX "<false>" hack to match RPAL interpreter AST output */
+        free(T_FIRST()->pStr);
+        T_FIRST()->pStr = strdup("<false>");
+    }
+    else if T_MATCH(T_FIRST(), T_KEYWORD, "nil")
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> 'nil'");
+        LOG_BUP("Rn -> 'nil'");
+
+        /* XXX "<nil>" hack to match RPAL interpreter AST output */
+        free(T_FIRST()->pStr);
+        T_FIRST()->pStr = strdup("<nil>");
+    }
+    else if T_MATCH(T_FIRST(), T_KEYWORD, "dummy")
+    {
+        /* nothing to do, leave token on the stack */
+        LOG_TDN("Rn -> 'dummy'");
+        LOG_BUP("Rn -> 'dummy'");
+
+        /* XXX "<dummy>" hack to match RPAL interpreter AST output */
+        free(T_FIRST()->pStr);
+        T_FIRST()->pStr = strdup("<dummy>");
+    }
+    else if (T_MATCH(T_FIRST(), T_PUNCTION, "(") &&
+             (parseNest == PARSE_MAX_NEST))
+    {
+        Parser_TooDeep();
+    }
+    else if (T_MATCH(T_FIRST(), T_PUNCTION, "("))
+    {
+        LOG_TDN("Rn -> '(' E ')'");
+
+        T_POP_DUMP(); /* dump the '(' */
+
+        parseNest++;
+        Parser_E();
+        parseNest--;
+
+        pE = T_POP(); /* pop E */
+
+        T_EXPECT(T_PUNCTION, ")"); /* dump the ')' */
+
+        T_PUSH(pE); /* push E back on the stack */
+
+        LOG_BUP("Rn -> '(' E ')'");
+    }
+    else
+    {
+        Parser_Recover(T_FIRST(), "an expression");
+    }
+}
+
+
+/*
+ * R -> R Rn   => 'gamma'
+ *   -> Rn
+ */
+void Parser_R(void)
+{
+    Token * pR;
+    Token * pRn;
+    Token * pGamma;
+
+    LOG_TDN("R -> Rn");
+    Parser_Rn();
+    LOG_BUP("R -> Rn");
+
+    while (T_SECOND()                               &&
+           (T_IS(T_SECOND(), T_IDENTIFIER)          ||
+            T_IS(T_SECOND(), T_INTEGER)             ||
+            T_IS(T_SECOND(), T_STRING)              ||
+            T_MATCH(T_SECOND(), T_KEYWORD, "true")  ||
+            T_MATCH(T_SECOND(), T_KEYWORD, "false") ||
+            T_MATCH(T_SECOND(), T_KEYWORD, "nil")   ||
+            T_MATCH(T_SECOND(), T_KEYWORD, "dummy") ||
+            T_MATCH(T_SECOND(), T_PUNCTION, "(")))
+    {
+        LOG_TDN("R -> R Rn");
+
+        pR = T_POP(); /* pop R */
+
+        Parser_Rn();
+
+        pRn = T_POP(); /* pop Rn */
+
+        pGamma = TokenAlloc(T_OPERATOR, 0, "gamma"); /* create a 'gamma' token */
+        pGamma->offset = pR->offset;
+
+        T_INSERT_TAIL_CHILD(pGamma, pR);  /* left child R */ 
+        T_INSERT_TAIL_CHILD(pGamma, pRn); /* right child pRn */
+        T_PUSH(pGamma);                   /* push tree Op */
+
+        LOG_BUP("R -> R Rn");
+    }
+}
+
+
+/*
+ * Ap -> Ap '@' '<IDENTIFIER>' R   => '@'
+ *    -> R
+ */
+void Parser_Ap(void)
+{
+    Token * pAp;
+    Token * pOp;
+    Token * pId;
+    Token * pR;
+
+    LOG_TDN("Ap -> R");
+    Parser_R();
+    LOG_BUP("Ap -> R");
+
+    while (T_MATCH(T_SECOND(), T_OPERATOR, "@"))
+    {
+        LOG_TDN("Ap -> Ap '@' '<IDENTIFIER>' R");
+
+        pAp = T_POP(); /* pop Ap */
+        pOp = T_POP(); /* pop operator */
+
+        if (!T_IS(T_FIRST(), T_IDENTIFIER))
+        {
+            Parser_Recover(T_FIRST(), "ID");
+        }
+
+        pId = T_POP(); /* pop id */
+
+        Parser_R();
+
+        pR = T_POP(); /* pop R */
+
+        T_INSERT_TAIL_CHILD(pOp, pAp); /* left child Ap */ 
+        T_INSERT_TAIL_CHILD(pOp, pId); /* middle child Id */
+        T_INSERT_TAIL_CHILD(pOp, pR);  /* right child R */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Ap -> Ap '@' '<IDENTIFIER>' R");
+    }
+}
+
+
+/*
+ * Af -> Ap '**' Af   => '**'
+ *    -> Ap
+ */
+void Parser_Af(void)
+{
+    Token * pAp;
+    Token * pOp;
+    Token * pAf;
+
+    LOG_TDN("Af -> Ap");
+    Parser_Ap();
+    LOG_BUP("Af -> Ap");
+
+    while (T_MATCH(T_SECOND(), T_OPERATOR, "**"))
+    {
+        LOG_TDN("Af -> Ap '**' Af");
+
+        pAp = T_POP(); /* pop Ap */
+        pOp = T_POP(); /* pop operator */
+
+        Parser_Af();
+
+        pAf = T_POP(); /* pop Af */
+
+        T_INSERT_TAIL_CHILD(pOp, pAp); /* left child Ap */
+        T_INSERT_TAIL_CHILD(pOp, pAf); /* right child Af */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Af -> Ap '**' Af");
+    }
+}
+
+
+/*
+ * At -> At '*' Af   => '*'
+ *    -> At '/' Af   => '/'
+ *    -> Af
+ */
+void Parser_At(void)
+{
+    char buf[64];
+    Token * pAt;
+    Token * pOp;
+    Token * pAf;
+
+    LOG_TDN("At -> Af");
+    Parser_Af();
+    LOG_BUP("At -> Af");
+
+    while (T_MATCH(T_SECOND(), T_OPERATOR, "*") ||
+           T_MATCH(T_SECOND(), T_OPERATOR, "/"))
+    {
+        strcpy(buf, T_SECOND()->pStr);
+
+        LOG_TDN("At -> At '%s' Af", buf);
+
+        pAt = T_POP(); /* pop At */
+        pOp = T_POP(); /* pop operator */
+
+        Parser_Af();
+
+        pAf = T_POP(); /* pop Af */
+
+        T_INSERT_TAIL_CHILD(pOp, pAt); /* left child At */
+        T_INSERT_TAIL_CHILD(pOp, pAf); /* right child Af */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("At -> At '%s' Af", buf);
+    }
+}
+
+
+/*
+ * A -> A '+' At   => '+'
+ *   -> A '-' At   => '-'
+ *   ->   '+' At
+ *   ->   '-' At   => 'neg'
+ *   -> At
+ */
+void Parser_A(void)
+{
+    char buf[64];
+    Token * pA;
+    Token * pOp;
+    Token * pAt;
+
+    if (T_MATCH(T_FIRST(), T_OPERATOR, "+"))
+    {
+        LOG_TDN("A -> '+' At");
+
+        T_POP_DUMP(); /* dump the '+' */
+
+        Parser_At();
+
+        LOG_BUP("A -> '+' At");
+    }
+    else if (T_MATCH(T_FIRST(), T_OPERATOR, "-"))
+    {
+        LOG_TDN("A -> '-' At");
+
+        pOp = TokenAlloc(T_OPERATOR, 0, "neg"); /* create a 'neg' token */
+        pOp->offset = T_FIRST()->offset;
+
+        T_POP_DUMP(); /* dump the '-' */
+
+        Parser_At();
+
+        pAt = T_POP(); /* pop At */
+
+        T_INSERT_TAIL_CHILD(pOp, pAt); /* single child At */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("A -> '-' At");
+    }
+    else
+    {
+        LOG_TDN("A -> At");
+        Parser_At();
+        LOG_BUP("A -> At");
+    }
+
+    while (T_MATCH(T_SECOND(), T_OPERATOR, "+") ||
+           T_MATCH(T_SECOND(), T_OPERATOR, "-"))
+    {
+        strcpy(buf, T_SECOND()->pStr);
+
+        LOG_TDN("A -> A '%s' At", buf);
+
+        pA  = T_POP(); /* pop A */
+        pOp = T_POP(); /* pop operator */
+
+        Parser_At();
+
+        pAt = T_POP(); /* pop At */
+
+        T_INSERT_TAIL_CHILD(pOp, pA);  /* left child A */ 
+        T_INSERT_TAIL_CHILD(pOp, pAt); /* right child At */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("A -> A '%s' At", buf);
+    }
+}
+
+
+/*
+ * Bp -> A ( 'gr' | '>'  ) A   => 'gr'
+ *    -> A ( 'ge' | '>=' ) A   => 'ge'
+ *    -> A ( 'ls' | '<'  ) A   => 'ls'
+ *    -> A ( 'le' | '<=' ) A   => 'le'
+ *    -> A 'eq' A              => 'eq'
+ *    -> A 'ne' A              => 'ne'
+ *    -> A
+ */
+void Parser_Bp(void)
+{
+    char buf[64];
+    Token * pA1;
+    Token * pOp;
+    Token * pA2;
+
+    LOG_TDN("Bp -> A");
+    Parser_A();
+    LOG_BUP("Bp -> A");
+
+    if (T_MATCH(T_SECOND(), T_KEYWORD,  "gr") ||
+        T_MATCH(T_SECOND(), T_OPERATOR, ">")  ||
+        T_MATCH(T_SECOND(), T_KEYWORD,  "ge") ||
+        T_MATCH(T_SECOND(), T_OPERATOR, ">=") ||
+        T_MATCH(T_SECOND(), T_KEYWORD,  "ls") ||
+        T_MATCH(T_SECOND(), T_OPERATOR, "<")  ||
+        T_MATCH(T_SECOND(), T_KEYWORD,  "le") ||
+        T_MATCH(T_SECOND(), T_OPERATOR, "<=") ||
+        T_MATCH(T_SECOND(), T_KEYWORD,  "eq") ||
+        T_MATCH(T_SECOND(), T_KEYWORD,  "ne"))
+    {
+        strcpy(buf,
+               (T_MATCH(T_SECOND(), T_KEYWORD, "gr") ||
+                T_MATCH(T_SECOND(), T_OPERATOR, ">"))   ? "( 'gr' | '>'  )" :
+               (T_MATCH(T_SECOND(), T_KEYWORD, "ge") ||
+                T_MATCH(T_SECOND(), T_OPERATOR, ">="))  ? "( 'ge' | '>=' )" :
+               (T_MATCH(T_SECOND(), T_KEYWORD, "ls") ||
+                T_MATCH(T_SECOND(), T_OPERATOR, "<"))   ? "( 'ls' | '<'  )" :
+               (T_MATCH(T_SECOND(), T_KEYWORD, "le") ||
+                T_MATCH(T_SECOND(), T_OPERATOR, "<="))  ? "( 'le' | '<=' )" :
+               (T_MATCH(T_SECOND(), T_KEYWORD, "eq"))   ? "'eq'" : "'ne'");
+
+        LOG_TDN("Bp -> A %s A", buf);
+
+        pA1 = T_POP(); /* pop A1 */
+
+        pOp = T_POP_OP(); /* pop operator */
+
+        Parser_A();
+
+        pA2 = T_POP(); /* pop A2 */
+
+        T_INSERT_TAIL_CHILD(pOp, pA1); /* left child A1 */ 
+        T_INSERT_TAIL_CHILD(pOp, pA2); /* right child A2 */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Bp -> A %s A", buf);
+    }
+}
+
+
+/*
+ * Bs -> 'not' Bp   => 'not'
+ *    -> Bp
+ */
+void Parser_Bs(void)
+{
+    Token * pOp;
+    Token * pBp;
+
+    if (T_MATCH(T_FIRST(), T_KEYWORD, "not"))
+    {
+        LOG_TDN("Bs -> 'not' Bp");
+
+        pOp = T_POP_OP(); /* pop 'not' */
+
+        Parser_Bp();
+
+        pBp = T_POP(); /* pop Bp */
+
+        T_INSERT_TAIL_CHILD(pOp, pBp); /* single child Bp */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Bs -> 'not' Bp");
+    }
+    else
+    {
+        LOG_TDN("Bs -> Bp");
+        Parser_Bp();
+        LOG_BUP("Bs -> Bp");
+    }
+}
+
+
+/*
+ * Bt -> Bt '&' Bs   => '&'
+ *    -> Bs
+ */
+void Parser_Bt(void)
+{
+    Token * pBt;
+    Token * pOp;
+    Token * pBs;
+
+    LOG_TDN("Bt -> Bs");
+    Parser_Bs();
+    LOG_BUP("Bt -> Bs");
+
+    while (T_MATCH(T_SECOND(), T_OPERATOR, "&"))
+    {
+        LOG_TDN("Bt -> Bt '&' Bs");
+
+        pBt = T_POP(); /* pop Bt */
+
+        pOp = T_POP_OP(); /* pop '&' */
+
+        Parser_Bs();
+
+        pBs = T_POP(); /* pop Bs */
+
+        T_INSERT_TAIL_CHILD(pOp, pBt); /* left child Bt */ 
+        T_INSERT_TAIL_CHILD(pOp, pBs); /* right child Bs */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Bt -> Bt '&' Bs");
+    }
+}
+
+
+/*
+ * B -> B 'or' Bt   => 'or'
+ *   -> Bt
+ */
+void Parser_B(void)
+{
+    Token * pB;
+    Token * pOp;
+    Token * pBt;
+
+    LOG_TDN("B -> Bt");
+    Parser_Bt();
+    LOG_BUP("B -> Bt");
+
+    while (T_MATCH(T_SECOND(), T_KEYWORD, "or"))
+    {
+        LOG_TDN("B -> B 'or' Bt");
+
+        pB = T_POP(); /* pop B */
+
+        pOp = T_POP_OP(); /* pop 'or' */
+
+        Parser_Bt();
+
+        pBt = T_POP(); /* pop Bt */
+
+        T_INSERT_TAIL_CHILD(pOp, pB);  /* left child B */ 
+        T_INSERT_TAIL_CHILD(pOp, pBt); /* right child Bt */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("B -> B 'or' Bt");
+    }
+}
+
+
+/*
+ * Tc -> B '->' Tc '|' Tc   => '->'
+ *    -> B
+ */
+void Parser_Tc(void)
+{
+    Token * pB;
+    Token * pOp;
+    Token * pTc1;
+    Token * pTc2;
+
+    LOG_TDN("Tc -> B");
+    Parser_B();
+    LOG_BUP("Tc -> B");
+
+    while (T_MATCH(T_SECOND(), T_OPERATOR, "->"))
+    {
+        LOG_TDN("Tc -> B '->' Tc '|' Tc");
+
+        pB = T_POP(); /* pop B */
+
+        pOp = T_POP_OP(); /* pop '->' */
+
+        Parser_Tc();
+
+        pTc1 = T_POP(); /* pop Tc1 */
+
+        T_EXPECT(T_OPERATOR, "|"); /* dump the '|' */
+
+        Parser_Tc();
+
+        pTc2 = T_POP(); /* pop Tc2 */
+
+        T_INSERT_TAIL_CHILD(pOp, pB);   /* left child B */
+        T_INSERT_TAIL_CHILD(pOp, pTc1); /* middle child Tc1 */
+        T_INSERT_TAIL_CHILD(pOp, pTc2); /* right child Tc2 */
+        T_PUSH(pOp);                    /* push tree Op */
+
+        LOG_BUP("Tc -> B '->' Tc '|' Tc");
+    }
+}
+
+
+/*
+ * Ta -> Ta 'aug' Tc   => 'aug'
+ *    -> Tc
+ */
+void Parser_Ta(void)
+{
+    Token * pTa;
+    Token * pOp;
+    Token * pTc;
+
+    LOG_TDN("Ta -> Tc");
+    Parser_Tc();
+    LOG_BUP("Ta -> Tc");
+
+    while (T_MATCH(T_SECOND(), T_KEYWORD, "aug"))
+    {
+        LOG_TDN("Ta -> Ta 'aug' Tc");
+
+        pTa = T_POP(); /* pop Bt */
+
+        pOp = T_POP_OP(); /* pop 'aug' */
+
+        Parser_Tc();
+
+        pTc = T_POP(); /* pop Tc */
+
+        T_INSERT_TAIL_CHILD(pOp, pTa); /* left child Ta */ 
+        T_INSERT_TAIL_CHILD(pOp, pTc); /* right child Tc */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Ta -> Ta 'aug' Tc");
+    }
+}
+
+
+/*
+ * T -> Ta ( ',' Ta )+   => 'tau'
+ *   -> Ta
+ */
+void Parser_T(void)
+{
+    Token * pTa;
+    Token * pOp;
+
+    LOG_TDN("T -> Ta");
+    Parser_Ta();
+    LOG_BUP("T -> Ta");
+
+    if (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+    {
+        LOG_TDN("T -> Ta ( ',' Ta )+");
+
+        pOp = TokenAlloc(T_OPERATOR, 0, "tau"); /* create a 'tau' token */
+        pOp->offset = T_FIRST()->offset;
+
+        while (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+        {
+            pTa = T_POP(); /* pop Ta */
+            T_INSERT_TAIL_CHILD(pOp, pTa); /* child Ta */ 
+
+            T_POP_DUMP(); /* dump the ',' */
+
+            Parser_Ta();
+        }
+
+        pTa = T_POP(); /* pop Ta */
+        T_INSERT_TAIL_CHILD(pOp, pTa); /* child Ta */ 
+
+        T_PUSH(pOp); /* push tree Op */
+
+        LOG_BUP("T -> Ta ( ',' Ta )+");
+    }
+}
+
+
+/*
+ * Ew -> T 'where' Dr   => 'where'
+ *    -> T
+ */
+void Parser_Ew(void)
+{
+    Token * pT;
+    Token * pOp;
+    Token * pDr;
+
+    LOG_TDN("Ew -> T");
+    Parser_T();
+    LOG_BUP("Ew -> T");
+
+    if (T_MATCH(T_SECOND(), T_KEYWORD, "where"))
+    {
+        LOG_TDN("Ew -> T 'where' Dr");
+
+        pT = T_POP(); /* pop T */
+
+        pOp = T_POP_OP(); /* pop 'where' */
+
+        Parser_Dr();
+
+        pDr = T_POP(); /* pop Dr */
+
+        T_INSERT_TAIL_CHILD(pOp, pT);  /* left child T */ 
+        T_INSERT_TAIL_CHILD(pOp, pDr); /* right child Dr */
+        T_PUSH(pOp);                   /* push tree Op */
+
+        LOG_BUP("Ew -> T 'where' Dr");
+    }
+}
+
+
+/*
+ * Parse an RPAL program!
+ *
+ * E -> 'let' D 'in' E   => 'let'
+ *   -> 'fn' Vb+ '.' E   => 'lambda'
+ *   -> Ew
+ */
+void Parser_E(void)
+{
+    Token * pD;
+    Token * pE;
+    Token * pOp;
+    Token * pVb;
+
+    if (T_MATCH(T_FIRST(), T_KEYWORD, "let"))
+    {
+        LOG_TDN("E -> 'let' D 'in' E");
+
+        pOp = T_POP(); /* pop 'let' */
+
+        Parser_D();
+
+        pD = T_POP(); /* pop D */
+
+        T_EXPECT(T_KEYWORD, "in"); /* dump the 'in' */
+
+        Parser_E();
+
+        pE = T_POP(); /* pop E */
+
+        T_INSERT_TAIL_CHILD(pOp, pD); /* left child D */
+        T_INSERT_TAIL_CHILD(pOp, pE); /* right child E */
+        T_PUSH(pOp);
+
+        LOG_BUP("E -> 'let' D 'in' E");
+    }
+    else if (T_MATCH(T_FIRST(), T_KEYWORD, "fn"))
+    {
+        LOG_TDN("E -> 'fn' Vb+ '.' E");
+
+        pOp = TokenAlloc(T_OPERATOR, 0, "lambda"); /* create a 'lambda' token */
+        pOp->offset = T_FIRST()->offset;
+
+        T_POP_DUMP(); /* dump the 'fn' */
+
+        do
+        {
+            Parser_Vb();
+            pVb = T_POP(); /* pop Vb */
+            T_INSERT_TAIL_CHILD(pOp, pVb); /* child Vb */
+        } while (T_IS(T_FIRST(), T_IDENTIFIER) ||
+                 (T_MATCH(T_FIRST(), T_PUNCTION, "(")));
+
+        T_EXPECT(T_OPERATOR, "."); /* dump the '.' */
+
+        Parser_E();
+
+        pE = T_POP(); /* pop E */
+
+        T_INSERT_TAIL_CHILD(pOp, pE); /* right child E */
+        T_PUSH(pOp); /* push tree Op */
+
+        LOG_BUP("E -> 'fn' Vb+ '.' E");
+    }
+    else
+    {
+        LOG_TDN("E -> Ew");
+        Parser_Ew();
+        LOG_BUP("E -> Ew");
+    }
+}
+
+
+/*
+ * Node kind index.  As the parser finishes each node (T_PUSH) it is given
+ * an id in the node table and the id is appended to the postings list for
+ * its kind ('gamma', 'rec', '<ID>', ...).  Structural queries (--query)
+ * then only look at the candidate nodes instead of walking the whole tree.
+ */
+#define IDX_MAX_KINDS 256
+
+typedef struct
+{
+    char * pName;
+    int *  pIds;
+    int    numIds;
+    int    maxIds;
+} IndexKind;
+
+Token ** idxNodes = NULL; /* indexed by (id - 1) */
+int idxNumNodes = 0;
+int idxMaxNodes = 0;
+IndexKind idxKinds[IDX_MAX_KINDS];
+int idxNumKinds = 0;
+int idxKindTable[IDX_MAX_KINDS * 2]; /* hashed names, (kind + 1), 0 = empty */
+
+
+/* The name a node is indexed under (leaves are indexed by type). */
+const char * IndexKindName(Token * pToken)
+{
+    switch (pToken->type)
+    {
+    case T_IDENTIFIER: return "<ID>";
+    case T_INTEGER:    return "<INT>";
+    case T_STRING:     return "<STR>";
+    default:           break;
+    }
+
+    /* same as TokenToStr() but without the copy */
+    return (strcmp(pToken->pStr, "()") == 0) ? "<()>" : pToken->pStr;
+}
+
+
+/* Find the kind for pName, optionally creating it.  Returns -1 if none. */
+int IndexKindLookup(const char * pName, int create)
+{
+    unsigned int hash = 2166136261u; /* FNV-1a */
+    const char * p;
+    int slot;
+
+    for (p = pName; *p; p++) hash = (hash ^ (unsigned char)*p) * 16777619u;
+
+    for (slot = (hash % (IDX_MAX_KINDS * 2));
+         idxKindTable[slot];
+         slot = ((slot + 1) % (IDX_MAX_KINDS * 2)))
+    {
+        if (strcmp(idxKinds[idxKindTable[slot] - 1].pName, pName) == 0)
+        {
+            return (idxKindTable[slot] - 1);
+        }
+    }
+
+    if (!create) return -1;
+
+    if (idxNumKinds == IDX_MAX_KINDS)
+    {
+        printf("ERROR: too many node kinds\n");
+        exit(1);
+    }
+
+    memset(&idxKinds[idxNumKinds], 0, sizeof(IndexKind));
+
+    if ((idxKinds[idxNumKinds].pName = strdup(pName)) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    idxKindTable[slot] = ++idxNumKinds;
+
+    return (idxNumKinds - 1);
+}
+
+
+/* Give a finished node its id and add it to the postings of its kind. */
+void IndexAdd(Token * pToken)
+{
+    IndexKind * pKind;
+
+    if (idxNumNodes == idxMaxNodes)
+    {
+        idxNodes = (Token **)ArrayGrow(idxNodes, &idxMaxNodes, sizeof(Token *));
+    }
+
+    idxNodes[idxNumNodes++] = pToken;
+    pToken->id = idxNumNodes;
+
+    pKind = &idxKinds[IndexKindLookup(IndexKindName(pToken), 1)];
+
+    if (pKind->numIds == pKind->maxIds)
+    {
+        pKind->pIds = (int *)ArrayGrow(pKind->pIds, &pKind->maxIds,
+                                       sizeof(int));
+    }
+
+    pKind->pIds[pKind->numIds++] = pToken->id;
+}
+
+
+/* Release the node table and all the postings lists. */
+void IndexFree(void)
+{
+    int i;
+
+    for (i = 0; i < idxNumKinds; i++)
+    {
+        free(idxKinds[i].pName);
+        free(idxKinds[i].pIds);
+    }
+
+    free(idxNodes);
+    idxNodes    = NULL;
+    idxNumNodes = 0;
+    idxMaxNodes = 0;
+    idxNumKinds = 0;
+    memset(idxKindTable, 0, sizeof(idxKindTable));
+}
+
+
+/*
+ * Query patterns (--query):
+ *
+ *   Pattern -> Atom
+ *           -> Atom '(' Pattern ( ',' Pattern )* ( ',' '...' )? ')'
+ *
+ *   Atom    -> '_'            any node
+ *           -> kind           e.g. 'gamma', 'function_form', '@', '<ID>'
+ *           -> leaf           e.g. '<ID:Print>', '<INT:0>'
+ *
+ * Without a child list the children aren't looked at.  With one the node
+ * must have exactly that many children, or at least that many if the list
+ * ends with '...'.  A ',' in the atom position is the ',' kind.  A '<'
+ * atom runs to its closing '>' (a string leaf to its closing "'>"), one
+ * that isn't closed is an error.
+ */
+typedef struct _pattern
+{
+    char *             pAtom;
+    int                numKids; /* -1 = children not constrained */
+    int                more;    /* trailing '...' */
+    struct _pattern ** ppKids;
+} Pattern;
+
+
+void PatternError(const char * pQuery, const char * p)
+{
+    printf("ERROR: invalid query pattern at offset %d ('%s')\n",
+           (int)(p - pQuery), pQuery);
+    exit(1);
+}
+
+
+Pattern * PatternParse(const char * pQuery, const char ** pp)
+{
+    Pattern * pPat;
+    const char * p = *pp;
+    const char * pStart;
+    int maxKids = 0;
+
+    while (IS_SPACE(*p)) p++;
+
+    if ((pPat = (Pattern *)calloc(1, sizeof(Pattern))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    pStart = p;
+
+    if (*p == ',')
+    {
+        p++;
+    }
+    else if (*p == '<') /* leaf or '<ID>' style kind, may hold any chars */
+    {
+        if (strncmp(p, "<STR:'", 6) == 0) /* "<STR:'a>b'>" */
+        {
+            for (p += 6; *p && ((p[0] != '\'') || (p[1] != '>')); p++);
+            if (*p) p++;
+        }
+
+        while (*p && (*p != '>')) p++;
+        if (*p != '>') PatternError(pQuery, p); /* unterminated */
+        p++;
+    }
+    else
+    {
+        while (*p && !IS_SPACE(*p) && (*p != '(') && (*p != ')') && (*p != ','))
+        {
+            p++;
+        }
+    }
+
+    if (p == pStart) PatternError(pQuery, p);
+
+    pPat->pAtom   = strndup(pStart, (p - pStart));
+    pPat->numKids = -1;
+
+    while (IS_SPACE(*p)) p++;
+
+    if (*p == '(')
+    {
+        pPat->numKids = 0;
+        p++;
+
+        do
+        {
+            while (IS_SPACE(*p)) p++;
+
+            if (strncmp(p, "...", 3) == 0)
+            {
+                pPat->more = 1;
+                p += 3;
+                while (IS_SPACE(*p)) p++;
+                break;
+            }
+
+            if (pPat->numKids == maxKids)
+            {
+                pPat->ppKids = (Pattern **)ArrayGrow(pPat->ppKids, &maxKids,
+                                                     sizeof(Pattern *));
+            }
+
+            pPat->ppKids[pPat->numKids++] = PatternParse(pQuery, &p);
+
+            while (IS_SPACE(*p)) p++;
+
+        } while ((*p == ',') && p++);
+
+        if (*p != ')') PatternError(pQuery, p);
+        p++;
+    }
+
+    *pp = p;
+    return pPat;
+}
+
+
+void PatternFree(Pattern * pPat)
+{
+    int i;
+
+    for (i = 0; i < pPat->numKids; i++) PatternFree(pPat->ppKids[i]);
+
+    free(pPat->ppKids);
+    free(pPat->pAtom);
+    free(pPat);
+}
+
+
+/* Match the pattern against a node and (only as deep as asked) its kids. */
+int PatternMatch(Pattern * pPat, Token * pToken)
+{
+    Token * pChild;
+    int i;
+
+    if (pToken->pShare) pToken = pToken->pShare;
+
+    if (strcmp(pPat->pAtom, "_") != 0)
+    {
+        if ((pPat->pAtom[0] == '<') && strchr(pPat->pAtom, ':'))
+        {
+            if (strcmp(pPat->pAtom, TokenToStr(pToken)) != 0) return 0;
+        }
+        else if (strcmp(pPat->pAtom, IndexKindName(pToken)) != 0)
+        {
+            return 0;
+        }
+    }
+
+    if (pPat->numKids == -1) return 1;
+
+    for (i = 0, pChild = T_FIRST_CHILD(pToken);
+         (i < pPat->numKids) && (pChild != NULL);
+         i++, pChild = T_NEXT(pChild))
+    {
+        if (!PatternMatch(pPat->ppKids[i], pChild)) return 0;
+    }
+
+    return ((i == pPat->numKids) && (pPat->more || (pChild == NULL)));
+}
+
+
+/* Answer a query from the postings list of the pattern's root kind. */
+void IndexQuery(const char * pQuery)
+{
+    const char * p = pQuery;
+    Pattern * pPat = PatternParse(pQuery, &p);
+    int * pIds = NULL;
+    int numIds = 0;
+    int matches = 0;
+    char * pKey;
+    char * pColon;
+    int kind, i;
+
+    while (IS_SPACE(*p)) p++;
+    if (*p) PatternError(pQuery, p);
+
+    if (strcmp(pPat->pAtom, "_") == 0)
+    {
+        numIds = idxNumNodes; /* every node is a candidate */
+    }
+    else
+    {
+        if ((pKey = strdup(pPat->pAtom)) == NULL)
+        {
+            perror("Failed to malloc memory");
+            exit(1);
+        }
+
+        /* a leaf pattern like '<ID:Print>' uses the postings for '<ID>' */
+        if ((pKey[0] == '<') && ((pColon = strchr(pKey, ':')) != NULL))
+        {
+            pColon[0] = '>';
+            pColon[1] = 0;
+        }
+
+        if ((kind = IndexKindLookup(pKey, 0)) != -1)
+        {
+            pIds   = idxKinds[kind].pIds;
+            numIds = idxKinds[kind].numIds;
+        }
+
+        free(pKey);
+    }
+
+    for (i = 0; i < numIds; i++)
+    {
+        Token * pToken = idxNodes[(pIds) ? (pIds[i] - 1) : i];
+
+        if (PatternMatch(pPat, pToken))
+        {
+            printf("QUERY: node %d at %s\n",
+                   pToken->id, LocToStr(pToken->offset));
+            DumpAST(pToken, 1);
+            matches++;
+        }
+    }
+
+    printf("QUERY: %d matches (%d candidates, %d nodes)\n",
+           matches, numIds, idxNumNodes);
+
+    PatternFree(pPat);
+}
+
+
+/*
+ * Hash-consing (-d).  Every tree built by the Parser_* functions is pushed
+ * back on the stack with T_PUSH which (via AstFinish) interns it here by
+ * (type, string, child ids).  The first copy of a subtree becomes the
+ * canonical node and any later identical copy is turned into a reference
+ * token (pShare) with no children, i.e. the AST becomes a DAG.  Children
+ * are always interned before their parent so the ids of the children fully
+ * identify a subtree.  A reference is still a whole token (a token can only
+ * be on one list of children), so what sharing saves is the subtree under
+ * a copy, a shared leaf only saves its string.
+ */
+typedef struct
+{
+    Token *       pNode; /* canonical node */
+    unsigned int  hash;
+    unsigned long nodes; /* node count of the fully expanded subtree */
+    unsigned long bytes; /* memory used by the fully expanded subtree */
+} HashConsNode;
+
+int hashCons = 0;
+HashConsNode * hcNodes = NULL; /* indexed by (id - 1), same ids as idxNodes */
+int hcNumNodes = 0;
+int hcMaxNodes = 0;
+int * hcTable = NULL; /* open addressing table of ids, 0 = empty slot */
+int hcTableSize = 0;
+
+
+unsigned int HashConsHash(Token * pToken)
+{
+    unsigned int hash = 2166136261u; /* FNV-1a */
+    Token * pChild;
+    char * p;
+
+    hash = (hash ^ pToken->type) * 16777619u;
+
+    for (p = pToken->pStr; *p; p++)
+    {
+        hash = (hash ^ (unsigned char)*p) * 16777619u;
+    }
+
+    for (pChild = T_FIRST_CHILD(pToken);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        hash = (hash ^ T_ID(pChild)) * 16777619u;
+    }
+
+    return hash;
+}
+
+
+/* Compare a new node against a canonical node (children already interned). */
+int HashConsEqual(Token * pToken, Token * pNode)
+{
+    Token * pC1;
+    Token * pC2;
+
+    if ((pToken->type != pNode->type) || strcmp(pToken->pStr, pNode->pStr))
+    {
+        return 0;
+    }
+
+    for (pC1 = T_FIRST_CHILD(pToken), pC2 = T_FIRST_CHILD(pNode);
+         (pC1 != NULL) && (pC2 != NULL);
+         pC1 = T_NEXT(pC1), pC2 = T_NEXT(pC2))
+    {
+        if (T_ID(pC1) != T_ID(pC2)) return 0;
+    }
+
+    return ((pC1 == NULL) && (pC2 == NULL));
+}
+
+
+/* Double the size of the hash table and rehash all the canonical nodes. */
+void HashConsGrow(void)
+{
+    int i, slot;
+
+    free(hcTable);
+
+    hcTableSize = (hcTableSize) ? (hcTableSize * 2) : 1024;
+
+    if ((hcTable = (int *)calloc(hcTableSize, sizeof(int))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    for (i = 0; i < hcNumNodes; i++)
+    {
+        slot = (hcNodes[i].hash & (hcTableSize - 1));
+        while (hcTable[slot]) slot = ((slot + 1) & (hcTableSize - 1));
+        hcTable[slot] = (i + 1);
+    }
+}
+
+
+/*
+ * Intern the tree rooted at pToken, bottom up.  Returns pToken if it is a
+ * new canonical node, otherwise pToken is converted in place into a
+ * reference to the existing identical subtree.
+ *
+ * Note that when a match is found all the children of pToken must already
+ * be references.  A canonical child would have been built before the match
+ * and the match would then be part of the subtree rooted at pToken itself.
+ */
+Token * HashConsIntern(Token * pToken)
+{
+    HashConsNode * pHcn;
+    Token * pChild;
+    Token * pNext;
+    unsigned long nodes = 1;
+    unsigned long bytes = (sizeof(Token) + pToken->length);
+    unsigned int hash;
+    int slot;
+
+    if (T_FINISHED(pToken)) return pToken;
+
+    for (pChild = T_FIRST_CHILD(pToken); pChild != NULL; pChild = pNext)
+    {
+        pNext = T_NEXT(pChild);
+
+        if (!T_FINISHED(pChild)) /* leaf straight from the scanner */
+        {
+            T_REMOVE_CHILD(pToken, pChild);
+            pChild = HashConsIntern(pChild);
+
+            if (pNext) TAILQ_INSERT_BEFORE(pNext, pChild, siblings);
+            else       T_INSERT_TAIL_CHILD(pToken, pChild);
+        }
+
+        nodes += hcNodes[T_ID(pChild) - 1].nodes;
+        bytes += hcNodes[T_ID(pChild) - 1].bytes;
+    }
+
+    if ((hcNumNodes * 2) >= hcTableSize) HashConsGrow();
+
+    hash = HashConsHash(pToken);
+    slot = (hash & (hcTableSize - 1));
+
+    while (hcTable[slot])
+    {
+        pHcn = &hcNodes[hcTable[slot] - 1];
+
+        if ((pHcn->hash == hash) && HashConsEqual(pToken, pHcn->pNode))
+        {
+            while ((pChild = T_FIRST_CHILD(pToken)) != NULL)
+            {
+                T_REMOVE_CHILD(pToken, pChild);
+                TokenFree(pChild);
+            }
+
+            free(pToken->pStr);
+            pToken->pStr   = pHcn->pNode->pStr;
+            pToken->pShare = pHcn->pNode;
+            return pToken;
+        }
+
+        slot = ((slot + 1) & (hcTableSize - 1));
+    }
+
+    if (hcNumNodes == hcMaxNodes)
+    {
+        hcMaxNodes = (hcMaxNodes) ? (hcMaxNodes * 2) : 1024;
+
+        if ((hcNodes = (HashConsNode *)realloc(hcNodes,
+                              (hcMaxNodes * sizeof(HashConsNode)))) == NULL)
+        {
+            perror("Failed to realloc memory");
+            exit(1);
+        }
+    }
+
+    pHcn = &hcNodes[hcNumNodes++];
+    pHcn->pNode = pToken;
+    pHcn->hash  = hash;
+    pHcn->nodes = nodes;
+    pHcn->bytes = bytes;
+
+    IndexAdd(pToken); /* assigns the id, only canonical nodes are indexed */
+    hcTable[slot] = pToken->id;
+
+    return pToken;
+}
+
+
+/*
+ * Count the nodes, the reference tokens and the memory actually used by the
+ * DAG rooted at pRoot.
+ */
+void HashConsCount(Token * pRoot, unsigned long * pNodes,
+                   unsigned long * pRefs, unsigned long * pBytes)
+{
+    Token * pChild;
+
+    (*pBytes) += sizeof(Token);
+
+    if (pRoot->pShare)
+    {
+        (*pRefs)++;
+        return;
+    }
+
+    (*pNodes)++;
+    (*pBytes) += pRoot->length;
+
+    for (pChild = T_FIRST_CHILD(pRoot);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        HashConsCount(pChild, pNodes, pRefs, pBytes);
+    }
+}
+
+
+/* Print the before/after sharing stats for the DAG rooted at pRoot. */
+void HashConsStats(Token * pRoot)
+{
+    unsigned long nodes = 0;
+    unsigned long refs  = 0;
+    unsigned long bytes = 0;
+    HashConsNode * pHcn = &hcNodes[T_ID(pRoot) - 1];
+
+    HashConsCount(pRoot, &nodes, &refs, &bytes);
+
+    printf("HASHCONS: %lu nodes -> %lu tokens (%lu distinct, %lu references), "
+           "%lu bytes saved\n",
+           pHcn->nodes, (nodes + refs), nodes, refs, (pHcn->bytes - bytes));
+}
+
+
+/* Release the hash-cons table (the nodes themselves live in the AST). */
+void HashConsFree(void)
+{
+    free(hcNodes);
+    free(hcTable);
+    hcNodes     = NULL;
+    hcTable     = NULL;
+    hcNumNodes  = 0;
+    hcMaxNodes  = 0;
+    hcTableSize = 0;
+}
+
+
+/*
+ * Finish the tree rooted at pToken, bottom up, when it is pushed back on the
+ * stack.  Leaves coming straight from the scanner are finished here when
+ * their parent is, and with -d the whole thing is hash-consed instead.
+ */
+Token * AstFinish(Token * pToken)
+{
+    Token * pChild;
+
+    if (T_FINISHED(pToken)) return pToken;
+
+    if (hashCons) return HashConsIntern(pToken);
+
+    for (pChild = T_FIRST_CHILD(pToken);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        if (!pChild->id) AstFinish(pChild);
+    }
+
+    IndexAdd(pToken);
+
+    return pToken;
+}
+
+
+/*
+ * Standardizer (-st).  Rewrites the AST into the standardized tree (ST):
+ *
+ *   let(=(X,E),P)                 => gamma(lambda(X,P),E)
+ *   where(P,=(X,E))               => gamma(lambda(X,P),E)
+ *   function_form(P,V1..Vn,E)     => =(P,lambda(V1,...lambda(Vn,E)))
+ *   lambda(V1..Vn,E)              => lambda(V1,...lambda(Vn,E))
+ *   within(=(X1,E1),=(X2,E2))     => =(X2,gamma(lambda(X1,E2),E1))
+ *   and(=(X1,E1)..=(Xn,En))       => =(,(X1..Xn),tau(E1..En))
+ *   rec(=(X,E))                   => =(X,gamma(<Y*>,lambda(X,E)))
+ *   @(E1,N,E2)                    => gamma(gamma(N,E1),E2)
+ *
+ * This is done in place.  Nodes keep their address (so a parent's children
+ * list stays valid), they are renamed and their children are relinked, and
+ * new nodes are only allocated where the ST has more nodes than the AST.
+ * Children must be standardized before their parent so the nodes are
+ * collected in pre-order with an explicit stack and then rewritten in the
+ * reverse order, deep programs never recurse on the C stack.
+ */
+int standardize = 0;
+
+
+/* Rename a node, reusing its string buffer when the new name fits. */
+void TokenRename(Token * pToken, TokenType type, const char * pStr)
+{
+    int len = (strlen(pStr) + 1);
+
+    if (len > pToken->length)
+    {
+        if ((pToken->pStr = (char *)realloc(pToken->pStr, len)) == NULL)
+        {
+            perror("Failed to realloc memory");
+            exit(1);
+        }
+
+        pToken->length = len;
+    }
+
+    pToken->type = type;
+    strcpy(pToken->pStr, pStr);
+}
+
+
+/* Allocate a new ST node for the source offset of an existing node. */
+Token * StdAlloc(const char * pStr, Token * pOrig)
+{
+    Token * pToken = TokenAlloc(T_OPERATOR, 0, pStr);
+
+    pToken->offset = pOrig->offset;
+    return pToken;
+}
+
+
+/* Deep copy a (small) subtree, used for the bound names of a rec. */
+Token * AstCopy(Token * pRoot)
+{
+    Token * pToken = TokenAlloc(pRoot->type, 0, pRoot->pStr);
+    Token * pChild;
+    Token * pCopy;
+
+    pToken->offset = pRoot->offset;
+
+    for (pChild = T_FIRST_CHILD(pRoot);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        pCopy = AstCopy(pChild);
+        T_INSERT_TAIL_CHILD(pToken, pCopy);
+    }
+
+    return pToken;
+}
+
+
+/* Curry lambda(V1..Vn,E) into lambda(V1,...lambda(Vn,E)). */
+void Std_Curry(Token * pLambda)
+{
+    Token * pNew;
+    Token * pChild;
+
+    /* while there is more than one bound variable left */
+    while (T_NEXT(T_SECOND_CHILD(pLambda)))
+    {
+        pNew = StdAlloc("lambda", T_SECOND_CHILD(pLambda));
+
+        while ((pChild = T_SECOND_CHILD(pLambda)) != NULL)
+        {
+            T_REMOVE_CHILD(pLambda, pChild);
+            T_INSERT_TAIL_CHILD(pNew, pChild);
+        }
+
+        T_INSERT_TAIL_CHILD(pLambda, pNew);
+        pLambda = pNew;
+    }
+}
+
+
+/* Standardize a single node, all its children are already standardized. */
+void Std_Node(Token * pNode)
+{
+    TAILQ_HEAD(, _token) xs;
+    TAILQ_HEAD(, _token) es;
+    Token * pEq1;
+    Token * pEq2;
+    Token * pX;
+    Token * pE;
+    Token * pP;
+    Token * pNew;
+
+    if (T_MATCH(pNode, T_KEYWORD, "let"))
+    {
+        pEq1 = T_FIRST_CHILD(pNode);
+        pP   = T_NEXT(pEq1);
+        pE   = T_SECOND_CHILD(pEq1);
+
+        T_REMOVE_CHILD(pNode, pP);
+        T_REMOVE_CHILD(pEq1, pE);
+        T_INSERT_TAIL_CHILD(pEq1, pP);
+        T_INSERT_TAIL_CHILD(pNode, pE);
+        TokenRename(pEq1, T_OPERATOR, "lambda");
+        TokenRename(pNode, T_OPERATOR, "gamma");
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "where"))
+    {
+        pP   = T_FIRST_CHILD(pNode);
+        pEq1 = T_NEXT(pP);
+        pE   = T_SECOND_CHILD(pEq1);
+
+        T_REMOVE_CHILD(pNode, pP);
+        T_REMOVE_CHILD(pEq1, pE);
+        T_INSERT_TAIL_CHILD(pEq1, pP);
+        T_INSERT_TAIL_CHILD(pNode, pE);
+        TokenRename(pEq1, T_OPERATOR, "lambda");
+        TokenRename(pNode, T_OPERATOR, "gamma");
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "function_form"))
+    {
+        pNew = StdAlloc("lambda", T_SECOND_CHILD(pNode));
+
+        while ((pX = T_SECOND_CHILD(pNode)) != NULL)
+        {
+            T_REMOVE_CHILD(pNode, pX);
+            T_INSERT_TAIL_CHILD(pNew, pX);
+        }
+
+        Std_Curry(pNew);
+        T_INSERT_TAIL_CHILD(pNode, pNew);
+        TokenRename(pNode, T_OPERATOR, "=");
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "lambda"))
+    {
+        Std_Curry(pNode);
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "within"))
+    {
+        pEq1 = T_FIRST_CHILD(pNode);
+        pEq2 = T_NEXT(pEq1);
+        pE   = T_SECOND_CHILD(pEq1); /* E1 */
+        pX   = T_FIRST_CHILD(pEq2);  /* X2 */
+        pP   = T_NEXT(pX);           /* E2 */
+
+        T_REMOVE_CHILD(pEq1, pE);
+        T_REMOVE_CHILD(pEq2, pX);
+        T_REMOVE_CHILD(pEq2, pP);
+        T_REMOVE_CHILD(pNode, pEq1);
+
+        T_INSERT_TAIL_CHILD(pEq1, pP);
+        TokenRename(pEq1, T_OPERATOR, "lambda");
+
+        T_INSERT_TAIL_CHILD(pEq2, pEq1);
+        T_INSERT_TAIL_CHILD(pEq2, pE);
+        TokenRename(pEq2, T_OPERATOR, "gamma");
+
+        T_INSERT_HEAD_CHILD(pNode, pX);
+        TokenRename(pNode, T_OPERATOR, "=");
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "and"))
+    {
+        TAILQ_INIT(&xs);
+        TAILQ_INIT(&es);
+
+        pEq1 = T_FIRST_CHILD(pNode);
+        pEq2 = T_NEXT(pEq1);
+
+        /* strip the '=' nodes, the first two become the ',' and 'tau' */
+        for (pP = pEq1; pP != NULL; pP = pNew)
+        {
+            pNew = T_NEXT(pP);
+            pX   = T_FIRST_CHILD(pP);
+            pE   = T_NEXT(pX);
+
+            T_REMOVE_CHILD(pP, pX);
+            T_REMOVE_CHILD(pP, pE);
+            TAILQ_INSERT_TAIL(&xs, pX, siblings);
+            TAILQ_INSERT_TAIL(&es, pE, siblings);
+
+            if ((pP != pEq1) && (pP != pEq2))
+            {
+                T_REMOVE_CHILD(pNode, pP);
+                TokenFree(pP);
+            }
+        }
+
+        while ((pX = xs.tqh_first) != NULL)
+        {
+            TAILQ_REMOVE(&xs, pX, siblings);
+            T_INSERT_TAIL_CHILD(pEq1, pX);
+        }
+
+        while ((pE = es.tqh_first) != NULL)
+        {
+            TAILQ_REMOVE(&es, pE, siblings);
+            T_INSERT_TAIL_CHILD(pEq2, pE);
+        }
+
+        TokenRename(pEq1, T_OPERATOR, ",");
+        TokenRename(pEq2, T_OPERATOR, "tau");
+        TokenRename(pNode, T_OPERATOR, "=");
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "rec"))
+    {
+        pEq1 = T_FIRST_CHILD(pNode);
+        pX   = T_FIRST_CHILD(pEq1);
+        pNew = StdAlloc("gamma", pNode);
+
+        T_REMOVE_CHILD(pNode, pEq1);
+        TokenRename(pEq1, T_OPERATOR, "lambda");
+
+        pE = StdAlloc("<Y*>", pNode);
+        T_INSERT_TAIL_CHILD(pNew, pE);
+        T_INSERT_TAIL_CHILD(pNew, pEq1);
+
+        pX = AstCopy(pX);
+        T_INSERT_TAIL_CHILD(pNode, pX);
+        T_INSERT_TAIL_CHILD(pNode, pNew);
+        TokenRename(pNode, T_OPERATOR, "=");
+    }
+    else if (T_MATCH(pNode, T_OPERATOR, "@"))
+    {
+        pE   = T_FIRST_CHILD(pNode); /* E1 */
+        pP   = T_NEXT(pE);           /* N */
+        pNew = StdAlloc("gamma", pP);
+
+        T_REMOVE_CHILD(pNode, pE);
+        T_REMOVE_CHILD(pNode, pP);
+        T_INSERT_TAIL_CHILD(pNew, pP);
+        T_INSERT_TAIL_CHILD(pNew, pE);
+
+        T_INSERT_HEAD_CHILD(pNode, pNew);
+        TokenRename(pNode, T_OPERATOR, "gamma");
+    }
+}
+
+
+/* Standardize the AST rooted at pRoot in place. */
+void Standardize(Token * pRoot)
+{
+    Token ** ppStack = NULL;
+    Token ** ppOrder = NULL;
+    int maxStack = 0;
+    int maxOrder = 0;
+    int numStack = 0;
+    int numOrder = 0;
+    Token * pToken;
+    Token * pChild;
+
+    ppStack = (Token **)ArrayGrow(ppStack, &maxStack, sizeof(Token *));
+    ppStack[numStack++] = pRoot;
+
+    while (numStack)
+    {
+        pToken = ppStack[--numStack];
+
+        if (numOrder == maxOrder)
+        {
+            ppOrder = (Token **)ArrayGrow(ppOrder, &maxOrder, sizeof(Token *));
+        }
+
+        ppOrder[numOrder++] = pToken;
+
+        for (pChild = T_FIRST_CHILD(pToken);
+             pChild != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            if (numStack == maxStack)
+            {
+                ppStack = (Token **)ArrayGrow(ppStack, &maxStack,
+                                              sizeof(Token *));
+            }
+
+            ppStack[numStack++] = pChild;
+        }
+    }
+
+    while (numOrder) Std_Node(ppOrder[--numOrder]);
+
+    free(ppStack);
+    free(ppOrder);
+}
+
+
+/*
+ * Lexical addressing (-r, and always before -e).  Every use of a name is
+ * resolved to a (depth, slot) pair: how many environments out its binding
+ * is and which slot of that environment holds it.  Runs on the AST and
+ * follows the binding forms the way the standardizer rewrites them, so the
+ * environments it counts are exactly the lambdas of the ST:
+ *
+ *   lambda(V1..Vn,E)         E sees n environments, one per Vi
+ *   let(D,P), where(P,D)     P sees the names of D, D's values don't
+ *   function_form(P,V..,E)   E sees one environment per V
+ *   within(D1,D2)            D2's values see the names of D1
+ *   and(D1..Dn)              one environment, a slot per Di
+ *   rec(D)                   D's values see its own names
+ *
+ * A '()' binds no names but is still an environment.  A name that isn't
+ * bound anywhere is free (a builtin, or an error if it is ever looked up).
+ * The CSE machine then finds a name by following depth parent links and
+ * indexing the slot, there is no string comparison left when it runs.
+ */
+int resolveNames = 0;
+
+Token ** ppResScopes = NULL; /* the binding patterns in scope, innermost last */
+int numResScopes = 0;
+int maxResScopes = 0;
+
+char ** ppResFree = NULL; /* free names, in order of first use */
+int numResFree = 0;
+int maxResFree = 0;
+int numResUses = 0;
+
+
+/* The names bound by a definition, its '=' left side once standardized. */
+Token * ResPattern(Token * pD)
+{
+    if ((strcmp(pD->pStr, "=") == 0) ||
+        (strcmp(pD->pStr, "function_form") == 0))
+    {
+        return T_FIRST_CHILD(pD);
+    }
+    else if (strcmp(pD->pStr, "within") == 0)
+    {
+        return ResPattern(T_SECOND_CHILD(pD));
+    }
+    else if (strcmp(pD->pStr, "rec") == 0)
+    {
+        return ResPattern(T_FIRST_CHILD(pD));
+    }
+
+    return pD; /* 'and' */
+}
+
+
+/* Open an environment binding the names of a pattern. */
+void ResPush(Token * pPat)
+{
+    if (numResScopes == maxResScopes)
+    {
+        ppResScopes = (Token **)ArrayGrow(ppResScopes, &maxResScopes,
+                                          sizeof(Token *));
+    }
+
+    ppResScopes[numResScopes++] = pPat;
+}
+
+
+/*
+ * The slot of a name in a pattern's environment, -1 if it isn't there.
+ * The first one wins like it does for the ST's lambda, a nested tuple
+ * (an 'and' of tuple definitions) takes a slot but binds nothing.
+ */
+int ResSlot(Token * pPat, const char * pName)
+{
+    Token * pChild;
+    Token * pVar;
+    int i;
+
+    if (T_IS(pPat, T_IDENTIFIER))
+    {
+        return (strcmp(pPat->pStr, pName) == 0) ? 0 : -1;
+    }
+
+    for (i = 0, pChild = T_FIRST_CHILD(pPat);
+         pChild != NULL;
+         i++, pChild = T_NEXT(pChild))
+    {
+        pVar = (strcmp(pPat->pStr, "and") == 0) ? ResPattern(pChild) : pChild;
+
+        if (T_IS(pVar, T_IDENTIFIER) && (strcmp(pVar->pStr, pName) == 0))
+        {
+            return i;
+        }
+    }
+
+    return -1; /* includes '()' */
+}
+
+
+/* Address a name use from the scopes open right now. */
+void ResName(Token * pNode)
+{
+    int depth;
+    int i;
+
+    numResUses++;
+
+    for (depth = 0; depth < numResScopes; depth++)
+    {
+        pNode->slot = ResSlot(ppResScopes[numResScopes - 1 - depth],
+                              pNode->pStr);
+
+        if (pNode->slot >= 0)
+        {
+            pNode->depth = depth;
+            return;
+        }
+    }
+
+    pNode->depth = RES_FREE;
+
+    for (i = 0; i < numResFree; i++)
+    {
+        if (strcmp(ppResFree[i], pNode->pStr) == 0) return;
+    }
+
+    if (numResFree == maxResFree)
+    {
+        ppResFree = (char **)ArrayGrow(ppResFree, &maxResFree,
+                                       sizeof(char *));
+    }
+
+    ppResFree[numResFree++] = pNode->pStr;
+}
+
+
+/*
+ * The resolve pass walks the tree with an explicit work stack, like the
+ * standardizer, so a deep tree (a long 'a + a + ...') can't run it out of
+ * C stack.  An item either resolves an expression or a definition, opens
+ * an environment or closes the ones opened since a mark.  Items come off
+ * last in first, so the steps of one node are pushed in reverse.
+ */
+#define RES_EXPR    0
+#define RES_DEF     1
+#define RES_PUSH    2
+#define RES_RESTORE 3
+
+typedef struct
+{
+    int kind;
+    int mark;      /* RES_RESTORE */
+    Token * pNode; /* the others */
+} ResItem;
+
+ResItem * pResWork = NULL;
+int numResWork = 0;
+int maxResWork = 0;
+
+
+void ResWork(int kind, Token * pNode, int mark)
+{
+    if (numResWork == maxResWork)
+    {
+        pResWork = (ResItem *)ArrayGrow(pResWork, &maxResWork,
+                                        sizeof(ResItem));
+    }
+
+    pResWork[numResWork].kind = kind;
+    pResWork[numResWork].mark = mark;
+    pResWork[numResWork].pNode = pNode;
+    numResWork++;
+}
+
+
+/* Queue the children of pNode as items of a kind, first one on top. */
+void ResWorkKids(int kind, Token * pNode)
+{
+    Token * pChild;
+    int first = numResWork;
+    ResItem item;
+    int i;
+
+    for (pChild = T_FIRST_CHILD(pNode);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        ResWork(kind, pChild, 0);
+    }
+
+    for (i = numResWork - 1; first < i; first++, i--)
+    {
+        item = pResWork[first];
+        pResWork[first] = pResWork[i];
+        pResWork[i] = item;
+    }
+}
+
+
+/* Open an environment per variable of a lambda or function_form, the
+   last child is the body and is left for the caller. */
+Token * ResPushVars(Token * pFirst)
+{
+    Token * pChild;
+
+    for (pChild = pFirst; T_NEXT(pChild) != NULL; pChild = T_NEXT(pChild))
+    {
+        ResPush(pChild);
+    }
+
+    return pChild;
+}
+
+
+/* Resolve the values (right sides) of a definition. */
+void ResDef(Token * pD)
+{
+    int mark = numResScopes;
+
+    if (strcmp(pD->pStr, "=") == 0)
+    {
+        ResWork(RES_EXPR, T_SECOND_CHILD(pD), 0);
+    }
+    else if (strcmp(pD->pStr, "function_form") == 0)
+    {
+        ResWork(RES_RESTORE, NULL, mark);
+        ResWork(RES_EXPR, ResPushVars(T_SECOND_CHILD(pD)), 0);
+    }
+    else if (strcmp(pD->pStr, "within") == 0)
+    {
+        ResWork(RES_RESTORE, NULL, mark);
+        ResWork(RES_DEF, T_SECOND_CHILD(pD), 0);
+        ResWork(RES_PUSH, ResPattern(T_FIRST_CHILD(pD)), 0);
+        ResWork(RES_DEF, T_FIRST_CHILD(pD), 0);
+    }
+    else if (strcmp(pD->pStr, "rec") == 0)
+    {
+        ResPush(ResPattern(pD));
+        ResWork(RES_RESTORE, NULL, mark);
+        ResWork(RES_DEF, T_FIRST_CHILD(pD), 0);
+    }
+    else /* 'and' */
+    {
+        ResWorkKids(RES_DEF, pD);
+    }
+}
+
+
+/* Resolve the names used in an expression. */
+void ResExpr(Token * pNode)
+{
+    int mark = numResScopes;
+
+    switch (pNode->type)
+    {
+    case T_IDENTIFIER:
+
+        ResName(pNode);
+        return;
+
+    case T_INTEGER:
+    case T_STRING:
+
+        return;
+
+    default:
+
+        break;
+    }
+
+    if (strcmp(pNode->pStr, "lambda") == 0)
+    {
+        ResWork(RES_RESTORE, NULL, mark);
+        ResWork(RES_EXPR, ResPushVars(T_FIRST_CHILD(pNode)), 0);
+    }
+    else if (strcmp(pNode->pStr, "let") == 0)
+    {
+        ResWork(RES_RESTORE, NULL, mark);
+        ResWork(RES_EXPR, T_SECOND_CHILD(pNode), 0);
+        ResWork(RES_PUSH, ResPattern(T_FIRST_CHILD(pNode)), 0);
+        ResWork(RES_DEF, T_FIRST_CHILD(pNode), 0);
+    }
+    else if (strcmp(pNode->pStr, "where") == 0)
+    {
+        ResWork(RES_RESTORE, NULL, mark);
+        ResWork(RES_EXPR, T_FIRST_CHILD(pNode), 0);
+        ResWork(RES_PUSH, ResPattern(T_SECOND_CHILD(pNode)), 0);
+        ResWork(RES_DEF, T_SECOND_CHILD(pNode), 0);
+    }
+    else
+    {
+        ResWorkKids(RES_EXPR, pNode);
+    }
+}
+
+
+/* Resolve every name used in the AST rooted at pRoot. */
+void Resolve(Token * pRoot)
+{
+    ResItem item;
+
+    numResUses = 0;
+    numResFree = 0;
+    numResScopes = 0;
+    numResWork = 0;
+
+    ResWork(RES_EXPR, pRoot, 0);
+
+    while (numResWork)
+    {
+        item = pResWork[--numResWork];
+
+        switch (item.kind)
+        {
+        case RES_EXPR:    ResExpr(item.pNode);     break;
+        case RES_DEF:     ResDef(item.pNode);      break;
+        case RES_PUSH:    ResPush(item.pNode);     break;
+        case RES_RESTORE: numResScopes = item.mark; break;
+        }
+    }
+}
+
+
+void ResolveStats(void)
+{
+    int i;
+
+    printf("RESOLVE: %d name uses, %d free names", numResUses, numResFree);
+
+    for (i = 0; i < numResFree; i++)
+    {
+        printf("%s%s", (i) ? ", " : " (", ppResFree[i]);
+    }
+
+    printf("%s\n", (numResFree) ? ")" : "");
+}
+
+
+void ResolveFree(void)
+{
+    free(ppResScopes);
+    free(ppResFree);
+    free(pResWork);
+    ppResScopes  = NULL;
+    ppResFree    = NULL;
+    pResWork     = NULL;
+    numResScopes = maxResScopes = 0;
+    numResFree   = maxResFree   = 0;
+    numResWork   = maxResWork   = 0;
+}
+
+
+/*
+ * Memoization (--memo).  A function defined under rec with a single
+ * parameter (a function_form or a lambda) is memoized when it's pure, when
+ * its result depends on nothing but its argument: it doesn't use Print and
+ * every other name it uses from outside is a builtin or bound by a pure
+ * definition (one that doesn't use Print or a parameter of an enclosing
+ * function, whose value differs from call to call).  Works on the AST
+ * before it's standardized, following the scopes the way Resolve() does
+ * with a purity flag per scope.  The function's body is marked and the
+ * machines cache its results (see MemoFind()).
+ */
+typedef struct _memoscope
+{
+    Token * pPat;
+    int     pure;  /* the values it binds are pure */
+} MemoScope;
+
+MemoScope * pMemoScopes = NULL; /* innermost last */
+int numMemoScopes = 0;
+int maxMemoScopes = 0;
+
+
+void MemoPush(Token * pPat, int pure)
+{
+    if (numMemoScopes == maxMemoScopes)
+    {
+        pMemoScopes = (MemoScope *)ArrayGrow(pMemoScopes, &maxMemoScopes,
+                                             sizeof(MemoScope));
+    }
+
+    pMemoScopes[numMemoScopes].pPat = pPat;
+    pMemoScopes[numMemoScopes].pure = pure;
+    numMemoScopes++;
+}
+
+
+/*
+ * The outermost scope with an impure value the rest of these walks use,
+ * -1 for Print and INT_MAX for none.  A name is looked up like ResName().
+ */
+int MemoName(Token * pNode)
+{
+    int i;
+
+    for (i = (numMemoScopes - 1); i >= 0; i--)
+    {
+        if (ResSlot(pMemoScopes[i].pPat, pNode->pStr) >= 0)
+        {
+            return (pMemoScopes[i].pure) ? INT_MAX : i;
+        }
+    }
+
+    return (strcmp(pNode->pStr, "Print") == 0) ? -1 : INT_MAX;
+}
+
+
+/* Mark the single parameter functions of a (pure) rec definition. */
+void MemoMark(Token * pD)
+{
+    Token * pChild;
+    Token * pBody = NULL;
+
+    if (strcmp(pD->pStr, "function_form") == 0)
+    {
+        pBody = T_NEXT(T_SECOND_CHILD(pD)); /* the name, a param, the body */
+        if (T_NEXT(pBody)) pBody = NULL;
+    }
+    else if ((strcmp(pD->pStr, "=") == 0) &&
+             (strcmp(T_SECOND_CHILD(pD)->pStr, "lambda") == 0))
+    {
+        pBody = T_SECOND_CHILD(T_SECOND_CHILD(pD)); /* a param, the body */
+        if (T_NEXT(pBody)) pBody = NULL;
+    }
+    else if (strcmp(pD->pStr, "and") == 0)
+    {
+        for (pChild = T_FIRST_CHILD(pD);
+             pChild != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            MemoMark(pChild);
+        }
+    }
+
+    if (pBody && !pBody->memo)
+    {
+        pBody->memo = 1;
+        memoFuncs++;
+    }
+}
+
+
+/*
+ * MemoDef() and MemoExpr() run off an explicit work stack like Resolve(),
+ * so a deep AST can't run them out of C stack.  Each walk of an expression
+ * or definition leaves its result (see MemoName()) on a stack of values,
+ * MEMO_MIN folds the top n of them into the least one and the other items
+ * do what followed the recursive call: open a scope that's pure if the
+ * value on top says so, mark a rec definition, close scopes to a mark.
+ */
+#define MEMO_EXPR    0
+#define MEMO_DEF     1
+#define MEMO_MIN     2 /* arg is the number of values */
+#define MEMO_PUSH    3 /* pure if the top value >= arg */
+#define MEMO_MARK    4 /* MemoMark() if the top value >= arg */
+#define MEMO_RESTORE 5 /* arg is the mark */
+
+typedef struct
+{
+    int     kind;
+    int     arg;
+    Token * pNode;
+} MemoItem;
+
+MemoItem * pMemoWork = NULL;
+int numMemoWork = 0;
+int maxMemoWork = 0;
+
+int * pMemoVals = NULL;
+int numMemoVals = 0;
+int maxMemoVals = 0;
+
+
+void MemoWork(int kind, Token * pNode, int arg)
+{
+    if (numMemoWork == maxMemoWork)
+    {
+        pMemoWork = (MemoItem *)ArrayGrow(pMemoWork, &maxMemoWork,
+                                          sizeof(MemoItem));
+    }
+
+    pMemoWork[numMemoWork].kind  = kind;
+    pMemoWork[numMemoWork].arg   = arg;
+    pMemoWork[numMemoWork].pNode = pNode;
+    numMemoWork++;
+}
+
+
+void MemoVal(int m)
+{
+    if (numMemoVals == maxMemoVals)
+    {
+        pMemoVals = (int *)ArrayGrow(pMemoVals, &maxMemoVals, sizeof(int));
+    }
+
+    pMemoVals[numMemoVals++] = m;
+}
+
+
+/* Queue the walks of the children of pNode, the first one on top, and
+   the MEMO_MIN of their values under them. */
+void MemoWorkKids(int kind, Token * pNode)
+{
+    Token * pChild;
+    MemoItem item;
+    int first;
+    int i;
+
+    MemoWork(MEMO_MIN, NULL, 0);
+    first = numMemoWork;
+
+    for (pChild = T_FIRST_CHILD(pNode);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        MemoWork(kind, pChild, 0);
+        pMemoWork[first - 1].arg++;
+    }
+
+    for (i = numMemoWork - 1; first < i; first++, i--)
+    {
+        item = pMemoWork[first];
+        pMemoWork[first] = pMemoWork[i];
+        pMemoWork[i] = item;
+    }
+}
+
+
+/* Walk the values of a definition, see MemoName(). */
+void MemoDef(Token * pD)
+{
+    Token * pChild;
+    int mark = numMemoScopes;
+
+    if (strcmp(pD->pStr, "=") == 0)
+    {
+        MemoWork(MEMO_EXPR, T_SECOND_CHILD(pD), 0);
+    }
+    else if (strcmp(pD->pStr, "function_form") == 0)
+    {
+        for (pChild = T_SECOND_CHILD(pD);
+             T_NEXT(pChild) != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            MemoPush(pChild, 0);
+        }
+
+        MemoWork(MEMO_RESTORE, NULL, mark);
+        MemoWork(MEMO_EXPR, pChild, 0);
+    }
+    else if (strcmp(pD->pStr, "within") == 0)
+    {
+        MemoWork(MEMO_RESTORE, NULL, mark);
+        MemoWork(MEMO_MIN, NULL, 2);
+        MemoWork(MEMO_DEF, T_SECOND_CHILD(pD), 0);
+        MemoWork(MEMO_PUSH, ResPattern(T_FIRST_CHILD(pD)), mark);
+        MemoWork(MEMO_DEF, T_FIRST_CHILD(pD), 0);
+    }
+    else if (strcmp(pD->pStr, "rec") == 0)
+    {
+        /* its own names are pure until found otherwise */
+        MemoPush(ResPattern(pD), 1);
+        MemoWork(MEMO_RESTORE, NULL, mark);
+        MemoWork(MEMO_MARK, T_FIRST_CHILD(pD), mark);
+        MemoWork(MEMO_DEF, T_FIRST_CHILD(pD), 0);
+    }
+    else /* 'and' */
+    {
+        MemoWorkKids(MEMO_DEF, pD);
+    }
+}
+
+
+/* Walk an expression, see MemoName(). */
+void MemoExpr(Token * pNode)
+{
+    Token * pChild;
+    int mark = numMemoScopes;
+
+    switch (pNode->type)
+    {
+    case T_IDENTIFIER: MemoVal(MemoName(pNode)); return;
+    case T_INTEGER:
+    case T_STRING:     MemoVal(INT_MAX); return;
+    default:           break;
+    }
+
+    if (strcmp(pNode->pStr, "lambda") == 0)
+    {
+        for (pChild = T_FIRST_CHILD(pNode);
+             T_NEXT(pChild) != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            MemoPush(pChild, 0);
+        }
+
+        MemoWork(MEMO_RESTORE, NULL, mark);
+        MemoWork(MEMO_EXPR, pChild, 0);
+    }
+    else if ((strcmp(pNode->pStr, "let") == 0) ||
+             (strcmp(pNode->pStr, "where") == 0))
+    {
+        pChild = (strcmp(pNode->pStr, "let") == 0) ? T_FIRST_CHILD(pNode) :
+                                                     T_SECOND_CHILD(pNode);
+        MemoWork(MEMO_RESTORE, NULL, mark);
+        MemoWork(MEMO_MIN, NULL, 2);
+        MemoWork(MEMO_EXPR, (pChild == T_FIRST_CHILD(pNode)) ?
+                            T_SECOND_CHILD(pNode) : T_FIRST_CHILD(pNode), 0);
+        MemoWork(MEMO_PUSH, ResPattern(pChild), mark);
+        MemoWork(MEMO_DEF, pChild, 0);
+    }
+    else
+    {
+        MemoWorkKids(MEMO_EXPR, pNode);
+    }
+}
+
+
+/* Find and mark the functions to memoize in the AST rooted at pRoot. */
+void Memo(Token * pRoot)
+{
+    MemoItem item;
+    int m;
+
+    numMemoScopes = 0;
+    numMemoVals = 0;
+    numMemoWork = 0;
+
+    MemoWork(MEMO_EXPR, pRoot, 0);
+
+    while (numMemoWork)
+    {
+        item = pMemoWork[--numMemoWork];
+
+        switch (item.kind)
+        {
+        case MEMO_EXPR: MemoExpr(item.pNode); break;
+        case MEMO_DEF:  MemoDef(item.pNode);  break;
+
+        case MEMO_MIN:
+
+            for (m = INT_MAX; item.arg; item.arg--)
+            {
+                if (pMemoVals[--numMemoVals] < m) m = pMemoVals[numMemoVals];
+            }
+
+            MemoVal(m);
+            break;
+
+        case MEMO_PUSH:
+
+            MemoPush(item.pNode, (pMemoVals[numMemoVals - 1] >= item.arg));
+            break;
+
+        case MEMO_MARK:
+
+            if (pMemoVals[numMemoVals - 1] >= item.arg) MemoMark(item.pNode);
+            break;
+
+        case MEMO_RESTORE:
+
+            numMemoScopes = item.arg;
+            break;
+        }
+    }
+
+    free(pMemoScopes);
+    free(pMemoWork);
+    free(pMemoVals);
+    pMemoScopes   = NULL;
+    pMemoWork     = NULL;
+    pMemoVals     = NULL;
+    maxMemoScopes = 0;
+    maxMemoWork   = 0;
+    maxMemoVals   = 0;
+}
+
+
+/*
+ * Profiler (--profile <file>).  ProfMark() gives each function of the
+ * program a ProfFunc named after the definition that binds it, f:3:5 for
+ * "f x = ..." or "f = fn x. ..." with f at line 3 col 5 (lambda:l:c for an
+ * anonymous fn), and tags its body.  The Ctl or Proto made for that body
+ * (the function's last curried parameter) calls ProfEnter() when a call of
+ * it starts and ProfLeave() when the call returns, a tail call out of it
+ * is a return.  A let body, a '->' branch or the shell of a curried
+ * parameter isn't a function of its own, its time is the function's it's
+ * in.  A result cached by --memo isn't a call.
+ *
+ * The calls are kept on a shadow stack and their time goes to the nodes of
+ * a calling context tree, a node for each function as called from the path
+ * of functions above it.  A recursive call goes to the node of the call it
+ * recurses on, which is still on the stack, so a function is on a path at
+ * most once and a deep recursion is a single node.  By default the clock is
+ * read at every call and return and the time in between goes to the node on
+ * top of the stack.  With --sample <us> a CPU timer ticks every us
+ * microseconds instead, the ticks go to the node on top at the next call or
+ * return, and a call just pushes its function: the nodes of the calls made
+ * since the last tick are only looked up when the next one comes (see
+ * ProfResolve()), which keeps the overhead down to a few instructions.
+ *
+ * When the program is done ProfReport() writes the tree to the file in the
+ * folded stack format of flamegraph.pl and the tools like it (a line per
+ * path, "main;f:1:5;g:4:5 1234", in microseconds or ticks) and prints the
+ * functions that took longest, with their own (self) time and the time
+ * including the functions they called (total).
+ */
+typedef struct _proffunc
+{
+    char *              pName;  /* name:line:col */
+    long                calls;
+    long                self;   /* ns, ticks with --sample */
+    long                total;  /* with the functions it called */
+    int                 active; /* calls of it with their node resolved */
+    struct _profnode *  pNode;  /* the node of those */
+    struct _proffunc *  pNext;
+} ProfFunc;
+
+typedef struct _profnode
+{
+    ProfFunc *          pFunc;  /* NULL for main */
+    long                self;
+    struct _profnode *  pParent;
+    struct _profnode *  pChild; /* first of the functions it called */
+    struct _profnode *  pNext;  /* next called by its parent */
+} ProfNode;
+
+typedef struct _profentry
+{
+    ProfFunc * pFunc;
+    ProfNode * pNode;  /* below profResolved */
+} ProfEntry;
+
+#define PROF_TOP 20 /* functions printed */
+
+char * pProfFile = NULL;     /* --profile */
+long profSample = 0;         /* --sample, microseconds */
+ProfFunc * pProfFuncs = NULL;
+int numProfFuncs = 0;
+ProfNode profRoot;           /* main, outside every function */
+ProfEntry * pProfStack = NULL;
+int numProfStack = 0;
+int maxProfStack = 0;
+int profResolved = 0;        /* entries with their node looked up */
+long profLast = 0;           /* ns, the last call or return */
+long profCpu = 0;            /* ns of CPU time at the start, --sample */
+double profTickMs = 0;       /* ms a tick stood for, --sample */
+volatile sig_atomic_t profTicks = 0;
+
+
+/* A ProfFunc for the function bound to pName (or the lambda pName). */
+ProfFunc * ProfFuncNew(Token * pName)
+{
+    ProfFunc * pFunc;
+    char * pLoc = LocToStr(pName->offset);
+
+    if (((pFunc = (ProfFunc *)calloc(1, sizeof(ProfFunc))) == NULL) ||
+        ((pFunc->pName = (char *)malloc(strlen(pName->pStr) +
+                                        strlen(pLoc) + 2)) == NULL))
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    sprintf(pFunc->pName, "%s:%s", pName->pStr, pLoc);
+
+    pFunc->pNext = pProfFuncs;
+    pProfFuncs   = pFunc;
+    numProfFuncs++;
+
+    return pFunc;
+}
+
+
+/*
+ * Tag the body of every function in the AST rooted at pRoot, in pre-order
+ * off an explicit stack so a deep AST can't run it out of C stack.
+ */
+void ProfMark(Token * pRoot)
+{
+    Token ** ppStack = NULL;
+    int maxStack = 0;
+    int numStack = 0;
+    int first;
+    Token * pNode;
+    Token * pChild;
+    Token * pName;
+    Token * pBody;
+    int i;
+
+    ppStack = (Token **)ArrayGrow(ppStack, &maxStack, sizeof(Token *));
+    ppStack[numStack++] = pRoot;
+
+    while (numStack)
+    {
+        pNode = ppStack[--numStack];
+        pName = NULL;
+        pBody = NULL;
+
+        if (T_FIRST_CHILD(pNode) == NULL) continue;
+
+        if (strcmp(pNode->pStr, "function_form") == 0)
+        {
+            pName = T_FIRST_CHILD(pNode);
+            pBody = T_LAST_CHILD(pNode);
+        }
+        else if ((strcmp(pNode->pStr, "=") == 0) &&
+                 T_IS(T_FIRST_CHILD(pNode), T_IDENTIFIER) &&
+                 (strcmp(T_SECOND_CHILD(pNode)->pStr, "lambda") == 0))
+        {
+            pName = T_FIRST_CHILD(pNode);
+            pBody = T_LAST_CHILD(T_SECOND_CHILD(pNode));
+        }
+        else if (strcmp(pNode->pStr, "lambda") == 0) /* named above if bound */
+        {
+            pName = pNode;
+            pBody = T_LAST_CHILD(pNode);
+        }
+
+        if (pBody && !pBody->pProf) pBody->pProf = ProfFuncNew(pName);
+
+        /* push the children, then reverse them so the first is on top */
+        for (first = numStack, pChild = T_FIRST_CHILD(pNode);
+             pChild != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            if (numStack == maxStack)
+            {
+                ppStack = (Token **)ArrayGrow(ppStack, &maxStack,
+                                              sizeof(Token *));
+            }
+
+            ppStack[numStack++] = pChild;
+        }
+
+        for (i = numStack - 1; first < i; first++, i--)
+        {
+            pChild = ppStack[first];
+            ppStack[first] = ppStack[i];
+            ppStack[i] = pChild;
+        }
+    }
+
+    free(ppStack);
+}
+
+
+static inline long ProfNow(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return ((now.tv_sec * 1000000000L) + now.tv_nsec);
+}
+
+
+/* Look up the nodes of the stack entries from profResolved up. */
+void ProfResolve(void)
+{
+    ProfEntry * pE;
+    ProfNode * pParent;
+    ProfNode * pNode;
+
+    for (; profResolved < numProfStack; profResolved++)
+    {
+        pE      = &pProfStack[profResolved];
+        pParent = (profResolved) ? pE[-1].pNode : &profRoot;
+
+        if (pE->pFunc->active) /* recursive, the node it recurses on */
+        {
+            pNode = pE->pFunc->pNode;
+        }
+        else
+        {
+            for (pNode = pParent->pChild;
+                 (pNode != NULL) && (pNode->pFunc != pE->pFunc);
+                 pNode = pNode->pNext);
+
+            if (pNode == NULL)
+            {
+                if ((pNode = (ProfNode *)calloc(1, sizeof(ProfNode))) == NULL)
+                {
+                    perror("Failed to malloc memory");
+                    exit(1);
+                }
+
+                pNode->pFunc    = pE->pFunc;
+                pNode->pParent  = pParent;
+                pNode->pNext    = pParent->pChild;
+                pParent->pChild = pNode;
+            }
+
+            pE->pFunc->pNode = pNode;
+        }
+
+        pE->pFunc->active++;
+        pE->pNode = pNode;
+    }
+}
+
+
+/* The time since the last call or return goes to the node on top. */
+static inline void ProfCharge(void)
+{
+    long now;
+    long t;
+
+    if (profSample)
+    {
+        if (profTicks == 0) return;
+
+        t = profTicks;
+        profTicks = 0;
+        ProfResolve();
+    }
+    else
+    {
+        now = ProfNow(CLOCK_MONOTONIC);
+        t   = (now - profLast);
+        profLast = now;
+    }
+
+    if (numProfStack) pProfStack[numProfStack - 1].pNode->self += t;
+    else              profRoot.self += t;
+}
+
+
+/* A call of pFunc starts.  Returns 1, the frame's prof flag. */
+int ProfEnter(ProfFunc * pFunc)
+{
+    ProfCharge();
+    pFunc->calls++;
+
+    if (numProfStack == maxProfStack)
+    {
+        pProfStack = (ProfEntry *)ArrayGrow(pProfStack, &maxProfStack,
+                                            sizeof(ProfEntry));
+    }
+
+    pProfStack[numProfStack++].pFunc = pFunc;
+    if (!profSample) ProfResolve();
+
+    return 1;
+}
+
+
+/* The call on top of the shadow stack returns. */
+void ProfLeave(void)
+{
+    ProfCharge();
+
+    if (--numProfStack < profResolved)
+    {
+        profResolved = numProfStack;
+        pProfStack[numProfStack].pFunc->active--;
+    }
+}
+
+
+/* A frame with the given prof flag tail calls pFunc. */
+int ProfTail(ProfFunc * pFunc, int prof)
+{
+    if (prof) ProfLeave();
+
+    return ProfEnter(pFunc);
+}
+
+
+/* SIGPROF, the timer of --sample */
+void ProfTick(int sig)
+{
+    (void)sig;
+    profTicks++;
+}
+
+
+/* Start the clock (or the timer) as the program starts. */
+void ProfStart(void)
+{
+    struct itimerval timer;
+    struct sigaction sa;
+
+    memset(&profRoot, 0, sizeof(profRoot));
+    numProfStack = profResolved = 0;
+    profTicks = 0;
+
+    if (profSample)
+    {
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = ProfTick;
+        sa.sa_flags   = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGPROF, &sa, NULL);
+
+        timer.it_interval.tv_sec  = (profSample / 1000000);
+        timer.it_interval.tv_usec = (profSample % 1000000);
+        timer.it_value = timer.it_interval;
+        setitimer(ITIMER_PROF, &timer, NULL);
+
+        profCpu = ProfNow(CLOCK_PROCESS_CPUTIME_ID);
+    }
+    else
+    {
+        profLast = ProfNow(CLOCK_MONOTONIC);
+    }
+}
+
+
+/* Time of the subtree rooted at pNode, added to the functions' totals. */
+long ProfTotal(ProfNode * pNode)
+{
+    ProfNode * pChild;
+    long t = pNode->self;
+
+    for (pChild = pNode->pChild; pChild != NULL; pChild = pChild->pNext)
+    {
+        t += ProfTotal(pChild);
+    }
+
+    /* a function is on a path once, its nodes don't overlap */
+    if (pNode->pFunc)
+    {
+        pNode->pFunc->self  += pNode->self;
+        pNode->pFunc->total += t;
+    }
+
+    return t;
+}
+
+
+/* Write the path of pNode, main;f;g. */
+void ProfPath(FILE * pOut, ProfNode * pNode)
+{
+    if (pNode->pParent)
+    {
+        ProfPath(pOut, pNode->pParent);
+        fprintf(pOut, ";%s", pNode->pFunc->pName);
+    }
+    else
+    {
+        fprintf(pOut, "main");
+    }
+}
+
+
+/* Write a line for each node with time of its own, free the subtree. */
+void ProfFold(FILE * pOut, ProfNode * pNode)
+{
+    ProfNode * pChild;
+    long t = (profSample) ? pNode->self : ((pNode->self + 500) / 1000);
+
+    if (pOut && (t > 0))
+    {
+        ProfPath(pOut, pNode);
+        fprintf(pOut, " %ld\n", t);
+    }
+
+    while ((pChild = pNode->pChild) != NULL)
+    {
+        pNode->pChild = pChild->pNext;
+        ProfFold(pOut, pChild);
+        free(pChild);
+    }
+}
+
+
+double ProfMs(long t)
+{
+    return (profSample) ? (t * profTickMs) : (t / 1000000.0);
+}
+
+
+int ProfCmp(const void * p1, const void * p2)
+{
+    long t1 = (*(ProfFunc **)p1)->self;
+    long t2 = (*(ProfFunc **)p2)->self;
+
+    return (t1 < t2) ? 1 : ((t1 > t2) ? -1 : 0);
+}
+
+
+/* Stop profiling, write the folded stacks and print the top functions. */
+void ProfReport(void)
+{
+    struct itimerval timer;
+    ProfFunc ** ppFuncs;
+    ProfFunc * pFunc;
+    FILE * pOut;
+    long t;
+    int i;
+
+    if (profSample)
+    {
+        memset(&timer, 0, sizeof(timer));
+        setitimer(ITIMER_PROF, &timer, NULL);
+        signal(SIGPROF, SIG_DFL);
+    }
+
+    ProfCharge();
+    t = ProfTotal(&profRoot);
+
+    /*
+     * The timer only fires on a kernel tick, a tick's worth of the CPU time
+     * is the most accurate time for a sample.
+     */
+    if (profSample && t)
+    {
+        profTickMs = ((ProfNow(CLOCK_PROCESS_CPUTIME_ID) - profCpu) /
+                      (t * 1000000.0));
+    }
+
+    if ((ppFuncs = (ProfFunc **)malloc((numProfFuncs + 1) *
+                                       sizeof(ProfFunc *))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    for (i = 0, pFunc = pProfFuncs; pFunc != NULL; pFunc = pFunc->pNext)
+    {
+        ppFuncs[i++] = pFunc;
+    }
+
+    qsort(ppFuncs, numProfFuncs, sizeof(ProfFunc *), ProfCmp);
+
+    if (profSample)
+    {
+        printf("PROFILE: %ld samples, %.3f ms apart, %d functions\n",
+               t, profTickMs, numProfFuncs);
+    }
+    else
+    {
+        printf("PROFILE: %.3f ms, %d functions\n", ProfMs(t), numProfFuncs);
+    }
+
+    printf("PROFILE: %10s %12s %12s  %s\n",
+           "calls", "total ms", "self ms", "function");
+
+    for (i = 0; (i < numProfFuncs) && (i < PROF_TOP); i++)
+    {
+        if (ppFuncs[i]->calls == 0) break;
+
+        printf("PROFILE: %10ld %12.3f %12.3f  %s\n", ppFuncs[i]->calls,
+               ProfMs(ppFuncs[i]->total), ProfMs(ppFuncs[i]->self),
+               ppFuncs[i]->pName);
+    }
+
+    if ((pOut = fopen(pProfFile, "w")) == NULL)
+    {
+        printf("ERROR: %s: ", pProfFile);
+        fflush(stdout);
+        perror("Could not open file");
+    }
+
+    ProfFold(pOut, &profRoot); /* frees the tree either way */
+    if (pOut) fclose(pOut);
+
+    while ((pFunc = pProfFuncs) != NULL)
+    {
+        pProfFuncs = pFunc->pNext;
+        free(pFunc->pName);
+        free(pFunc);
+    }
+
+    free(ppFuncs);
+    free(pProfStack);
+    pProfStack   = NULL;
+    maxProfStack = 0;
+    numProfFuncs = 0;
+}
+
+
+/*
+ * CSE machine (-e).  Runs the standardized tree.
+ *
+ * Every lambda body, every '->' branch and the program itself is flattened
+ * ahead of time into a control structure: an array of instructions laid
+ * out in pre-order and executed from the end back to the start, exactly
+ * like the classic CSE control stack.  The machine keeps a stack of
+ * (control structure, pc, environment) frames and a stack of values.  A
+ * frame running off the start of its control structure is the environment
+ * marker being popped.
+ *
+ * The instruction at the start of a control structure is the last one it
+ * runs, so a gamma or '->' there is a tail call (a lambda body's last
+ * gamma, both '->' branches, a let/where body which is the body of the
+ * lambda it standardizes to).  Those pop their own frame before pushing
+ * the next, so a loop written as tail recursion runs in a constant number
+ * of frames.
+ *
+ * Everything created while running (environments, closures, tuples,
+ * strings and big integers) is garbage collected, see GcAlloc().  The
+ * literals decoded at load time come from a per-run arena, a simple bump
+ * allocator that is thrown away in one go when the program finishes.
+ */
+int evaluate = 0;
+
+
+typedef enum
+{
+    I_PUSH,   /* push a literal */
+    I_LOOKUP, /* push the value of a name */
+    I_LAMBDA, /* push a closure for pCtl */
+    I_GAMMA,  /* apply the top of the stack to the one below */
+    I_BUILTIN,/* apply builtin arg to the top of the stack */
+    I_CONC,   /* Conc of the top of the stack and the one below */
+    I_COND,   /* pick pCtl or pElse by the truth value on the stack */
+    I_TAU,    /* make a tuple of the top arg values */
+    I_BINOP,
+    I_UNOP
+} InstrOp;
+
+typedef struct _instr
+{
+    InstrOp        op;
+    int            tail;   /* last thing its control structure does */
+    int            arg;    /* tau count, operator, slot or builtin of a name */
+    int            depth;  /* I_LOOKUP, envs out (RES_FREE for a builtin) */
+    unsigned int   offset; /* source offset for runtime errors */
+    char *         pName;  /* I_LOOKUP */
+    struct _ctl *  pCtl;   /* I_LAMBDA, I_COND then */
+    struct _ctl *  pElse;  /* I_COND else */
+    Value          val;    /* I_PUSH */
+} Instr;
+
+typedef struct _ctl
+{
+    int     index;    /* delta number (order of creation) */
+    int     numVars;  /* bound names, more than one for a tuple */
+    char ** ppVars;
+    Instr * pCode;
+    int     numCode;
+    int     maxCode;
+    int     memo;     /* --memo, cache its results (see MemoFind()) */
+    struct _ctl * pRec; /* a rec function, prints as the eta of pRec */
+    ProfFunc * pProf; /* --profile, the function it's the body of */
+} Ctl;
+
+typedef struct _frame
+{
+    Ctl * pCtl;
+    int   pc;     /* counts down to 0 */
+    Env * pEnv;
+    Ctl * pMemo;  /* --memo, cache the result for pMemo(memo) */
+    Value memo;
+    int   prof;   /* --profile, ProfEnter()ed for the call */
+} Frame;
+
+Ctl ** ppCtls = NULL;
+int numCtls = 0;
+int maxCtls = 0;
+
+Value * rtStack = NULL;
+int rtNumStack = 0;
+int rtMaxStack = 0;
+
+Frame * rtFrames = NULL;
+int rtNumFrames = 0;
+int rtMaxFrames = 0;
+int rtLowFrames = 0;  /* fewest frames since the last collection */
+int rtFrameCap = 0;   /* frames before growing, see RtDepth() */
+
+
+struct
+{
+    const char * pName;
+    int          op;
+} rtOps[] =
+{
+    { "+",   OP_PLUS  }, { "-",   OP_MINUS }, { "*",   OP_MUL },
+    { "/",   OP_DIV   }, { "**",  OP_POW   }, { "gr",  OP_GR  },
+    { ">",   OP_GR    }, { "ge",  OP_GE    }, { ">=",  OP_GE  },
+    { "ls",  OP_LS    }, { "<",   OP_LS    }, { "le",  OP_LE  },
+    { "<=",  OP_LE    }, { "eq",  OP_EQ    }, { "ne",  OP_NE  },
+    { "&",   OP_AND   }, { "or",  OP_OR    }, { "aug", OP_AUG },
+    { "not", OP_NOT   }, { "neg", OP_NEG   },
+    { NULL,  0        }
+};
+
+
+static inline void RT_PUSH(Value v)
+{
+    if (rtNumStack == rtMaxStack)
+    {
+        rtStack = (Value *)ArrayGrow(rtStack, &rtMaxStack, sizeof(Value));
+    }
+
+    rtStack[rtNumStack++] = v;
+}
+
+#define RT_POP() (rtStack[--rtNumStack])
+
+
+static inline void RT_CALL(Ctl * pCtl, Env * pEnv)
+{
+    if (rtNumFrames >= rtFrameCap)
+    {
+        if (rtNumFrames == rtMaxFrames)
+        {
+            rtFrames = (Frame *)ArrayGrow(rtFrames, &rtMaxFrames,
+                                          sizeof(Frame));
+        }
+
+        rtFrameCap = RtDepth(rtNumFrames, rtMaxFrames);
+    }
+
+    rtFrames[rtNumFrames].pCtl  = pCtl;
+    rtFrames[rtNumFrames].pc    = pCtl->numCode;
+    rtFrames[rtNumFrames].pEnv  = pEnv;
+    rtFrames[rtNumFrames].pMemo = NULL;
+    rtFrames[rtNumFrames].memo  = 0;
+    rtFrames[rtNumFrames].prof  = (pCtl->pProf) ? ProfEnter(pCtl->pProf) : 0;
+    rtNumFrames++;
+}
+
+
+/*
+ * A tail call, the top frame runs pCtl instead.  Its result is the result
+ * of the frame's call so it's still cached for the call (with --memo).
+ */
+static inline void RT_TAIL_CALL(Ctl * pCtl, Env * pEnv)
+{
+    if (pCtl->pProf)
+    {
+        rtFrames[rtNumFrames - 1].prof =
+            ProfTail(pCtl->pProf, rtFrames[rtNumFrames - 1].prof);
+    }
+
+    rtFrames[rtNumFrames - 1].pCtl = pCtl;
+    rtFrames[rtNumFrames - 1].pc   = pCtl->numCode;
+    rtFrames[rtNumFrames - 1].pEnv = pEnv;
+}
+
+
+/* The value of a name, by its lexical address (or a builtin). */
+static inline Value EnvLookup(Instr * pI, Env * pEnv)
+{
+    int depth = pI->depth;
+
+    if (depth == RES_FREE)
+    {
+        if (pI->arg < 0)
+        {
+            RtError(pI->offset, "undeclared identifier (%s)", pI->pName);
+        }
+
+        return (Value)&builtins[pI->arg];
+    }
+
+    while (depth--) pEnv = pEnv->pParent;
+
+    return pEnv->v[pI->arg];
+}
+
+
+/* A new environment binding the names of the closure's lambda to arg. */
+Env * EnvBind(Instr * pI, Closure * pClosure, Value arg)
+{
+    Ctl * pCtl = pClosure->pCtl;
+    Env * pEnv;
+
+    pEnv = (Env *)GcAlloc((sizeof(Env) + (pCtl->numVars * sizeof(Value))),
+                          V_ENV);
+    pEnv->num     = pCtl->numVars;
+    pEnv->pParent = pClosure->pEnv;
+    pEnv->pCtl    = pCtl;
+
+    if (pCtl->numVars == 1)
+    {
+        pEnv->v[0] = arg;
+    }
+    else if (pCtl->numVars > 1) /* fn (a, b, ...). */
+    {
+        if (!V_IS(arg, V_TUPLE) || (V_TUPLE_NUM(arg) != pCtl->numVars))
+        {
+            RtError(pI->offset, "expected a tuple of %d values",
+                    pCtl->numVars);
+        }
+
+        memcpy(pEnv->v, V_TUPLE_V(arg), (pCtl->numVars * sizeof(Value)));
+    }
+
+    return pEnv;
+}
+
+
+/*
+ * Y* of fn X. E where E is a lambda, or a tuple of lambdas one for each of
+ * X's names (a rec of functions), without the eta closure.  The env that
+ * binds X is made here, holding the closures of E that are made in it, so
+ * they refer to themselves directly and a recursive call costs the same as
+ * any other call.  Returns 0 for any other E, which gets the eta closure.
+ */
+Value CtlRec(Closure * pClosure)
+{
+    Ctl * pCtl = pClosure->pCtl;
+    Instr * pCode = pCtl->pCode;
+    int first = (pCtl->numCode > 1); /* the lambdas after the I_TAU */
+    Env * pEnv;
+    Value v;
+    int i;
+
+    if (first)
+    {
+        if ((pCode[0].op != I_TAU) || (pCode[0].arg != pCtl->numVars) ||
+            (pCtl->numVars != (pCtl->numCode - 1)) || (pCtl->numVars < 2))
+        {
+            return 0;
+        }
+    }
+    else if (pCtl->numVars != 1)
+    {
+        return 0;
+    }
+
+    for (i = first; i < pCtl->numCode; i++)
+    {
+        if (pCode[i].op != I_LAMBDA) return 0;
+    }
+
+    pEnv = (Env *)GcAlloc((sizeof(Env) + (pCtl->numVars * sizeof(Value))),
+                          V_ENV);
+    pEnv->num     = pCtl->numVars;
+    pEnv->pParent = pClosure->pEnv;
+    pEnv->pCtl    = pCtl;
+
+    for (i = 0; i < pCtl->numVars; i++)
+    {
+        pCode[first + i].pCtl->pRec = pCtl;
+        pEnv->v[i] = ValueClosure(V_CLOSURE, pCode[first + i].pCtl, NULL,
+                                  pEnv, 0);
+    }
+
+    if (!first) return pEnv->v[0];
+
+    v = ValueTuple(pCtl->numVars);
+    memcpy(V_PTUPLE(v)->v, pEnv->v, (pCtl->numVars * sizeof(Value)));
+
+    return v;
+}
+
+
+/*
+ * The builtin a (resolved) name is, -1 if it's bound or not a builtin.  A
+ * call of it is an I_BUILTIN, the builtin isn't looked up and applied.
+ */
+int CtlBuiltin(Token * pNode)
+{
+    if (!T_IS(pNode, T_IDENTIFIER) || (pNode->depth != RES_FREE)) return -1;
+
+    return BuiltinFind(pNode->pStr);
+}
+
+
+/* A new (empty) control structure. */
+Ctl * CtlAlloc(void)
+{
+    Ctl * pCtl;
+
+    if ((pCtl = (Ctl *)calloc(1, sizeof(Ctl))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    if (numCtls == maxCtls)
+    {
+        ppCtls = (Ctl **)ArrayGrow(ppCtls, &maxCtls, sizeof(Ctl *));
+    }
+
+    pCtl->index = numCtls;
+    ppCtls[numCtls++] = pCtl;
+
+    return pCtl;
+}
+
+
+/* Append an instruction to a control structure. */
+Instr * CtlEmit(Ctl * pCtl, InstrOp op, Token * pToken)
+{
+    Instr * pI;
+
+    if (pCtl->numCode == pCtl->maxCode)
+    {
+        pCtl->pCode = (Instr *)ArrayGrow(pCtl->pCode, &pCtl->maxCode,
+                                         sizeof(Instr));
+    }
+
+    pI = &pCtl->pCode[pCtl->numCode++];
+    memset(pI, 0, sizeof(Instr));
+    pI->op     = op;
+    pI->tail   = (pCtl->numCode == 1); /* runs last, see CseRun() */
+    pI->offset = pToken->offset;
+
+    return pI;
+}
+
+
+/*
+ * CtlFlatten() works off an explicit stack, like the standardizer, so a
+ * deep ST (a long '1 + 1 + ...') can't run it out of C stack.  An item
+ * flattens a node onto a control structure, or for the branches of an
+ * I_COND first gives the instruction its then (else) control structure, so
+ * the deltas are still numbered in the order the recursion made them.
+ */
+#define CTL_NODE 0
+#define CTL_THEN 1
+#define CTL_ELSE 2
+
+typedef struct
+{
+    int     kind;
+    int     cond;  /* CTL_THEN, CTL_ELSE: the I_COND's index in pCtl */
+    Ctl *   pCtl;
+    Token * pNode;
+} CtlItem;
+
+CtlItem * pCtlWork = NULL;
+int numCtlWork = 0;
+int maxCtlWork = 0;
+
+
+void CtlWork(int kind, Ctl * pCtl, int cond, Token * pNode)
+{
+    if (numCtlWork == maxCtlWork)
+    {
+        pCtlWork = (CtlItem *)ArrayGrow(pCtlWork, &maxCtlWork,
+                                        sizeof(CtlItem));
+    }
+
+    pCtlWork[numCtlWork].kind  = kind;
+    pCtlWork[numCtlWork].cond  = cond;
+    pCtlWork[numCtlWork].pCtl  = pCtl;
+    pCtlWork[numCtlWork].pNode = pNode;
+    numCtlWork++;
+}
+
+
+/* Queue the children of pNode onto pCtl, the first one on top. */
+void CtlWorkKids(Ctl * pCtl, Token * pNode)
+{
+    Token * pChild;
+    int first = numCtlWork;
+    CtlItem item;
+    int i;
+
+    for (pChild = T_FIRST_CHILD(pNode);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        CtlWork(CTL_NODE, pCtl, 0, pChild);
+    }
+
+    for (i = numCtlWork - 1; first < i; first++, i--)
+    {
+        item = pCtlWork[first];
+        pCtlWork[first] = pCtlWork[i];
+        pCtlWork[i] = item;
+    }
+}
+
+
+/* Emit the instruction for one ST node and queue what it's made of. */
+void CtlNode(Ctl * pCtl, Token * pNode)
+{
+    Token * pChild;
+    Ctl * pNew;
+    Instr * pI;
+    int i;
+
+    switch (pNode->type)
+    {
+    case T_INTEGER:
+
+        pI = CtlEmit(pCtl, I_PUSH, pNode);
+        pI->val = ValueIntLiteral(pNode->pStr);
+        return;
+
+    case T_STRING:
+
+        pI = CtlEmit(pCtl, I_PUSH, pNode);
+        pI->val = ValueStrLiteral(pNode->pStr);
+        return;
+
+    case T_IDENTIFIER:
+
+        pI = CtlEmit(pCtl, I_LOOKUP, pNode);
+        pI->pName = pNode->pStr;
+        pI->depth = pNode->depth; /* see Resolve() */
+        pI->arg   = pNode->slot;
+
+        if (pI->depth == RES_FREE) pI->arg = BuiltinFind(pNode->pStr);
+
+        return;
+
+    case T_KEYWORD:
+
+        pI = CtlEmit(pCtl, I_PUSH, pNode);
+
+        if (strcmp(pNode->pStr, "<nil>") == 0)
+        {
+            pI->val = ValueTuple(0);
+        }
+        else if (strcmp(pNode->pStr, "<dummy>") == 0)
+        {
+            pI->val = RT_DUMMY;
+        }
+        else
+        {
+            pI->val = ValueTruth(strcmp(pNode->pStr, "<true>") == 0);
+        }
+
+        return;
+
+    default:
+
+        break;
+    }
+
+    if (strcmp(pNode->pStr, "lambda") == 0)
+    {
+        pNew  = CtlAlloc();
+        pI    = CtlEmit(pCtl, I_LAMBDA, pNode);
+        pI->pCtl = pNew;
+
+        pChild = T_FIRST_CHILD(pNode);
+
+        if (T_IS(pChild, T_IDENTIFIER))
+        {
+            pNew->numVars = 1;
+            pNew->ppVars  = (char **)malloc(sizeof(char *));
+            pNew->ppVars[0] = pChild->pStr;
+        }
+        else if (strcmp(pChild->pStr, ",") == 0)
+        {
+            for (pChild = T_FIRST_CHILD(pChild);
+                 pChild != NULL;
+                 pChild = T_NEXT(pChild))
+            {
+                pNew->ppVars = (char **)realloc(pNew->ppVars,
+                                  ((pNew->numVars + 1) * sizeof(char *)));
+                pNew->ppVars[pNew->numVars++] = pChild->pStr;
+            }
+        }
+        /* else '()', nothing is bound */
+
+        pNew->memo  = T_SECOND_CHILD(pNode)->memo; /* see Memo() */
+        pNew->pProf = T_SECOND_CHILD(pNode)->pProf; /* see ProfMark() */
+        CtlWork(CTL_NODE, pNew, 0, T_SECOND_CHILD(pNode));
+    }
+    else if (strcmp(pNode->pStr, "->") == 0)
+    {
+        CtlEmit(pCtl, I_COND, pNode);
+        i = pCtl->numCode - 1; /* pCode moves as it grows */
+        CtlWork(CTL_NODE, pCtl, 0, T_FIRST_CHILD(pNode));
+        CtlWork(CTL_ELSE, pCtl, i, T_NEXT(T_SECOND_CHILD(pNode)));
+        CtlWork(CTL_THEN, pCtl, i, T_SECOND_CHILD(pNode));
+    }
+    else if (strcmp(pNode->pStr, "gamma") == 0)
+    {
+        pChild = T_FIRST_CHILD(pNode);
+
+        CtlWork(CTL_NODE, pCtl, 0, T_SECOND_CHILD(pNode));
+
+        if ((i = CtlBuiltin(pChild)) >= 0) /* no builtin value to apply */
+        {
+            pI = CtlEmit(pCtl, I_BUILTIN, pNode);
+            pI->arg = i;
+        }
+        else if (T_MATCH(pChild, T_OPERATOR, "gamma") &&
+                 (CtlBuiltin(T_FIRST_CHILD(pChild)) == B_CONC) &&
+                 (pChild->offset == pNode->offset)) /* Conc E1 E2 */
+        {
+            CtlEmit(pCtl, I_CONC, pNode);
+            CtlWork(CTL_NODE, pCtl, 0, T_SECOND_CHILD(pChild));
+        }
+        else
+        {
+            CtlEmit(pCtl, I_GAMMA, pNode);
+            CtlWork(CTL_NODE, pCtl, 0, pChild);
+        }
+    }
+    else if (strcmp(pNode->pStr, "tau") == 0)
+    {
+        pI = CtlEmit(pCtl, I_TAU, pNode);
+
+        for (pChild = T_FIRST_CHILD(pNode);
+             pChild != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            pI->arg++;
+        }
+
+        CtlWorkKids(pCtl, pNode);
+    }
+    else if (strcmp(pNode->pStr, "<Y*>") == 0)
+    {
+        pI = CtlEmit(pCtl, I_PUSH, pNode);
+        pI->val = RT_YSTAR;
+    }
+    else
+    {
+        for (i = 0; rtOps[i].pName; i++)
+        {
+            if (strcmp(pNode->pStr, rtOps[i].pName) == 0) break;
+        }
+
+        if (!rtOps[i].pName)
+        {
+            RtError(pNode->offset, "can't evaluate (%s)", pNode->pStr);
+        }
+
+        pI = CtlEmit(pCtl, ((rtOps[i].op >= OP_NOT) ? I_UNOP : I_BINOP),
+                     pNode);
+        pI->arg = rtOps[i].op;
+
+        CtlWorkKids(pCtl, pNode);
+    }
+}
+
+
+/* Flatten the ST rooted at pNode (in pre-order) onto pCtl. */
+void CtlFlatten(Ctl * pCtl, Token * pNode)
+{
+    CtlItem item;
+    Ctl * pNew;
+
+    numCtlWork = 0;
+    CtlWork(CTL_NODE, pCtl, 0, pNode);
+
+    while (numCtlWork)
+    {
+        item = pCtlWork[--numCtlWork];
+
+        if (item.kind == CTL_NODE)
+        {
+            CtlNode(item.pCtl, item.pNode);
+            continue;
+        }
+
+        pNew = CtlAlloc();
+
+        if (item.kind == CTL_THEN)
+        {
+            item.pCtl->pCode[item.cond].pCtl = pNew;
+        }
+        else
+        {
+            item.pCtl->pCode[item.cond].pElse = pNew;
+        }
+
+        CtlNode(pNew, item.pNode);
+    }
+
+    free(pCtlWork);
+    pCtlWork = NULL;
+    maxCtlWork = 0;
+}
+
+
+/* Free the control structures and the machine stacks. */
+void CtlFree(void)
+{
+    int i;
+
+    for (i = 0; i < numCtls; i++)
+    {
+        free(ppCtls[i]->ppVars);
+        free(ppCtls[i]->pCode);
+        free(ppCtls[i]);
+    }
+
+    free(ppCtls);
+    free(rtStack);
+    free(rtFrames);
+    ppCtls      = NULL;
+    rtStack     = NULL;
+    rtFrames    = NULL;
+    numCtls     = maxCtls     = 0;
+    rtNumStack  = rtMaxStack  = 0;
+    rtNumFrames = rtMaxFrames = 0;
+    rtLowFrames = 0;
+    rtFrameCap  = 0;
+}
+
+
+/*
+ * The CSE machine's roots for the collector (see GcRoots()), the value
+ * stack and the frames' environments.
+ */
+void RtRoots(int minor)
+{
+    int low = 0;
+    int i;
+
+    if (minor && (rtLowFrames > 1)) low = (rtLowFrames - 1);
+
+    for (i = 0; i < rtNumStack; i++) GC_VALUE(rtStack[i]);
+
+    for (i = low; i < rtNumFrames; i++)
+    {
+        GC_ENV(rtFrames[i].pEnv);
+        GC_VALUE(rtFrames[i].memo);
+    }
+
+    rtLowFrames = rtNumFrames;
+}
+
+
+/* Run the CSE machine until the program's control structure is done. */
+void CseRun(Ctl * pMain)
+{
+    static Instr gammaInstr = { I_GAMMA, 1 };
+    static Ctl gammaCtl = { -1, 0, NULL, &gammaInstr, 1, 1 };
+    Frame * pF;
+    Instr * pI;
+    Ctl * pCtl;
+    Env * pEnv;
+    Value rator;
+    Value rand;
+    Value v;
+    int i;
+
+    RT_STEP(); /* as the VM counts its main frame */
+    RT_CALL(pMain, NULL);
+
+    while (rtNumFrames)
+    {
+        if (gcPending) GcCollect(); /* between instructions is safe */
+
+        pF = &rtFrames[rtNumFrames - 1];
+
+        if (pF->pc == 0) /* done, drop the frame and its environment */
+        {
+            if (pF->pMemo)
+            {
+                MemoStore(pF->pMemo, pF->memo, rtStack[rtNumStack - 1]);
+            }
+
+            if (pF->prof) ProfLeave();
+            if (--rtNumFrames < rtLowFrames) rtLowFrames = rtNumFrames;
+            continue;
+        }
+
+        pI = &pF->pCtl->pCode[--pF->pc];
+
+        switch (pI->op)
+        {
+        case I_PUSH:
+
+            RT_PUSH(pI->val);
+            break;
+
+        case I_LOOKUP:
+
+            RT_PUSH(EnvLookup(pI, pF->pEnv));
+            break;
+
+        case I_LAMBDA:
+
+            RT_PUSH(ValueClosure(V_CLOSURE, pI->pCtl, NULL, pF->pEnv, 0));
+            break;
+
+        case I_COND:
+
+            v = RT_POP();
+
+            if (!V_IS(v, V_TRUTH))
+            {
+                RtError(pI->offset, "'->' condition is not a truthvalue");
+            }
+
+            pCtl = (V_BOOL(v)) ? pI->pCtl : pI->pElse;
+
+            if (pI->tail) RT_TAIL_CALL(pCtl, pF->pEnv);
+            else          RT_CALL(pCtl, pF->pEnv);
+
+            break;
+
+        case I_TAU:
+
+            v = ValueTuple(pI->arg);
+
+            for (i = 0; i < pI->arg; i++) V_PTUPLE(v)->v[i] = RT_POP();
+
+            RT_PUSH(v);
+            break;
+
+        case I_BINOP:
+
+            rator = RT_POP(); /* the left operand is on top */
+            rand  = RT_POP();
+            RT_PUSH(BinOp(pI->offset, pI->arg, rator, rand));
+            break;
+
+        case I_UNOP:
+
+            v = RT_POP();
+
+            if (pI->arg == OP_NOT)
+            {
+                if (!V_IS(v, V_TRUTH))
+                {
+                    RtError(pI->offset, "not applied to a non-truthvalue");
+                }
+
+                v = ValueTruth(!V_BOOL(v));
+            }
+            else
+            {
+                if (!V_IS(v, V_INT))
+                {
+                    RtError(pI->offset, "neg applied to a non-integer");
+                }
+
+                v = IntNeg(v);
+            }
+
+            RT_PUSH(v);
+            break;
+
+        case I_BUILTIN:
+
+            v = RT_POP();
+            RT_PUSH(BuiltinCall(pI->offset, pI->arg, v));
+            break;
+
+        case I_CONC:
+
+            rator = RT_POP(); /* the first string is on top */
+            rand  = RT_POP();
+            RT_PUSH(BuiltinConc(pI->offset, rator, rand));
+            break;
+
+        case I_GAMMA:
+
+            rator = RT_POP();
+            rand  = RT_POP();
+
+            switch (V_TYPE(rator))
+            {
+            case V_CLOSURE:
+
+                pCtl = V_PCLOSURE(rator)->pCtl;
+                i    = -1;
+
+                /* a cached result instead of the call (see MemoFind()) */
+                if (pCtl->memo && !(pI->tail && pF->pMemo) &&
+                    ((i = MemoFind(pCtl, rand, &v)) == 1))
+                {
+                    RT_PUSH(v);
+                    break;
+                }
+
+                pEnv = EnvBind(pI, V_PCLOSURE(rator), rand);
+                RT_STEP();
+
+                if (pI->tail) RT_TAIL_CALL(pCtl, pEnv);
+                else          RT_CALL(pCtl, pEnv);
+
+                if (i == 0)
+                {
+                    rtFrames[rtNumFrames - 1].pMemo = pCtl;
+                    rtFrames[rtNumFrames - 1].memo  = rand;
+                }
+
+                break;
+
+            case V_ETA:
+
+                /*
+                 * Y* unrolled once: apply the lambda to the eta closure
+                 * itself and then apply the result to the argument.
+                 */
+                RT_PUSH(rand);
+                RT_STEP();
+
+                if (pI->tail) RT_TAIL_CALL(&gammaCtl, pF->pEnv);
+                else          RT_CALL(&gammaCtl, pF->pEnv);
+
+                RT_CALL(V_PCLOSURE(rator)->pCtl,
+                        EnvBind(pI, V_PCLOSURE(rator), rator));
+                break;
+
+            case V_YSTAR:
+
+                if (!V_IS(rand, V_CLOSURE))
+                {
+                    RtError(pI->offset, "Y* applied to a non-function");
+                }
+
+                if ((v = CtlRec(V_PCLOSURE(rand))) == 0)
+                {
+                    v = ValueClosure(V_ETA, V_PCLOSURE(rand)->pCtl, NULL,
+                                     V_PCLOSURE(rand)->pEnv, 0);
+                }
+
+                RT_PUSH(v);
+                break;
+
+            case V_TUPLE:
+
+                if (!V_IS_SMALL(rand) || (V_SMALL(rand) < 1) ||
+                    (V_SMALL(rand) > V_TUPLE_NUM(rator)))
+                {
+                    RtError(pI->offset, "bad tuple selection");
+                }
+
+                RT_PUSH(V_TUPLE_V(rator)[V_SMALL(rand) - 1]);
+                break;
+
+            case V_BUILTIN:
+
+                RT_PUSH(BuiltinApply(pI->offset, V_PBUILTIN(rator), rand));
+                break;
+
+            default:
+
+                RtError(pI->offset, "can't apply a non-function");
+            }
+
+            break;
+        }
+    }
+}
+
+
+/*
+ * Evaluate the (standardized) program rooted at pRoot.  A runtime error
+ * comes back here (see RtStop()) and everything is freed just the same.
+ */
+void Evaluate(Token * pRoot)
+{
+    jmp_buf jmp;
+
+    BuiltinInit();
+    RtStart();
+    if (pProfFile) ProfStart();
+
+    if (setjmp(jmp) == 0)
+    {
+        pRtJmp = &jmp;
+        CtlFlatten(CtlAlloc(), pRoot);
+        GcInit();
+        CseRun(ppCtls[0]);
+        printf("\n");
+    }
+
+    pRtJmp = NULL;
+    if (pProfFile) ProfReport();
+
+    if (gcLive) GcFree();
+    CtlFree();
+    ArenaFree();
+}
+
+
+/*
+ * Bytecode compiler and register VM (--vm).
+ *
+ * The AST is compiled as is (let, where, within, and, rec and @ are
+ * compiled directly, there is no ST) into a prototype per function,
+ * counting each curried parameter as a function.  The code is an
+ * array of 64-bit words: a 16-bit opcode and three 16-bit operands A, B
+ * and C (mostly registers), plus a second word for the instructions that
+ * need a bigger operand (a constant, slot, prototype or jump target).
+ *
+ * Names are resolved by the compiler.  Each call gets an environment with
+ * a slot for every name bound in the function body (the parameter and all
+ * the let/where definitions, a body runs each of them at most once).  The
+ * closures are flat: a closure holds a copy of the values of just the free
+ * names its function uses (see VmCapture()), not a link to the environment
+ * it was made in.  So a name is loaded from a slot or from the closure by
+ * a single index, and a closure doesn't keep anything else alive (bindings
+ * never change, a copy is as good as the original).  Temporaries live in
+ * registers, a window on the VM stack for each call.  Evaluation order is
+ * the same as the CSE machine's (the rand before the rator, right operands
+ * first) so side effects match.
+ *
+ * The dispatch loop uses computed goto (a plain switch without GCC).
+ */
+int vmRun = 0;
+
+enum
+{
+    VM_LOADK,   /* A ; k      R[A] = K[k] */
+    VM_LOADV,   /* A ; s      R[A] = slot s of this call's env */
+    VM_LOADC,   /* A ; i      R[A] = captured value i of this closure */
+    VM_STOREV,  /* A ; s      slot s of this call's env = R[A] */
+    VM_LOADG,   /* A B        R[A] = builtin B */
+    VM_UNDEF,   /* A ; k      undeclared identifier K[k] */
+    VM_CLOSURE, /* A ; p      R[A] = closure of prototype p */
+    VM_FIX,     /* A B        R[A] = Y* R[B] (an eta closure) */
+    VM_REC,     /* A C ; s    R[A] is C rec functions, tie them to slot s.. */
+    VM_CALL,    /* A B C      R[A] = R[B] R[C] */
+    VM_TAILCALL,/* A B C      return R[B] R[C], reusing the frame */
+    VM_BUILTIN, /* A B C      R[A] = builtin B R[C] */
+    VM_CONC,    /* A B C      R[A] = Conc R[B] R[C] */
+    VM_RET,     /* A          return R[A] */
+    VM_TUPLE,   /* A B C      R[A] = (R[B], ... R[B+C-1]) */
+    VM_TUPLEN,  /* A ; n      R[A] = a tuple of n values, for VM_FILL */
+    VM_FILL,    /* A B C ; i  values i.. of R[A] = R[B], ... R[B+C-1] */
+    VM_BIND,    /* A n        R[A] must be a tuple of n values */
+    VM_SELECT,  /* A B C      R[A] = R[B] C */
+    VM_JMP,     /*   ; t      goto t */
+    VM_JMPF,    /* A ; t      goto t if R[A] is false */
+    VM_ADD,     /* A B C      R[A] = R[B] op R[C], same order as OP_* */
+    VM_SUB,
+    VM_MUL,
+    VM_DIV,
+    VM_POW,
+    VM_GR,
+    VM_GE,
+    VM_LS,
+    VM_LE,
+    VM_EQ,
+    VM_NE,
+    VM_AND,
+    VM_OR,
+    VM_AUG,
+    VM_NOT,     /* A B        R[A] = op R[B] */
+    VM_NEG,
+    VM_NUM_OPS
+};
+
+#define VM_OP(i)           ((unsigned int)(i) & 0xffff)
+#define VM_A(i)            ((unsigned int)((i) >> 16) & 0xffff)
+#define VM_B(i)            ((unsigned int)((i) >> 32) & 0xffff)
+#define VM_C(i)            ((unsigned int)((i) >> 48))
+#define VM_BX(i)           ((unsigned int)((i) >> 32))
+#define VM_INS(op, a, b, c) \
+    ((VmWord)(op) | ((VmWord)(a) << 16) | ((VmWord)(b) << 32) | \
+     ((VmWord)(c) << 48))
+
+#define VM_MAX_REGS 0x10000
+
+/*
+ * A tuple wider than this is made by VM_TUPLEN and then filled in a chunk
+ * of registers at a time by VM_FILL, so it takes no more registers than
+ * this however wide it is.
+ */
+#define VM_TUPLE_CHUNK 64
+
+/* compile time view of a function: the names in scope and the registers */
+typedef struct _vmscope
+{
+    struct _vmscope * pParent;
+    Proto *           pProto;
+    char **           ppNames;
+    int *             pSlots;
+    int               numNames;
+    int               maxNames;
+    char **           ppCaps;  /* the names captured, pProto->pCaps order */
+    int               maxCaps;
+    int               nextReg;
+} VmScope;
+
+Proto ** ppProtos = NULL;
+int numProtos = 0;
+int maxProtos = 0;
+
+VmScope * pVmScope = NULL; /* the function being compiled, innermost */
+
+void ClosurePrint(Value v)
+{
+    Closure * pC = V_PCLOSURE(v);
+    Ctl * pCtl = pC->pCtl;
+
+    if (!pCtl)
+    {
+        ProtoClosurePrint(v);
+    }
+    else
+    {
+        if (pCtl->pRec) pCtl = pCtl->pRec; /* see CtlRec() */
+
+        ClosurePrintAs((V_IS(v, V_ETA) || (pCtl != pC->pCtl)), pCtl->ppVars,
+                       pCtl->numVars, pCtl->index);
+    }
+}
+
+
+Proto * ProtoAlloc(void)
+{
+    Proto * pProto;
+
+    if ((pProto = (Proto *)calloc(1, sizeof(Proto))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    if (numProtos == maxProtos)
+    {
+        ppProtos = (Proto **)ArrayGrow(ppProtos, &maxProtos, sizeof(Proto *));
+    }
+
+    pProto->index = numProtos;
+    ppProtos[numProtos++] = pProto;
+
+    return pProto;
+}
+
+
+/* Append a code word, returns its index. */
+int VmEmit(Proto * pProto, VmWord word, unsigned int offset)
+{
+    if (pProto->numCode == pProto->maxCode)
+    {
+        pProto->maxCode = (pProto->maxCode) ? (pProto->maxCode * 2) : 64;
+
+        if (((pProto->pCode = (VmWord *)realloc(pProto->pCode,
+                   (pProto->maxCode * sizeof(VmWord)))) == NULL) ||
+            ((pProto->pOffsets = (unsigned int *)realloc(pProto->pOffsets,
+                   (pProto->maxCode * sizeof(unsigned int)))) == NULL))
+        {
+            perror("Failed to realloc memory");
+            exit(1);
+        }
+    }
+
+    pProto->pCode[pProto->numCode]    = word;
+    pProto->pOffsets[pProto->numCode] = offset;
+
+    return pProto->numCode++;
+}
+
+
+int VmConst(Proto * pProto, Value v)
+{
+    if (pProto->numConsts == pProto->maxConsts)
+    {
+        pProto->pConsts = (Value *)ArrayGrow(pProto->pConsts,
+                                             &pProto->maxConsts,
+                                             sizeof(Value));
+    }
+
+    pProto->pConsts[pProto->numConsts] = v;
+
+    return pProto->numConsts++;
+}
+
+
+int VmRegAlloc(VmScope * pS, Token * pNode)
+{
+    if (pS->nextReg == VM_MAX_REGS)
+    {
+        RtError(pNode->offset, "expression too complex (out of registers)");
+    }
+
+    if (pS->nextReg == pS->pProto->numRegs) pS->pProto->numRegs++;
+
+    return pS->nextReg++;
+}
+
+
+/* Make a name visible, bound to a slot of this function's env. */
+void VmScopePush(VmScope * pS, char * pName, int slot)
+{
+    if (pS->numNames == pS->maxNames)
+    {
+        pS->maxNames = (pS->maxNames) ? (pS->maxNames * 2) : 16;
+
+        if (((pS->ppNames = (char **)realloc(pS->ppNames,
+                                   (pS->maxNames * sizeof(char *)))) == NULL) ||
+            ((pS->pSlots = (int *)realloc(pS->pSlots,
+                                   (pS->maxNames * sizeof(int)))) == NULL))
+        {
+            perror("Failed to realloc memory");
+            exit(1);
+        }
+    }
+
+    pS->ppNames[pS->numNames] = pName;
+    pS->pSlots[pS->numNames]  = slot;
+    pS->numNames++;
+}
+
+
+/* The slot of a name bound in this function, -1 if it isn't. */
+int VmLocal(VmScope * pS, const char * pName)
+{
+    int i;
+
+    for (i = (pS->numNames - 1); i >= 0; i--)
+    {
+        if (strcmp(pS->ppNames[i], pName) == 0) return pS->pSlots[i];
+    }
+
+    return -1;
+}
+
+
+/*
+ * The index of a free name in the function's closure, -1 if the name is
+ * bound nowhere.  The first use adds it, taken from a slot of the function
+ * around it (or from what that one captured, which then captures it too).
+ * pCaps holds where each value comes from, the slot or capture index times
+ * two plus one for a capture, VM_CLOSURE copies them in that order.
+ */
+int VmCapture(VmScope * pS, char * pName)
+{
+    Proto * pProto = pS->pProto;
+    int from;
+    int i;
+
+    if (pS->pParent == NULL) return -1;
+
+    for (i = 0; i < pProto->numCaps; i++)
+    {
+        if (strcmp(pS->ppCaps[i], pName) == 0) return i;
+    }
+
+    if ((i = VmLocal(pS->pParent, pName)) >= 0)
+    {
+        from = (i << 1);
+    }
+    else if ((i = VmCapture(pS->pParent, pName)) >= 0)
+    {
+        from = ((i << 1) | 1);
+    }
+    else
+    {
+        return -1;
+    }
+
+    if (pProto->numCaps == pS->maxCaps)
+    {
+        pS->maxCaps = (pS->maxCaps) ? (pS->maxCaps * 2) : 8;
+
+        if (((pS->ppCaps = (char **)realloc(pS->ppCaps,
+                                   (pS->maxCaps * sizeof(char *)))) == NULL) ||
+            ((pProto->pCaps = (int *)realloc(pProto->pCaps,
+                                   (pS->maxCaps * sizeof(int)))) == NULL))
+        {
+            perror("Failed to realloc memory");
+            exit(1);
+        }
+    }
+
+    pS->ppCaps[pProto->numCaps] = pName;
+    pProto->pCaps[pProto->numCaps] = from;
+
+    return pProto->numCaps++;
+}
+
+
+/* Emit the load of a name, from the env, the closure (or a builtin). */
+void VmLoadName(VmScope * pS, Token * pNode, int dst)
+{
+    Value v;
+    int i;
+
+    if ((i = VmLocal(pS, pNode->pStr)) >= 0)
+    {
+        VmEmit(pS->pProto, VM_INS(VM_LOADV, dst, 0, 0), pNode->offset);
+        VmEmit(pS->pProto, i, pNode->offset);
+        return;
+    }
+
+    if ((i = VmCapture(pS, pNode->pStr)) >= 0)
+    {
+        VmEmit(pS->pProto, VM_INS(VM_LOADC, dst, 0, 0), pNode->offset);
+        VmEmit(pS->pProto, i, pNode->offset);
+        return;
+    }
+
+    if ((i = BuiltinFind(pNode->pStr)) >= 0)
+    {
+        VmEmit(pS->pProto, VM_INS(VM_LOADG, dst, i, 0), pNode->offset);
+        return;
+    }
+
+    /* only an error if it is ever evaluated, like the CSE machine */
+    v = ValueStr(pNode->pStr, strlen(pNode->pStr));
+    VmEmit(pS->pProto, VM_INS(VM_UNDEF, dst, 0, 0), pNode->offset);
+    VmEmit(pS->pProto, VmConst(pS->pProto, v), pNode->offset);
+}
+
+
+/*
+ * The builtin a name is, -1 if it's bound or not a builtin.  A call of it
+ * is a VM_BUILTIN, there's no builtin value to load and call.
+ */
+int VmBuiltin(VmScope * pS, Token * pNode)
+{
+    if (!T_IS(pNode, T_IDENTIFIER) || (VmLocal(pS, pNode->pStr) >= 0) ||
+        (VmCapture(pS, pNode->pStr) >= 0))
+    {
+        return -1;
+    }
+
+    return BuiltinFind(pNode->pStr);
+}
+
+
+/* Bind a name to a new slot from R[reg]. */
+void VmBindName(VmScope * pS, Token * pName, int reg)
+{
+    int slot = pS->pProto->numSlots++;
+
+    VmEmit(pS->pProto, VM_INS(VM_STOREV, reg, 0, 0), pName->offset);
+    VmEmit(pS->pProto, slot, pName->offset);
+    VmScopePush(pS, pName->pStr, slot);
+}
+
+
+int VmNumChildren(Token * pNode)
+{
+    Token * pChild;
+    int n = 0;
+
+    for (pChild = T_FIRST_CHILD(pNode);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        n++;
+    }
+
+    return n;
+}
+
+
+/*
+ * The names bound by a definition, the same as the left side of the '='
+ * it standardizes to: an identifier, a ',' list, or an 'and' whose
+ * definitions' names make up the list.
+ */
+Token * VmPattern(Token * pD)
+{
+    pD = T_NODE(pD);
+
+    if ((strcmp(pD->pStr, "=") == 0) ||
+        (strcmp(pD->pStr, "function_form") == 0))
+    {
+        return T_NODE(T_FIRST_CHILD(pD));
+    }
+    else if (strcmp(pD->pStr, "within") == 0)
+    {
+        return VmPattern(T_SECOND_CHILD(pD));
+    }
+    else if (strcmp(pD->pStr, "rec") == 0)
+    {
+        return VmPattern(T_FIRST_CHILD(pD));
+    }
+
+    return pD; /* 'and' */
+}
+
+
+/*
+ * Bind the names of a pattern from R[reg].  A name nested one more tuple
+ * down (an 'and' of tuple definitions) is never visible, the same as the
+ * ',' it turns into in the ST.
+ */
+void VmBindPattern(VmScope * pS, Token * pPat, int reg)
+{
+    Token * pChild;
+    Token * pName;
+    int tmp;
+    int n;
+
+    if (T_IS(pPat, T_IDENTIFIER))
+    {
+        VmBindName(pS, pPat, reg);
+        return;
+    }
+
+    if (strcmp(pPat->pStr, "()") == 0) return;
+
+    n = VmNumChildren(pPat);
+    VmEmit(pS->pProto, VM_INS(VM_BIND, reg, (n & 0xffff), (n >> 16)),
+           pPat->offset);
+
+    tmp = VmRegAlloc(pS, pPat);
+
+    for (n = 1, pChild = T_FIRST_CHILD(pPat);
+         pChild != NULL;
+         pChild = T_NEXT(pChild), n++)
+    {
+        pName = (strcmp(pPat->pStr, "and") == 0) ? VmPattern(pChild) :
+                                                   T_NODE(pChild);
+
+        if (!T_IS(pName, T_IDENTIFIER)) continue;
+
+        if (n > 0xffff)
+        {
+            RtError(pName->offset, "too many names in a tuple binding");
+        }
+
+        VmEmit(pS->pProto, VM_INS(VM_SELECT, tmp, reg, n), pName->offset);
+        VmBindName(pS, pName, tmp);
+    }
+
+    pS->nextReg--;
+}
+
+
+void VmExpr(VmScope * pS, Token * pNode, int dst);
+void VmDefValue(VmScope * pS, Token * pD, int dst);
+
+
+
+void VmScopeFree(VmScope * pS)
+{
+    free(pS->ppNames);
+    free(pS->pSlots);
+    free(pS->ppCaps);
+    free(pS);
+}
+
+
+/* Start compiling a function whose argument (R[0]) binds pPat. */
+VmScope * VmFuncBegin(VmScope * pOuter, Token * pPat)
+{
+    VmScope * pS;
+    Proto * pProto = ProtoAlloc();
+    Token * pChild;
+
+    if ((pS = (VmScope *)calloc(1, sizeof(VmScope))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    pS->pParent = pOuter;
+    pS->pProto  = pProto;
+    pVmScope    = pS;
+
+    if (pPat)
+    {
+        if (T_IS(pPat, T_IDENTIFIER))
+        {
+            pProto->numVars = 1;
+            pProto->ppVars  = (char **)malloc(sizeof(char *));
+            pProto->ppVars[0] = pPat->pStr;
+        }
+        else
+        {
+            for (pChild = T_FIRST_CHILD(pPat);
+                 pChild != NULL;
+                 pChild = T_NEXT(pChild))
+            {
+                pProto->ppVars = (char **)realloc(pProto->ppVars,
+                                    ((pProto->numVars + 1) * sizeof(char *)));
+                pProto->ppVars[pProto->numVars++] = T_NODE(pChild)->pStr;
+            }
+        }
+
+        VmRegAlloc(pS, pPat); /* R[0] is the argument */
+        VmBindPattern(pS, pPat, 0);
+    }
+
+    return pS;
+}
+
+
+/* Code words taken by an instruction. */
+int VmInsLen(VmWord ins)
+{
+    switch (VM_OP(ins))
+    {
+    case VM_LOADK: case VM_LOADV: case VM_LOADC: case VM_STOREV:
+    case VM_UNDEF:
+    case VM_CLOSURE: case VM_REC: case VM_JMP: case VM_JMPF:
+    case VM_TUPLEN: case VM_FILL:
+        return 2;
+    default:
+        return 1;
+    }
+}
+
+
+/*
+ * Finish a function returning R[reg], returns its prototype.
+ *
+ * Any call whose result goes straight to the RET (maybe through the JMPs
+ * out of a '->' branch) is in tail position and becomes a TAILCALL, that
+ * reuses the caller's frame, so tail recursion runs in constant stack.
+ */
+Proto * VmFuncEnd(VmScope * pS, int reg, Token * pNode)
+{
+    Proto * pProto = pS->pProto;
+    VmWord * pCode;
+    int i;
+    int j;
+
+    VmEmit(pProto, VM_INS(VM_RET, reg, 0, 0), pNode->offset);
+
+    pCode = pProto->pCode;
+
+    for (i = 0; i < pProto->numCode; i += VmInsLen(pCode[i]))
+    {
+        if (VM_OP(pCode[i]) != VM_CALL) continue;
+
+        j = (i + 1);
+        while (VM_OP(pCode[j]) == VM_JMP) j = pCode[j + 1];
+
+        if ((VM_OP(pCode[j]) == VM_RET) && (VM_A(pCode[j]) == VM_A(pCode[i])))
+        {
+            pCode[i] = ((pCode[i] & ~(VmWord)0xffff) | VM_TAILCALL);
+        }
+    }
+
+    pVmScope = pS->pParent;
+    VmScopeFree(pS);
+
+    return pProto;
+}
+
+
+/* R[dst] = closure of lambda(pParam, ..., body), the params are curried. */
+void VmLambda(VmScope * pS, Token * pParam, int dst)
+{
+    VmScope * pFunc = VmFuncBegin(pS, T_NODE(pParam));
+    Proto * pProto;
+    int reg = VmRegAlloc(pFunc, pParam);
+
+    if (T_NEXT(T_NEXT(pParam))) /* more params */
+    {
+        VmLambda(pFunc, T_NEXT(pParam), reg);
+    }
+    else
+    {
+        VmExpr(pFunc, T_NEXT(pParam), reg);
+    }
+
+    pProto = VmFuncEnd(pFunc, reg, pParam);
+    pProto->memo  = T_NEXT(pParam)->memo; /* see Memo() */
+    pProto->pProf = T_NEXT(pParam)->pProf; /* see ProfMark() */
+
+    VmEmit(pS->pProto, VM_INS(VM_CLOSURE, dst, 0, 0), pParam->offset);
+    VmEmit(pS->pProto, pProto->index, pParam->offset);
+}
+
+
+/* Is the definition a function, f x = E or f = fn x. E? */
+int VmIsFunc(Token * pD)
+{
+    pD = T_NODE(pD);
+
+    return ((strcmp(pD->pStr, "function_form") == 0) ||
+            ((strcmp(pD->pStr, "=") == 0) &&
+             T_MATCH(T_NODE(T_SECOND_CHILD(pD)), T_OPERATOR, "lambda")));
+}
+
+
+/*
+ * The functions a rec defines when its definition is nothing else, one
+ * function or an 'and' of them (at most 65535), 0 otherwise.  Those are tied
+ * to themselves by VM_REC (see VmRec()) rather than through Y*.
+ */
+int VmRecFuncs(Token * pD)
+{
+    Token * pChild;
+    int n = 0;
+
+    pD = T_NODE(pD);
+
+    if (strcmp(pD->pStr, "and") != 0)
+    {
+        return (VmIsFunc(pD) && T_IS(VmPattern(pD), T_IDENTIFIER));
+    }
+
+    for (pChild = T_FIRST_CHILD(pD); pChild != NULL; pChild = T_NEXT(pChild))
+    {
+        if (!VmIsFunc(pChild) || (++n > 0xffff)) return 0;
+    }
+
+    return n;
+}
+
+
+/*
+ * R[dst] = the tuple of the children of pNode, each compiled by pValue
+ * (VmExpr() or VmDefValue()), the last one first like the CSE machine.
+ * A wide one is filled in from the end a VM_TUPLE_CHUNK at a time.
+ */
+void VmTuple(VmScope * pS, Token * pNode,
+             void (* pValue)(VmScope *, Token *, int), int dst)
+{
+    Token * pChild = T_LAST_CHILD(pNode);
+    int n = VmNumChildren(pNode);
+    int reg = pS->nextReg;
+    int first;
+    int last;
+    int i;
+
+    if (n <= VM_TUPLE_CHUNK)
+    {
+        for (i = 0; i < n; i++) VmRegAlloc(pS, pNode);
+
+        for (i = (n - 1); i >= 0; i--)
+        {
+            pValue(pS, pChild, (reg + i));
+            if (i) pChild = T_PREV(pChild);
+        }
+
+        VmEmit(pS->pProto, VM_INS(VM_TUPLE, dst, reg, n), pNode->offset);
+        pS->nextReg = reg;
+        return;
+    }
+
+    VmEmit(pS->pProto, VM_INS(VM_TUPLEN, dst, 0, 0), pNode->offset);
+    VmEmit(pS->pProto, n, pNode->offset);
+
+    for (i = 0; i < VM_TUPLE_CHUNK; i++) VmRegAlloc(pS, pNode);
+
+    for (last = n; last > 0; last = first)
+    {
+        first = (last > VM_TUPLE_CHUNK) ? (last - VM_TUPLE_CHUNK) : 0;
+
+        for (i = (last - 1); i >= first; i--)
+        {
+            pValue(pS, pChild, (reg + i - first));
+            if (i) pChild = T_PREV(pChild);
+        }
+
+        VmEmit(pS->pProto, VM_INS(VM_FILL, dst, reg, (last - first)),
+               pNode->offset);
+        VmEmit(pS->pProto, first, pNode->offset);
+    }
+
+    pS->nextReg = reg;
+}
+
+
+/* R[dst] = the value of a definition (the right side of its '='). */
+void VmDefValue(VmScope * pS, Token * pD, int dst)
+{
+    VmScope * pFunc;
+    Proto * pProto;
+    Token * pPat;
+    Token * pChild;
+    VmWord * pCode;
+    char ** ppNames;
+    int mark;
+    int slot;
+    int reg;
+    int i;
+    int n;
+
+    pD = T_NODE(pD);
+
+    if (strcmp(pD->pStr, "=") == 0)
+    {
+        VmExpr(pS, T_SECOND_CHILD(pD), dst);
+    }
+    else if (strcmp(pD->pStr, "function_form") == 0)
+    {
+        VmLambda(pS, T_SECOND_CHILD(pD), dst);
+    }
+    else if (strcmp(pD->pStr, "within") == 0)
+    {
+        mark = pS->numNames;
+        reg  = VmRegAlloc(pS, pD);
+        VmDefValue(pS, T_FIRST_CHILD(pD), reg);
+        VmBindPattern(pS, VmPattern(T_FIRST_CHILD(pD)), reg);
+        VmDefValue(pS, T_SECOND_CHILD(pD), dst);
+        pS->numNames = mark;
+        pS->nextReg--;
+    }
+    else if ((strcmp(pD->pStr, "rec") == 0) &&
+             ((n = VmRecFuncs(T_FIRST_CHILD(pD))) > 0))
+    {
+        /*
+         * The names go in slots of their own first, so the functions
+         * capture them from there, then VM_REC fills them in.
+         */
+        mark   = pS->numNames;
+        slot   = pS->pProto->numSlots;
+        pChild = T_NODE(T_FIRST_CHILD(pD));
+
+        if (strcmp(pChild->pStr, "and") == 0) pChild = T_FIRST_CHILD(pChild);
+
+        if ((ppNames = (char **)malloc(n * sizeof(char *))) == NULL)
+        {
+            perror("Failed to malloc memory");
+            exit(1);
+        }
+
+        /* a name nested in a tuple is never visible, its slot is unnamed */
+        for (i = 0; i < n; i++, pChild = T_NEXT(pChild))
+        {
+            pPat = VmPattern(pChild);
+            ppNames[i] = pPat->pStr;
+
+            if (T_IS(pPat, T_IDENTIFIER))
+            {
+                VmScopePush(pS, pPat->pStr, pS->pProto->numSlots);
+            }
+
+            pS->pProto->numSlots++;
+        }
+
+        reg = pS->pProto->numCode;
+        VmDefValue(pS, T_FIRST_CHILD(pD), dst);
+
+        /* the functions print as the eta of the rec's names */
+        for (pCode = pS->pProto->pCode;
+             reg < pS->pProto->numCode;
+             reg += VmInsLen(pCode[reg]))
+        {
+            if (VM_OP(pCode[reg]) != VM_CLOSURE) continue;
+
+            pProto = ppProtos[pCode[reg + 1]];
+            pProto->numRecVars = n;
+            pProto->ppRecVars  = (char **)malloc(n * sizeof(char *));
+            memcpy(pProto->ppRecVars, ppNames, (n * sizeof(char *)));
+        }
+
+        free(ppNames);
+        VmEmit(pS->pProto, VM_INS(VM_REC, dst, 0, n), pD->offset);
+        VmEmit(pS->pProto, slot, pD->offset);
+        pS->numNames = mark;
+    }
+    else if (strcmp(pD->pStr, "rec") == 0) /* Y* (fn X. E) */
+    {
+        pFunc = VmFuncBegin(pS, VmPattern(pD));
+        reg   = VmRegAlloc(pFunc, pD);
+        VmDefValue(pFunc, T_FIRST_CHILD(pD), reg);
+        pProto = VmFuncEnd(pFunc, reg, pD);
+
+        VmEmit(pS->pProto, VM_INS(VM_CLOSURE, dst, 0, 0), pD->offset);
+        VmEmit(pS->pProto, pProto->index, pD->offset);
+        VmEmit(pS->pProto, VM_INS(VM_FIX, dst, dst, 0), pD->offset);
+    }
+    else /* 'and', a tuple of the values */
+    {
+        VmTuple(pS, pD, VmDefValue, dst);
+    }
+}
+
+
+/* let/where: bind the definition then compile the body. */
+void VmLet(VmScope * pS, Token * pD, Token * pE, int dst)
+{
+    int mark = pS->numNames;
+    int reg  = VmRegAlloc(pS, pD);
+
+    VmDefValue(pS, pD, reg);
+    VmBindPattern(pS, VmPattern(pD), reg);
+    pS->nextReg--;
+
+    VmExpr(pS, pE, dst);
+    pS->numNames = mark;
+}
+
+
+/* Compile an expression into R[dst]. */
+void VmExpr(VmScope * pS, Token * pNode, int dst)
+{
+    Proto * pProto = pS->pProto;
+    Token * pChild;
+    Value v;
+    int jmpf;
+    int jmp;
+    int reg;
+    int i;
+
+    pNode = T_NODE(pNode);
+
+    switch (pNode->type)
+    {
+    case T_INTEGER:
+
+        v = ValueIntLiteral(pNode->pStr);
+        VmEmit(pProto, VM_INS(VM_LOADK, dst, 0, 0), pNode->offset);
+        VmEmit(pProto, VmConst(pProto, v), pNode->offset);
+        return;
+
+    case T_STRING:
+
+        v = ValueStrLiteral(pNode->pStr);
+        VmEmit(pProto, VM_INS(VM_LOADK, dst, 0, 0), pNode->offset);
+        VmEmit(pProto, VmConst(pProto, v), pNode->offset);
+        return;
+
+    case T_IDENTIFIER:
+
+        VmLoadName(pS, pNode, dst);
+        return;
+
+    case T_KEYWORD:
+
+        if (strcmp(pNode->pStr, "let") == 0) break;
+
+        if (strcmp(pNode->pStr, "<nil>") == 0)
+        {
+            v = ValueTuple(0);
+        }
+        else if (strcmp(pNode->pStr, "<dummy>") == 0)
+        {
+            v = RT_DUMMY;
+        }
+        else
+        {
+            v = ValueTruth(strcmp(pNode->pStr, "<true>") == 0);
+        }
+
+        VmEmit(pProto, VM_INS(VM_LOADK, dst, 0, 0), pNode->offset);
+        VmEmit(pProto, VmConst(pProto, v), pNode->offset);
+        return;
+
+    default:
+
+        break;
+    }
+
+    if (strcmp(pNode->pStr, "let") == 0)
+    {
+        VmLet(pS, T_FIRST_CHILD(pNode), T_SECOND_CHILD(pNode), dst);
+    }
+    else if (strcmp(pNode->pStr, "where") == 0)
+    {
+        VmLet(pS, T_SECOND_CHILD(pNode), T_FIRST_CHILD(pNode), dst);
+    }
+    else if (strcmp(pNode->pStr, "lambda") == 0)
+    {
+        VmLambda(pS, T_FIRST_CHILD(pNode), dst);
+    }
+    else if (strcmp(pNode->pStr, "gamma") == 0)
+    {
+        pChild = T_NODE(T_FIRST_CHILD(pNode));
+
+        if ((i = VmBuiltin(pS, pChild)) >= 0) /* no builtin value to call */
+        {
+            VmExpr(pS, T_SECOND_CHILD(pNode), dst);
+            VmEmit(pProto, VM_INS(VM_BUILTIN, dst, i, dst), pNode->offset);
+            return;
+        }
+
+        reg = VmRegAlloc(pS, pNode);
+        VmExpr(pS, T_SECOND_CHILD(pNode), reg);
+
+        if (T_MATCH(pChild, T_OPERATOR, "gamma") &&
+            (VmBuiltin(pS, T_NODE(T_FIRST_CHILD(pChild))) == B_CONC) &&
+            (pChild->offset == pNode->offset)) /* Conc E1 E2 */
+        {
+            VmExpr(pS, T_SECOND_CHILD(pChild), dst);
+            VmEmit(pProto, VM_INS(VM_CONC, dst, dst, reg), pNode->offset);
+        }
+        else
+        {
+            VmExpr(pS, pChild, dst);
+            VmEmit(pProto, VM_INS(VM_CALL, dst, dst, reg), pNode->offset);
+        }
+
+        pS->nextReg--;
+    }
+    else if (strcmp(pNode->pStr, "@") == 0) /* E1 @N E2 => N E1 E2 */
+    {
+        /* N E1 is at N and the rest at the '@', as on the CSE machine */
+        pChild = T_FIRST_CHILD(pNode);
+        reg    = VmRegAlloc(pS, pNode);
+        VmRegAlloc(pS, pNode);
+        VmExpr(pS, T_NEXT(T_NEXT(pChild)), (reg + 1));
+        VmExpr(pS, pChild, reg);
+        VmExpr(pS, T_NEXT(pChild), dst);
+        VmEmit(pProto, VM_INS(VM_CALL, dst, dst, reg), T_NEXT(pChild)->offset);
+        VmEmit(pProto, VM_INS(VM_CALL, dst, dst, (reg + 1)), pNode->offset);
+        pS->nextReg -= 2;
+    }
+    else if (strcmp(pNode->pStr, "->") == 0)
+    {
+        pChild = T_FIRST_CHILD(pNode);
+        VmExpr(pS, pChild, dst);
+        VmEmit(pProto, VM_INS(VM_JMPF, dst, 0, 0), pNode->offset);
+        jmpf = VmEmit(pProto, 0, pNode->offset);
+        VmExpr(pS, T_NEXT(pChild), dst);
+        VmEmit(pProto, VM_INS(VM_JMP, 0, 0, 0), pNode->offset);
+        jmp = VmEmit(pProto, 0, pNode->offset);
+        pProto->pCode[jmpf] = pProto->numCode;
+        VmExpr(pS, T_NEXT(T_NEXT(pChild)), dst);
+        pProto->pCode[jmp] = pProto->numCode;
+    }
+    else if (strcmp(pNode->pStr, "tau") == 0)
+    {
+        VmTuple(pS, pNode, VmExpr, dst);
+    }
+    else
+    {
+        for (i = 0; rtOps[i].pName; i++)
+        {
+            if (strcmp(pNode->pStr, rtOps[i].pName) == 0) break;
+        }
+
+        if (!rtOps[i].pName)
+        {
+            RtError(pNode->offset, "can't compile (%s)", pNode->pStr);
+        }
+
+        pChild = T_FIRST_CHILD(pNode);
+
+        if (rtOps[i].op >= OP_NOT)
+        {
+            VmExpr(pS, pChild, dst);
+            VmEmit(pProto, VM_INS((VM_ADD + rtOps[i].op), dst, dst, 0),
+                   pNode->offset);
+        }
+        else
+        {
+            reg = VmRegAlloc(pS, pNode);
+            VmExpr(pS, T_NEXT(pChild), reg);
+            VmExpr(pS, pChild, dst);
+            VmEmit(pProto, VM_INS((VM_ADD + rtOps[i].op), dst, dst, reg),
+                   pNode->offset);
+            pS->nextReg--;
+        }
+    }
+}
+
+
+/* Free the prototypes and the VM stacks. */
+void VmFree(void)
+{
+    VmScope * pS;
+    int i;
+
+    /* the functions a compile error stopped in the middle of */
+    while ((pS = pVmScope) != NULL)
+    {
+        pVmScope = pS->pParent;
+        VmScopeFree(pS);
+    }
+
+    for (i = 0; i < numProtos; i++)
+    {
+        free(ppProtos[i]->ppVars);
+        free(ppProtos[i]->ppRecVars);
+        free(ppProtos[i]->pCaps);
+        free(ppProtos[i]->pCode);
+        free(ppProtos[i]->pOffsets);
+        free(ppProtos[i]->pConsts);
+        free(ppProtos[i]);
+    }
+
+    free(ppProtos);
+    free(vmStack);
+    free(vmFrames);
+    ppProtos    = NULL;
+    vmStack     = NULL;
+    vmFrames    = NULL;
+    numProtos   = maxProtos   = 0;
+    vmMaxStack  = 0;
+    vmHighStack = 0;
+    vmNumFrames = vmMaxFrames = 0;
+    vmLowFrames = 0;
+    vmFrameCap  = 0;
+}
+
+
+#define VM_OFFSET() (pP->pOffsets[pc - pP->pCode - 1])
+
+/* collect if due, the calls are the safe points */
+#define VM_SAFEPOINT()         \
+    if (gcPending)             \
+    {                          \
+        pF->pc = pc;           \
+        GcCollect();           \
+        pEnv = pF->pEnv;       \
+    }
+
+/* a call of a profiled function starts (--profile) */
+#define VM_PROF_ENTER(pF)                                  \
+    if ((pF)->pProto->pProf)                               \
+    {                                                      \
+        (pF)->prof = ProfEnter((pF)->pProto->pProf);       \
+    }
+
+#if defined(__GNUC__)
+#define VM_CASE(op)   L_##op
+#define VM_DISPATCH() ins = *pc++; goto *vmLabels[VM_OP(ins)]
+#else
+#define VM_CASE(op)   case op
+#define VM_DISPATCH() continue
+#endif
+
+/*
+ * Immediate int op immediate int fast path, anything else goes through
+ * BinOp().  The tag doesn't change the order, the tagged words are compared
+ * as they are.
+ */
+#define VM_ARITH(op, expr)                                           \
+    a = R[VM_B(ins)];                                                \
+    b = R[VM_C(ins)];                                                \
+    if (V_IS_SMALL(a & b))                                           \
+    {                                                                \
+        R[VM_A(ins)] = expr;                                         \
+    }                                                                \
+    else                                                             \
+    {                                                                \
+        R[VM_A(ins)] = BinOp(VM_OFFSET(), (op - VM_ADD), a, b);      \
+    }                                                                \
+    VM_DISPATCH()
+
+
+/* Run the main prototype. */
+void VmExec(Proto * pMain)
+{
+#if defined(__GNUC__)
+    static void * vmLabels[VM_NUM_OPS] =
+    {
+        &&L_VM_LOADK, &&L_VM_LOADV, &&L_VM_LOADC, &&L_VM_STOREV,
+        &&L_VM_LOADG, &&L_VM_UNDEF, &&L_VM_CLOSURE, &&L_VM_FIX,
+        &&L_VM_REC, &&L_VM_CALL, &&L_VM_TAILCALL, &&L_VM_BUILTIN,
+        &&L_VM_CONC, &&L_VM_RET,
+        &&L_VM_TUPLE, &&L_VM_TUPLEN, &&L_VM_FILL,
+        &&L_VM_BIND, &&L_VM_SELECT, &&L_VM_JMP, &&L_VM_JMPF,
+        &&L_VM_ADD, &&L_VM_SUB, &&L_VM_MUL, &&L_VM_DIV, &&L_VM_POW,
+        &&L_VM_GR, &&L_VM_GE, &&L_VM_LS, &&L_VM_LE, &&L_VM_EQ, &&L_VM_NE,
+        &&L_VM_AND, &&L_VM_OR, &&L_VM_AUG, &&L_VM_NOT, &&L_VM_NEG
+    };
+#endif
+    VmFrame * pF;
+    Proto * pP;
+    Proto * pMemo;
+    VmWord * pc;
+    VmWord ins;
+    Value * R;
+    Env * pEnv;
+    Value a;
+    Value b;
+    Value f;
+    Value arg;
+    long n;
+    int ret;
+    int eta;
+    int prof;
+    int i;
+
+    pF = VM_CALL_FRAME(pMain, NULL, 0, 0, RT_DUMMY);
+
+load:
+
+    pP   = pF->pProto;
+    pc   = pF->pc;
+    R    = (vmStack + pF->base);
+    pEnv = pF->pEnv;
+
+#if defined(__GNUC__)
+    VM_DISPATCH();
+#else
+    for (;;)
+    {
+        ins = *pc++;
+
+        switch (VM_OP(ins))
+        {
+#endif
+
+    VM_CASE(VM_LOADK):
+
+        R[VM_A(ins)] = pP->pConsts[*pc++];
+        VM_DISPATCH();
+
+    VM_CASE(VM_LOADV):
+
+        R[VM_A(ins)] = pEnv->v[*pc++];
+        VM_DISPATCH();
+
+    VM_CASE(VM_LOADC):
+
+        R[VM_A(ins)] = pF->pClosure->v[*pc++];
+        VM_DISPATCH();
+
+    VM_CASE(VM_STOREV):
+
+        a = R[VM_A(ins)];
+        pEnv->v[*pc++] = a;
+        GC_WRITE_BARRIER(pEnv, a);
+        VM_DISPATCH();
+
+    VM_CASE(VM_LOADG):
+
+        R[VM_A(ins)] = (Value)&builtins[VM_B(ins)];
+        VM_DISPATCH();
+
+    VM_CASE(VM_UNDEF):
+
+        pc++;
+        RtError(VM_OFFSET(), "undeclared identifier (%s)",
+                V_PSTR(pP->pConsts[pc[-1]])->s);
+        VM_DISPATCH();
+
+    VM_CASE(VM_CLOSURE):
+
+        R[VM_A(ins)] = VmClosure(ppProtos[*pc++], pF);
+        VM_DISPATCH();
+
+    VM_CASE(VM_FIX):
+
+        R[VM_A(ins)] = VmFix(R[VM_B(ins)]);
+        VM_DISPATCH();
+
+    VM_CASE(VM_REC):
+
+        VmRec(R[VM_A(ins)], pF, *pc++, VM_C(ins));
+        VM_DISPATCH();
+
+    VM_CASE(VM_BUILTIN):
+
+        R[VM_A(ins)] = BuiltinCall(VM_OFFSET(), VM_B(ins), R[VM_C(ins)]);
+        VM_DISPATCH();
+
+    VM_CASE(VM_CONC):
+
+        R[VM_A(ins)] = BuiltinConc(VM_OFFSET(), R[VM_B(ins)], R[VM_C(ins)]);
+        VM_DISPATCH();
+
+    VM_CASE(VM_CALL):
+
+        VM_SAFEPOINT();
+        f   = R[VM_B(ins)];
+        arg = R[VM_C(ins)];
+        ret = (pF->base + VM_A(ins));
+
+apply: /* f arg, the result goes to vmStack[ret] */
+
+        switch (V_TYPE(f))
+        {
+        case V_CLOSURE:
+        case V_ETA:
+
+            pF->pc = pc;
+            i = (pF->base + pP->numRegs);
+
+            if (V_IS(f, V_ETA)) /* f f arg */
+            {
+                pF = VM_CALL_FRAME(V_PCLOSURE(f)->pProto,
+                                   V_PCLOSURE(f), i, ret, f);
+                pF->eta = 1;
+                pF->arg = arg;
+                VM_PROF_ENTER(pF);
+                goto load;
+            }
+
+            pMemo = V_PCLOSURE(f)->pProto;
+            n     = -1;
+
+            /* a cached result instead of the call (see MemoFind()) */
+            if (pMemo->memo && ((n = MemoFind(pMemo, arg, &a)) == 1))
+            {
+                vmStack[ret] = a;
+                break;
+            }
+
+            pF = VM_CALL_FRAME(pMemo, V_PCLOSURE(f), i, ret, arg);
+            VM_PROF_ENTER(pF);
+
+            if (n == 0)
+            {
+                pF->pMemo = pMemo;
+                pF->memo  = arg;
+            }
+
+            goto load;
+
+        case V_TUPLE:
+
+            if (!V_IS_SMALL(arg) || (V_SMALL(arg) < 1) ||
+                (V_SMALL(arg) > V_TUPLE_NUM(f)))
+            {
+                RtError(VM_OFFSET(), "bad tuple selection");
+            }
+
+            vmStack[ret] = V_TUPLE_V(f)[V_SMALL(arg) - 1];
+            break;
+
+        case V_BUILTIN:
+
+            a = BuiltinApply(VM_OFFSET(), V_PBUILTIN(f), arg);
+            vmStack[ret] = a;
+            break;
+
+        default:
+
+            RtError(VM_OFFSET(), "can't apply a non-function");
+        }
+
+        VM_DISPATCH();
+
+    VM_CASE(VM_TAILCALL):
+
+        VM_SAFEPOINT();
+        f   = R[VM_B(ins)];
+        arg = R[VM_C(ins)];
+        n   = -1;
+
+        /*
+         * A cached result is returned straight away.  Otherwise the
+         * frame's result is still cached for its call, unless the eta
+         * apply below takes it over.
+         */
+        if (V_IS(f, V_CLOSURE) && V_PCLOSURE(f)->pProto->memo &&
+            !pF->pMemo &&
+            ((n = MemoFind(V_PCLOSURE(f)->pProto, arg, &a)) == 1))
+        {
+            goto leave;
+        }
+
+        /* a pending eta apply can't be stacked, call it the usual way */
+        if (V_IS(f, V_CLOSURE) || (V_IS(f, V_ETA) && !pF->eta))
+        {
+            ret   = pF->ret;
+            eta   = pF->eta;
+            a     = pF->arg;
+            i     = pF->base;
+            pMemo = pF->pMemo;
+            b     = pF->memo;
+            prof  = pF->prof;
+
+            vmNumFrames--;
+
+            if (V_IS(f, V_ETA)) /* f f arg */
+            {
+                pF = VM_CALL_FRAME(V_PCLOSURE(f)->pProto,
+                                   V_PCLOSURE(f), i, ret, f);
+                pF->eta = 1;
+                pF->arg = arg;
+            }
+            else
+            {
+                pF = VM_CALL_FRAME(V_PCLOSURE(f)->pProto,
+                                   V_PCLOSURE(f), i, ret, arg);
+                pF->eta = eta;
+                pF->arg = a;
+
+                if (pMemo)
+                {
+                    pF->pMemo = pMemo;
+                    pF->memo  = b;
+                }
+                else if (n == 0)
+                {
+                    pF->pMemo = pF->pProto;
+                    pF->memo  = arg;
+                }
+            }
+
+            /* a tail call out of a function leaves it (see ProfTail()) */
+            if (pF->pProto->pProf) prof = ProfTail(pF->pProto->pProf, prof);
+            pF->prof = prof;
+            goto load;
+        }
+
+        ret = (pF->base + VM_A(ins));
+        goto apply;
+
+    VM_CASE(VM_RET):
+
+        a = R[VM_A(ins)];
+
+leave: /* return a */
+
+        if (pF->pMemo) MemoStore(pF->pMemo, pF->memo, a);
+
+        if (pF->prof) ProfLeave();
+
+        ret = pF->ret;
+        eta = pF->eta;
+        arg = pF->arg;
+
+        if (--vmNumFrames == 0) return;
+        if (vmNumFrames < vmLowFrames) vmLowFrames = vmNumFrames;
+
+        pF = &vmFrames[vmNumFrames - 1];
+        pP = pF->pProto;
+        pc = pF->pc;
+        R  = (vmStack + pF->base);
+        pEnv = pF->pEnv;
+
+        if (eta)
+        {
+            f = a;
+            goto apply;
+        }
+
+        vmStack[ret] = a;
+        VM_DISPATCH();
+
+    VM_CASE(VM_TUPLE):
+
+        a = ValueTuple(VM_C(ins));
+
+        for (i = 0; i < (int)VM_C(ins); i++)
+        {
+            V_PTUPLE(a)->v[i] = R[VM_B(ins) + i];
+        }
+
+        R[VM_A(ins)] = a;
+        VM_DISPATCH();
+
+    VM_CASE(VM_TUPLEN):
+
+        R[VM_A(ins)] = TupleEmpty(*pc++);
+        VM_DISPATCH();
+
+    VM_CASE(VM_FILL):
+
+        TupleFill(R[VM_A(ins)], *pc++, (R + VM_B(ins)), VM_C(ins));
+        VM_DISPATCH();
+
+    VM_CASE(VM_BIND):
+
+        a = R[VM_A(ins)];
+        i = VM_BX(ins);
+
+        if (!V_IS(a, V_TUPLE) || (V_TUPLE_NUM(a) != i))
+        {
+            RtError(VM_OFFSET(), "expected a tuple of %d values", i);
+        }
+
+        VM_DISPATCH();
+
+    VM_CASE(VM_SELECT):
+
+        R[VM_A(ins)] = V_TUPLE_V(R[VM_B(ins)])[VM_C(ins) - 1];
+        VM_DISPATCH();
+
+    VM_CASE(VM_JMP):
+
+        pc = (pP->pCode + *pc);
+        VM_DISPATCH();
+
+    VM_CASE(VM_JMPF):
+
+        a = R[VM_A(ins)];
+
+        if (!V_IS(a, V_TRUTH))
+        {
+            pc++;
+            RtError(VM_OFFSET(), "'->' condition is not a truthvalue");
+        }
+
+        pc = V_BOOL(a) ? (pc + 1) : (pP->pCode + *pc);
+        VM_DISPATCH();
+
+    VM_CASE(VM_ADD): VM_ARITH(VM_ADD, ValueInt(V_SMALL(a) + V_SMALL(b)));
+    VM_CASE(VM_SUB): VM_ARITH(VM_SUB, ValueInt(V_SMALL(a) - V_SMALL(b)));
+    VM_CASE(VM_GR):  VM_ARITH(VM_GR,  ValueTruth((long)a >  (long)b));
+    VM_CASE(VM_GE):  VM_ARITH(VM_GE,  ValueTruth((long)a >= (long)b));
+    VM_CASE(VM_LS):  VM_ARITH(VM_LS,  ValueTruth((long)a <  (long)b));
+    VM_CASE(VM_LE):  VM_ARITH(VM_LE,  ValueTruth((long)a <= (long)b));
+    VM_CASE(VM_EQ):  VM_ARITH(VM_EQ,  ValueTruth(a == b));
+    VM_CASE(VM_NE):  VM_ARITH(VM_NE,  ValueTruth(a != b));
+
+    VM_CASE(VM_MUL):
+
+        a = R[VM_B(ins)];
+        b = R[VM_C(ins)];
+
+        if (V_IS_SMALL(a & b) && INT_MUL_OK(V_SMALL(a), V_SMALL(b), &n))
+        {
+            R[VM_A(ins)] = ValueInt(n);
+        }
+        else
+        {
+            R[VM_A(ins)] = BinOp(VM_OFFSET(), (VM_MUL - VM_ADD), a, b);
+        }
+
+        VM_DISPATCH();
+
+    VM_CASE(VM_DIV):
+    VM_CASE(VM_POW):
+    VM_CASE(VM_AND):
+    VM_CASE(VM_OR):
+    VM_CASE(VM_AUG):
+
+        R[VM_A(ins)] = BinOp(VM_OFFSET(), (VM_OP(ins) - VM_ADD),
+                             R[VM_B(ins)], R[VM_C(ins)]);
+        VM_DISPATCH();
+
+    VM_CASE(VM_NOT):
+
+        a = R[VM_B(ins)];
+
+        if (!V_IS(a, V_TRUTH))
+        {
+            RtError(VM_OFFSET(), "not applied to a non-truthvalue");
+        }
+
+        R[VM_A(ins)] = ValueTruth(!V_BOOL(a));
+        VM_DISPATCH();
+
+    VM_CASE(VM_NEG):
+
+        a = R[VM_B(ins)];
+
+        if (!V_IS(a, V_INT))
+        {
+            RtError(VM_OFFSET(), "neg applied to a non-integer");
+        }
+
+        R[VM_A(ins)] = IntNeg(a);
+        VM_DISPATCH();
+
+#if !defined(__GNUC__)
+        }
+    }
+#endif
+}
+
+
+/* Compile and run the AST rooted at pRoot on the VM, see Evaluate(). */
+void VmRun(Token * pRoot)
+{
+    VmScope * pMain;
+    Proto * pProto;
+    jmp_buf jmp;
+    int reg;
+
+    BuiltinInit();
+    RtStart();
+    if (pProfFile) ProfStart();
+
+    if (setjmp(jmp) == 0)
+    {
+        pRtJmp = &jmp;
+        pMain  = VmFuncBegin(NULL, NULL);
+        reg    = VmRegAlloc(pMain, pRoot);
+        VmExpr(pMain, pRoot, reg);
+        pProto = VmFuncEnd(pMain, reg, pRoot);
+
+        GcInit();
+        VmExec(pProto);
+        printf("\n");
+    }
+
+    pRtJmp = NULL;
+    if (pProfFile) ProfReport();
+
+    if (gcLive) GcFree();
+    VmFree();
+    ArenaFree();
+}
+
+
+/*
+ * C backend (-c).  The program is compiled for the VM and each prototype's
+ * bytecode is then translated to a C function, a statement or two per
+ * instruction over the same registers, with the runtime (rpal_rt.h) doing
+ * everything else.  The output builds into a native executable:
+ *
+ *   % rpal -c fib.c fib && gcc -O2 -pthread -I<rpal> fib.c -o fib
+ *
+ * There's no dispatch, the operands are constants and the C compiler keeps
+ * the values it can in machine registers.
+ */
+char * pCFile = NULL; /* -c */
+
+/* BinOp() operator of VM_ADD..VM_AUG */
+const char * cgOps[] =
+{
+    "OP_PLUS", "OP_MINUS", "OP_MUL", "OP_DIV", "OP_POW",
+    "OP_GR", "OP_GE", "OP_LS", "OP_LE", "OP_EQ", "OP_NE",
+    "OP_AND", "OP_OR", "OP_AUG"
+};
+
+/* immediate int fast path of VM_ADD..VM_NE, NULL for none (see VmExec()) */
+const char * cgFast[] =
+{
+    "ValueInt(V_SMALL(a) + V_SMALL(b))", "ValueInt(V_SMALL(a) - V_SMALL(b))",
+    NULL, NULL, NULL,
+    "ValueTruth((long)a > (long)b)", "ValueTruth((long)a >= (long)b)",
+    "ValueTruth((long)a < (long)b)", "ValueTruth((long)a <= (long)b)",
+    "ValueTruth(a == b)", "ValueTruth(a != b)"
+};
+
+
+/* Write len bytes of pStr as a C string literal. */
+void CgString(FILE * pOut, const char * pStr, int len)
+{
+    int i;
+
+    fputc('"', pOut);
+
+    for (i = 0; i < len; i++)
+    {
+        unsigned char c = (unsigned char)pStr[i];
+
+        if ((c == '"') || (c == '\\')) fprintf(pOut, "\\%c", c);
+        else if (c == '\n')            fprintf(pOut, "\\n");
+        else if (c == '\t')            fprintf(pOut, "\\t");
+        else if ((c < ' ') || (c > '~')) fprintf(pOut, "\\%03o", c);
+        else                           fputc(c, pOut);
+    }
+
+    fputc('"', pOut);
+}
+
+
+/* Write constant k of pProto as a C expression. */
+void CgConst(FILE * pOut, Proto * pProto, int k)
+{
+    Value v = pProto->pConsts[k];
+
+    if (V_IS_SMALL(v))
+    {
+        fprintf(pOut, "V_INT_SMALL(%ldL)", V_SMALL(v));
+    }
+    else if (v == RT_TRUE)  fprintf(pOut, "RT_TRUE");
+    else if (v == RT_FALSE) fprintf(pOut, "RT_FALSE");
+    else if (v == RT_NIL)   fprintf(pOut, "RT_NIL");
+    else if (v == RT_DUMMY) fprintf(pOut, "RT_DUMMY");
+    else                    fprintf(pOut, "K%d[%d]", pProto->index, k);
+}
+
+
+/* Does constant k of pProto live on the heap (made by the load function)? */
+int CgHeapConst(Proto * pProto, int k)
+{
+    Value v = pProto->pConsts[k];
+
+    return (!V_IS_SMALL(v) && !(v & V_TAG_IMM));
+}
+
+
+/* Write the code to make heap constant k of pProto, at load time. */
+void CgLoadConst(FILE * pOut, Proto * pProto, int k)
+{
+    Value v = pProto->pConsts[k];
+    char * pStr;
+    int len;
+
+    fprintf(pOut, "    K%d[%d] = ", pProto->index, k);
+
+    if (V_IS(v, V_STR))
+    {
+        fprintf(pOut, "ValueStr(");
+        CgString(pOut, V_PSTR(v)->s, V_PSTR(v)->len);
+        fprintf(pOut, ", %d);\n", V_PSTR(v)->len);
+        return;
+    }
+
+    pStr = IntStr(v, &len); /* a big integer */
+
+    if (pStr[0] == '-') fprintf(pOut, "IntNeg(ValueIntLiteral(\"%s\"));\n",
+                                (pStr + 1));
+    else                fprintf(pOut, "ValueIntLiteral(\"%s\");\n", pStr);
+
+    free(pStr);
+}
+
+
+/*
+ * Does pProto need a real environment?  Only a closure made in the call
+ * reads it (see VmClosure()), otherwise its slots are kept as registers
+ * after the others, R[numRegs + slot], and the call allocates nothing.
+ */
+int CgNeedsEnv(Proto * pProto)
+{
+    int pc;
+
+    for (pc = 0; pc < pProto->numCode; pc += VmInsLen(pProto->pCode[pc]))
+    {
+        if (VM_OP(pProto->pCode[pc]) == VM_CLOSURE) return 1;
+    }
+
+    return 0;
+}
+
+
+/* Write pProto's bytecode as the C function F<index>. */
+void CgFunc(FILE * pOut, Proto * pProto, int isMain)
+{
+    VmWord * pCode = pProto->pCode;
+    char * pTarget;
+    char slot[32];
+    VmWord ins;
+    unsigned int off;
+    unsigned int k;
+    int needEnv = CgNeedsEnv(pProto);
+    int useEnv = 0;
+    int useCaps = 0;
+    int useA = 0;
+    int useB = 0;
+    int useN = 0;
+    int op;
+    int pc;
+    int i;
+
+    if ((pTarget = (char *)calloc((pProto->numCode + 1), 1)) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    for (pc = 0; pc < pProto->numCode; pc += VmInsLen(pCode[pc]))
+    {
+        switch (VM_OP(pCode[pc]))
+        {
+        case VM_LOADV:  useEnv = needEnv; break;
+        case VM_STOREV: useEnv = needEnv; useA = 1; break;
+        case VM_LOADC:  useCaps = 1; break;
+        case VM_JMP:    pTarget[pCode[pc + 1]] = 1; break;
+        case VM_JMPF:   pTarget[pCode[pc + 1]] = useA = 1; break;
+        case VM_TAILCALL: pTarget[0] = !isMain; useA = 1; break;
+        case VM_CALL: case VM_TUPLE: case VM_BIND: case VM_NOT: case VM_NEG:
+            useA = 1;
+            break;
+        case VM_LOADK: case VM_LOADG: case VM_UNDEF: case VM_CLOSURE:
+        case VM_FIX: case VM_REC: case VM_RET: case VM_SELECT:
+        case VM_BUILTIN: case VM_CONC: case VM_TUPLEN: case VM_FILL:
+            break;
+        default: /* the binary operators */
+            useA = useB = 1;
+            if (VM_OP(pCode[pc]) == VM_MUL) useN = 1;
+            break;
+        }
+    }
+
+    fprintf(pOut, "static Value F%d(void)\n{\n", pProto->index);
+    fprintf(pOut, "    int fr = (vmNumFrames - 1);\n");
+    fprintf(pOut, "    Value * R = (vmStack + vmFrames[fr].base);\n");
+    if (useEnv)  fprintf(pOut, "    Env * pEnv = vmFrames[fr].pEnv;\n");
+    if (useCaps) fprintf(pOut, "    Closure * pC = vmFrames[fr].pClosure;\n");
+    if (useA)    fprintf(pOut, "    Value a;\n");
+    if (useB)    fprintf(pOut, "    Value b;\n");
+    if (useN)    fprintf(pOut, "    long n;\n");
+    fprintf(pOut, "\n");
+
+    for (pc = 0; pc < pProto->numCode; pc += VmInsLen(ins))
+    {
+        ins = pCode[pc];
+        op  = VM_OP(ins);
+        off = pProto->pOffsets[pc + VmInsLen(ins) - 1]; /* as VM_OFFSET() */
+        k   = (VmInsLen(ins) == 2) ? (unsigned int)pCode[pc + 1] : 0;
+
+        if (pTarget[pc]) fprintf(pOut, "L%d:\n", pc);
+
+        if ((op == VM_LOADV) || (op == VM_STOREV))
+        {
+            if (needEnv) snprintf(slot, sizeof(slot), "pEnv->v[%u]",
+                                  k);
+            else         snprintf(slot, sizeof(slot), "R[%u]",
+                                  (pProto->numRegs + k));
+        }
+
+        switch (op)
+        {
+        case VM_LOADK:
+
+            fprintf(pOut, "    R[%u] = ", VM_A(ins));
+            CgConst(pOut, pProto, k);
+            fprintf(pOut, ";\n");
+            break;
+
+        case VM_LOADV:
+
+            fprintf(pOut, "    R[%u] = %s;\n", VM_A(ins), slot);
+            break;
+
+        case VM_LOADC:
+
+            fprintf(pOut, "    R[%u] = pC->v[%u];\n", VM_A(ins),
+                    k);
+            break;
+
+        case VM_STOREV:
+
+            fprintf(pOut, "    a = R[%u];\n", VM_A(ins));
+            fprintf(pOut, "    %s = a;\n", slot);
+            if (needEnv) fprintf(pOut, "    GC_WRITE_BARRIER(pEnv, a);\n");
+            break;
+
+        case VM_LOADG:
+
+            fprintf(pOut, "    R[%u] = (Value)&builtins[%u];\n", VM_A(ins),
+                    VM_B(ins));
+            break;
+
+        case VM_UNDEF:
+
+            fprintf(pOut, "    RtError(%u, \"undeclared identifier (%%s)\", ",
+                    off);
+            CgString(pOut, V_PSTR(pProto->pConsts[k])->s,
+                     V_PSTR(pProto->pConsts[k])->len);
+            fprintf(pOut, ");\n");
+            break;
+
+        case VM_CLOSURE:
+
+            fprintf(pOut, "    R[%u] = VmClosure(&P%u, &vmFrames[fr]);\n",
+                    VM_A(ins), k);
+            break;
+
+        case VM_FIX:
+
+            fprintf(pOut, "    R[%u] = VmFix(R[%u]);\n", VM_A(ins),
+                    VM_B(ins));
+            break;
+
+        case VM_REC:
+
+            fprintf(pOut, "    VmRec(R[%u], &vmFrames[fr], %u, %u);\n",
+                    VM_A(ins), k, VM_C(ins));
+            break;
+
+        case VM_BUILTIN:
+
+            fprintf(pOut, "    R[%u] = BuiltinCall(%u, %u, R[%u]);\n",
+                    VM_A(ins), off, VM_B(ins), VM_C(ins));
+            break;
+
+        case VM_CONC:
+
+            fprintf(pOut, "    R[%u] = BuiltinConc(%u, R[%u], R[%u]);\n",
+                    VM_A(ins), off, VM_B(ins), VM_C(ins));
+            break;
+
+        case VM_CALL:
+
+            /* the callee may collect, the env and captures move */
+            fprintf(pOut, "    RT_SAFEPOINT();\n");
+            fprintf(pOut, "    a = RtCall(R[%u], R[%u], %u);\n", VM_B(ins),
+                    VM_C(ins), off);
+            fprintf(pOut, "    R = (vmStack + vmFrames[fr].base);\n");
+            if (useEnv)  fprintf(pOut, "    pEnv = vmFrames[fr].pEnv;\n");
+            if (useCaps) fprintf(pOut, "    pC = vmFrames[fr].pClosure;\n");
+            fprintf(pOut, "    R[%u] = a;\n", VM_A(ins));
+            break;
+
+        case VM_TAILCALL:
+
+            fprintf(pOut, "    RT_SAFEPOINT();\n");
+            fprintf(pOut, "    a = R[%u];\n", VM_B(ins));
+
+            if (!isMain) /* calling itself, start over in the same frame */
+            {
+                fprintf(pOut, "    if (RT_SELF(a, &P%d))\n    {\n",
+                        pProto->index);
+                fprintf(pOut, "        R[0] = R[%u];\n", VM_C(ins));
+                fprintf(pOut, "        vmFrames[fr].pClosure = "
+                        "V_PCLOSURE(a);\n");
+
+                if (useCaps) fprintf(pOut, "        pC = V_PCLOSURE(a);\n");
+
+                if (needEnv)
+                {
+                    fprintf(pOut, "        pEnv = EnvNew(%d);\n"
+                            "        vmFrames[fr].pEnv = pEnv;\n",
+                            pProto->numSlots);
+                }
+
+                fprintf(pOut, "        RT_STEP();\n        goto L0;\n    }\n");
+            }
+
+            fprintf(pOut, "    rtTailF = a;\n");
+            fprintf(pOut, "    rtTailArg = R[%u];\n", VM_C(ins));
+            fprintf(pOut, "    rtTailOffset = %u;\n", off);
+            fprintf(pOut, "    return RT_TAIL;\n");
+            break;
+
+        case VM_RET:
+
+            fprintf(pOut, "    return R[%u];\n", VM_A(ins));
+            break;
+
+        case VM_TUPLE:
+
+            fprintf(pOut, "    a = ValueTuple(%u);\n", VM_C(ins));
+
+            for (i = 0; i < (int)VM_C(ins); i++)
+            {
+                fprintf(pOut, "    V_PTUPLE(a)->v[%d] = R[%u];\n", i,
+                        (VM_B(ins) + i));
+            }
+
+            fprintf(pOut, "    R[%u] = a;\n", VM_A(ins));
+            break;
+
+        case VM_TUPLEN:
+
+            fprintf(pOut, "    R[%u] = TupleEmpty(%u);\n", VM_A(ins), k);
+            break;
+
+        case VM_FILL:
+
+            fprintf(pOut, "    TupleFill(R[%u], %u, (R + %u), %u);\n",
+                    VM_A(ins), k, VM_B(ins), VM_C(ins));
+            break;
+
+        case VM_BIND:
+
+            i = VM_BX(ins);
+            fprintf(pOut, "    a = R[%u];\n", VM_A(ins));
+            fprintf(pOut, "    if (!V_IS(a, V_TUPLE) || "
+                    "(V_TUPLE_NUM(a) != %d))\n", i);
+            fprintf(pOut, "        RtError(%u, \"expected a tuple of %d "
+                    "values\");\n", off, i);
+            break;
+
+        case VM_SELECT:
+
+            fprintf(pOut, "    R[%u] = V_TUPLE_V(R[%u])[%u];\n", VM_A(ins),
+                    VM_B(ins), (VM_C(ins) - 1));
+            break;
+
+        case VM_JMP:
+
+            fprintf(pOut, "    goto L%u;\n", k);
+            break;
+
+        case VM_JMPF:
+
+            fprintf(pOut, "    a = R[%u];\n", VM_A(ins));
+            fprintf(pOut, "    if (!V_IS(a, V_TRUTH))\n");
+            fprintf(pOut, "        RtError(%u, \"'->' condition is not a "
+                    "truthvalue\");\n", off);
+            fprintf(pOut, "    if (!V_BOOL(a)) goto L%u;\n", k);
+            break;
+
+        case VM_MUL:
+
+            fprintf(pOut, "    a = R[%u];\n    b = R[%u];\n", VM_B(ins),
+                    VM_C(ins));
+            fprintf(pOut, "    R[%u] = (V_IS_SMALL(a & b) && "
+                    "INT_MUL_OK(V_SMALL(a), V_SMALL(b), &n)) ?\n"
+                    "        ValueInt(n) : BinOp(%u, OP_MUL, a, b);\n",
+                    VM_A(ins), off);
+            break;
+
+        case VM_DIV:
+
+            fprintf(pOut, "    a = R[%u];\n    b = R[%u];\n", VM_B(ins),
+                    VM_C(ins));
+            fprintf(pOut, "    R[%u] = (V_IS_SMALL(a & b) && V_SMALL(b)) ?\n"
+                    "        ValueInt(V_SMALL(a) / V_SMALL(b)) : "
+                    "BinOp(%u, OP_DIV, a, b);\n", VM_A(ins), off);
+            break;
+
+        case VM_NOT:
+
+            fprintf(pOut, "    a = R[%u];\n", VM_B(ins));
+            fprintf(pOut, "    if (!V_IS(a, V_TRUTH))\n");
+            fprintf(pOut, "        RtError(%u, \"not applied to a "
+                    "non-truthvalue\");\n", off);
+            fprintf(pOut, "    R[%u] = ValueTruth(!V_BOOL(a));\n", VM_A(ins));
+            break;
+
+        case VM_NEG:
+
+            fprintf(pOut, "    a = R[%u];\n", VM_B(ins));
+            fprintf(pOut, "    if (!V_IS(a, V_INT))\n");
+            fprintf(pOut, "        RtError(%u, \"neg applied to a "
+                    "non-integer\");\n", off);
+            fprintf(pOut, "    R[%u] = IntNeg(a);\n", VM_A(ins));
+            break;
+
+        default: /* the binary operators */
+
+            fprintf(pOut, "    a = R[%u];\n    b = R[%u];\n", VM_B(ins),
+                    VM_C(ins));
+
+            if ((op <= VM_NE) && cgFast[op - VM_ADD])
+            {
+                fprintf(pOut, "    R[%u] = V_IS_SMALL(a & b) ? %s :\n"
+                        "        BinOp(%u, %s, a, b);\n", VM_A(ins),
+                        cgFast[op - VM_ADD], off, cgOps[op - VM_ADD]);
+            }
+            else
+            {
+                fprintf(pOut, "    R[%u] = BinOp(%u, %s, a, b);\n",
+                        VM_A(ins), off, cgOps[op - VM_ADD]);
+            }
+
+            break;
+        }
+    }
+
+    fprintf(pOut, "}\n\n\n");
+    free(pTarget);
+}
+
+
+/* Emit a table of n line starts as the C array pName. */
+void CgLines(FILE * pOut, const char * pName, const unsigned int * starts,
+             int n)
+{
+    int i;
+
+    fprintf(pOut, "\nstatic unsigned int %s[] =\n{", pName);
+
+    for (i = 0; i < n; i++)
+    {
+        if ((i % 10) == 0) fprintf(pOut, "\n   ");
+        fprintf(pOut, " %u%s", starts[i], (i < (n - 1)) ? "," : "");
+    }
+
+    fprintf(pOut, "\n};\n\n\n");
+}
+
+
+/* Remove the output after an error, unless it isn't a file (/dev/stdout). */
+void CgRemove(void)
+{
+    struct stat st;
+
+    if ((stat(pCFile, &st) == 0) && S_ISREG(st.st_mode)) unlink(pCFile);
+}
+
+
+/* Compile the AST rooted at pRoot to a C program in pCFile. */
+void CgProgram(Token * pRoot)
+{
+    VmScope * pMain;
+    Proto * pProto;
+    FILE * pOut;
+    jmp_buf jmp;
+    char vars[16];
+    char caps[16];
+    int reg;
+    int i;
+    int k;
+
+    BuiltinInit();
+
+    /* a compile error leaves no output, not even one from before */
+    if (setjmp(jmp) != 0)
+    {
+        pRtJmp = NULL;
+        CgRemove();
+        VmFree();
+        ArenaFree();
+        return;
+    }
+
+    pRtJmp = &jmp;
+    pMain  = VmFuncBegin(NULL, NULL);
+    reg    = VmRegAlloc(pMain, pRoot);
+    VmExpr(pMain, pRoot, reg);
+    pProto = VmFuncEnd(pMain, reg, pRoot);
+    pRtJmp = NULL;
+
+    if ((pOut = fopen(pCFile, "w")) == NULL)
+    {
+        printf("ERROR: failed to open %s for writing\n", pCFile);
+        exit(1);
+    }
+
+    fprintf(pOut, "/* Generated by rpal -c from %s, do not edit. */\n\n",
+            pRunFile);
+    fprintf(pOut, "#define RPAL_RT_MAIN\n#include \"rpal_rt.h\"\n\n\n");
+
+    for (i = 0; i < numProtos; i++)
+    {
+        fprintf(pOut, "static Value F%d(void);\n", i);
+    }
+
+    fprintf(pOut, "\n");
+
+    for (i = 0; i < numProtos; i++)
+    {
+        Proto * pP = ppProtos[i];
+
+        snprintf(vars, sizeof(vars), (pP->numVars) ? "V%d" : "NULL", i);
+        snprintf(caps, sizeof(caps), (pP->numCaps) ? "C%d" : "NULL", i);
+
+        if (pP->numVars)
+        {
+            fprintf(pOut, "static char * V%d[] = { ", i);
+
+            for (k = 0; k < pP->numVars; k++)
+            {
+                fprintf(pOut, "%s", (k) ? ", " : "");
+                CgString(pOut, pP->ppVars[k], strlen(pP->ppVars[k]));
+            }
+
+            fprintf(pOut, " };\n");
+        }
+
+        if (pP->numRecVars)
+        {
+            fprintf(pOut, "static char * R%d[] = { ", i);
+
+            for (k = 0; k < pP->numRecVars; k++)
+            {
+                fprintf(pOut, "%s", (k) ? ", " : "");
+                CgString(pOut, pP->ppRecVars[k], strlen(pP->ppRecVars[k]));
+            }
+
+            fprintf(pOut, " };\n");
+        }
+
+        if (pP->numCaps)
+        {
+            fprintf(pOut, "static int C%d[] = { ", i);
+
+            for (k = 0; k < pP->numCaps; k++)
+            {
+                fprintf(pOut, "%s%d", (k) ? ", " : "", pP->pCaps[k]);
+            }
 
-        T_VERIFY(T_PUNCTION, ")");
-        T_POP_DUMP(); /* dump the ')' */
+            fprintf(pOut, " };\n");
+        }
 
-        T_PUSH(pE); /* push E back on the stack */
+        for (k = 0; k < pP->numConsts; k++)
+        {
+            if (CgHeapConst(pP, k))
+            {
+                fprintf(pOut, "static Value K%d[%d];\n", i, pP->numConsts);
+                break;
+            }
+        }
 
-        LOG_BUP("Rn -> '(' E ')'");
+        /* with no env its slots are registers, see CgNeedsEnv() */
+        fprintf(pOut, "static Proto P%d =\n{\n"
+                "    .index = %d, .numVars = %d, .ppVars = %s,\n"
+                "    .numSlots = %d, .numCaps = %d, .pCaps = %s,\n"
+                "    .numRegs = %d, .pNative = F%d%s",
+                i, i, pP->numVars, vars,
+                (CgNeedsEnv(pP)) ? pP->numSlots : 0, pP->numCaps, caps,
+                (CgNeedsEnv(pP)) ? pP->numRegs : (pP->numRegs + pP->numSlots),
+                i, (pP->memo) ? ", .memo = 1" : "");
+
+        if (pP->numRecVars)
+        {
+            fprintf(pOut, ",\n    .numRecVars = %d, .ppRecVars = R%d",
+                    pP->numRecVars, i);
+        }
+
+        fprintf(pOut, "\n};\n\n");
     }
-}
 
+    /* the source line starts, for the runtime errors */
+    if (numLines == 0) LineTableBuild();
 
-/*
- * R -> R Rn   => 'gamma'
- *   -> Rn
- */
-void Parser_R(void)
-{
-    Token * pR;
-    Token * pRn;
-    Token * pGamma;
+    CgLines(pOut, "lineStarts", lineStarts, numLines);
 
-    LOG_TDN("R -> Rn");
-    Parser_Rn();
-    LOG_BUP("R -> Rn");
+    if (numPreLines) /* and those of the prelude, see PRE_LOC */
+    {
+        CgLines(pOut, "preLineStarts", preLineStarts, numPreLines);
+
+        fprintf(pOut,
+            "char * LocToStr(unsigned int offset)\n"
+            "{\n"
+            "    static char loc[%d];\n"
+            "    unsigned int * starts = lineStarts;\n"
+            "    int line = (sizeof(lineStarts) / sizeof(lineStarts[0]));\n"
+            "    const char * pPre = \"\";\n"
+            "\n"
+            "    if (offset & 0x%xu)\n"
+            "    {\n"
+            "        starts  = preLineStarts;\n"
+            "        line    = (sizeof(preLineStarts) / sizeof(starts[0]));\n"
+            "        offset &= ~0x%xu;\n"
+            "        pPre    = ",
+            (int)(strlen(pPreName) + 32), PRE_LOC, PRE_LOC);
+        CgString(pOut, pPreName, strlen(pPreName));
+        fprintf(pOut,
+            ";\n"
+            "    }\n"
+            "\n"
+            "    while ((line > 1) && (starts[line - 1] > offset)) line--;\n"
+            "\n"
+            "    snprintf(loc, sizeof(loc), \"%%s%%s%%d:%%u\", pPre,\n"
+            "             (*pPre) ? \":\" : \"\", line,\n"
+            "             (offset - starts[line - 1] + 1));\n"
+            "\n"
+            "    return loc;\n"
+            "}\n\n\n");
+    }
+    else
+    {
+        fprintf(pOut,
+            "char * LocToStr(unsigned int offset)\n"
+            "{\n"
+            "    static char loc[32];\n"
+            "    int line = (sizeof(lineStarts) / sizeof(lineStarts[0]));\n"
+            "\n"
+            "    while ((line > 1) && (lineStarts[line - 1] > offset)) "
+            "line--;\n"
+            "\n"
+            "    snprintf(loc, sizeof(loc), \"%%d:%%u\", line,\n"
+            "             (offset - lineStarts[line - 1] + 1));\n"
+            "\n"
+            "    return loc;\n"
+            "}\n\n\n");
+    }
 
-    while (T_SECOND()                               &&
-           ((T_SECOND()->type == T_IDENTIFIER)      ||
-            (T_SECOND()->type == T_INTEGER)         ||
-            (T_SECOND()->type == T_STRING)          ||
-            T_MATCH(T_SECOND(), T_KEYWORD, "true")  ||
-            T_MATCH(T_SECOND(), T_KEYWORD, "false") ||
-            T_MATCH(T_SECOND(), T_KEYWORD, "nil")   ||
-            T_MATCH(T_SECOND(), T_KEYWORD, "dummy") ||
-            T_MATCH(T_SECOND(), T_PUNCTION, "(")))
+    fprintf(pOut,
+        "void ClosurePrint(Value v)\n"
+        "{\n"
+        "    ProtoClosurePrint(v);\n"
+        "}\n\n\n"
+        "/* no roots but the VM frames and registers */\n"
+        "void RtRoots(int minor)\n"
+        "{\n"
+        "    (void)minor;\n"
+        "}\n\n\n");
+
+    for (i = 0; i < numProtos; i++)
     {
-        LOG_TDN("R -> R Rn");
+        CgFunc(pOut, ppProtos[i], (ppProtos[i] == pProto));
+    }
 
-        pR = T_POP(); /* pop R */
+    fprintf(pOut, "static void Load(void)\n{\n");
+    fprintf(pOut, "    pRunFile = ");
+    CgString(pOut, pRunFile, strlen(pRunFile));
+    fprintf(pOut, ";\n");
 
-        Parser_Rn();
+    if (memoize) /* --memo, reported when the program ends */
+    {
+        fprintf(pOut, "    memoize   = 1;\n    memoFuncs = %d;\n", memoFuncs);
+    }
 
-        pRn = T_POP(); /* pop Rn */
+    /* the limits it was compiled with */
+    if (rtMaxSteps) fprintf(pOut, "    rtMaxSteps = %ld;\n", rtMaxSteps);
+    if (rtMaxHeap)  fprintf(pOut, "    rtMaxHeap  = %ld;\n", rtMaxHeap);
+    if (rtMaxDepth) fprintf(pOut, "    rtMaxDepth = %d;\n", rtMaxDepth);
+    if (rtMaxTime)  fprintf(pOut, "    rtMaxTime  = %ld;\n", rtMaxTime);
 
-        pGamma = TokenAlloc(T_OPERATOR, 0, "gamma"); /* create a 'gamma' token */
+    for (i = 0; i < numProtos; i++)
+    {
+        for (k = 0; k < ppProtos[i]->numConsts; k++)
+        {
+            if (CgHeapConst(ppProtos[i], k)) CgLoadConst(pOut, ppProtos[i], k);
+        }
+    }
 
-        T_INSERT_TAIL_CHILD(pGamma, pR);  /* left child R */ 
-        T_INSERT_TAIL_CHILD(pGamma, pRn); /* right child pRn */
-        T_PUSH(pGamma);                   /* push tree Op */
+    fprintf(pOut, "}\n\n\n");
+    fprintf(pOut, "int main(int argc, char * argv[])\n{\n");
+    fprintf(pOut, "    return RtRun(&P%d, Load, argc, argv);\n}\n",
+            pProto->index);
 
-        LOG_BUP("R -> R Rn");
+    if (ferror(pOut) | fclose(pOut))
+    {
+        printf("ERROR: failed to write %s\n", pCFile);
+        CgRemove();
+        exit(1);
     }
+
+    VmFree();
+    ArenaFree();
 }
 
 
 /*
- * Ap -> Ap '@' '<IDENTIFIER>' R   => '@'
- *    -> R
+ * Constant folding (-O).  Runs on the AST before anything else sees it
+ * (-st, -e, -vm or the dump).  An operator on literal operands is worked
+ * out with the runtime's own arithmetic (big integers and all) and turned
+ * into the literal, a '->' on a literal truthvalue is replaced by the
+ * branch it takes, and the identities x + 0, x - 0, x * 1, x / 1, x ** 1,
+ * x & true, x or false, not not x and neg neg x become x when x can only
+ * be an integer (or a truthvalue) anyway.  Anything that fails when it
+ * runs (1 / 0, 'a' + 1, 1 -> 2 | 3) is left alone so it still fails, in
+ * the same place with the same error.  A negative result is neg(<INT>),
+ * there are no negative literals.
+ *
+ * Like the standardizer it rewrites the tree in place, children before
+ * their parent, off a pre-order list.
  */
-void Parser_Ap(void)
+int optimize = 0;
+int foldCount = 0;
+int foldBefore = 0;
+unsigned long foldAfter = 0;
+
+void FreeAST(Token * pRoot); /* forward declaration */
+
+
+/* The operator (OP_*) a node applies, -1 if it isn't one. */
+int FoldOp(Token * pNode)
 {
-    Token * pAp;
-    Token * pOp;
-    Token * pId;
-    Token * pR;
+    int i;
 
-    LOG_TDN("Ap -> R");
-    Parser_R();
-    LOG_BUP("Ap -> R");
+    if (!T_IS(pNode, T_OPERATOR)) return -1;
 
-    while (T_MATCH(T_SECOND(), T_OPERATOR, "@"))
+    for (i = 0; rtOps[i].pName; i++)
     {
-        LOG_TDN("Ap -> Ap '@' '<IDENTIFIER>' R");
+        if (strcmp(pNode->pStr, rtOps[i].pName) == 0) return rtOps[i].op;
+    }
 
-        pAp = T_POP(); /* pop Ap */
-        pOp = T_POP(); /* pop operator */
-        pId = T_POP(); /* pop id */
+    return -1;
+}
 
-        Parser_R();
 
-        pR = T_POP(); /* pop R */
+/* A literal integer or truthvalue node (or neg(<INT>)) and its value. */
+int FoldValue(Token * pNode, Value * pV)
+{
+    Token * pChild = T_FIRST_CHILD(pNode);
 
-        T_INSERT_TAIL_CHILD(pOp, pAp); /* left child Ap */ 
-        T_INSERT_TAIL_CHILD(pOp, pId); /* middle child Id */
-        T_INSERT_TAIL_CHILD(pOp, pR);  /* right child R */
-        T_PUSH(pOp);                   /* push tree Op */
+    if (T_IS(pNode, T_INTEGER))
+    {
+        *pV = ValueIntLiteral(pNode->pStr);
+        return 1;
+    }
 
-        LOG_BUP("Ap -> Ap '@' '<IDENTIFIER>' R");
+    if (T_MATCH(pNode, T_KEYWORD, "<true>") ||
+        T_MATCH(pNode, T_KEYWORD, "<false>"))
+    {
+        *pV = ValueTruth(pNode->pStr[1] == 't');
+        return 1;
+    }
+
+    if (T_MATCH(pNode, T_OPERATOR, "neg") && T_IS(pChild, T_INTEGER))
+    {
+        *pV = IntNeg(ValueIntLiteral(pChild->pStr));
+        return 1;
     }
+
+    return 0;
 }
 
 
-/*
- * Af -> Ap '**' Af   => '**'
- *    -> Ap
- */
-void Parser_Af(void)
+/* Whether a node can only be an integer (or fail). */
+int FoldIsInt(Token * pNode)
 {
-    Token * pAp;
-    Token * pOp;
-    Token * pAf;
+    int op = FoldOp(pNode);
 
-    LOG_TDN("Af -> Ap");
-    Parser_Ap();
-    LOG_BUP("Af -> Ap");
+    return (T_IS(pNode, T_INTEGER) ||
+            ((op >= OP_PLUS) && (op <= OP_POW)) || (op == OP_NEG));
+}
 
-    while (T_MATCH(T_SECOND(), T_OPERATOR, "**"))
+
+/* Whether a node can only be a truthvalue (or fail). */
+int FoldIsTruth(Token * pNode)
+{
+    int op = FoldOp(pNode);
+
+    return (T_MATCH(pNode, T_KEYWORD, "<true>") ||
+            T_MATCH(pNode, T_KEYWORD, "<false>") ||
+            ((op >= OP_GR) && (op <= OP_OR)) || (op == OP_NOT));
+}
+
+
+/* Whether BinOp() works out a op b without a runtime error. */
+int FoldSafe(int op, Value a, Value b)
+{
+    int ints = (V_IS(a, V_INT) && V_IS(b, V_INT));
+    long bits;
+    long n;
+
+    switch (op)
     {
-        LOG_TDN("Af -> Ap '**' Af");
+    case OP_PLUS: case OP_MINUS: case OP_MUL:
+    case OP_GR: case OP_GE: case OP_LS: case OP_LE:
 
-        pAp = T_POP(); /* pop Ap */
-        pOp = T_POP(); /* pop operator */
+        return ints;
 
-        Parser_Af();
+    case OP_DIV:
 
-        pAf = T_POP(); /* pop Af */
+        return (ints && (b != V_INT_SMALL(0)));
 
-        T_INSERT_TAIL_CHILD(pOp, pAp); /* left child Ap */
-        T_INSERT_TAIL_CHILD(pOp, pAf); /* right child Af */
-        T_PUSH(pOp);                   /* push tree Op */
+    case OP_POW:
 
-        LOG_BUP("Af -> Ap '**' Af");
+        if (!ints) return 0;
+
+        if (IntCmp(b, V_INT_SMALL(0)) < 0) return (a != V_INT_SMALL(0));
+
+        if (!V_IS_SMALL(a)) return 0;
+
+        for (bits = 0, n = labs(V_SMALL(a)); n; n >>= 1) bits++;
+
+        /* 0, 1 and -1 to any power, anything else up to a 4096 bit result */
+        return ((bits <= 1) ||
+                (V_IS_SMALL(b) && (V_SMALL(b) <= (4096 / bits))));
+
+    case OP_EQ: case OP_NE:
+
+        return (ints || (V_IS(a, V_TRUTH) && V_IS(b, V_TRUTH)));
+
+    case OP_AND: case OP_OR:
+
+        return (V_IS(a, V_TRUTH) && V_IS(b, V_TRUTH));
     }
+
+    return 0;
 }
 
 
-/*
- * At -> At '*' Af   => '*'
- *    -> At '/' Af   => '/'
- *    -> Af
- */
-void Parser_At(void)
+void FoldDropChildren(Token * pNode)
 {
-    char buf[64];
-    Token * pAt;
-    Token * pOp;
-    Token * pAf;
+    Token * pChild;
 
-    LOG_TDN("At -> Af");
-    Parser_Af();
-    LOG_BUP("At -> Af");
+    while ((pChild = T_FIRST_CHILD(pNode)) != NULL)
+    {
+        T_REMOVE_CHILD(pNode, pChild);
+        FreeAST(pChild);
+    }
+}
 
-    while (T_MATCH(T_SECOND(), T_OPERATOR, "*") ||
-           T_MATCH(T_SECOND(), T_OPERATOR, "/"))
+
+/* Turn a node into the literal for v. */
+void FoldLiteral(Token * pNode, Value v)
+{
+    Token * pInt;
+    char * pStr;
+    int len;
+
+    FoldDropChildren(pNode);
+    foldCount++;
+
+    if (V_IS(v, V_TRUTH))
     {
-        strcpy(buf, T_SECOND()->pStr);
+        TokenRename(pNode, T_KEYWORD, (V_BOOL(v)) ? "<true>" : "<false>");
+        return;
+    }
 
-        LOG_TDN("At -> At '%s' Af", buf);
+    pStr = IntStr(v, &len);
 
-        pAt = T_POP(); /* pop At */
-        pOp = T_POP(); /* pop operator */
+    if (pStr[0] == '-')
+    {
+        pInt = TokenAlloc(T_INTEGER, 0, (pStr + 1));
+        pInt->offset = pNode->offset;
+        T_INSERT_TAIL_CHILD(pNode, pInt);
+        TokenRename(pNode, T_OPERATOR, "neg");
+    }
+    else
+    {
+        TokenRename(pNode, T_INTEGER, pStr);
+    }
 
-        Parser_Af();
+    free(pStr);
+}
 
-        pAf = T_POP(); /* pop Af */
 
-        T_INSERT_TAIL_CHILD(pOp, pAt); /* left child At */
-        T_INSERT_TAIL_CHILD(pOp, pAf); /* right child Af */
-        T_PUSH(pOp);                   /* push tree Op */
+/* Replace a node by one of its children, it keeps its place in the tree. */
+void FoldKeep(Token * pNode, Token * pKeep)
+{
+    Token * pChild;
+    char * pStr;
+    int len;
 
-        LOG_BUP("At -> At '%s' Af", buf);
+    T_REMOVE_CHILD(pNode, pKeep);
+    FoldDropChildren(pNode);
+    foldCount++;
+
+    while ((pChild = T_FIRST_CHILD(pKeep)) != NULL)
+    {
+        T_REMOVE_CHILD(pKeep, pChild);
+        T_INSERT_TAIL_CHILD(pNode, pChild);
     }
+
+    /* pNode takes over pKeep's string, pKeep goes with the old one */
+    pStr          = pNode->pStr;
+    len           = pNode->length;
+    pNode->pStr   = pKeep->pStr;
+    pNode->length = pKeep->length;
+    pNode->type   = pKeep->type;
+    pNode->offset = pKeep->offset;
+    pKeep->pStr   = pStr;
+    pKeep->length = len;
+
+    TokenFree(pKeep);
 }
 
 
-/*
- * A -> A '+' At   => '+'
- *   -> A '-' At   => '-'
- *   ->   '+' At
- *   ->   '-' At   => 'neg'
- *   -> At
- */
-void Parser_A(void)
+/* x op k (or k op x) is x, for the identities above. */
+Token * FoldIdentity(int op, Token * pA, Token * pB)
 {
-    char buf[64];
-    Token * pA;
-    Token * pOp;
-    Token * pAt;
+    Value a = 0;
+    Value b = 0;
 
-    if (T_MATCH(T_FIRST(), T_OPERATOR, "+"))
+    FoldValue(pA, &a);
+    FoldValue(pB, &b);
+
+    switch (op)
     {
-        LOG_TDN("A -> '+' At");
+    case OP_PLUS:
 
-        T_POP_DUMP(); /* dump the '+' */
+        if ((b == V_INT_SMALL(0)) && FoldIsInt(pA)) return pA;
+        if ((a == V_INT_SMALL(0)) && FoldIsInt(pB)) return pB;
+        break;
 
-        Parser_At();
+    case OP_MUL:
 
-        LOG_BUP("A -> '+' At");
+        if ((b == V_INT_SMALL(1)) && FoldIsInt(pA)) return pA;
+        if ((a == V_INT_SMALL(1)) && FoldIsInt(pB)) return pB;
+        break;
+
+    case OP_MINUS:
+
+        if ((b == V_INT_SMALL(0)) && FoldIsInt(pA)) return pA;
+        break;
+
+    case OP_DIV:
+    case OP_POW:
+
+        if ((b == V_INT_SMALL(1)) && FoldIsInt(pA)) return pA;
+        break;
+
+    case OP_AND:
+
+        if ((b == RT_TRUE) && FoldIsTruth(pA)) return pA;
+        if ((a == RT_TRUE) && FoldIsTruth(pB)) return pB;
+        break;
+
+    case OP_OR:
+
+        if ((b == RT_FALSE) && FoldIsTruth(pA)) return pA;
+        if ((a == RT_FALSE) && FoldIsTruth(pB)) return pB;
+        break;
     }
-    else if (T_MATCH(T_FIRST(), T_OPERATOR, "-"))
+
+    return NULL;
+}
+
+
+/* Fold a node, its children are already done. */
+void FoldNode(Token * pNode)
+{
+    Token * pA = T_FIRST_CHILD(pNode);
+    Token * pB;
+    Value a;
+    Value b;
+    int op;
+    int i;
+
+    if (T_MATCH(pNode, T_OPERATOR, "->"))
     {
-        LOG_TDN("A -> '-' At");
+        if (T_MATCH(pA, T_KEYWORD, "<true>"))
+        {
+            FoldKeep(pNode, T_NEXT(pA));
+        }
+        else if (T_MATCH(pA, T_KEYWORD, "<false>"))
+        {
+            FoldKeep(pNode, T_LAST_CHILD(pNode));
+        }
 
-        T_POP_DUMP(); /* dump the '-' */
+        return;
+    }
 
-        Parser_At();
+    if ((op = FoldOp(pNode)) < 0) return;
 
-        pAt = T_POP(); /* pop At */
+    if (op >= OP_NOT) /* unary */
+    {
+        if (T_IS(pA, T_INTEGER)) return; /* neg(<INT>) is a literal */
 
-        pOp = TokenAlloc(T_OPERATOR, 0, "neg"); /* create a 'neg' token */
+        if (FoldValue(pA, &a))
+        {
+            if ((op == OP_NOT) && V_IS(a, V_TRUTH))
+            {
+                FoldLiteral(pNode, ValueTruth(!V_BOOL(a)));
+            }
+            else if ((op == OP_NEG) && V_IS(a, V_INT))
+            {
+                FoldLiteral(pNode, IntNeg(a));
+            }
+        }
+        else if ((FoldOp(pA) == op) &&
+                 ((op == OP_NOT) ? FoldIsTruth(T_FIRST_CHILD(pA)) :
+                                   FoldIsInt(T_FIRST_CHILD(pA))))
+        {
+            FoldKeep(pNode, pA);
+            FoldKeep(pNode, T_FIRST_CHILD(pNode));
+        }
 
-        T_INSERT_TAIL_CHILD(pOp, pAt); /* single child At */
-        T_PUSH(pOp);                   /* push tree Op */
+        return;
+    }
 
-        LOG_BUP("A -> '-' At");
+    pB = T_NEXT(pA);
+
+    if (FoldValue(pA, &a) && FoldValue(pB, &b) && FoldSafe(op, a, b))
+    {
+        FoldLiteral(pNode, BinOp(pNode->offset, op, a, b));
     }
-    else
+    else if (((op == OP_EQ) || (op == OP_NE)) &&
+             T_IS(pA, T_STRING) && T_IS(pB, T_STRING))
     {
-        LOG_TDN("A -> At");
-        Parser_At();
-        LOG_BUP("A -> At");
+        /* the escapes are unique, the same text is the same string */
+        i = (strcmp(pA->pStr, pB->pStr) == 0);
+        FoldLiteral(pNode, ValueTruth((op == OP_EQ) ? i : !i));
+    }
+    else if ((pA = FoldIdentity(op, pA, pB)) != NULL)
+    {
+        FoldKeep(pNode, pA);
     }
+}
+
+
+/* Fold the AST rooted at pRoot in place. */
+void Fold(Token * pRoot)
+{
+    Token ** ppStack = NULL;
+    Token ** ppOrder = NULL;
+    int maxStack = 0;
+    int maxOrder = 0;
+    int numStack = 0;
+    int numOrder = 0;
+    unsigned long refs  = 0; /* none, -O and -d don't mix */
+    unsigned long bytes = 0;
+    Token * pToken;
+    Token * pChild;
 
-    while (T_MATCH(T_SECOND(), T_OPERATOR, "+") ||
-           T_MATCH(T_SECOND(), T_OPERATOR, "-"))
+    ppStack = (Token **)ArrayGrow(ppStack, &maxStack, sizeof(Token *));
+    ppStack[numStack++] = pRoot;
+
+    while (numStack)
     {
-        strcpy(buf, T_SECOND()->pStr);
+        pToken = ppStack[--numStack];
 
-        LOG_TDN("A -> A '%s' At", buf);
+        if (numOrder == maxOrder)
+        {
+            ppOrder = (Token **)ArrayGrow(ppOrder, &maxOrder, sizeof(Token *));
+        }
 
-        pA  = T_POP(); /* pop A */
-        pOp = T_POP(); /* pop operator */
+        ppOrder[numOrder++] = pToken;
 
-        Parser_At();
+        for (pChild = T_FIRST_CHILD(pToken);
+             pChild != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            if (numStack == maxStack)
+            {
+                ppStack = (Token **)ArrayGrow(ppStack, &maxStack,
+                                              sizeof(Token *));
+            }
 
-        pAt = T_POP(); /* pop At */
+            ppStack[numStack++] = pChild;
+        }
+    }
 
-        T_INSERT_TAIL_CHILD(pOp, pA);  /* left child A */ 
-        T_INSERT_TAIL_CHILD(pOp, pAt); /* right child At */
-        T_PUSH(pOp);                   /* push tree Op */
+    foldBefore = numOrder;
+    foldCount  = 0;
+    foldAfter  = 0;
 
-        LOG_BUP("A -> A '%s' At", buf);
-    }
+    while (numOrder) FoldNode(ppOrder[--numOrder]);
+
+    free(ppStack);
+    free(ppOrder);
+    ArenaFree(); /* the values worked out on the way */
+
+    HashConsCount(pRoot, &foldAfter, &refs, &bytes);
+}
+
+
+void FoldStats(void)
+{
+    printf("FOLD: %d nodes -> %lu nodes (%d folds), %lu nodes removed\n",
+           foldBefore, foldAfter, foldCount, (foldBefore - foldAfter));
 }
 
 
 /*
- * Bp -> A ( 'gr' | '>'  ) A   => 'gr'
- *    -> A ( 'ge' | '>=' ) A   => 'ge'
- *    -> A ( 'ls' | '<'  ) A   => 'ls'
- *    -> A ( 'le' | '<=' ) A   => 'le'
- *    -> A 'eq' A              => 'eq'
- *    -> A 'ne' A              => 'ne'
- *    -> A
+ * Print the AST tree rooted at pRoot, one node per line indented a dot per
+ * level.  Walks an explicit stack so a deep tree (a long left-nested
+ * '1 + 1 + ...') can't run it out of C stack.
  */
-void Parser_Bp(void)
+void DumpAST(Token * pRoot, int indent)
 {
-    char buf[64];
-    Token * pA1;
-    Token * pOp;
-    Token * pA2;
+    Token ** ppStack = NULL;
+    int * pIndents = NULL;
+    int maxStack = 0;
+    int maxIndents = 0;
+    int numStack = 0;
+    int first;
+    Token * pChild;
+    Token * pSwap;
+    int i;
 
-    LOG_TDN("Bp -> A");
-    Parser_A();
-    LOG_BUP("Bp -> A");
+    if (pRoot == NULL) return;
 
-    if (T_MATCH(T_SECOND(), T_KEYWORD,  "gr") ||
-        T_MATCH(T_SECOND(), T_OPERATOR, ">")  ||
-        T_MATCH(T_SECOND(), T_KEYWORD,  "ge") ||
-        T_MATCH(T_SECOND(), T_OPERATOR, ">=") ||
-        T_MATCH(T_SECOND(), T_KEYWORD,  "ls") ||
-        T_MATCH(T_SECOND(), T_OPERATOR, "<")  ||
-        T_MATCH(T_SECOND(), T_KEYWORD,  "le") ||
-        T_MATCH(T_SECOND(), T_OPERATOR, "<=") ||
-        T_MATCH(T_SECOND(), T_KEYWORD,  "eq") ||
-        T_MATCH(T_SECOND(), T_KEYWORD,  "ne"))
+    ppStack = (Token **)ArrayGrow(ppStack, &maxStack, sizeof(Token *));
+    pIndents = (int *)ArrayGrow(pIndents, &maxIndents, sizeof(int));
+    ppStack[0] = pRoot;
+    pIndents[0] = indent;
+    numStack = 1;
+
+    while (numStack)
     {
-        strcpy(buf,
-               (T_MATCH(T_SECOND(), T_KEYWORD, "gr") ||
-                T_MATCH(T_SECOND(), T_OPERATOR, ">"))   ? "( 'gr' | '>'  )" :
-               (T_MATCH(T_SECOND(), T_KEYWORD, "ge") ||
-                T_MATCH(T_SECOND(), T_OPERATOR, ">="))  ? "( 'ge' | '>=' )" :
-               (T_MATCH(T_SECOND(), T_KEYWORD, "ls") ||
-                T_MATCH(T_SECOND(), T_OPERATOR, "<"))   ? "( 'ls' | '<'  )" :
-               (T_MATCH(T_SECOND(), T_KEYWORD, "le") ||
-                T_MATCH(T_SECOND(), T_OPERATOR, "<="))  ? "( 'le' | '<=' )" :
-               (T_MATCH(T_SECOND(), T_KEYWORD, "eq"))   ? "'eq'" : "'ne'");
+        pRoot = ppStack[--numStack];
+        indent = pIndents[numStack];
 
-        LOG_TDN("Bp -> A %s A", buf);
+        while (pRoot->pShare) /* print the full shared subtree */
+        {
+            pRoot = pRoot->pShare;
+        }
 
-        pA1 = T_POP(); /* pop A1 */
+        for (i = 0; i < indent; i++) printf(".");
 
-        pOp = T_POP_OP(); /* pop operator */
+        printf("%s", TokenToStr(pRoot));
 
-        Parser_A();
+        if (resolveNames && (pRoot->depth == RES_FREE))
+        {
+            printf(" @free");
+        }
+        else if (resolveNames && (pRoot->depth != RES_NONE))
+        {
+            printf(" @%d,%d", pRoot->depth, pRoot->slot);
+        }
 
-        pA2 = T_POP(); /* pop A2 */
+        /* XXX trailing space hack to match RPAL interpreter AST output */
+        if (showLocations)
+        {
+            printf(" [%s] \n", LocToStr(pRoot->offset));
+        }
+        else
+        {
+            printf(" \n");
+        }
 
-        T_INSERT_TAIL_CHILD(pOp, pA1); /* left child A1 */ 
-        T_INSERT_TAIL_CHILD(pOp, pA2); /* right child A2 */
-        T_PUSH(pOp);                   /* push tree Op */
+        /* push the children, then reverse them so the first is on top */
+        for (first = numStack, pChild = T_FIRST_CHILD(pRoot);
+             pChild != NULL;
+             pChild = T_NEXT(pChild))
+        {
+            if (numStack == maxStack)
+            {
+                ppStack = (Token **)ArrayGrow(ppStack, &maxStack,
+                                              sizeof(Token *));
+                pIndents = (int *)ArrayGrow(pIndents, &maxIndents,
+                                            sizeof(int));
+            }
 
-        LOG_BUP("Bp -> A %s A", buf);
+            ppStack[numStack] = pChild;
+            pIndents[numStack++] = indent + 1;
+        }
+
+        for (i = numStack - 1; first < i; first++, i--)
+        {
+            pSwap = ppStack[first];
+            ppStack[first] = ppStack[i];
+            ppStack[i] = pSwap;
+        }
     }
+
+    free(ppStack);
+    free(pIndents);
 }
 
 
-/*
- * Bs -> 'not' Bp   => 'not'
- *    -> Bp
- */
-void Parser_Bs(void)
+/* Free the AST tree rooted at pRoot, with an explicit stack. */
+void FreeAST(Token * pRoot)
 {
-    Token * pOp;
-    Token * pBp;
+    Token ** ppStack = NULL;
+    int maxStack = 0;
+    int numStack = 0;
+    Token * pChild;
 
-    if (T_MATCH(T_FIRST(), T_KEYWORD, "not"))
-    {
-        LOG_TDN("Bs -> 'not' Bp");
+    if (pRoot == NULL) return;
 
-        pOp = T_POP_OP(); /* pop 'not' */
+    ppStack = (Token **)ArrayGrow(ppStack, &maxStack, sizeof(Token *));
+    ppStack[numStack++] = pRoot;
 
-        Parser_Bp();
+    while (numStack)
+    {
+        pRoot = ppStack[--numStack];
 
-        pBp = T_POP(); /* pop Bp */
+        while ((pChild = T_FIRST_CHILD(pRoot)) != NULL)
+        {
+            T_REMOVE_CHILD(pRoot, pChild);
 
-        T_INSERT_TAIL_CHILD(pOp, pBp); /* single child Bp */
-        T_PUSH(pOp);                   /* push tree Op */
+            if (numStack == maxStack)
+            {
+                ppStack = (Token **)ArrayGrow(ppStack, &maxStack,
+                                              sizeof(Token *));
+            }
 
-        LOG_BUP("Bs -> 'not' Bp");
-    }
-    else
-    {
-        LOG_TDN("Bs -> Bp");
-        Parser_Bp();
-        LOG_BUP("Bs -> Bp");
+            ppStack[numStack++] = pChild;
+        }
+
+        //printf("FREE: %s\n", TokenToStr(pRoot));
+        TokenFree(pRoot);
     }
+
+    free(ppStack);
 }
 
 
 /*
- * Bt -> Bt '&' Bs   => '&'
- *    -> Bs
+ * Prelude images (--prelude, --build-image and --image).  A prelude is the
+ * 'let D in' ... 'let D in' text that would otherwise be pasted in front of
+ * every program.  It is scanned and parsed once, with a hole (a nameless
+ * identifier) standing in for the program as the body of its innermost let,
+ * and its AST is saved as an image: a header, the nodes in pre-order, the
+ * line starts of the prelude and the strings.  There are no pointers in it,
+ * only offsets into the image, so it is mapped as is, wherever it lands.
+ * Each program then gets its own copy of the prelude tree straight from the
+ * image, with its AST in place of the hole (see PreludeGraft()), and the
+ * scanner and parser never see the prelude again.  Only the AST is kept,
+ * the folding, the name resolution, the standardizer and the compiler work
+ * on the whole program, prelude included.
  */
-void Parser_Bt(void)
-{
-    Token * pBt;
-    Token * pOp;
-    Token * pBs;
+#define IMG_MAGIC "RPALIMG1"
+#define IMG_ORDER 0x01020304u /* the same byte order and int size */
+#define IMG_MAX_DEPTH 16384   /* PreludeNode() recurses, a let per level */
 
-    LOG_TDN("Bt -> Bs");
-    Parser_Bs();
-    LOG_BUP("Bt -> Bs");
+typedef struct
+{
+    char         magic[8];
+    unsigned int order;
+    unsigned int size;     /* of the whole image */
+    unsigned int numNodes;
+    unsigned int hole;     /* node standing in for the program */
+    unsigned int numLines;
+    unsigned int nodes;    /* image offsets of the nodes, */
+    unsigned int lines;    /* the line starts */
+    unsigned int strs;     /* and the strings (last) */
+    unsigned int name;     /* prelude file name, in the strings */
+} ImgHeader;
+
+typedef struct
+{
+    unsigned int type     : 8;
+    unsigned int children : 24;
+    unsigned int offset;   /* source offset in the prelude */
+    unsigned int str;      /* pStr, in the strings */
+} ImgNode;
+
+#define IMG_AT(h, o)   ((const char *)(h) + (o))
+#define IMG_NODES(h)   ((const ImgNode *)IMG_AT((h), (h)->nodes))
+#define IMG_LINES(h)   ((const unsigned int *)IMG_AT((h), (h)->lines))
+#define IMG_STR(h, o)  IMG_AT((h), ((h)->strs + (o)))
+
+const ImgHeader * pImg = NULL; /* the prelude of every program */
+
+ImgNode * pImgNodes = NULL;    /* the image being built */
+int numImgNodes = 0;
+int maxImgNodes = 0;
+char * pImgStrs = NULL;
+int numImgStrs = 0;
+int maxImgStrs = 0;
+int imgHole = -1;
+
+
+/* Add a string to the image being built, returns its offset. */
+unsigned int PreludeStr(const char * pStr)
+{
+    int len = (strlen(pStr) + 1);
 
-    while (T_MATCH(T_SECOND(), T_OPERATOR, "&"))
+    while ((numImgStrs + len) > maxImgStrs)
     {
-        LOG_TDN("Bt -> Bt '&' Bs");
-
-        pBt = T_POP(); /* pop Bt */
-
-        pOp = T_POP_OP(); /* pop '&' */
-
-        Parser_Bs();
-
-        pBs = T_POP(); /* pop Bs */
+        pImgStrs = (char *)ArrayGrow(pImgStrs, &maxImgStrs, sizeof(char));
+    }
 
-        T_INSERT_TAIL_CHILD(pOp, pBt); /* left child Bt */ 
-        T_INSERT_TAIL_CHILD(pOp, pBs); /* right child Bs */
-        T_PUSH(pOp);                   /* push tree Op */
+    memcpy((pImgStrs + numImgStrs), pStr, len);
+    numImgStrs += len;
 
-        LOG_BUP("Bt -> Bt '&' Bs");
-    }
+    return (numImgStrs - len);
 }
 
 
 /*
- * B -> B 'or' Bt   => 'or'
- *   -> Bt
+ * Add the tree rooted at pNode to the image being built, in pre-order.
+ * Returns 0 if the hole isn't the body of a let.
  */
-void Parser_B(void)
+int PreludeSave(Token * pNode, Token * pParent, Token * pHole)
 {
-    Token * pB;
-    Token * pOp;
-    Token * pBt;
-
-    LOG_TDN("B -> Bt");
-    Parser_Bt();
-    LOG_BUP("B -> Bt");
+    Token * pChild;
+    int i = numImgNodes;
+    int n = 0;
 
-    while (T_MATCH(T_SECOND(), T_KEYWORD, "or"))
+    if (pNode == pHole)
     {
-        LOG_TDN("B -> B 'or' Bt");
+        if (!T_MATCH(pParent, T_KEYWORD, "let") ||
+            (T_LAST_CHILD(pParent) != pHole))
+        {
+            return 0;
+        }
 
-        pB = T_POP(); /* pop B */
+        imgHole = i;
+    }
 
-        pOp = T_POP_OP(); /* pop 'or' */
+    if (numImgNodes == maxImgNodes)
+    {
+        pImgNodes = (ImgNode *)ArrayGrow(pImgNodes, &maxImgNodes,
+                                         sizeof(ImgNode));
+    }
 
-        Parser_Bt();
+    numImgNodes++;
+    pImgNodes[i].type   = pNode->type;
+    pImgNodes[i].offset = pNode->offset;
+    pImgNodes[i].str    = PreludeStr(pNode->pStr);
 
-        pBt = T_POP(); /* pop Bt */
+    for (pChild = T_FIRST_CHILD(pNode);
+         pChild != NULL;
+         pChild = T_NEXT(pChild))
+    {
+        if (!PreludeSave(pChild, pNode, pHole)) return 0;
+        n++;
+    }
 
-        T_INSERT_TAIL_CHILD(pOp, pB);  /* left child B */ 
-        T_INSERT_TAIL_CHILD(pOp, pBt); /* right child Bt */
-        T_PUSH(pOp);                   /* push tree Op */
+    pImgNodes[i].children = n;
 
-        LOG_BUP("B -> B 'or' Bt");
-    }
+    return 1;
 }
 
 
+int PreludeCheck(const ImgHeader * pHdr, unsigned long size);
+
 /*
- * Tc -> B '->' Tc '|' Tc   => '->'
- *    -> B
+ * Scan and parse the prelude in pFile and turn it into an image (malloc'ed).
+ * Returns NULL once the errors are reported.
  */
-void Parser_Tc(void)
+ImgHeader * PreludeBuild(const char * pFile)
 {
-    Token * pB;
-    Token * pOp;
-    Token * pTc1;
-    Token * pTc2;
+    ImgHeader * pHdr = NULL;
+    Token * pToken;
+    Token * pHole;
+    Token * pTree;
+    int saveHashCons = hashCons;
+    int saveLogRules = log_rules;
+    unsigned int size;
+    int ok = 0;
+    int fd;
+
+    if ((fd = open(pFile, O_RDONLY)) == -1)
+    {
+        printf("ERROR: %s: ", pFile);
+        fflush(stdout);
+        perror("Could not open file");
+        return NULL;
+    }
 
-    LOG_TDN("Tc -> B");
-    Parser_B();
-    LOG_BUP("Tc -> B");
+    srcFd       = fd;
+    scanOffset  = 0;
+    errorOffset = (unsigned int)-1;
+    hashCons    = 0; /* a plain tree, parsed quietly */
+    log_rules   = LOG_RULE_OFF;
 
-    while (T_MATCH(T_SECOND(), T_OPERATOR, "->"))
-    {
-        LOG_TDN("Tc -> B '->' Tc '|' Tc");
+    if (dfaScanner) ScannerDfa(fd);
+    else            Scanner(fd);
 
-        pB = T_POP(); /* pop B */
+    pHole = TokenAlloc(T_IDENTIFIER, 0, NULL);
+    pHole->offset = scanOffset;
+    T_INSERT_TAIL(pHole);
 
-        pOp = T_POP_OP(); /* pop '->' */
+    Parser_E();
+    pTree = AstFinish(T_POP());
 
-        Parser_Tc();
+    if (T_FIRST()) Parser_Error(T_FIRST(), "end of file");
 
-        pTc1 = T_POP(); /* pop Tc1 */
+    while ((pToken = T_FIRST()) != NULL)
+    {
+        T_REMOVE(pToken);
+        FreeAST(pToken);
+    }
 
-        T_VERIFY(T_OPERATOR, "|");
-        T_POP_DUMP(); /* dump the '|' */
+    imgHole     = -1;
+    numImgNodes = 0;
+    numImgStrs  = 0;
 
-        Parser_Tc();
+    if (numDiags == 0)
+    {
+        if (scanOffset >= PRE_LOC)
+        {
+            printf("ERROR: %s: too big for a prelude\n", pFile);
+        }
+        else if (!PreludeSave(pTree, NULL, pHole) || (imgHole == -1))
+        {
+            printf("ERROR: %s: a prelude is a chain of 'let D in', the "
+                   "program goes after the last 'in'\n", pFile);
+        }
+        else
+        {
+            ok = 1;
+        }
+    }
 
-        pTc2 = T_POP(); /* pop Tc2 */
+    DiagFlush(pFile);
 
-        T_INSERT_TAIL_CHILD(pOp, pB);   /* left child B */
-        T_INSERT_TAIL_CHILD(pOp, pTc1); /* middle child Tc1 */
-        T_INSERT_TAIL_CHILD(pOp, pTc2); /* right child Tc2 */
-        T_PUSH(pOp);                    /* push tree Op */
+    if (ok)
+    {
+        if (numLines == 0) LineTableBuild();
 
-        LOG_BUP("Tc -> B '->' Tc '|' Tc");
-    }
-}
+        PreludeStr(pFile); /* the name goes last */
 
+        size = (sizeof(ImgHeader) + (numImgNodes * sizeof(ImgNode)) +
+                (numLines * sizeof(unsigned int)) + numImgStrs);
 
-/*
- * Ta -> Ta 'aug' Tc   => 'aug'
- *    -> Tc
- */
-void Parser_Ta(void)
-{
-    Token * pTa;
-    Token * pOp;
-    Token * pTc;
+        if ((pHdr = (ImgHeader *)calloc(1, size)) == NULL)
+        {
+            perror("Failed to malloc memory");
+            exit(1);
+        }
 
-    LOG_TDN("Ta -> Tc");
-    Parser_Tc();
-    LOG_BUP("Ta -> Tc");
+        memcpy(pHdr->magic, IMG_MAGIC, sizeof(pHdr->magic));
+        pHdr->order    = IMG_ORDER;
+        pHdr->size     = size;
+        pHdr->numNodes = numImgNodes;
+        pHdr->hole     = imgHole;
+        pHdr->numLines = numLines;
+        pHdr->nodes    = sizeof(ImgHeader);
+        pHdr->lines    = (pHdr->nodes + (numImgNodes * sizeof(ImgNode)));
+        pHdr->strs     = (pHdr->lines + (numLines * sizeof(unsigned int)));
+        pHdr->name     = (numImgStrs - (strlen(pFile) + 1));
+
+        memcpy((char *)IMG_NODES(pHdr), pImgNodes,
+               (numImgNodes * sizeof(ImgNode)));
+        memcpy((char *)IMG_LINES(pHdr), lineStarts,
+               (numLines * sizeof(unsigned int)));
+        memcpy((char *)IMG_STR(pHdr, 0), pImgStrs, numImgStrs);
+
+        if (!PreludeCheck(pHdr, size)) /* all it can fail on is the depth */
+        {
+            printf("ERROR: %s: nests more than %d deep, too deep for a "
+                   "prelude\n", pFile, IMG_MAX_DEPTH);
+            free(pHdr);
+            pHdr = NULL;
+        }
+    }
 
-    while (T_MATCH(T_SECOND(), T_KEYWORD, "aug"))
-    {
-        LOG_TDN("Ta -> Ta 'aug' Tc");
+    FreeAST(pTree);
+    IndexFree();
+    LineTableFree();
+    close(fd);
 
-        pTa = T_POP(); /* pop Bt */
+    free(pImgNodes);
+    free(pImgStrs);
+    pImgNodes   = NULL;
+    pImgStrs    = NULL;
+    maxImgNodes = 0;
+    maxImgStrs  = 0;
+    hashCons    = saveHashCons;
+    log_rules   = saveLogRules;
 
-        pOp = T_POP_OP(); /* pop 'aug' */
+    return pHdr;
+}
 
-        Parser_Tc();
 
-        pTc = T_POP(); /* pop Tc */
+/* Write the image pHdr to pFile (--build-image). */
+int PreludeWrite(const ImgHeader * pHdr, const char * pFile)
+{
+    FILE * pOut;
 
-        T_INSERT_TAIL_CHILD(pOp, pTa); /* left child Ta */ 
-        T_INSERT_TAIL_CHILD(pOp, pTc); /* right child Tc */
-        T_PUSH(pOp);                   /* push tree Op */
+    if ((pOut = fopen(pFile, "wb")) == NULL)
+    {
+        printf("ERROR: failed to open %s for writing\n", pFile);
+        return 1;
+    }
 
-        LOG_BUP("Ta -> Ta 'aug' Tc");
+    if ((fwrite(pHdr, 1, pHdr->size, pOut) != pHdr->size) || fclose(pOut))
+    {
+        printf("ERROR: failed to write %s\n", pFile);
+        return 1;
     }
+
+    return 0;
 }
 
 
 /*
- * T -> Ta ( ',' Ta )+   => 'tau'
- *   -> Ta
+ * Check that the size bytes at pHdr are an image this rpal can use, all the
+ * offsets in it land inside and the nodes make up a single tree, at most
+ * IMG_MAX_DEPTH deep.
  */
-void Parser_T(void)
+int PreludeCheck(const ImgHeader * pHdr, unsigned long size)
 {
-    Token * pTa;
-    Token * pOp;
-
-    LOG_TDN("T -> Ta");
-    Parser_Ta();
-    LOG_BUP("T -> Ta");
-
-    if (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+    static unsigned int left[IMG_MAX_DEPTH]; /* children to come, by depth */
+    const ImgNode * pIn;
+    int depth = 0;
+    unsigned int i;
+
+    if ((size < sizeof(ImgHeader)) ||
+        memcmp(pHdr->magic, IMG_MAGIC, sizeof(pHdr->magic)) ||
+        (pHdr->order != IMG_ORDER) || (pHdr->size != size) ||
+        ((pHdr->nodes | pHdr->lines) & 3) ||
+        (pHdr->nodes < sizeof(ImgHeader)) ||
+        ((pHdr->nodes + ((unsigned long)pHdr->numNodes * sizeof(ImgNode))) >
+         pHdr->lines) ||
+        ((pHdr->lines +
+          ((unsigned long)pHdr->numLines * sizeof(unsigned int))) >
+         pHdr->strs) ||
+        (pHdr->strs >= size) || (pHdr->name >= (size - pHdr->strs)) ||
+        (pHdr->numLines == 0) || (pHdr->hole >= pHdr->numNodes) ||
+        (IMG_AT(pHdr, 0)[size - 1] != 0)) /* the last string ends */
     {
-        LOG_TDN("T -> Ta ( ',' Ta )+");
-
-        pOp = TokenAlloc(T_OPERATOR, 0, "tau"); /* create a 'tau' token */
+        return 0;
+    }
 
-        while (T_MATCH(T_SECOND(), T_PUNCTION, ","))
+    for (i = 0, pIn = IMG_NODES(pHdr); i < pHdr->numNodes; i++, pIn++)
+    {
+        if ((i && (depth == 0)) || (pIn->type > T_PUNCTION) ||
+            (pIn->offset >= PRE_LOC) || (pIn->str >= (size - pHdr->strs)) ||
+            ((i == pHdr->hole) && pIn->children) ||
+            (pIn->children && (depth == IMG_MAX_DEPTH)))
         {
-            pTa = T_POP(); /* pop Ta */
-            T_INSERT_TAIL_CHILD(pOp, pTa); /* child Ta */ 
-
-            T_POP_DUMP(); /* dump the ',' */
-
-            Parser_Ta();
+            return 0;
         }
 
-        pTa = T_POP(); /* pop Ta */
-        T_INSERT_TAIL_CHILD(pOp, pTa); /* child Ta */ 
-
-        T_PUSH(pOp); /* push tree Op */
+        if (depth) left[depth - 1]--;
+        if (pIn->children) left[depth++] = pIn->children;
 
-        LOG_BUP("T -> Ta ( ',' Ta )+");
+        while (depth && (left[depth - 1] == 0)) depth--;
     }
+
+    return (pHdr->numNodes && (depth == 0));
 }
 
 
-/*
- * Ew -> T 'where' Dr   => 'where'
- *    -> T
- */
-void Parser_Ew(void)
+/* Map the image in pFile (--image).  Returns NULL if it can't be used. */
+const ImgHeader * PreludeMap(const char * pFile)
 {
-    Token * pT;
-    Token * pOp;
-    Token * pDr;
+    struct stat st;
+    void * p;
+    int fd;
 
-    LOG_TDN("Ew -> T");
-    Parser_T();
-    LOG_BUP("Ew -> T");
+    if ((fd = open(pFile, O_RDONLY)) == -1)
+    {
+        printf("ERROR: %s: ", pFile);
+        fflush(stdout);
+        perror("Could not open file");
+        return NULL;
+    }
 
-    if (T_MATCH(T_SECOND(), T_KEYWORD, "where"))
+    if ((fstat(fd, &st) == -1) || (st.st_size < (off_t)sizeof(ImgHeader)) ||
+        ((p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) ==
+         MAP_FAILED))
     {
-        LOG_TDN("Ew -> T 'where' Dr");
+        p = NULL;
+    }
+    else if (!PreludeCheck((const ImgHeader *)p, st.st_size))
+    {
+        munmap(p, st.st_size);
+        p = NULL;
+    }
 
-        pT = T_POP(); /* pop T */
+    close(fd);
 
-        pOp = T_POP_OP(); /* pop 'where' */
+    if (p == NULL)
+    {
+        printf("ERROR: %s: not a prelude image built by this rpal\n", pFile);
+    }
 
-        Parser_Dr();
+    return (const ImgHeader *)p;
+}
 
-        pDr = T_POP(); /* pop Dr */
 
-        T_INSERT_TAIL_CHILD(pOp, pT);  /* left child T */ 
-        T_INSERT_TAIL_CHILD(pOp, pDr); /* right child Dr */
-        T_PUSH(pOp);                   /* push tree Op */
+/* Copy the next node (in pre-order) of the prelude image, and its subtree. */
+Token * PreludeNode(unsigned int * pNext, Token * pProgram)
+{
+    const ImgNode * pIn = &IMG_NODES(pImg)[*pNext];
+    Token * pToken;
+    Token * pChild;
+    unsigned int i;
 
-        LOG_BUP("Ew -> T 'where' Dr");
+    if ((*pNext)++ == pImg->hole) return pProgram;
+
+    pToken = TokenAlloc((TokenType)pIn->type, 0, IMG_STR(pImg, pIn->str));
+    pToken->offset = (pIn->offset | PRE_LOC);
+
+    for (i = 0; i < pIn->children; i++)
+    {
+        pChild = PreludeNode(pNext, pProgram); /* the macro uses it twice */
+        T_INSERT_TAIL_CHILD(pToken, pChild);
     }
+
+    return pToken;
 }
 
 
-/*
- * Parse an RPAL program!
- *
- * E -> 'let' D 'in' E   => 'let'
- *   -> 'fn' Vb+ '.' E   => 'lambda'
- *   -> Ew
- */
-void Parser_E(void)
+/* The whole program, the prelude with pProgram (its AST) in the hole. */
+Token * PreludeGraft(Token * pProgram)
 {
-    Token * pD;
-    Token * pE;
-    Token * pOp;
-    Token * pVb;
+    unsigned int next = 0;
 
-    if (T_MATCH(T_FIRST(), T_KEYWORD, "let"))
-    {
-        LOG_TDN("E -> 'let' D 'in' E");
+    return AstFinish(PreludeNode(&next, pProgram));
+}
 
-        pOp = T_POP(); /* pop 'let' */
 
-        Parser_D();
+/* Make pHdr the prelude of every program to come. */
+void PreludeUse(const ImgHeader * pHdr)
+{
+    pImg          = pHdr;
+    preLineStarts = IMG_LINES(pHdr);
+    numPreLines   = pHdr->numLines;
+    pPreName      = IMG_STR(pHdr, pHdr->name);
+}
 
-        pD = T_POP(); /* pop D */
 
-        T_VERIFY(T_KEYWORD, "in");
-        T_POP_DUMP(); /* dump the 'in' */
+void Usage(char * pPrg)
+{
+    printf("Usage: %s [ -hspPdlLeOr ] [ -st ] [ -vm ] [ -c <out.c> ] "
+           "[ --gc-stats ]\n"
+           "       [ --memo ] [ --profile <file> ] [ --sample <us> ]\n"
+           "       [ --max-steps <n> ] [ --max-heap <MB> ]\n"
+           "       [ --max-depth <n> ] [ --max-time <ms> ]\n"
+           "       [ --prelude <file> | --image <img> ] [ --query <pattern> ]\n"
+           "       <file> ...\n"
+           "       %s --build-image <prelude> -o <img>\n",
+           pPrg, pPrg);
+    printf("   -h      this usage info\n");
+    printf("   -s      stop after the scanner and print the tokens\n");
+    printf("   -p      print production rules top down\n");
+    printf("   -P      print production rules bottom up\n");
+    printf("   -d      share identical subtrees (DAG) and print the stats\n");
+    printf("   -l      print the source line:col of the tokens/AST nodes\n");
+    printf("   -L      use the table driven (DFA) scanner\n");
+    printf("   -st     print the standardized tree (ST) instead of the AST\n");
+    printf("   -e      run the program (on the CSE machine)\n");
+    printf("   -vm     run the program compiled to bytecode (on the VM)\n");
+    printf("   -O      fold the constant expressions first, print the stats\n");
+    printf("   -r      print the lexical address (depth,slot) of names and\n"
+           "           the free names\n");
+    printf("   -c <out.c>\n");
+    printf("           compile the program to C, build it with rpal_rt.h\n");
+    printf("   --gc-stats\n");
+    printf("           with -e/-vm, report the garbage collections\n");
+    printf("   --memo  with -e/-vm/-c, cache the results of the pure\n"
+           "           functions defined with rec, report the hits\n");
+    printf("   --profile <file>\n");
+    printf("           with -e/-vm, time the calls of each function, print\n"
+           "           the top ones and write the folded stacks to file\n");
+    printf("   --sample <us>\n");
+    printf("           with --profile, sample every us microseconds of CPU\n"
+           "           time instead of timing every call\n");
+    printf("   --max-steps <n>, --max-heap <MB>, --max-depth <n>, "
+           "--max-time <ms>\n");
+    printf("           with -e/-vm/-c, stop a program that makes more than\n"
+           "           n calls, has more than MB live, nests more than n\n"
+           "           calls deep or runs longer than ms (exit status 2,\n"
+           "           3, 4 or 5), then go on to the next file\n");
+    printf("   --prelude <file>\n");
+    printf("           put the 'let D in' chain in file in front of every\n"
+           "           program\n");
+    printf("   --build-image <prelude> -o <img>\n");
+    printf("           parse a prelude once and save its AST in img\n");
+    printf("   --image <img>\n");
+    printf("           like --prelude, with the AST mapped from img\n");
+    printf("   --query <pattern>\n");
+    printf("           print the nodes matching a kind (and child) pattern,\n");
+    printf("           e.g. 'function_form' or 'gamma(<ID:Print>, _)'\n");
+    printf("   <file>  RPAL program file(s), all the errors in each are reported\n");
+    exit(1);
+}
+
 
-        Parser_E();
+int scanOnly = 0;
+char * pQuery = NULL;
+int exitStatus = 0; /* of the last program a limit stopped */
 
-        pE = T_POP(); /* pop E */
 
-        T_INSERT_TAIL_CHILD(pOp, pD); /* left child D */
-        T_INSERT_TAIL_CHILD(pOp, pE); /* right child E */
-        T_PUSH(pOp);
+/* Scan and parse a single file.  Returns the number of errors found. */
+int ProcessFile(const char * pFile)
+{
+    TAILQ_HEAD(, _token) junk;
+    Token * pToken;
+    Token * pTree;
+    int errors;
+    int fd;
 
-        LOG_BUP("E -> 'let' D 'in' E");
-    }
-    else if (T_MATCH(T_FIRST(), T_KEYWORD, "fn"))
+    if ((fd = open(pFile, O_RDONLY)) == -1)
     {
-        LOG_TDN("E -> 'fn' Vb+ '.' E");
+        printf("ERROR: %s: ", pFile);
+        fflush(stdout);
+        perror("Could not open file");
+        return 1;
+    }
 
-        T_POP_DUMP(); /* dump the 'fn' */
+    srcFd       = fd; /* for the line table */
+    pRunFile    = pFile;
+    scanOffset  = 0;
+    errorOffset = (unsigned int)-1;
 
-        pOp = TokenAlloc(T_OPERATOR, 0, "lambda"); /* create a 'lambda' token */
+    if (dfaScanner) ScannerDfa(fd); /* Scan the program... */
+    else            Scanner(fd);
 
-        do
+    if (scanOnly)
+    {
+        while ((pToken = T_FIRST()) != NULL)
         {
-            Parser_Vb();
-            pVb = T_POP(); /* pop Vb */
-            T_INSERT_TAIL_CHILD(pOp, pVb); /* child Vb */
-        } while ((T_FIRST()->type == T_IDENTIFIER) ||
-                 (T_MATCH(T_FIRST(), T_PUNCTION, "(")));
+            T_REMOVE(pToken);
 
-        T_VERIFY(T_OPERATOR, ".");
-        T_POP_DUMP(); /* dump the '.' */
+            if (showLocations)
+            {
+                printf("%s [%s]\n",
+                       TokenToStr(pToken), LocToStr(pToken->offset));
+            }
+            else
+            {
+                printf("%s\n", TokenToStr(pToken));
+            }
 
-        Parser_E();
+            FreeAST(pToken);
+        }
+    }
+    else if (T_FIRST())
+    {
+        TAILQ_INIT(&junk);
 
-        pE = T_POP(); /* pop E */
+        Parser_E(); /* Parse the program... */
 
-        T_INSERT_TAIL_CHILD(pOp, pE); /* right child E */
-        T_PUSH(pOp); /* push tree Op */
+        pTree = T_POP();
+        pTree = AstFinish(pTree); /* a lone leaf was never pushed */
 
-        LOG_BUP("E -> 'fn' Vb+ '.' E");
-    }
-    else
-    {
-        LOG_TDN("E -> Ew");
-        Parser_Ew();
-        LOG_BUP("E -> Ew");
-    }
-}
+        /*
+         * Tokens left over after the program are an error.  Skip the first
+         * one and parse whatever follows to find any further errors, those
+         * trees are thrown away at the end.
+         */
+        while (T_FIRST())
+        {
+            Parser_Error(T_FIRST(), "end of file");
+            T_POP_DUMP();
 
+            if (T_FIRST())
+            {
+                Parser_E();
+                pToken = T_POP();
+                TAILQ_INSERT_TAIL(&junk, pToken, siblings);
+            }
+        }
 
-/* Recursively print the AST tree rooted at pRoot. */
-void DumpAST(Token * pRoot, int indent)
-{
-    Token * pChild;
-    int i;
+        if (numDiags == 0)
+        {
+            if (pImg) pTree = PreludeGraft(pTree);
 
-    if (pRoot == NULL) return;
+            if (pQuery)
+            {
+                IndexQuery(pQuery);
+            }
+            else
+            {
+                if (log_rules) printf("----------\n");
+
+                if (optimize)
+                {
+                    Fold(pTree);
+                    FoldStats();
+                }
+
+                if (memoize && (evaluate || vmRun)) Memo(pTree);
+                if (pProfFile) ProfMark(pTree);
+
+                if (resolveNames || (evaluate && !vmRun))
+                {
+                    Resolve(pTree);
+                    if (resolveNames) ResolveStats();
+                }
+
+                if ((standardize || evaluate) && !vmRun) Standardize(pTree);
+
+                if (pCFile)
+                {
+                    CgProgram(pTree);
+                }
+                else if (vmRun)
+                {
+                    VmRun(pTree);
+                }
+                else if (evaluate)
+                {
+                    Evaluate(pTree);
+                }
+                else
+                {
+                    DumpAST(pTree, 0);
+                    if (hashCons) HashConsStats(pTree);
+                }
+            }
+        }
 
-    for (i = 0; i < indent; i++) printf(".");
+        FreeAST(pTree);
 
-    /* XXX trailing space hack to match RPAL interpreter AST output */
-    printf("%s \n", TokenToStr(pRoot));
+        while ((pToken = junk.tqh_first) != NULL)
+        {
+            TAILQ_REMOVE(&junk, pToken, siblings);
+            FreeAST(pToken);
+        }
 
-    for (pChild = T_FIRST_CHILD(pRoot);
-         pChild != NULL;
-         pChild = T_NEXT(pChild))
+        HashConsFree();
+        IndexFree();
+        ResolveFree();
+    }
+
+    errors = numDiags;
+    DiagFlush(pFile);
+
+    if (rtStatus != RT_OK) /* a runtime error, see RtStop() */
     {
-        DumpAST(pChild, (indent + 1));
+        if (rtStatus != RT_ERROR) exitStatus = rtStatus;
+        rtStatus = RT_OK;
+        errors++;
     }
+
+    LineTableFree();
+    close(fd);
+
+    return errors;
 }
 
 
-/* Recursively free the AST tree rooted at pRoot. */
-void FreeAST(Token * pRoot)
+/* The number in an option's argument, -1 unless it's all digits and <= max. */
+long OptNum(const char * pArg, long max)
 {
-    Token * pChild;
+    char * pEnd;
+    long n;
 
-    if (pRoot != NULL)
-    {
-        while ((pChild = T_FIRST_CHILD(pRoot)) != NULL)
-        {
-            T_REMOVE(pChild);
-            FreeAST(pChild);
-        }
+    errno = 0;
+    n = strtol(pArg, &pEnd, 10);
 
-        //printf("FREE: %s\n", TokenToStr(pRoot));
-        TokenFree(pRoot);
+    if ((*pArg < '0') || (*pArg > '9') || *pEnd || (errno == ERANGE) ||
+        (n > max))
+    {
+        return -1;
     }
-}
-
 
-void Usage(char * pPrg)
-{
-    printf("Usage: %s [ -hspP ] <file>\n", pPrg);
-    printf("   -h      this usage info\n");
-    printf("   -s      stop after the scanner and print the tokens\n");
-    printf("   -p      print production rules top down\n");
-    printf("   -P      print production rules bottom up\n");
-    printf("   <file>  RPAL program file\n");
-    exit(1);
+    return n;
 }
 
 
 int main(int argc, char * argv[])
 {
-    Token * pToken;
-    int scanOnly = 0;
-    int fd, opt;
+    static struct option longOpts[] =
+    {
+        { "query",       required_argument, NULL, 'q' },
+        { "st",          no_argument,       NULL, 't' },
+        { "vm",          no_argument,       NULL, 'v' },
+        { "gc-stats",    no_argument,       NULL, 'g' },
+        { "memo",        no_argument,       NULL, 'm' },
+        { "profile",     required_argument, NULL, 'f' },
+        { "sample",      required_argument, NULL, 'S' },
+        { "max-steps",   required_argument, NULL, 'X' },
+        { "max-heap",    required_argument, NULL, 'H' },
+        { "max-depth",   required_argument, NULL, 'D' },
+        { "max-time",    required_argument, NULL, 'T' },
+        { "prelude",     required_argument, NULL, 'u' },
+        { "image",       required_argument, NULL, 'i' },
+        { "build-image", required_argument, NULL, 'b' },
+        { NULL,          0,                 NULL, 0   }
+    };
+    const ImgHeader * pHdr = NULL;
+    char * pPreFile = NULL;
+    char * pImgFile = NULL;
+    char * pBuildFile = NULL;
+    char * pOutFile = NULL;
+    int errors = 0;
+    int i, opt;
 
     TAILQ_INIT(&thead);
+    TAILQ_INIT(&dhead);
 
-    while ((opt = getopt(argc, argv, "hspP")) != -1)
+    /* long_only so -st works, single letter options are still short ones */
+    while ((opt = getopt_long_only(argc, argv, "hspPdlLeOrc:o:",
+                                   longOpts, NULL)) != -1)
     {
         switch (opt)
         {
+        case 'q': pQuery = optarg; break;
+        case 't': standardize = 1; break;
+        case 'e': evaluate = 1; break;
+        case 'O': optimize = 1; break;
+        case 'r': resolveNames = 1; break;
+        case 'v': vmRun = 1; break;
+        case 'c': pCFile = optarg; vmRun = 1; break;
+        case 'g': gcStats = 1; break;
+        case 'm': memoize = 1; break;
+        case 'f': pProfFile = optarg; break;
+        case 'S': profSample = OptNum(optarg, LONG_MAX); break;
+        case 'X': rtMaxSteps = OptNum(optarg, LONG_MAX); break;
+        case 'H': rtMaxHeap = OptNum(optarg, (LONG_MAX >> 20)); break;
+        case 'D': rtMaxDepth = OptNum(optarg, INT_MAX); break;
+        case 'T': rtMaxTime = OptNum(optarg, LONG_MAX); break;
+        case 'u': pPreFile = optarg; break;
+        case 'i': pImgFile = optarg; break;
+        case 'b': pBuildFile = optarg; break;
+        case 'o': pOutFile = optarg; break;
         case 's': scanOnly = 1; break;
         case 'p': log_rules |= LOG_RULE_TDN; break;
         case 'P': log_rules |= LOG_RULE_BUP; break;
+        case 'd': hashCons = 1; break;
+        case 'l': showLocations = 1; break;
+        case 'L': dfaScanner = 1; break;
         case 'h': default: Usage(argv[0]); break;
         }
     }
 
-    if (optind == argc)
+    if ((((standardize || evaluate) && !vmRun) || optimize || resolveNames) &&
+        hashCons)
     {
-        printf("ERROR: must specify input file\n");
+        printf("ERROR: -st/-e/-O/-r rewrite the tree in place, they can't be "
+               "used with -d\n");
         Usage(argv[0]);
     }
 
-    if ((fd = open(argv[optind], O_RDONLY)) == -1)
+    if ((pProfFile && (!(evaluate || vmRun) || pCFile ||
+                       ((argc - optind) > 1))) ||
+        (profSample < 0) || (profSample && !pProfFile))
     {
-        perror("Could not open file");
-        exit(1);
+        printf("ERROR: --profile runs a single file with -e/-vm, "
+               "--sample takes a number of microseconds\n");
+        Usage(argv[0]);
     }
 
-    Scanner(fd); /* Scan the program... */
+    if ((rtMaxSteps < 0) || (rtMaxHeap < 0) || (rtMaxDepth < 0) ||
+        (rtMaxTime < 0) ||
+        ((rtMaxSteps || rtMaxHeap || rtMaxDepth || rtMaxTime) &&
+         !(evaluate || vmRun)))
+    {
+        printf("ERROR: the --max limits take a number (0 is none), with "
+               "-e/-vm/-c\n");
+        Usage(argv[0]);
+    }
 
-    close(fd);
+    if ((pBuildFile && (!pOutFile || (optind != argc) || pPreFile ||
+                        pImgFile)) ||
+        (pOutFile && !pBuildFile))
+    {
+        printf("ERROR: --build-image <prelude> -o <image> takes no other "
+               "files\n");
+        Usage(argv[0]);
+    }
 
-    if (scanOnly)
+    if (pPreFile && pImgFile)
     {
-        while ((pToken = T_FIRST()) != NULL)
-        {
-            T_REMOVE(pToken);
-            printf("%s\n", TokenToStr(pToken));
-            FreeAST(pToken);
-        }
+        printf("ERROR: a program gets one prelude, use one of "
+               "--prelude/--image\n");
+        Usage(argv[0]);
     }
-    else if (T_FIRST())
+
+    if (pBuildFile) /* save the prelude image, that's all */
     {
-        Parser_E(); /* Parse the program... */
+        if ((pHdr = PreludeBuild(pBuildFile)) == NULL) return 1;
 
-        while ((pToken = T_FIRST()) != NULL)
-        {
-            T_REMOVE(pToken);
-            if (log_rules) printf("----------\n");
-            DumpAST(pToken, 0);
-            FreeAST(pToken);
-        }
+        return PreludeWrite(pHdr, pOutFile);
     }
-}
 
+    if (optind == argc)
+    {
+        printf("ERROR: must specify input file\n");
+        Usage(argv[0]);
+    }
+
+    if (pCFile && ((argc - optind) > 1))
+    {
+        printf("ERROR: -c compiles a single file\n");
+        Usage(argv[0]);
+    }
+
+    if (pPreFile) pHdr = PreludeBuild(pPreFile);
+    if (pImgFile) pHdr = PreludeMap(pImgFile);
+
+    if (pPreFile || pImgFile)
+    {
+        if (pHdr == NULL) return 1;
+        PreludeUse(pHdr);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        if ((argc - optind) > 1) printf("FILE: %s\n", argv[i]);
+        errors += ProcessFile(argv[i]);
+    }
+
+    if (exitStatus) return exitStatus;
+
+    return (errors) ? 1 : 0;
+}
@@ -0,0 +1,3154 @@
+
+/*
+ * RPAL runtime: values, the garbage collected heap, big integers and the
+ * builtins.  It's shared by the interpreter (parser.c, -e and -vm) and the C
+ * programs that rpal -c writes, which define RPAL_RT_MAIN and include it:
+ *
+ *   % rpal -c fib.c fib && gcc -O2 -pthread -I<rpal> fib.c -o fib
+ *
+ * Definitions and all, include it once per program.  The includer provides
+ * LocToStr() (a source offset as "line:col"), ClosurePrint() and RtRoots(),
+ * any roots of its own for the collector.
+ *
+ * License: (Beerware) This code is public domain and can be used without
+ * restriction.  Just buy me a beer if we should ever meet.
+ */
+
+#ifndef RPAL_RT_H
+#define RPAL_RT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <time.h>
+
+
+char * LocToStr(unsigned int offset);
+void RtRoots(int minor);
+
+
+/* Double the capacity (*pMax) of a dynamic array of size byte elements. */
+void * ArrayGrow(void * pArray, int * pMax, int size)
+{
+    *pMax = (*pMax) ? (*pMax * 2) : 64;
+
+    if ((pArray = realloc(pArray, (*pMax * size))) == NULL)
+    {
+        perror("Failed to realloc memory");
+        exit(1);
+    }
+
+    return pArray;
+}
+
+
+const char * pRunFile = NULL;
+
+
+/*
+ * Resource limits (--max-steps, --max-heap, --max-depth and --max-time),
+ * for running programs that can't be trusted, 0 is no limit.  A step is a
+ * call, counted as its frame is pushed (RT_STEP()), and every
+ * RT_STEP_CHECK of them and at every collection the clock is looked at.
+ * The depth is the number of frames, checked when the frame stack is full
+ * up to its cap (see RtDepth()).  The heap is the live data, what's left
+ * after a full collection, or a single allocation that size (see
+ * GcAllocSlow()).  Going over a limit is a runtime error of its own kind.
+ *
+ * A runtime error gives up on the program.  rpal itself runs it with
+ * pRtJmp set and goes back there to carry on with the next file, the exit
+ * status says what went wrong (RT_ERROR, RT_STEPS, ...).
+ */
+enum { RT_OK, RT_ERROR, RT_STEPS, RT_HEAP, RT_DEPTH, RT_TIME };
+
+#define RT_STEP_CHECK 4096
+
+long rtMaxSteps = 0;   /* calls */
+long rtMaxHeap = 0;    /* MB */
+int rtMaxDepth = 0;    /* frames */
+long rtMaxTime = 0;    /* ms */
+long rtSteps = 0;
+long rtStepCheck = 0;  /* the step RtCheck() looks at the limits */
+long rtDeadline = 0;   /* ns */
+int rtStatus = RT_OK;  /* how the program ended */
+jmp_buf * pRtJmp = NULL;
+
+
+/* Give up on the program, back to rpal or out with rtStatus. */
+void RtStop(int status)
+{
+    fflush(stdout);
+    if (rtStatus == RT_OK) rtStatus = status;
+    if (pRtJmp) longjmp(*pRtJmp, 1);
+    exit(rtStatus);
+}
+
+
+/* Report a runtime error at a source offset and give up. */
+void RtError(unsigned int offset, const char * pFmt, ...)
+{
+    va_list args;
+
+    fflush(stdout);
+    printf("\nERROR: %s:%s: ", pRunFile, LocToStr(offset));
+    va_start(args, pFmt);
+    vprintf(pFmt, args);
+    va_end(args);
+    printf("\n");
+    RtStop(RT_ERROR);
+}
+
+
+/* Report going over a limit and give up. */
+void RtLimit(int status, const char * pFmt, ...)
+{
+    va_list args;
+
+    fflush(stdout);
+    printf("\nERROR: %s: ", pRunFile);
+    va_start(args, pFmt);
+    vprintf(pFmt, args);
+    va_end(args);
+    printf("\n");
+    RtStop(status);
+}
+
+
+static inline long RtNow(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((now.tv_sec * 1000000000L) + now.tv_nsec);
+}
+
+
+/*
+ * Past --max-time?  Also looked at between the steps of a builtin that can
+ * take long on a single huge integer (**, / and ItoS), which overshoots by
+ * one multiplication at most.
+ */
+static inline int RtLate(void)
+{
+    return (rtMaxTime && (RtNow() >= rtDeadline));
+}
+
+
+void RtTimeUp(void)
+{
+    RtLimit(RT_TIME, "time limit reached (%ld ms)", rtMaxTime);
+}
+
+
+/* Check the step and time limits, and when to check them next. */
+void RtCheck(void)
+{
+    if (rtMaxSteps && (rtSteps > rtMaxSteps))
+    {
+        RtLimit(RT_STEPS, "step limit reached (%ld calls)", rtMaxSteps);
+    }
+
+    if (RtLate()) RtTimeUp();
+
+    rtStepCheck = (rtMaxTime) ? (rtSteps + RT_STEP_CHECK) : LONG_MAX;
+
+    if (rtMaxSteps && (rtStepCheck > rtMaxSteps))
+    {
+        rtStepCheck = (rtMaxSteps + 1);
+    }
+}
+
+
+#define RT_STEP() if (++rtSteps >= rtStepCheck) RtCheck()
+
+
+/*
+ * A frame stack is full up to its cap with num frames (and room for max).
+ * Gives up at --max-depth, otherwise returns the new cap.
+ */
+int RtDepth(int num, int max)
+{
+    if (rtMaxDepth && (num >= rtMaxDepth))
+    {
+        RtLimit(RT_DEPTH, "depth limit reached (%d calls deep)", rtMaxDepth);
+    }
+
+    return (rtMaxDepth && (rtMaxDepth < max)) ? rtMaxDepth : max;
+}
+
+
+/* A program starts, so do the limits. */
+void RtStart(void)
+{
+    rtStatus    = RT_OK;
+    rtSteps     = 0;
+    rtStepCheck = 0; /* the first call sets it */
+    rtDeadline  = (RtNow() + (rtMaxTime * 1000000L));
+}
+
+
+typedef struct _arenablock
+{
+    struct _arenablock * pNext;
+    size_t               size;
+    size_t               used;
+    char                 data[];
+} ArenaBlock;
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+ArenaBlock * pArena = NULL;
+
+
+/* Allocate size bytes (8 byte aligned) from the run arena. */
+void * ArenaAlloc(size_t size)
+{
+    ArenaBlock * pBlock;
+    size_t bsize;
+    void * p;
+
+    size = ((size + 7) & ~(size_t)7);
+
+    if (!pArena || ((pArena->used + size) > pArena->size))
+    {
+        bsize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+
+        if ((pBlock = (ArenaBlock *)malloc(sizeof(ArenaBlock) + bsize)) == NULL)
+        {
+            perror("Failed to malloc memory");
+            exit(1);
+        }
+
+        pBlock->size  = bsize;
+        pBlock->used  = 0;
+        pBlock->pNext = pArena;
+        pArena        = pBlock;
+    }
+
+    p = (pArena->data + pArena->used);
+    pArena->used += size;
+
+    return p;
+}
+
+
+/* Release the whole run arena. */
+void ArenaFree(void)
+{
+    ArenaBlock * pBlock;
+
+    while ((pBlock = pArena) != NULL)
+    {
+        pArena = pBlock->pNext;
+        free(pBlock);
+    }
+}
+
+
+typedef enum
+{
+    V_INT,
+    V_TRUTH,
+    V_STR,
+    V_TUPLE,   /* nil is the empty tuple */
+    V_DUMMY,
+    V_CLOSURE,
+    V_ETA,     /* a closure tied to itself by Y* */
+    V_YSTAR,
+    V_BUILTIN,
+    V_ENV,     /* not a value, environments are heap objects too */
+    V_TUPLEVEC /* not a value, the values of aug'd tuples (see TupleAug()) */
+} ValueType;
+
+/*
+ * A value is a single machine word.  Integers that fit in 63 bits,
+ * truthvalues, nil, dummy and Y* are immediates tagged in the low bits,
+ * everything else points at an (8 byte aligned) heap object whose first
+ * field is a header with its type (and the GC flags, see GcAlloc()):
+ *
+ *   ...nnnn1   integer n
+ *   ...pp10    immediate, payload << 8 | type << 2
+ *   ...pp00    RtStr, Tuple, Closure, Builtin or a BigInt
+ *
+ * An integer is a BigInt only when it doesn't fit in an immediate, so the
+ * same number always has the same representation.
+ */
+typedef uintptr_t Value;
+
+#define V_TAG_INT  1
+#define V_TAG_IMM  2
+#define V_IMM(t, p) (((Value)(p) << 8) | ((t) << 2) | V_TAG_IMM)
+
+#define V_TYPE(v)                                                  \
+    (((v) & V_TAG_INT) ? V_INT                                :    \
+     ((v) & V_TAG_IMM) ? (ValueType)(((v) >> 2) & 0x3f)       :    \
+                         (ValueType)(((Obj *)(v))->hdr & GC_TYPE_MASK))
+#define V_IS(v, t) (V_TYPE(v) == (t))
+
+#define RT_FALSE V_IMM(V_TRUTH, 0)
+#define RT_TRUE  V_IMM(V_TRUTH, 1)
+#define RT_NIL   V_IMM(V_TUPLE, 0)
+#define RT_DUMMY V_IMM(V_DUMMY, 0)
+#define RT_YSTAR V_IMM(V_YSTAR, 0)
+
+#define V_SMALL_MIN (LONG_MIN >> 1)
+#define V_SMALL_MAX (LONG_MAX >> 1)
+
+#define V_IS_SMALL(v)  ((v) & V_TAG_INT)
+#define V_SMALL(v)     ((long)(v) >> 1)
+#define V_INT_SMALL(n) (((Value)(n) << 1) | V_TAG_INT)
+#define V_BOOL(v)      ((int)((v) >> 8))
+#define V_PBIG(v)      ((BigInt *)(v))
+#define V_PSTR(v)      ((RtStr *)(v))
+#define V_PTUPLE(v)    ((Tuple *)(v))
+#define V_PCLOSURE(v)  ((Closure *)(v))
+#define V_PBUILTIN(v)  ((Builtin *)(v))
+#define V_PVIEW(v)     ((TupleView *)(v))
+#define V_PROPE(v)     ((Rope *)(v))
+#define V_PSLICE(v)    ((StrSlice *)(v))
+#define V_IS_ROPE(v)   (V_PSTR(v)->hdr & STR_ROPE)
+#define V_TUPLE_NUM(v) (((v) == RT_NIL) ? 0 : V_PTUPLE(v)->num)
+
+/* the values of a (non-nil) tuple, its own or those of the vector it views */
+#define V_TUPLE_V(t)                                                 \
+    ((V_PTUPLE(t)->hdr & TUPLE_VIEW) ? V_PVIEW(t)->pVec->v : V_PTUPLE(t)->v)
+
+#define GC_TYPE_MASK  0xff
+#define GC_OLD        0x100 /* promoted out of the nursery */
+#define GC_STATIC     0x200 /* loaded with the program, never moves */
+#define GC_REMEMBERED 0x400 /* old and may point into the nursery */
+#define GC_FORWARD    0x800 /* copied, the new address follows the header */
+#define TUPLE_VIEW    0x1000 /* a TupleView, not a Tuple (kept by the GC) */
+#define STR_ROPE      0x2000 /* a Rope, not an RtStr (kept by the GC) */
+#define STR_SLICE     0x4000 /* a StrSlice, not an RtStr (kept by the GC) */
+
+typedef struct _obj
+{
+    unsigned int hdr;
+} Obj;
+
+typedef uint32_t Limb;
+typedef uint64_t Limb2;
+
+typedef struct _bigint
+{
+    unsigned int hdr;
+    int          size;  /* limbs, negative for a negative number */
+    Limb         d[];   /* magnitude, least significant limb first */
+} BigInt;
+
+typedef struct _rtstr
+{
+    unsigned int hdr;
+    int          len;
+    char         s[];
+} RtStr;
+
+/*
+ * A string made by Conc (or Stern) is a rope, a tree whose leaves are
+ * RtStrs and StrSlices.  All three start with the hdr and len of an RtStr,
+ * so V_PSTR(v)->len is the length of any string, but only a flat string
+ * (neither flag set) has its chars in s[] (see StrChars()).
+ */
+typedef struct _rope
+{
+    unsigned int hdr;   /* V_STR | STR_ROPE */
+    int          len;
+    int          depth; /* of the tree, the leaves are 0 */
+    Value        left;
+    Value        right;
+} Rope;
+
+typedef struct _strslice
+{
+    unsigned int hdr;   /* V_STR | STR_SLICE */
+    int          len;
+    int          off;
+    Value        base;  /* the RtStr whose chars from off on are these */
+} StrSlice;
+
+typedef struct _tuple
+{
+    unsigned int hdr;
+    int          num;
+    Value        v[];
+} Tuple;
+
+/*
+ * An aug'd tuple is a view of the first num values of a vector with room to
+ * grow, shared by the tuples aug'd from each other (see TupleAug()).
+ */
+typedef struct _tuplevec
+{
+    unsigned int hdr;
+    int          cap;
+    int          used;  /* values appended so far, no view sees past it */
+    Value        v[];
+} TupleVec;
+
+typedef struct _tupleview
+{
+    unsigned int hdr;   /* V_TUPLE | TUPLE_VIEW */
+    int          num;
+    TupleVec *   pVec;
+} TupleView;
+
+typedef struct _env
+{
+    unsigned int  hdr;
+    int           num;
+    struct _env * pParent;
+    struct _ctl * pCtl;     /* the lambda that made it, has the names */
+    Value         v[];
+} Env;
+
+typedef struct _closure
+{
+    unsigned int    hdr;    /* V_CLOSURE or V_ETA */
+    int             num;    /* captured values (VM) */
+    struct _ctl *   pCtl;   /* CSE machine, NULL on the VM */
+    union
+    {
+        Env *           pEnv;   /* CSE machine */
+        struct _proto * pProto; /* VM (--vm) */
+    };
+    Value           v[];    /* VM, the values of its function's free names */
+} Closure;
+
+typedef struct _builtin
+{
+    unsigned int hdr;
+    int          id;
+    int          nargs;   /* args collected so far (Conc takes two) */
+    Value        arg;
+} Builtin;
+
+
+/*
+ * The runtime heap.  Everything allocated while a program runs comes from
+ * a bump allocated nursery.  A collection copies the live objects out of
+ * it into the old generation (a list of chunks), or when the old
+ * generation has doubled since the last full collection, copies
+ * everything live (young and old) into a fresh set of chunks (Cheney).
+ *
+ * Collections only happen at safe points, the calls, where every live
+ * value is in a root: the value stacks, the frames (and their
+ * environments).  So the C code never has to worry about an object moving
+ * under it, and allocation itself never collects.  When the nursery is
+ * full the allocation spills into an overflow chunk and a collection is
+ * due at the next safe point.  The only store into an object that is
+ * already old is a VM let binding (STOREV), that's the write barrier.
+ *
+ * Objects made while loading the program (the literals) come from the
+ * arena and are marked static, the collector never moves them.
+ */
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (4 * 1024 * 1024)
+#endif
+#ifndef GC_CHUNK_SIZE
+#define GC_CHUNK_SIZE   (1024 * 1024)
+#endif
+#ifndef GC_OLD_MIN
+#define GC_OLD_MIN      (8 * 1024 * 1024)
+#endif
+
+#define GC_IS_YOUNG(v) \
+    ((v) && !((v) & 3) && !(((Obj *)(v))->hdr & (GC_OLD | GC_STATIC)))
+
+int gcLive = 0;       /* a program is running, allocate from the heap */
+int gcPending = 0;    /* the nursery is full, collect at the safe point */
+int gcStats = 0;      /* --gc-stats */
+
+ArenaBlock * pNursery = NULL;
+ArenaBlock * pYoungExtra = NULL;  /* nursery overflow */
+size_t gcExtraSize = 0;
+ArenaBlock * pOldHead = NULL;
+ArenaBlock * pOldTail = NULL;
+size_t gcOldUsed = 0;
+size_t gcOldLimit = GC_OLD_MIN;
+
+Obj ** ppRemembered = NULL;
+int numRemembered = 0;
+int maxRemembered = 0;
+
+struct
+{
+    long   numMinor;
+    long   numMajor;
+    double allocated;   /* bytes */
+    double young;       /* bytes in the nursery when collected */
+    double promoted;
+    double majorBefore;
+    double majorAfter;
+    double pauseTotal;  /* ms */
+    double pauseMax;
+    size_t peakOld;
+} gcStat;
+
+void GcCollect(void);
+void GcInit(void);
+void GcFree(void);
+
+
+ArenaBlock * GcChunk(size_t size)
+{
+    ArenaBlock * pChunk;
+
+    if ((pChunk = (ArenaBlock *)malloc(sizeof(ArenaBlock) + size)) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    pChunk->size  = size;
+    pChunk->used  = 0;
+    pChunk->pNext = NULL;
+
+    return pChunk;
+}
+
+
+/* Allocate from a nursery overflow chunk, a collection is now due. */
+void * GcAllocSlow(size_t size)
+{
+    ArenaBlock * pChunk = pYoungExtra;
+
+    gcPending = 1;
+
+    if (!pChunk || ((pChunk->used + size) > pChunk->size))
+    {
+        /* more than --max-heap before the next collection */
+        if (rtMaxHeap && ((gcExtraSize + size) > ((size_t)rtMaxHeap << 20)))
+        {
+            RtLimit(RT_HEAP, "heap limit reached (%ld MB)", rtMaxHeap);
+        }
+
+        pChunk = GcChunk((size > GC_CHUNK_SIZE) ? size : GC_CHUNK_SIZE);
+        gcExtraSize  += pChunk->size;
+        pChunk->pNext = pYoungExtra;
+        pYoungExtra   = pChunk;
+    }
+
+    pChunk->used += size;
+
+    return (pChunk->data + pChunk->used - size);
+}
+
+
+/* A new heap object of size bytes and the given type. */
+static inline void * GcAlloc(size_t size, ValueType type)
+{
+    Obj * pObj;
+
+    /* room for the forwarding address */
+    size = (size < 16) ? 16 : ((size + 7) & ~(size_t)7);
+
+    if (!gcLive)
+    {
+        pObj = (Obj *)ArenaAlloc(size);
+        pObj->hdr = (type | GC_STATIC);
+        return pObj;
+    }
+
+    gcStat.allocated += size;
+
+    if ((pNursery->used + size) <= pNursery->size)
+    {
+        pObj = (Obj *)(pNursery->data + pNursery->used);
+        pNursery->used += size;
+    }
+    else
+    {
+        pObj = (Obj *)GcAllocSlow(size);
+    }
+
+    pObj->hdr = type;
+    return pObj;
+}
+
+
+void GcRemember(Obj * pObj)
+{
+    if (numRemembered == maxRemembered)
+    {
+        ppRemembered = (Obj **)ArrayGrow(ppRemembered, &maxRemembered,
+                                         sizeof(Obj *));
+    }
+
+    pObj->hdr |= GC_REMEMBERED;
+    ppRemembered[numRemembered++] = pObj;
+}
+
+/* an old object is about to point at v */
+#define GC_WRITE_BARRIER(pObj, v)                                    \
+    if (((pObj)->hdr & GC_OLD) && !((pObj)->hdr & GC_REMEMBERED) &&  \
+        GC_IS_YOUNG(v))                                              \
+    {                                                                \
+        GcRemember((Obj *)(pObj));                                   \
+    }
+
+
+enum
+{
+    OP_PLUS, OP_MINUS, OP_MUL, OP_DIV, OP_POW,
+    OP_GR, OP_GE, OP_LS, OP_LE, OP_EQ, OP_NE,
+    OP_AND, OP_OR, OP_AUG, OP_NOT, OP_NEG
+};
+
+enum
+{
+    B_PRINT, B_CONC, B_STEM, B_STERN, B_ORDER, B_ISINTEGER, B_ISTRUTHVALUE,
+    B_ISSTRING, B_ISTUPLE, B_ISFUNCTION, B_ISDUMMY, B_NULL, B_ITOS,
+    B_NUM
+};
+
+const char * builtinNames[B_NUM] =
+{
+    "Print", "Conc", "Stem", "Stern", "Order", "Isinteger", "Istruthvalue",
+    "Isstring", "Istuple", "Isfunction", "Isdummy", "Null", "ItoS"
+};
+
+Builtin builtins[B_NUM];
+
+
+/* The builtins are static objects, set up before a program runs. */
+void BuiltinInit(void)
+{
+    int i;
+
+    for (i = 0; i < B_NUM; i++)
+    {
+        builtins[i].hdr = (V_BUILTIN | GC_STATIC);
+        builtins[i].id  = i;
+    }
+}
+
+
+/* The id of the builtin called pName, -1 if there's none. */
+int BuiltinFind(const char * pName)
+{
+    int i;
+
+    for (i = 0; i < B_NUM; i++)
+    {
+        if (strcmp(pName, builtinNames[i]) == 0) return i;
+    }
+
+    return -1;
+}
+
+
+/*
+ * Big integers.  A BigInt is a sign and a magnitude in 32 bit limbs.  The
+ * arithmetic below works on magnitudes (limbs and a count, the top limb
+ * may be zero) and the operators on values put the sign back on.
+ * Multiplication is schoolbook up to BIG_KARATSUBA limbs and Karatsuba
+ * above that.  None of it can collect, so the operands stay put.
+ */
+#ifndef BIG_KARATSUBA
+#define BIG_KARATSUBA 32
+#endif
+
+#if defined(__GNUC__)
+#define INT_MUL_OK(x, y, pN) (!__builtin_mul_overflow((x), (y), (pN)))
+#else /* two 31 bit numbers can't overflow */
+#define INT_MUL_OK(x, y, pN)                                         \
+    ((((unsigned long)(x) + 0x40000000UL) < 0x80000000UL) &&         \
+     (((unsigned long)(y) + 0x40000000UL) < 0x80000000UL) &&         \
+     ((*(pN) = ((x) * (y))), 1))
+#endif
+
+/* an integer operand as a magnitude, an immediate is spread over buf */
+typedef struct _bignum
+{
+    int          neg;
+    int          len;
+    const Limb * pD;
+    Limb         buf[2];
+} BigNum;
+
+
+/* A zeroed BigInt of len limbs. */
+BigInt * BigAlloc(int len)
+{
+    BigInt * pBig;
+
+    pBig = (BigInt *)GcAlloc((sizeof(BigInt) + (len * sizeof(Limb))), V_INT);
+    pBig->size = len;
+    memset(pBig->d, 0, (len * sizeof(Limb)));
+
+    return pBig;
+}
+
+
+Limb * BigScratch(int len)
+{
+    Limb * pD;
+
+    if ((pD = (Limb *)calloc(len, sizeof(Limb))) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    return pD;
+}
+
+
+/* A BigInt for a long that doesn't fit in an immediate. */
+Value BigFromLong(long num)
+{
+    BigInt * pBig = BigAlloc(2);
+    Limb2 mag = (num < 0) ? (0 - (Limb2)num) : (Limb2)num;
+
+    pBig->d[0] = (Limb)mag;
+    pBig->d[1] = (Limb)(mag >> 32);
+
+    if (!pBig->d[1]) pBig->size = 1;
+    if (num < 0) pBig->size = -pBig->size;
+
+    return (Value)pBig;
+}
+
+
+/* An integer, a BigInt only when it doesn't fit in an immediate. */
+static inline Value ValueInt(long num)
+{
+    if ((num >= V_SMALL_MIN) && (num <= V_SMALL_MAX))
+    {
+        return V_INT_SMALL(num);
+    }
+
+    return BigFromLong(num);
+}
+
+
+/* Finish a result of (at most) len limbs, an immediate if it fits. */
+Value BigNormal(BigInt * pBig, int len, int neg)
+{
+    Limb2 mag;
+
+    while (len && !pBig->d[len - 1]) len--;
+
+    if (len <= 2)
+    {
+        mag = (len) ? pBig->d[0] : 0;
+        if (len == 2) mag |= ((Limb2)pBig->d[1] << 32);
+
+        if (mag <= (Limb2)V_SMALL_MAX)
+        {
+            return ValueInt((neg) ? -(long)mag : (long)mag);
+        }
+
+        if (neg && (mag == ((Limb2)V_SMALL_MAX + 1)))
+        {
+            return ValueInt(V_SMALL_MIN);
+        }
+    }
+
+    /* the unused top limbs are dropped when it's copied */
+    pBig->size = (neg) ? -len : len;
+
+    return (Value)pBig;
+}
+
+
+void BigOperand(Value v, BigNum * pNum)
+{
+    Limb2 mag;
+
+    if (V_IS_SMALL(v))
+    {
+        pNum->neg = (V_SMALL(v) < 0);
+        mag = (pNum->neg) ? (0 - (Limb2)V_SMALL(v)) : (Limb2)V_SMALL(v);
+        pNum->buf[0] = (Limb)mag;
+        pNum->buf[1] = (Limb)(mag >> 32);
+        pNum->len = (pNum->buf[1]) ? 2 : (pNum->buf[0]) ? 1 : 0;
+        pNum->pD  = pNum->buf;
+    }
+    else
+    {
+        pNum->neg = (V_PBIG(v)->size < 0);
+        pNum->len = abs(V_PBIG(v)->size);
+        pNum->pD  = V_PBIG(v)->d;
+    }
+}
+
+
+int BigCmpMag(const Limb * pA, int na, const Limb * pB, int nb)
+{
+    if (na != nb) return (na < nb) ? -1 : 1;
+
+    while (na--)
+    {
+        if (pA[na] != pB[na]) return (pA[na] < pB[na]) ? -1 : 1;
+    }
+
+    return 0;
+}
+
+
+/* r[0..nr) += a[0..na) for na <= nr, returns the carry out. */
+Limb BigAddTo(Limb * pR, int nr, const Limb * pA, int na)
+{
+    Limb2 t = 0;
+    int i;
+
+    for (i = 0; i < na; i++)
+    {
+        t += ((Limb2)pR[i] + pA[i]);
+        pR[i] = (Limb)t;
+        t >>= 32;
+    }
+
+    for (; t && (i < nr); i++)
+    {
+        t += pR[i];
+        pR[i] = (Limb)t;
+        t >>= 32;
+    }
+
+    return (Limb)t;
+}
+
+
+/* r[0..nr) -= a[0..na) for na <= nr, returns the borrow out. */
+Limb BigSubFrom(Limb * pR, int nr, const Limb * pA, int na)
+{
+    Limb borrow = 0;
+    Limb2 t;
+    int i;
+
+    for (i = 0; i < na; i++)
+    {
+        t = ((Limb2)pR[i] - pA[i] - borrow);
+        pR[i] = (Limb)t;
+        borrow = (Limb)(t >> 63);
+    }
+
+    for (; borrow && (i < nr); i++)
+    {
+        t = ((Limb2)pR[i] - borrow);
+        pR[i] = (Limb)t;
+        borrow = (Limb)(t >> 63);
+    }
+
+    return borrow;
+}
+
+
+/* r[0..na+nb) += a * b, schoolbook. */
+void BigMulBasic(Limb * pR, const Limb * pA, int na, const Limb * pB, int nb)
+{
+    Limb2 t;
+    int i;
+    int j;
+
+    for (i = 0; i < nb; i++)
+    {
+        t = 0;
+
+        for (j = 0; j < na; j++)
+        {
+            t += (((Limb2)pA[j] * pB[i]) + pR[i + j]);
+            pR[i + j] = (Limb)t;
+            t >>= 32;
+        }
+
+        pR[i + na] = (Limb)t;
+    }
+}
+
+
+/*
+ * r[0..na+nb) = a * b, r starts out zeroed.  Karatsuba splits both at m
+ * limbs, a = a1.B^m + a0 and b = b1.B^m + b0, and gets by with three
+ * products instead of four:
+ *
+ *   a.b = a1.b1.B^2m + ((a0 + a1)(b0 + b1) - a0.b0 - a1.b1).B^m + a0.b0
+ */
+void BigMul(Limb * pR, const Limb * pA, int na, const Limb * pB, int nb)
+{
+    const Limb * pT;
+    Limb * pSa;
+    Limb * pSb;
+    Limb * pZ;
+    int la;
+    int lb;
+    int m;
+    int n;
+    int i;
+
+    if (na < nb)
+    {
+        pT = pA; pA = pB; pB = pT;
+        n  = na; na = nb; nb = n;
+    }
+
+    if ((nb < BIG_KARATSUBA) || (nb < 4)) /* (a0 + a1) has to be shorter */
+    {
+        BigMulBasic(pR, pA, na, pB, nb);
+        return;
+    }
+
+    if (na >= (2 * nb)) /* lopsided, a piece of a at a time */
+    {
+        pZ = BigScratch(2 * nb);
+
+        for (i = 0; i < na; i += nb)
+        {
+            n = ((na - i) < nb) ? (na - i) : nb;
+            memset(pZ, 0, ((n + nb) * sizeof(Limb)));
+            BigMul(pZ, (pA + i), n, pB, nb);
+            BigAddTo((pR + i), (na + nb - i), pZ, (n + nb));
+        }
+
+        free(pZ);
+        return;
+    }
+
+    m  = (na / 2);
+    la = (na - m + 1);
+    lb = (((nb - m) > m) ? (nb - m) : m) + 1;
+
+    pSa = BigScratch(2 * (la + lb));
+    pSb = (pSa + la);
+    pZ  = (pSb + lb);
+
+    BigMul(pR, pA, m, pB, m);
+    BigMul((pR + (2 * m)), (pA + m), (na - m), (pB + m), (nb - m));
+
+    memcpy(pSa, (pA + m), ((na - m) * sizeof(Limb)));
+    BigAddTo(pSa, la, pA, m);
+    memcpy(pSb, (pB + m), ((nb - m) * sizeof(Limb)));
+    BigAddTo(pSb, lb, pB, m);
+
+    BigMul(pZ, pSa, la, pSb, lb);
+    BigSubFrom(pZ, (la + lb), pR, (2 * m));
+    BigSubFrom(pZ, (la + lb), (pR + (2 * m)), (na + nb - (2 * m)));
+
+    for (n = (la + lb); (n > (na + nb - m)) && !pZ[n - 1]; n--);
+
+    BigAddTo((pR + m), (na + nb - m), pZ, n);
+
+    free(pSa);
+}
+
+
+/*
+ * q[0..nu-nv] = u / v, for nu >= nv and v[nv-1] != 0 (Knuth's algorithm
+ * D, with v shifted up so its top bit is set).
+ */
+void BigDivMag(Limb * pQ, const Limb * pU, int nu, const Limb * pV, int nv)
+{
+    Limb * pUn;
+    Limb * pVn;
+    Limb2 qhat;
+    Limb2 rhat;
+    Limb2 p;
+    int64_t k;
+    int64_t t;
+    int s;
+    int i;
+    int j;
+
+    if (nv == 1)
+    {
+        for (rhat = 0, j = (nu - 1); j >= 0; j--)
+        {
+            rhat  = ((rhat << 32) | pU[j]);
+            pQ[j] = (Limb)(rhat / pV[0]);
+            rhat %= pV[0];
+        }
+
+        return;
+    }
+
+    for (s = 0; !(pV[nv - 1] & (0x80000000U >> s)); s++);
+
+    pUn = BigScratch(nu + 1 + nv);
+    pVn = (pUn + nu + 1);
+
+    for (i = (nv - 1); i > 0; i--)
+    {
+        pVn[i] = ((pV[i] << s) | ((s) ? (pV[i - 1] >> (32 - s)) : 0));
+    }
+
+    pVn[0]  = (pV[0] << s);
+    pUn[nu] = ((s) ? (pU[nu - 1] >> (32 - s)) : 0);
+
+    for (i = (nu - 1); i > 0; i--)
+    {
+        pUn[i] = ((pU[i] << s) | ((s) ? (pU[i - 1] >> (32 - s)) : 0));
+    }
+
+    pUn[0] = (pU[0] << s);
+
+    for (j = (nu - nv); j >= 0; j--)
+    {
+        if ((nv > 64) && RtLate())
+        {
+            free(pUn);
+            RtTimeUp();
+        }
+
+        /* estimate the quotient limb from the top two, at most 2 over */
+        p    = (((Limb2)pUn[j + nv] << 32) | pUn[j + nv - 1]);
+        qhat = (p / pVn[nv - 1]);
+        rhat = (p % pVn[nv - 1]);
+
+        while ((qhat >> 32) ||
+               ((qhat * pVn[nv - 2]) > ((rhat << 32) | pUn[j + nv - 2])))
+        {
+            qhat--;
+            rhat += pVn[nv - 1];
+            if (rhat >> 32) break;
+        }
+
+        /* u -= qhat * v */
+        for (k = 0, i = 0; i < nv; i++)
+        {
+            p = (qhat * pVn[i]);
+            t = ((int64_t)pUn[i + j] - k - (int64_t)(p & 0xffffffff));
+            pUn[i + j] = (Limb)t;
+            k = ((int64_t)(p >> 32) - (t >> 32));
+        }
+
+        t = ((int64_t)pUn[j + nv] - k);
+        pUn[j + nv] = (Limb)t;
+        pQ[j] = (Limb)qhat;
+
+        if (t < 0) /* one too many, add v back */
+        {
+            pQ[j]--;
+
+            for (p = 0, i = 0; i < nv; i++)
+            {
+                p += ((Limb2)pUn[i + j] + pVn[i]);
+                pUn[i + j] = (Limb)p;
+                p >>= 32;
+            }
+
+            pUn[j + nv] += (Limb)p;
+        }
+    }
+
+    free(pUn);
+}
+
+
+/* a + b (or a - b), for integers that don't both fit in a long. */
+Value BigSum(Value a, Value b, int sub)
+{
+    BigNum x;
+    BigNum y;
+    BigNum * pX = &x;
+    BigNum * pY = &y;
+    BigNum * pT;
+    BigInt * pBig;
+
+    BigOperand(a, &x);
+    BigOperand(b, &y);
+
+    if (sub) y.neg = !y.neg;
+
+    if ((x.neg == y.neg) ? (x.len < y.len) :
+        (BigCmpMag(x.pD, x.len, y.pD, y.len) < 0))
+    {
+        pT = pX; pX = pY; pY = pT;
+    }
+
+    pBig = BigAlloc(pX->len + 1);
+    memcpy(pBig->d, pX->pD, (pX->len * sizeof(Limb)));
+
+    if (x.neg == y.neg)
+    {
+        BigAddTo(pBig->d, (pX->len + 1), pY->pD, pY->len);
+    }
+    else
+    {
+        BigSubFrom(pBig->d, pX->len, pY->pD, pY->len);
+    }
+
+    return BigNormal(pBig, (pX->len + 1), pX->neg);
+}
+
+
+Value BigProduct(Value a, Value b)
+{
+    BigNum x;
+    BigNum y;
+    BigInt * pBig;
+
+    BigOperand(a, &x);
+    BigOperand(b, &y);
+
+    if (!x.len || !y.len) return ValueInt(0);
+
+    pBig = BigAlloc(x.len + y.len);
+    BigMul(pBig->d, x.pD, x.len, y.pD, y.len);
+
+    return BigNormal(pBig, (x.len + y.len), (x.neg != y.neg));
+}
+
+
+/* a / b truncated toward zero, b isn't 0. */
+Value BigQuotient(Value a, Value b)
+{
+    BigNum x;
+    BigNum y;
+    BigInt * pBig;
+
+    BigOperand(a, &x);
+    BigOperand(b, &y);
+
+    if (BigCmpMag(x.pD, x.len, y.pD, y.len) < 0) return ValueInt(0);
+
+    pBig = BigAlloc(x.len - y.len + 1);
+    BigDivMag(pBig->d, x.pD, x.len, y.pD, y.len);
+
+    return BigNormal(pBig, (x.len - y.len + 1), (x.neg != y.neg));
+}
+
+
+/* <0, 0 or >0 as integer a is less than, equal to or greater than b. */
+int IntCmp(Value a, Value b)
+{
+    BigNum x;
+    BigNum y;
+    int i;
+
+    if (V_IS_SMALL(a & b))
+    {
+        return ((V_SMALL(a) > V_SMALL(b)) - (V_SMALL(a) < V_SMALL(b)));
+    }
+
+    BigOperand(a, &x);
+    BigOperand(b, &y);
+
+    if (x.neg != y.neg) return (x.neg) ? -1 : 1;
+
+    i = BigCmpMag(x.pD, x.len, y.pD, y.len);
+
+    return (x.neg) ? -i : i;
+}
+
+
+static inline Value IntMul(Value a, Value b)
+{
+    long n;
+
+    if (V_IS_SMALL(a & b) && INT_MUL_OK(V_SMALL(a), V_SMALL(b), &n))
+    {
+        return ValueInt(n);
+    }
+
+    return BigProduct(a, b);
+}
+
+
+Value IntNeg(Value a)
+{
+    if (V_IS_SMALL(a)) return ValueInt(-V_SMALL(a));
+
+    return BigSum(V_INT_SMALL(0), a, 1);
+}
+
+
+/* The decimal digits of an integer, in a buffer the caller frees. */
+char * IntStr(Value v, int * pLen)
+{
+    BigNum x;
+    Limb * pD;
+    char * pBuf;
+    char * pEnd;
+    char * p;
+    Limb2 rem;
+    int len;
+    int i;
+
+    BigOperand(v, &x);
+
+    /* a limb is less than 10 digits */
+    if ((pBuf = (char *)malloc((x.len * 10) + 3)) == NULL)
+    {
+        perror("Failed to malloc memory");
+        exit(1);
+    }
+
+    pD = BigScratch(x.len + 1);
+    memcpy(pD, x.pD, (x.len * sizeof(Limb)));
+    len  = x.len;
+    pEnd = p = (pBuf + (x.len * 10) + 2);
+    *p = '\0';
+
+    while (len) /* nine digits at a time */
+    {
+        if ((len > 64) && RtLate())
+        {
+            free(pD);
+            free(pBuf);
+            RtTimeUp();
+        }
+
+        for (rem = 0, i = (len - 1); i >= 0; i--)
+        {
+            rem   = ((rem << 32) | pD[i]);
+            pD[i] = (Limb)(rem / 1000000000);
+            rem  %= 1000000000;
+        }
+
+        while (len && !pD[len - 1]) len--;
+
+        for (i = 0; (i < 9) && (len || rem); i++)
+        {
+            *--p = ('0' + (rem % 10));
+            rem /= 10;
+        }
+    }
+
+    free(pD);
+
+    if (p == pEnd) *--p = '0';
+    if (x.neg) *--p = '-';
+
+    *pLen = (pEnd - p);
+    memmove(pBuf, p, (*pLen + 1));
+
+    return pBuf;
+}
+
+
+/* An integer literal, converted once when the program is loaded. */
+Value ValueIntLiteral(const char * pStr)
+{
+    BigInt * pBig;
+    Limb2 t;
+    Limb chunk;
+    Limb scale;
+    int len = 0;
+    int n;
+    int i;
+    int j;
+    int k;
+
+    if ((n = strlen(pStr)) <= 18) return ValueInt(strtol(pStr, NULL, 10));
+
+    /* a limb holds more than 9 digits */
+    pBig = BigAlloc((n / 9) + 1);
+
+    for (i = 0; i < n; i += k)
+    {
+        k = (i == 0 && (n % 9)) ? (n % 9) : 9;
+
+        for (chunk = 0, scale = 1, j = 0; j < k; j++)
+        {
+            chunk = ((chunk * 10) + (pStr[i + j] - '0'));
+            scale *= 10;
+        }
+
+        for (t = chunk, j = 0; j < len; j++) /* big = big * scale + chunk */
+        {
+            t += ((Limb2)pBig->d[j] * scale);
+            pBig->d[j] = (Limb)t;
+            t >>= 32;
+        }
+
+        if (t) pBig->d[len++] = (Limb)t;
+    }
+
+    return BigNormal(pBig, len, 0);
+}
+
+
+#define ValueTruth(b) ((b) ? RT_TRUE : RT_FALSE)
+
+
+/* A new string of len chars, copied from pStr unless it is NULL. */
+Value ValueStr(const char * pStr, int len)
+{
+    RtStr * pStrObj = (RtStr *)GcAlloc((sizeof(RtStr) + len + 1), V_STR);
+
+    pStrObj->len = len;
+    if (pStr) memcpy(pStrObj->s, pStr, len);
+    pStrObj->s[len] = 0;
+    return (Value)pStrObj;
+}
+
+
+/*
+ * Ropes.  Conc joins two strings with a Rope node instead of copying them
+ * (short strings are still copied, up to ROPE_LEAF chars) and Stern makes a
+ * slice of a flat string or rebuilds the left edge of a rope, so Conc takes
+ * O(1) and Stem and Stern O(depth).  The depth is kept down the way Boehm's
+ * ropes (the SGI STL's rope) do: once a rope gets deeper than ROPE_MAX_DEPTH
+ * it's rebuilt, balanced, from its leaves and its subtrees that are already
+ * balanced.  A rope is only walked (never flattened in place) to print it
+ * and copied to a buffer to compare it.
+ */
+#define ROPE_LEAF      64
+#define ROPE_MAX_DEPTH 45
+
+/* ropeMinLen[d] is the least length of a balanced rope of depth d */
+long ropeMinLen[ROPE_MAX_DEPTH + 2];
+
+
+/* A new rope node, without rebalancing. */
+Value RopeNew(Value left, Value right)
+{
+    Rope * pRope = (Rope *)GcAlloc(sizeof(Rope), V_STR);
+    int depthL = V_IS_ROPE(left) ? V_PROPE(left)->depth : 0;
+    int depthR = V_IS_ROPE(right) ? V_PROPE(right)->depth : 0;
+
+    pRope->hdr  |= STR_ROPE;
+    pRope->len   = (V_PSTR(left)->len + V_PSTR(right)->len);
+    pRope->depth = ((depthL > depthR) ? depthL : depthR) + 1;
+    pRope->left  = left;
+    pRope->right = right;
+    return (Value)pRope;
+}
+
+
+/* Copy the chars of a string to pDst (which has room for them). */
+void StrCopy(Value v, char * pDst)
+{
+    while (V_IS_ROPE(v))
+    {
+        StrCopy(V_PROPE(v)->left, pDst);
+        pDst += V_PSTR(V_PROPE(v)->left)->len;
+        v     = V_PROPE(v)->right;
+    }
+
+    if (V_PSTR(v)->hdr & STR_SLICE)
+    {
+        memcpy(pDst, (V_PSTR(V_PSLICE(v)->base)->s + V_PSLICE(v)->off),
+               V_PSLICE(v)->len);
+    }
+    else
+    {
+        memcpy(pDst, V_PSTR(v)->s, V_PSTR(v)->len);
+    }
+}
+
+
+/*
+ * The chars of a string, in place unless it's a rope.  A rope's are copied
+ * to a buffer the caller frees (*ppFree, otherwise NULL).
+ */
+char * StrChars(Value v, char ** ppFree)
+{
+    *ppFree = NULL;
+
+    if (V_PSTR(v)->hdr & STR_SLICE)
+    {
+        return (V_PSTR(V_PSLICE(v)->base)->s + V_PSLICE(v)->off);
+    }
+
+    if (!V_IS_ROPE(v)) return V_PSTR(v)->s;
+
+    *ppFree = (char *)malloc(V_PSTR(v)->len);
+    StrCopy(v, *ppFree);
+    return *ppFree;
+}
+
+
+/* Add a rope's pieces to the forest (ordered by length) it's rebuilt from. */
+void RopeForest(Value * pForest, Value v)
+{
+    Value tiny = 0;
+    int i;
+
+    if (V_IS_ROPE(v) && (V_PROPE(v)->len < ropeMinLen[V_PROPE(v)->depth]))
+    {
+        RopeForest(pForest, V_PROPE(v)->left);
+        RopeForest(pForest, V_PROPE(v)->right);
+        return;
+    }
+
+    /* the shorter pieces (to the left of this one) are joined first */
+    for (i = 0; V_PSTR(v)->len >= ropeMinLen[i + 1]; i++)
+    {
+        if (pForest[i])
+        {
+            tiny = (tiny) ? RopeNew(pForest[i], tiny) : pForest[i];
+            pForest[i] = 0;
+        }
+    }
+
+    if (tiny) v = RopeNew(tiny, v);
+
+    for (;; i++)
+    {
+        if (pForest[i])
+        {
+            v = RopeNew(pForest[i], v);
+            pForest[i] = 0;
+        }
+
+        if ((i == ROPE_MAX_DEPTH) || (V_PSTR(v)->len < ropeMinLen[i + 1]))
+        {
+            pForest[i] = v;
+            return;
+        }
+    }
+}
+
+
+/* The same string as a balanced rope. */
+Value RopeBalance(Value v)
+{
+    Value forest[ROPE_MAX_DEPTH + 1];
+    int i;
+
+    if (ropeMinLen[0] == 0)
+    {
+        ropeMinLen[0] = 1;
+        ropeMinLen[1] = 2;
+
+        for (i = 2; i < (ROPE_MAX_DEPTH + 2); i++)
+        {
+            ropeMinLen[i] = (ropeMinLen[i - 1] + ropeMinLen[i - 2]);
+        }
+    }
+
+    memset(forest, 0, sizeof(forest));
+    RopeForest(forest, v);
+
+    for (v = 0, i = 0; i <= ROPE_MAX_DEPTH; i++)
+    {
+        if (forest[i]) v = (v) ? RopeNew(forest[i], v) : forest[i];
+    }
+
+    return v;
+}
+
+
+/* a Conc b */
+Value StrConc(Value a, Value b)
+{
+    Value v;
+    int lenA = V_PSTR(a)->len;
+    int lenB = V_PSTR(b)->len;
+
+    if (lenA == 0) return b;
+    if (lenB == 0) return a;
+
+    if ((lenA + lenB) <= ROPE_LEAF)
+    {
+        v = ValueStr(NULL, (lenA + lenB));
+        StrCopy(a, V_PSTR(v)->s);
+        StrCopy(b, (V_PSTR(v)->s + lenA));
+        return v;
+    }
+
+    /* a short string goes into the leaf next to it, not a new node */
+    if ((lenB < ROPE_LEAF) && V_IS_ROPE(a) &&
+        ((V_PSTR(V_PROPE(a)->right)->len + lenB) <= ROPE_LEAF))
+    {
+        return RopeNew(V_PROPE(a)->left, StrConc(V_PROPE(a)->right, b));
+    }
+
+    if ((lenA < ROPE_LEAF) && V_IS_ROPE(b) &&
+        ((lenA + V_PSTR(V_PROPE(b)->left)->len) <= ROPE_LEAF))
+    {
+        return RopeNew(StrConc(a, V_PROPE(b)->left), V_PROPE(b)->right);
+    }
+
+    v = RopeNew(a, b);
+
+    return (V_PROPE(v)->depth > ROPE_MAX_DEPTH) ? RopeBalance(v) : v;
+}
+
+
+/* Stem, the first char of a (non-empty) string. */
+Value StrStem(Value v)
+{
+    char * pFree;
+
+    while (V_IS_ROPE(v)) v = V_PROPE(v)->left;
+
+    return ValueStr(StrChars(v, &pFree), 1);
+}
+
+
+/* Stern, all but the first char of a (non-empty) string. */
+Value StrStern(Value v)
+{
+    StrSlice * pSlice;
+    char * pFree;
+
+    if (V_IS_ROPE(v))
+    {
+        if (V_PSTR(V_PROPE(v)->left)->len == 1) return V_PROPE(v)->right;
+
+        return StrConc(StrStern(V_PROPE(v)->left), V_PROPE(v)->right);
+    }
+
+    if (V_PSTR(v)->len <= ROPE_LEAF)
+    {
+        return ValueStr((StrChars(v, &pFree) + 1), (V_PSTR(v)->len - 1));
+    }
+
+    pSlice = (StrSlice *)GcAlloc(sizeof(StrSlice), V_STR);
+    pSlice->hdr |= STR_SLICE;
+    pSlice->len  = (V_PSTR(v)->len - 1);
+
+    if (V_PSTR(v)->hdr & STR_SLICE)
+    {
+        pSlice->off  = (V_PSLICE(v)->off + 1);
+        pSlice->base = V_PSLICE(v)->base;
+    }
+    else
+    {
+        pSlice->off  = 1;
+        pSlice->base = v;
+    }
+
+    return (Value)pSlice;
+}
+
+
+/* a eq b, for strings */
+int StrEq(Value a, Value b)
+{
+    char * pFreeA;
+    char * pFreeB;
+    int eq;
+
+    if (V_PSTR(a)->len != V_PSTR(b)->len) return 0;
+
+    eq = (memcmp(StrChars(a, &pFreeA), StrChars(b, &pFreeB),
+                 V_PSTR(a)->len) == 0);
+
+    free(pFreeA);
+    free(pFreeB);
+    return eq;
+}
+
+
+/* Print a string, a rope a leaf at a time. */
+void StrPrint(Value v)
+{
+    char * pFree;
+
+    while (V_IS_ROPE(v))
+    {
+        StrPrint(V_PROPE(v)->left);
+        v = V_PROPE(v)->right;
+    }
+
+    fwrite(StrChars(v, &pFree), 1, V_PSTR(v)->len, stdout);
+}
+
+
+/* A new tuple of num (unset) values, nil if num is 0. */
+Value ValueTuple(int num)
+{
+    Tuple * pTuple;
+
+    if (num == 0) return RT_NIL;
+
+    pTuple = (Tuple *)GcAlloc((sizeof(Tuple) + (num * sizeof(Value))), V_TUPLE);
+    pTuple->num = num;
+    return (Value)pTuple;
+}
+
+
+/*
+ * t aug x, without copying t when it can be helped.  The result is a view of
+ * num + 1 values of a TupleVec.  When t is the newest view of its vector (it
+ * sees all the values appended so far) and there's room, x is appended in
+ * place.  t only ever sees its own num values so it's unchanged, and a
+ * tuple built by aug takes amortized O(1) per aug instead of a copy of the
+ * whole tuple each time.  Otherwise (a plain tuple, a full vector or an
+ * older view that has been aug'd already) the values are copied to a new
+ * vector with twice the room.
+ */
+Value TupleAug(Value t, Value x)
+{
+    TupleView * pView;
+    TupleVec * pVec = NULL;
+    int num = V_TUPLE_NUM(t);
+    int cap;
+
+    if (num && (V_PTUPLE(t)->hdr & TUPLE_VIEW))
+    {
+        pVec = V_PVIEW(t)->pVec;
+
+        if ((pVec->used != num) || (pVec->used == pVec->cap) ||
+            (pVec->hdr & GC_STATIC))
+        {
+            pVec = NULL;
+        }
+    }
+
+    if (!pVec)
+    {
+        cap  = (num < 2) ? 4 : (2 * num);
+        pVec = (TupleVec *)GcAlloc((sizeof(TupleVec) + (cap * sizeof(Value))),
+                                   V_TUPLEVEC);
+        pVec->cap  = cap;
+        pVec->used = num;
+        if (num) memcpy(pVec->v, V_TUPLE_V(t), (num * sizeof(Value)));
+    }
+
+    pVec->v[pVec->used++] = x;
+    GC_WRITE_BARRIER(pVec, x);
+
+    pView = (TupleView *)GcAlloc(sizeof(TupleView), V_TUPLE);
+    pView->hdr |= TUPLE_VIEW;
+    pView->num  = (num + 1);
+    pView->pVec = pVec;
+
+    return (Value)pView;
+}
+
+
+/* A new closure (V_CLOSURE or V_ETA), the caller fills in the num values. */
+Value ValueClosure(ValueType type, struct _ctl * pCtl, struct _proto * pProto,
+                   Env * pEnv, int num)
+{
+    Closure * pClosure = (Closure *)GcAlloc((sizeof(Closure) +
+                                             (num * sizeof(Value))), type);
+
+    pClosure->num  = num;
+    pClosure->pCtl = pCtl;
+
+    if (pCtl) pClosure->pEnv   = pEnv;
+    else      pClosure->pProto = pProto;
+
+    return (Value)pClosure;
+}
+
+
+/* Decode the escapes of a string literal (the scanner keeps them raw). */
+Value ValueStrLiteral(const char * pStr)
+{
+    char * pBuf = (char *)malloc(strlen(pStr) + 1);
+    Value v;
+    int len = 0;
+
+    for (; *pStr; pStr++)
+    {
+        if ((*pStr == '\\') && pStr[1])
+        {
+            pStr++;
+            pBuf[len++] = (*pStr == 'n') ? '\n' :
+                          (*pStr == 't') ? '\t' : *pStr;
+        }
+        else
+        {
+            pBuf[len++] = *pStr;
+        }
+    }
+
+    v = ValueStr(pBuf, len);
+    free(pBuf);
+    return v;
+}
+
+
+void ClosurePrint(Value v);
+
+
+/*
+ * Print a closure given the names of its function's bound variables.  The
+ * closure of a rec function is tied to itself without an eta closure (see
+ * VmRec(), or CtlRec() in parser.c) but prints as the eta it stands for.
+ */
+void ClosurePrintAs(int eta, char ** ppVars, int numVars, int index)
+{
+    int i;
+
+    printf("[%s closure: ", (eta) ? "eta" : "lambda");
+
+    for (i = 0; i < numVars; i++)
+    {
+        printf("%s%s", (i) ? "," : "", ppVars[i]);
+    }
+
+    if (numVars == 0) printf("()");
+
+    printf(": %d]", index);
+}
+
+
+/* Print a value the way the RPAL interpreter does. */
+void ValuePrint(Value v)
+{
+    char * pStr;
+    int i;
+
+    switch (V_TYPE(v))
+    {
+    case V_INT:
+
+        if (V_IS_SMALL(v))
+        {
+            printf("%ld", V_SMALL(v));
+            break;
+        }
+
+        pStr = IntStr(v, &i);
+        fputs(pStr, stdout);
+        free(pStr);
+        break;
+
+    case V_TRUTH:
+
+        printf("%s", V_BOOL(v) ? "true" : "false");
+        break;
+
+    case V_STR:
+
+        StrPrint(v);
+        break;
+
+    case V_TUPLE:
+
+        if (v == RT_NIL)
+        {
+            printf("nil");
+            break;
+        }
+
+        printf("(");
+
+        for (i = 0; i < V_PTUPLE(v)->num; i++)
+        {
+            if (i) printf(", ");
+            ValuePrint(V_TUPLE_V(v)[i]);
+        }
+
+        printf(")");
+        break;
+
+    case V_DUMMY:
+
+        printf("dummy");
+        break;
+
+    case V_CLOSURE:
+    case V_ETA:
+
+        ClosurePrint(v);
+        break;
+
+    case V_YSTAR:
+
+        printf("Y*");
+        break;
+
+    case V_BUILTIN:
+
+        printf("[builtin: %s]", builtinNames[V_PBUILTIN(v)->id]);
+        break;
+
+    case V_ENV:      /* never a value */
+    case V_TUPLEVEC: /* never a value either */
+
+        break;
+    }
+}
+
+
+/* Conc a b, both strings. */
+Value BuiltinConc(unsigned int offset, Value a, Value b)
+{
+    if (!V_IS(a, V_STR) || !V_IS(b, V_STR))
+    {
+        RtError(offset, "Conc applied to a non-string");
+    }
+
+    return StrConc(a, b);
+}
+
+
+/* Apply a builtin function to an argument. */
+Value BuiltinApply(unsigned int offset, Builtin * pB, Value arg)
+{
+    Builtin * pPart;
+    char buf[32];
+    Value v;
+    char * pStr;
+    int len;
+
+    switch (pB->id)
+    {
+    case B_PRINT:
+
+        ValuePrint(arg);
+        return RT_DUMMY;
+
+    case B_CONC:
+
+        if (!V_IS(arg, V_STR))
+        {
+            RtError(offset, "Conc applied to a non-string");
+        }
+
+        if (pB->nargs == 0) /* curried, wait for the second string */
+        {
+            pPart = (Builtin *)GcAlloc(sizeof(Builtin), V_BUILTIN);
+            pPart->id    = B_CONC;
+            pPart->nargs = 1;
+            pPart->arg   = arg;
+            return (Value)pPart;
+        }
+
+        return BuiltinConc(offset, pB->arg, arg);
+
+    case B_STEM:
+    case B_STERN:
+
+        if (!V_IS(arg, V_STR) || (V_PSTR(arg)->len == 0))
+        {
+            RtError(offset, "%s applied to a non-string or ''",
+                    builtinNames[pB->id]);
+        }
+
+        return (pB->id == B_STEM) ? StrStem(arg) : StrStern(arg);
+
+    case B_ORDER:
+
+        if (!V_IS(arg, V_TUPLE))
+        {
+            RtError(offset, "Order applied to a non-tuple");
+        }
+
+        return ValueInt(V_TUPLE_NUM(arg));
+
+    case B_ISINTEGER:    return ValueTruth(V_IS(arg, V_INT));
+    case B_ISTRUTHVALUE: return ValueTruth(V_IS(arg, V_TRUTH));
+    case B_ISSTRING:     return ValueTruth(V_IS(arg, V_STR));
+    case B_ISTUPLE:      return ValueTruth(V_IS(arg, V_TUPLE));
+    case B_ISDUMMY:      return ValueTruth(V_IS(arg, V_DUMMY));
+
+    case B_ISFUNCTION:
+
+        return ValueTruth(V_IS(arg, V_CLOSURE) || V_IS(arg, V_ETA) ||
+                          V_IS(arg, V_YSTAR) || V_IS(arg, V_BUILTIN));
+
+    case B_NULL:
+
+        return ValueTruth(arg == RT_NIL);
+
+    case B_ITOS:
+
+        if (!V_IS(arg, V_INT))
+        {
+            RtError(offset, "ItoS applied to a non-integer");
+        }
+
+        if (V_IS_SMALL(arg))
+        {
+            snprintf(buf, sizeof(buf), "%ld", V_SMALL(arg));
+            return ValueStr(buf, strlen(buf));
+        }
+
+        pStr = IntStr(arg, &len);
+        v    = ValueStr(pStr, len);
+        free(pStr);
+        return v;
+    }
+
+    return arg; /* not reached */
+}
+
+
+/*
+ * Builtin id applied to arg, a call the compilers found is a builtin (see
+ * I_BUILTIN and VM_BUILTIN).  The tests and Order are done right here, the
+ * others go to BuiltinApply().  The C backend passes id as a constant so
+ * the C compiler picks the case and the call is just its code.
+ */
+static inline Value BuiltinCall(unsigned int offset, int id, Value arg)
+{
+    switch (id)
+    {
+    case B_ISINTEGER:    return ValueTruth(V_IS(arg, V_INT));
+    case B_ISTRUTHVALUE: return ValueTruth(V_IS(arg, V_TRUTH));
+    case B_ISSTRING:     return ValueTruth(V_IS(arg, V_STR));
+    case B_ISTUPLE:      return ValueTruth(V_IS(arg, V_TUPLE));
+    case B_ISDUMMY:      return ValueTruth(V_IS(arg, V_DUMMY));
+    case B_NULL:         return ValueTruth(arg == RT_NIL);
+
+    case B_ORDER:
+
+        if (V_IS(arg, V_TUPLE)) return V_INT_SMALL(V_TUPLE_NUM(arg));
+        break;
+    }
+
+    return BuiltinApply(offset, &builtins[id], arg);
+}
+
+
+/* Integer power, negative exponents truncate toward zero like '/'. */
+Value IntPow(unsigned int offset, Value base, Value exp)
+{
+    Value r = V_INT_SMALL(1);
+    int neg = (IntCmp(exp, V_INT_SMALL(0)) < 0);
+    int odd;
+    long e;
+
+    if ((base == V_INT_SMALL(0)) && neg)
+    {
+        RtError(offset, "zero to a negative power");
+    }
+
+    if ((base == V_INT_SMALL(1)) || (base == V_INT_SMALL(-1)))
+    {
+        odd = (V_IS_SMALL(exp)) ? (int)(V_SMALL(exp) & 1) :
+                                  (int)(V_PBIG(exp)->d[0] & 1);
+        return (base == V_INT_SMALL(1) || !odd) ? V_INT_SMALL(1) : base;
+    }
+
+    if (neg) return V_INT_SMALL(0);
+
+    if (!V_IS_SMALL(exp))
+    {
+        if (base == V_INT_SMALL(0)) return base;
+        RtError(offset, "integer too large");
+    }
+
+    for (e = V_SMALL(exp); e; )
+    {
+        if (RtLate()) RtTimeUp();
+        if (e & 1) r = IntMul(r, base);
+        if ((e >>= 1)) base = IntMul(base, base);
+    }
+
+    return r;
+}
+
+
+/* Apply a binary operator (OP_*), a is the left operand. */
+Value BinOp(unsigned int offset, int op, Value a, Value b)
+{
+    long x;
+    long y;
+    int i;
+
+    switch (op)
+    {
+    case OP_PLUS: case OP_MINUS: case OP_MUL: case OP_DIV: case OP_POW:
+    case OP_GR: case OP_GE: case OP_LS: case OP_LE:
+
+        if (!V_IS(a, V_INT) || !V_IS(b, V_INT))
+        {
+            RtError(offset, "arithmetic on a non-integer");
+        }
+
+        if ((op == OP_DIV) && (b == V_INT_SMALL(0)))
+        {
+            RtError(offset, "division by zero");
+        }
+
+        if (V_IS_SMALL(a & b)) /* can't overflow a long, except '*' */
+        {
+            x = V_SMALL(a);
+            y = V_SMALL(b);
+
+            switch (op)
+            {
+            case OP_PLUS:  return ValueInt(x + y);
+            case OP_MINUS: return ValueInt(x - y);
+            case OP_DIV:   return ValueInt(x / y);
+            case OP_GR:    return ValueTruth(x >  y);
+            case OP_GE:    return ValueTruth(x >= y);
+            case OP_LS:    return ValueTruth(x <  y);
+            case OP_LE:    return ValueTruth(x <= y);
+            case OP_MUL:
+
+                if (INT_MUL_OK(x, y, &x)) return ValueInt(x);
+                break;
+            }
+        }
+
+        switch (op)
+        {
+        case OP_PLUS:  return BigSum(a, b, 0);
+        case OP_MINUS: return BigSum(a, b, 1);
+        case OP_MUL:   return BigProduct(a, b);
+        case OP_DIV:   return BigQuotient(a, b);
+        case OP_POW:   return IntPow(offset, a, b);
+        case OP_GR:    return ValueTruth(IntCmp(a, b) >  0);
+        case OP_GE:    return ValueTruth(IntCmp(a, b) >= 0);
+        case OP_LS:    return ValueTruth(IntCmp(a, b) <  0);
+        case OP_LE:    return ValueTruth(IntCmp(a, b) <= 0);
+        }
+
+        break;
+
+    case OP_EQ:
+    case OP_NE:
+
+        if (V_IS(a, V_INT) && V_IS(b, V_INT))
+        {
+            /* the same number has the same representation */
+            i = ((a == b) || (!V_IS_SMALL(a | b) && (IntCmp(a, b) == 0)));
+        }
+        else if (V_IS(a, V_TRUTH) && V_IS(b, V_TRUTH))
+        {
+            i = (a == b);
+        }
+        else if (V_IS(a, V_STR) && V_IS(b, V_STR))
+        {
+            i = StrEq(a, b);
+        }
+        else
+        {
+            RtError(offset, "%s on incompatible values",
+                    (op == OP_EQ) ? "eq" : "ne");
+        }
+
+        return ValueTruth((op == OP_EQ) ? i : !i);
+
+    case OP_AND:
+    case OP_OR:
+
+        if (!V_IS(a, V_TRUTH) || !V_IS(b, V_TRUTH))
+        {
+            RtError(offset, "logic on a non-truthvalue");
+        }
+
+        return ValueTruth((op == OP_AND) ? (V_BOOL(a) && V_BOOL(b)) :
+                                           (V_BOOL(a) || V_BOOL(b)));
+
+    case OP_AUG:
+
+        if (!V_IS(a, V_TUPLE))
+        {
+            RtError(offset, "aug applied to a non-tuple");
+        }
+
+        return TupleAug(a, b);
+    }
+
+    return a; /* not reached */
+}
+
+
+typedef uint64_t VmWord; /* a VM code word, see VM_INS() in parser.c */
+
+typedef struct _proto
+{
+    int            index;
+    int            numVars;   /* bound names, for printing closures */
+    char **        ppVars;
+    int            numSlots;  /* env slots */
+    int            numCaps;   /* captured values, see VmCapture() */
+    int *          pCaps;
+    int            numRegs;
+    VmWord *       pCode;
+    unsigned int * pOffsets;  /* source offset of each code word */
+    int            numCode;
+    int            maxCode;
+    Value *        pConsts;
+    int            numConsts;
+    int            maxConsts;
+    Value       (* pNative)(void); /* rpal -c, the function compiled to C */
+    int            memo;      /* --memo, cache its results (see MemoFind()) */
+    int            numRecVars; /* a rec function, printed as an eta of */
+    char **        ppRecVars;  /* the rec's names (see VmRec()) */
+    struct _proffunc * pProf; /* --profile, see ProfEnter() in parser.c */
+} Proto;
+
+typedef struct _vmframe
+{
+    Proto *        pProto;
+    VmWord *       pc;
+    int            base;   /* R[0] on the VM stack */
+    Env *          pEnv;
+    Closure *      pClosure; /* the values it captured, NULL for main */
+    int            ret;    /* VM stack index for the result */
+    int            eta;    /* apply the result to arg (Y* unrolled) */
+    Value          arg;
+    Proto *        pMemo;  /* --memo, cache the result for pMemo(memo) */
+    Value          memo;
+    int            prof;   /* --profile, ProfEnter()ed for the call */
+} VmFrame;
+
+Value * vmStack = NULL;
+int vmMaxStack = 0;
+int vmHighStack = 0;  /* registers used since the last collection */
+
+VmFrame * vmFrames = NULL;
+int vmNumFrames = 0;
+int vmMaxFrames = 0;
+int vmLowFrames = 0;  /* fewest frames since the last collection */
+int vmFrameCap = 0;   /* frames before growing, see RtDepth() */
+
+
+/* A new call environment, nothing outside the call points at it. */
+Env * EnvNew(int numSlots)
+{
+    Env * pEnv = (Env *)GcAlloc((sizeof(Env) + (numSlots * sizeof(Value))),
+                                V_ENV);
+
+    pEnv->num     = numSlots;
+    pEnv->pParent = NULL;
+    pEnv->pCtl    = NULL;
+    memset(pEnv->v, 0, (numSlots * sizeof(Value))); /* no junk for the GC */
+
+    return pEnv;
+}
+
+
+/* Push a call frame for pProto, R[0] = arg. */
+static inline VmFrame * VM_CALL_FRAME(Proto * pProto, Closure * pClosure,
+                                      int base, int ret, Value arg)
+{
+    VmFrame * pF;
+    int max = vmMaxStack;
+
+    RT_STEP();
+
+    if (vmNumFrames >= vmFrameCap)
+    {
+        if (vmNumFrames == vmMaxFrames)
+        {
+            vmFrames = (VmFrame *)ArrayGrow(vmFrames, &vmMaxFrames,
+                                            sizeof(VmFrame));
+        }
+
+        vmFrameCap = RtDepth(vmNumFrames, vmMaxFrames);
+    }
+
+    if ((base + pProto->numRegs) > vmMaxStack)
+    {
+        while ((base + pProto->numRegs) > vmMaxStack)
+        {
+            vmStack = (Value *)ArrayGrow(vmStack, &vmMaxStack, sizeof(Value));
+        }
+
+        memset((vmStack + max), 0, ((vmMaxStack - max) * sizeof(Value)));
+    }
+
+    if ((base + pProto->numRegs) > vmHighStack)
+    {
+        vmHighStack = (base + pProto->numRegs);
+    }
+
+    pF = &vmFrames[vmNumFrames++];
+    pF->pProto   = pProto;
+    pF->pc       = pProto->pCode;
+    pF->base     = base;
+    pF->pEnv     = (pProto->numSlots) ? EnvNew(pProto->numSlots) : NULL;
+    pF->pClosure = pClosure;
+    pF->ret      = ret;
+    pF->eta      = 0;
+    pF->arg      = 0;
+    pF->pMemo    = NULL;
+    pF->memo     = 0;
+    pF->prof     = 0;
+
+    vmStack[base] = arg;
+
+    return pF;
+}
+
+
+/* A closure of pProto, capturing its free names from the frame pF. */
+Value VmClosure(Proto * pProto, VmFrame * pF)
+{
+    int * pCaps = pProto->pCaps;
+    Value v;
+    int i;
+
+    v = ValueClosure(V_CLOSURE, NULL, pProto, NULL, pProto->numCaps);
+
+    for (i = 0; i < pProto->numCaps; i++)
+    {
+        V_PCLOSURE(v)->v[i] = (pCaps[i] & 1) ?
+                              pF->pClosure->v[pCaps[i] >> 1] :
+                              pF->pEnv->v[pCaps[i] >> 1];
+    }
+
+    return v;
+}
+
+
+/*
+ * rec of functions (VM_REC), Y* without the eta closure.  v is the closure,
+ * or the tuple of the num closures of an 'and', of functions that capture
+ * the rec's names from the slots starting at slot, which are empty when
+ * the closures are made.  Store them there and copy the captures again,
+ * now each one holds itself (and the others), so a recursive call is just
+ * a call and isn't unrolled through Y* every time.
+ */
+void VmRec(Value v, VmFrame * pF, int slot, int num)
+{
+    Value * pV = (num == 1) ? &v : V_TUPLE_V(v);
+    Closure * pC;
+    int * pCaps;
+    int i;
+    int k;
+
+    for (i = 0; i < num; i++)
+    {
+        pF->pEnv->v[slot + i] = pV[i];
+        GC_WRITE_BARRIER(pF->pEnv, pV[i]);
+    }
+
+    for (i = 0; i < num; i++)
+    {
+        pC    = V_PCLOSURE(pV[i]);
+        pCaps = pC->pProto->pCaps;
+
+        for (k = 0; k < pC->num; k++)
+        {
+            pC->v[k] = (pCaps[k] & 1) ? pF->pClosure->v[pCaps[k] >> 1] :
+                                        pF->pEnv->v[pCaps[k] >> 1];
+            GC_WRITE_BARRIER(pC, pC->v[k]);
+        }
+    }
+}
+
+
+/* Print a VM closure, a rec function as the eta of the rec's names. */
+void ProtoClosurePrint(Value v)
+{
+    Proto * pProto = V_PCLOSURE(v)->pProto;
+
+    if (pProto->numRecVars)
+    {
+        ClosurePrintAs(1, pProto->ppRecVars, pProto->numRecVars,
+                       pProto->index);
+    }
+    else
+    {
+        ClosurePrintAs(V_IS(v, V_ETA), pProto->ppVars, pProto->numVars,
+                       pProto->index);
+    }
+}
+
+
+/*
+ * A wide tuple (VM_TUPLEN), its values are filled in a chunk at a time by
+ * TupleFill().  They are zeroed so the GC finds no junk in it meanwhile.
+ */
+Value TupleEmpty(int num)
+{
+    Value t = ValueTuple(num);
+
+    memset(V_PTUPLE(t)->v, 0, (num * sizeof(Value)));
+
+    return t;
+}
+
+
+/* Values i.. of the tuple t = pV[0..num-1] (VM_FILL). */
+void TupleFill(Value t, int i, const Value * pV, int num)
+{
+    Tuple * pTuple = V_PTUPLE(t);
+    int k;
+
+    for (k = 0; k < num; k++)
+    {
+        pTuple->v[i + k] = pV[k];
+        GC_WRITE_BARRIER(pTuple, pV[k]); /* t may be old by now */
+    }
+}
+
+
+/* Y* of a closure, an eta closure with the same captures. */
+Value VmFix(Value v)
+{
+    Value eta = ValueClosure(V_ETA, NULL, V_PCLOSURE(v)->pProto, NULL,
+                             V_PCLOSURE(v)->num);
+
+    memcpy(V_PCLOSURE(eta)->v, V_PCLOSURE(v)->v,
+           (V_PCLOSURE(v)->num * sizeof(Value)));
+
+    return eta;
+}
+
+
+/*
+ * Memoization (--memo).  The results of the functions found to be pure (see
+ * Memo() in parser.c, a Ctl or a Proto with memo set) are cached, keyed on
+ * the function and the argument.  The cache is a direct mapped table of
+ * MEMO_SIZE entries so it never grows, a result that hashes to a taken
+ * entry evicts the one there.  Only integers, strings, truthvalues, nil,
+ * dummy and tuples of those are keys, a call with any other argument (a
+ * function) or with one bigger than MEMO_KEY_MAX values or characters (a
+ * huge tuple or string, which would cost more to hash than to recompute
+ * most of the time) just isn't cached.
+ * The keys and results are roots for the collector (see GcRoots()).
+ */
+#ifndef MEMO_SIZE
+#define MEMO_SIZE (64 * 1024) /* a power of 2 */
+#endif
+
+#define MEMO_KEY_MAX 256
+
+typedef struct _memoentry
+{
+    void *        pFunc; /* NULL for an empty entry */
+    unsigned long hash;
+    Value         arg;
+    Value         result;
+} MemoEntry;
+
+int memoize = 0;      /* --memo */
+int memoFuncs = 0;    /* functions memoized */
+
+MemoEntry * pMemoTable = NULL;
+int * pMemoNew = NULL; /* entries stored since the last collection */
+int memoNumNew = 0;
+
+struct
+{
+    long hits;
+    long misses;
+    long evicted;
+    long uncached;
+    long used;
+} memoStat;
+
+
+/* Hash a key into *pHash, the count of values left or -1 if it isn't one. */
+int MemoHash(Value v, unsigned long * pHash, int left)
+{
+    unsigned long h = *pHash;
+    char * pFree;
+    char * pStr;
+    int i;
+
+    if (--left < 0) return -1;
+
+    switch (V_TYPE(v))
+    {
+    case V_INT:
+
+        if (V_IS_SMALL(v))
+        {
+            h = ((h ^ v) * 0x100000001b3UL);
+            break;
+        }
+
+        for (i = 0; i < abs(V_PBIG(v)->size); i++)
+        {
+            h = ((h ^ V_PBIG(v)->d[i]) * 0x100000001b3UL);
+        }
+
+        h ^= (unsigned long)V_PBIG(v)->size;
+        break;
+
+    case V_STR:
+
+        if ((left -= V_PSTR(v)->len) < 0) return -1;
+
+        pStr = StrChars(v, &pFree);
+
+        for (i = 0; i < V_PSTR(v)->len; i++)
+        {
+            h = ((h ^ (unsigned char)pStr[i]) * 0x100000001b3UL);
+        }
+
+        h ^= (unsigned long)V_PSTR(v)->len;
+        free(pFree);
+        break;
+
+    case V_TUPLE:
+
+        h = ((h ^ V_TUPLE_NUM(v)) * 0x100000001b3UL);
+
+        for (i = 0; i < V_TUPLE_NUM(v); i++)
+        {
+            if ((left = MemoHash(V_TUPLE_V(v)[i], &h, left)) < 0) return -1;
+        }
+
+        break;
+
+    case V_TRUTH:
+    case V_DUMMY:
+
+        h = ((h ^ v) * 0x100000001b3UL);
+        break;
+
+    default:
+
+        return -1;
+    }
+
+    *pHash = h;
+    return left;
+}
+
+
+/* Are two keys the same value? */
+int MemoEq(Value a, Value b)
+{
+    int i;
+
+    if (a == b) return 1;
+    if (V_TYPE(a) != V_TYPE(b)) return 0;
+
+    switch (V_TYPE(a))
+    {
+    case V_INT:
+
+        return (!V_IS_SMALL(a | b) && (IntCmp(a, b) == 0));
+
+    case V_STR:
+
+        return StrEq(a, b);
+
+    case V_TUPLE:
+
+        if ((a == RT_NIL) || (b == RT_NIL) ||
+            (V_TUPLE_NUM(a) != V_TUPLE_NUM(b)))
+        {
+            return 0;
+        }
+
+        for (i = 0; i < V_TUPLE_NUM(a); i++)
+        {
+            if (!MemoEq(V_TUPLE_V(a)[i], V_TUPLE_V(b)[i])) return 0;
+        }
+
+        return 1;
+
+    default:
+
+        return 0;
+    }
+}
+
+
+/* The cache entry of pFunc(arg) and its hash, NULL if arg isn't a key. */
+MemoEntry * MemoEntryOf(void * pFunc, Value arg, unsigned long * pHash)
+{
+    *pHash = (((unsigned long)pFunc >> 4) * 0xcbf29ce484222325UL);
+
+    if (MemoHash(arg, pHash, MEMO_KEY_MAX) < 0) return NULL;
+
+    *pHash ^= (*pHash >> 29);
+
+    if (!pMemoTable)
+    {
+        pMemoTable = (MemoEntry *)calloc(MEMO_SIZE, sizeof(MemoEntry));
+        pMemoNew   = (int *)malloc(MEMO_SIZE * sizeof(int));
+
+        if (!pMemoTable || !pMemoNew)
+        {
+            perror("Failed to malloc memory");
+            exit(1);
+        }
+    }
+
+    return &pMemoTable[*pHash & (MEMO_SIZE - 1)];
+}
+
+
+/*
+ * Look up pFunc(arg): 1 with the result in *pResult if it's cached, 0 if
+ * it isn't and -1 if it can't be (arg isn't a key).
+ */
+int MemoFind(void * pFunc, Value arg, Value * pResult)
+{
+    MemoEntry * pE;
+    unsigned long hash;
+
+    if ((pE = MemoEntryOf(pFunc, arg, &hash)) == NULL)
+    {
+        memoStat.uncached++;
+        return -1;
+    }
+
+    if ((pE->pFunc == pFunc) && (pE->hash == hash) && MemoEq(pE->arg, arg))
+    {
+        memoStat.hits++;
+        *pResult = pE->result;
+        return 1;
+    }
+
+    memoStat.misses++;
+    return 0;
+}
+
+
+/* Cache the result of pFunc(arg) (a MemoFind() miss). */
+void MemoStore(void * pFunc, Value arg, Value result)
+{
+    MemoEntry * pE;
+    unsigned long hash;
+
+    if ((pE = MemoEntryOf(pFunc, arg, &hash)) == NULL) return;
+
+    if (!pE->pFunc)
+    {
+        memoStat.used++;
+    }
+    else if ((pE->pFunc != pFunc) || (pE->hash != hash) ||
+             !MemoEq(pE->arg, arg))
+    {
+        memoStat.evicted++;
+    }
+
+    pE->pFunc  = pFunc;
+    pE->hash   = hash;
+    pE->arg    = arg;
+    pE->result = result;
+
+    /* a minor collection only has to move what was stored since the last */
+    if (memoNumNew < MEMO_SIZE) pMemoNew[memoNumNew] = (pE - pMemoTable);
+    memoNumNew++;
+}
+
+
+/* Empty the cache (and report on it with --memo). */
+void MemoFree(void)
+{
+    if (memoize)
+    {
+        printf("MEMO: %d functions, %ld hits, %ld misses\n",
+               memoFuncs, memoStat.hits, memoStat.misses);
+        printf("MEMO: %ld of %d entries used, %ld evicted, "
+               "%ld calls not cached\n", memoStat.used, MEMO_SIZE,
+               memoStat.evicted, memoStat.uncached);
+    }
+
+    free(pMemoTable);
+    free(pMemoNew);
+    pMemoTable = NULL;
+    pMemoNew   = NULL;
+    memoNumNew = 0;
+    memoFuncs  = 0;
+    memset(&memoStat, 0, sizeof(memoStat));
+}
+
+
+/*
+ * Garbage collector (the heap is described at GcAlloc()).
+ */
+unsigned int gcSkip;   /* objects left where they are this collection */
+
+/* the new address of a copied object, over what followed its header */
+#define GC_FORWARDED(pObj) (*(Obj **)((char *)(pObj) + 8))
+
+
+/* Size of a heap object as allocated. */
+size_t GcSize(Obj * pObj)
+{
+    size_t size;
+
+    switch (pObj->hdr & GC_TYPE_MASK)
+    {
+    case V_INT:   size = (sizeof(BigInt) +
+                          (abs(((BigInt *)pObj)->size) * sizeof(Limb))); break;
+    case V_STR:   size = (pObj->hdr & STR_ROPE) ? sizeof(Rope) :
+                         (pObj->hdr & STR_SLICE) ? sizeof(StrSlice) :
+                         (sizeof(RtStr) + ((RtStr *)pObj)->len + 1); break;
+    case V_TUPLE: size = (pObj->hdr & TUPLE_VIEW) ? sizeof(TupleView) :
+                         (sizeof(Tuple) +
+                          (((Tuple *)pObj)->num * sizeof(Value))); break;
+    case V_TUPLEVEC: size = (sizeof(TupleVec) +
+                             (((TupleVec *)pObj)->cap * sizeof(Value))); break;
+    case V_ENV:   size = (sizeof(Env) +
+                          (((Env *)pObj)->num * sizeof(Value))); break;
+    case V_BUILTIN: size = sizeof(Builtin); break;
+    default:      size = (sizeof(Closure) +
+                          (((Closure *)pObj)->num * sizeof(Value))); break;
+    }
+
+    return (size < 16) ? 16 : ((size + 7) & ~(size_t)7);
+}
+
+
+/* Room in the old generation (to-space) for a copy. */
+void * GcOldAlloc(size_t size)
+{
+    ArenaBlock * pChunk;
+
+    if (!pOldTail || ((pOldTail->used + size) > pOldTail->size))
+    {
+        pChunk = GcChunk((size > GC_CHUNK_SIZE) ? size : GC_CHUNK_SIZE);
+
+        if (pOldTail) pOldTail->pNext = pChunk;
+        else pOldHead = pChunk;
+
+        pOldTail = pChunk;
+    }
+
+    pOldTail->used += size;
+    gcOldUsed      += size;
+
+    return (pOldTail->data + pOldTail->used - size);
+}
+
+
+/* Copy an object to the old generation (once), returns where it is now. */
+Obj * GcMove(Obj * pObj)
+{
+    Obj * pNew;
+    size_t size;
+
+    if (!pObj || (pObj->hdr & gcSkip)) return pObj;
+
+    if (pObj->hdr & GC_FORWARD) return GC_FORWARDED(pObj);
+
+    size = GcSize(pObj);
+    pNew = (Obj *)GcOldAlloc(size);
+    memcpy(pNew, pObj, size);
+    pNew->hdr = ((pObj->hdr & (GC_TYPE_MASK | TUPLE_VIEW | STR_ROPE |
+                               STR_SLICE)) | GC_OLD);
+
+    pObj->hdr = GC_FORWARD;
+    GC_FORWARDED(pObj) = pNew;
+
+    return pNew;
+}
+
+#define GC_VALUE(v) \
+    if ((v) && !((v) & 3)) (v) = (Value)GcMove((Obj *)(v))
+
+#define GC_ENV(pEnv) (pEnv) = (Env *)GcMove((Obj *)(pEnv))
+
+#define GC_CLOSURE(p) (p) = (Closure *)GcMove((Obj *)(p))
+
+
+/* Move everything an object points at. */
+void GcScan(Obj * pObj)
+{
+    int i;
+
+    switch (pObj->hdr & GC_TYPE_MASK)
+    {
+    case V_TUPLE:
+
+        if (pObj->hdr & TUPLE_VIEW)
+        {
+            ((TupleView *)pObj)->pVec =
+                (TupleVec *)GcMove((Obj *)((TupleView *)pObj)->pVec);
+            break;
+        }
+
+        for (i = 0; i < ((Tuple *)pObj)->num; i++)
+        {
+            GC_VALUE(((Tuple *)pObj)->v[i]);
+        }
+
+        break;
+
+    case V_STR:
+
+        if (pObj->hdr & STR_ROPE)
+        {
+            GC_VALUE(((Rope *)pObj)->left);
+            GC_VALUE(((Rope *)pObj)->right);
+        }
+        else if (pObj->hdr & STR_SLICE)
+        {
+            GC_VALUE(((StrSlice *)pObj)->base);
+        }
+
+        break;
+
+    case V_TUPLEVEC:
+
+        for (i = 0; i < ((TupleVec *)pObj)->used; i++)
+        {
+            GC_VALUE(((TupleVec *)pObj)->v[i]);
+        }
+
+        break;
+
+    case V_ENV:
+
+        GC_ENV(((Env *)pObj)->pParent);
+
+        for (i = 0; i < ((Env *)pObj)->num; i++)
+        {
+            GC_VALUE(((Env *)pObj)->v[i]);
+        }
+
+        break;
+
+    case V_CLOSURE:
+    case V_ETA:
+
+        if (((Closure *)pObj)->pCtl) GC_ENV(((Closure *)pObj)->pEnv);
+
+        for (i = 0; i < ((Closure *)pObj)->num; i++)
+        {
+            GC_VALUE(((Closure *)pObj)->v[i]);
+        }
+
+        break;
+
+    case V_BUILTIN:
+
+        GC_VALUE(((Builtin *)pObj)->arg);
+        break;
+    }
+}
+
+
+/*
+ * Move the roots: the includer's (RtRoots(), the CSE machine's stack and
+ * frames) and the VM's frames and registers.  After a collection every root
+ * points at the old generation, and a frame (and its registers) only changes
+ * when it's on top.  So a minor collection starts at the lowest frame that
+ * has been on top since the last one, a deep recursion isn't rescanned every
+ * time.
+ */
+void GcRoots(int minor)
+{
+    VmFrame * pTop;
+    int top = 0;
+    int low = 0;
+    int i;
+
+    RtRoots(minor);
+
+    if (minor && (vmLowFrames > 1)) low = (vmLowFrames - 1);
+
+    for (i = low; i < vmNumFrames; i++)
+    {
+        GC_ENV(vmFrames[i].pEnv);
+        GC_CLOSURE(vmFrames[i].pClosure);
+        GC_VALUE(vmFrames[i].arg);
+        GC_VALUE(vmFrames[i].memo);
+    }
+
+    if (pMemoTable)
+    {
+        if (!minor || (memoNumNew > MEMO_SIZE))
+        {
+            for (i = 0; i < MEMO_SIZE; i++)
+            {
+                GC_VALUE(pMemoTable[i].arg);
+                GC_VALUE(pMemoTable[i].result);
+            }
+        }
+        else
+        {
+            for (i = 0; i < memoNumNew; i++)
+            {
+                GC_VALUE(pMemoTable[pMemoNew[i]].arg);
+                GC_VALUE(pMemoTable[pMemoNew[i]].result);
+            }
+        }
+
+        memoNumNew = 0;
+    }
+
+    if (vmNumFrames)
+    {
+        pTop = &vmFrames[vmNumFrames - 1];
+        top  = (pTop->base + pTop->pProto->numRegs);
+    }
+
+    for (i = ((low) ? vmFrames[low].base : 0); i < top; i++)
+    {
+        GC_VALUE(vmStack[i]);
+    }
+
+    /* dead registers above the top would go stale, clear them */
+    if (vmHighStack > top)
+    {
+        memset((vmStack + top), 0, ((vmHighStack - top) * sizeof(Value)));
+    }
+
+    vmHighStack = top;
+}
+
+
+/* Move whatever the copies from (pChunk, used) on point at (Cheney). */
+void GcScanCopies(ArenaBlock * pChunk, size_t used)
+{
+    for (; pChunk != NULL; pChunk = pChunk->pNext, used = 0)
+    {
+        while (used < pChunk->used)
+        {
+            GcScan((Obj *)(pChunk->data + used));
+            used += GcSize((Obj *)(pChunk->data + used));
+        }
+    }
+}
+
+
+/* Empty the nursery (it's all been moved out or is garbage). */
+void GcNurseryReset(void)
+{
+    ArenaBlock * pChunk;
+
+    while ((pChunk = pYoungExtra) != NULL)
+    {
+        pYoungExtra = pChunk->pNext;
+        free(pChunk);
+    }
+
+    pNursery->used = 0;
+    gcExtraSize    = 0;
+}
+
+
+void GcCollect(void)
+{
+    struct timespec t0;
+    struct timespec t1;
+    ArenaBlock * pFrom;
+    ArenaBlock * pChunk;
+    size_t young = pNursery->used;
+    size_t limit = gcOldLimit;
+    size_t before;
+    size_t used;
+    double ms;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (pChunk = pYoungExtra; pChunk != NULL; pChunk = pChunk->pNext)
+    {
+        young += pChunk->used;
+    }
+
+    gcStat.young += young;
+
+    /* --max-heap, a full collection tells what's live */
+    if (rtMaxHeap && (limit > ((size_t)rtMaxHeap << 20)))
+    {
+        limit = ((size_t)rtMaxHeap << 20);
+    }
+
+    if ((gcOldUsed + young) <= limit) /* minor */
+    {
+        before = gcOldUsed;
+        pChunk = pOldTail;
+        used   = (pChunk) ? pChunk->used : 0;
+        gcSkip = (GC_OLD | GC_STATIC);
+
+        GcRoots(1);
+
+        while (numRemembered)
+        {
+            ppRemembered[--numRemembered]->hdr &= ~GC_REMEMBERED;
+            GcScan(ppRemembered[numRemembered]);
+        }
+
+        GcScanCopies(((pChunk) ? pChunk : pOldHead), used);
+
+        gcStat.promoted += (gcOldUsed - before);
+        gcStat.numMinor++;
+    }
+    else /* major, copy all of it to a new old generation */
+    {
+        before    = gcOldUsed;
+        pFrom     = pOldHead;
+        pOldHead  = pOldTail = NULL;
+        gcOldUsed = 0;
+        gcSkip    = GC_STATIC;
+        numRemembered = 0;
+
+        GcRoots(0);
+        GcScanCopies(pOldHead, 0);
+
+        while ((pChunk = pFrom) != NULL)
+        {
+            pFrom = pChunk->pNext;
+            free(pChunk);
+        }
+
+        gcOldLimit = (2 * gcOldUsed);
+        if (gcOldLimit < GC_OLD_MIN) gcOldLimit = GC_OLD_MIN;
+
+        gcStat.majorBefore += (before + young);
+        gcStat.majorAfter  += gcOldUsed;
+        gcStat.numMajor++;
+    }
+
+    GcNurseryReset();
+    gcPending   = 0;
+    vmLowFrames = vmNumFrames;
+
+    if (gcOldUsed > gcStat.peakOld) gcStat.peakOld = gcOldUsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    ms = (((t1.tv_sec - t0.tv_sec) * 1000.0) +
+          ((t1.tv_nsec - t0.tv_nsec) / 1000000.0));
+    gcStat.pauseTotal += ms;
+    if (ms > gcStat.pauseMax) gcStat.pauseMax = ms;
+
+    if (rtMaxHeap && (gcOldUsed > ((size_t)rtMaxHeap << 20)))
+    {
+        RtLimit(RT_HEAP, "heap limit reached (%ld MB)", rtMaxHeap);
+    }
+
+    if (RtLate()) RtTimeUp();
+}
+
+
+/* Set up the heap, from now on allocations are collectable. */
+void GcInit(void)
+{
+    memset(&gcStat, 0, sizeof(gcStat));
+    pNursery   = GcChunk(GC_NURSERY_SIZE);
+    gcOldLimit = GC_OLD_MIN;
+    gcLive     = 1;
+}
+
+
+#define MB(x) ((x) / (1024.0 * 1024.0))
+
+/* Release the heap (and report on it with --gc-stats). */
+void GcFree(void)
+{
+    ArenaBlock * pChunk;
+
+    MemoFree();
+
+    if (gcStats)
+    {
+        printf("GC: %ld minor, %ld major collections, %.1fMB allocated\n",
+               gcStat.numMinor, gcStat.numMajor, MB(gcStat.allocated));
+        printf("GC: pauses %.2fms total, %.2fms max\n",
+               gcStat.pauseTotal, gcStat.pauseMax);
+        printf("GC: survival %.1f%% minor (%.1fMB promoted), "
+               "%.1f%% major\n",
+               ((gcStat.young) ? ((100.0 * gcStat.promoted) / gcStat.young) :
+                                 0.0),
+               MB(gcStat.promoted),
+               ((gcStat.majorBefore) ?
+                ((100.0 * gcStat.majorAfter) / gcStat.majorBefore) : 0.0));
+        printf("GC: heap %.1fMB nursery + %.1fMB old (peak)\n",
+               MB(GC_NURSERY_SIZE), MB(gcStat.peakOld));
+    }
+
+    GcNurseryReset();
+    free(pNursery);
+
+    while ((pChunk = pOldHead) != NULL)
+    {
+        pOldHead = pChunk->pNext;
+        free(pChunk);
+    }
+
+    free(ppRemembered);
+    pNursery      = NULL;
+    pOldTail      = NULL;
+    ppRemembered  = NULL;
+    numRemembered = maxRemembered = 0;
+    gcOldUsed     = 0;
+    gcLive        = 0;
+    gcPending     = 0;
+}
+
+
+#if defined(RPAL_RT_MAIN)
+/*
+ * Compiled programs (rpal -c).  A function compiled to C runs on a VM frame
+ * and its registers are the frame's window of vmStack, so the collector
+ * finds its roots just like it does for the VM.  A call in tail position
+ * returns RT_TAIL with the call left in rtTailF/rtTailArg and the caller,
+ * RtApply(), makes it from the same frame position, tail recursion runs in
+ * a constant number of frames (and C stack).
+ */
+#include <pthread.h>
+
+#define RT_TAIL V_IMM(V_ENV, 0) /* not a value */
+
+/* C stack for the (non-tail) recursion, only touched as far as it's used */
+#ifndef RT_STACK_SIZE
+#define RT_STACK_SIZE ((size_t)1 << 30)
+#endif
+
+Value rtTailF;
+Value rtTailArg;
+unsigned int rtTailOffset;
+
+/* collect if due, the calls are the safe points */
+#define RT_SAFEPOINT() if (gcPending) GcCollect()
+
+
+/* Apply f to arg for compiled code, the call is at source offset. */
+Value RtApply(Value f, Value arg, unsigned int offset)
+{
+    VmFrame * pF;
+    Proto * pProto;
+    Value v;
+    int base;
+    int memo;
+
+    for (;;)
+    {
+        switch (V_TYPE(f))
+        {
+        case V_CLOSURE:
+        case V_ETA:
+
+            pF   = &vmFrames[vmNumFrames - 1];
+            base = (pF->base + pF->pProto->numRegs);
+
+            pProto = V_PCLOSURE(f)->pProto;
+            memo   = -1;
+
+            if (V_IS(f, V_ETA)) /* f f arg */
+            {
+                pF = VM_CALL_FRAME(pProto, V_PCLOSURE(f), base, 0, f);
+                pF->eta = 1;
+                pF->arg = arg;
+            }
+            else if (pProto->memo &&
+                     ((memo = MemoFind(pProto, arg, &v)) == 1))
+            {
+                return v; /* cached, see MemoFind() */
+            }
+            else
+            {
+                pF = VM_CALL_FRAME(pProto, V_PCLOSURE(f), base, 0, arg);
+                if (memo == 0) pF->memo = arg;
+            }
+
+            v  = pF->pProto->pNative();
+            pF = &vmFrames[vmNumFrames - 1];
+
+            /* the result of a tail call isn't known here, it's not cached */
+            if (pF->memo && (v != RT_TAIL)) MemoStore(pProto, pF->memo, v);
+
+            /* the eta apply waits for the tail call, its frame holds arg */
+            if ((v == RT_TAIL) && pF->eta)
+            {
+                v  = RtApply(rtTailF, rtTailArg, rtTailOffset);
+                pF = &vmFrames[vmNumFrames - 1];
+            }
+
+            if (--vmNumFrames < vmLowFrames) vmLowFrames = vmNumFrames;
+
+            if (v == RT_TAIL)
+            {
+                f      = rtTailF;
+                arg    = rtTailArg;
+                offset = rtTailOffset;
+            }
+            else if (pF->eta)
+            {
+                f   = v;
+                arg = pF->arg;
+            }
+            else
+            {
+                return v;
+            }
+
+            break;
+
+        case V_TUPLE:
+
+            if (!V_IS_SMALL(arg) || (V_SMALL(arg) < 1) ||
+                (V_SMALL(arg) > V_TUPLE_NUM(f)))
+            {
+                RtError(offset, "bad tuple selection");
+            }
+
+            return V_TUPLE_V(f)[V_SMALL(arg) - 1];
+
+        case V_BUILTIN:
+
+            return BuiltinApply(offset, V_PBUILTIN(f), arg);
+
+        default:
+
+            RtError(offset, "can't apply a non-function");
+        }
+    }
+}
+
+
+/* f arg from compiled code, calling a closure straight away. */
+static inline Value RtCall(Value f, Value arg, unsigned int offset)
+{
+    VmFrame * pF;
+    Value v;
+
+    if (!V_IS(f, V_CLOSURE) || V_PCLOSURE(f)->pProto->memo)
+    {
+        return RtApply(f, arg, offset);
+    }
+
+    pF = &vmFrames[vmNumFrames - 1];
+    VM_CALL_FRAME(V_PCLOSURE(f)->pProto, V_PCLOSURE(f),
+                  (pF->base + pF->pProto->numRegs), 0, arg);
+
+    v = V_PCLOSURE(f)->pProto->pNative();
+
+    if (--vmNumFrames < vmLowFrames) vmLowFrames = vmNumFrames;
+
+    return (v == RT_TAIL) ? RtApply(rtTailF, rtTailArg, rtTailOffset) : v;
+}
+
+
+/* Is f pProto's closure?  A tail call of it reuses the running frame. */
+#define RT_SELF(f, pSelf) \
+    (V_IS(f, V_CLOSURE) && (V_PCLOSURE(f)->pProto == (pSelf)))
+
+
+/* Run the main function, on a thread with room for a deep recursion. */
+void * RtThread(void * pMain)
+{
+    Value v;
+
+    GcInit();
+    RtStart();
+    VM_CALL_FRAME((Proto *)pMain, NULL, 0, 0, RT_DUMMY);
+
+    v = ((Proto *)pMain)->pNative();
+    if (v == RT_TAIL) RtApply(rtTailF, rtTailArg, rtTailOffset);
+
+    printf("\n");
+
+    return NULL;
+}
+
+
+/* main() of a compiled program, pLoad() makes its constants. */
+int RtRun(Proto * pMain, void (* pLoad)(void), int argc, char * argv[])
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--gc-stats") != 0)
+        {
+            printf("Usage: %s [ --gc-stats ]\n", argv[0]);
+            return 1;
+        }
+
+        gcStats = 1;
+    }
+
+    BuiltinInit();
+    pLoad();
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, RT_STACK_SIZE);
+
+    if (pthread_create(&thread, &attr, RtThread, pMain) != 0)
+    {
+        perror("Failed to create a thread");
+        exit(1);
+    }
+
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    GcFree();
+    ArenaFree();
+    free(vmStack);
+    free(vmFrames);
+
+    return 0;
+}
+#endif /* RPAL_RT_MAIN */
+
+
+#endif /* RPAL_RT_H */